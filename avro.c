@@ -27,8 +27,18 @@
  */
 
 #include "kafkacat.h"
+#include "instr.h"
+#include "bench.h"
 #include <libserdes/serdes-avro.h>
 
+#include <math.h>
+#ifdef _MSC_VER
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
 static serdes_t *serdes;
 static serdes_schema_t *key_schema, *value_schema;
 
@@ -80,6 +90,1152 @@ static serdes_schema_t *load_schema (const char *name, const char *path) {
 }
 
 
+/**
+ * Avro to JSON decoding.
+ *
+ * Messages are decoded directly from the Avro binary encoding to JSON
+ * using a decoding plan compiled (once per schema) from the writer schema,
+ * without building an intermediate avro_value_t tree.
+ * The output is identical to that of avro_value_to_json(), which is used
+ * as a fallback for any message the direct decoder fails to decode,
+ * to provide the same error reporting.
+ */
+
+/**
+ * @brief Compiled schema node.
+ */
+struct avro_node {
+        avro_type_t type;
+        int         cnt;       /**< Record fields, union branches,
+                                *   enum symbols, or fixed size. */
+        struct avro_node **sub; /**< Record fields, union branches, or
+                                 *   array items/map values ([0]) */
+        char      **pre;       /**< Pre-rendered JSON: record field
+                                *   prefixes ("{\"name\": ", ", \"name\": "),
+                                *   union branch prefixes ("{\"name\": ",
+                                *   NULL for null), or enum symbols. */
+        size_t     *pre_len;
+        avro_schema_t schema;  /**< Compiled schema, for recursive types */
+        struct avro_node *next; /**< Plan's list of nodes */
+};
+
+/**
+ * @brief Decoding plan for a schema, cached by schema.
+ */
+struct avro_plan {
+        serdes_schema_t  *schema;
+        int               schema_id;
+        struct avro_node *root;
+        struct avro_node *nodes;  /**< All nodes, for freeing */
+};
+
+/**
+ * Plan cache, shared by all consumer threads.
+ * Plans are never freed until kc_avro_term().
+ */
+static struct {
+        rd_mutex_t lock;          /**< Protects plans, cnt, size */
+        struct avro_plan **plans;
+        int      cnt;
+        int      size;
+
+        uint64_t hits;            /**< Lookups of cached plans */
+        uint64_t misses;          /**< Plans compiled */
+        uint64_t fallbacks;       /**< Messages decoded with
+                                   *   avro_value_to_json() */
+} avro_cache;
+
+/* Last used plan of the thread */
+static RD_TLS struct avro_plan *avro_last_plan;
+
+/**
+ * Reusable per-thread JSON output buffer.
+ */
+static RD_TLS struct {
+        char    *buf;
+        size_t   len;
+        size_t   size;
+} avro_json;
+
+/* Maximum nesting depth for the direct decoder */
+#define AVRO_MAX_DEPTH 256
+
+
+static void avro_json_grow (size_t len) {
+        if (avro_json.len + len < avro_json.size)
+                return;
+
+        avro_json.size = MAX(avro_json.size * 2,
+                             avro_json.len + len + 1024);
+        if (!(avro_json.buf = realloc(avro_json.buf, avro_json.size)))
+                KC_FATAL("Failed to allocate %"PRIu64" bytes "
+                         "for JSON output", (uint64_t)avro_json.size);
+}
+
+static RD_INLINE void avro_json_write (const void *p, size_t len) {
+        avro_json_grow(len);
+        memcpy(avro_json.buf + avro_json.len, p, len);
+        avro_json.len += len;
+}
+
+static RD_INLINE void avro_json_putc (char c) {
+        avro_json_grow(1);
+        avro_json.buf[avro_json.len++] = c;
+}
+
+
+/**
+ * @brief Write \p codepoint as a \\u escape sequence, or a
+ *        surrogate pair outside of the BMP.
+ */
+static void avro_json_ucs (uint32_t codepoint) {
+        char seq[16];
+        int r;
+
+        if (codepoint < 0x10000)
+                r = snprintf(seq, sizeof(seq), "\\u%04X",
+                             (unsigned int)codepoint);
+        else {
+                codepoint -= 0x10000;
+                r = snprintf(seq, sizeof(seq), "\\u%04X\\u%04X",
+                             (unsigned int)(0xD800 |
+                                            ((codepoint & 0xffc00) >> 10)),
+                             (unsigned int)(0xDC00 |
+                                            (codepoint & 0x003ff)));
+        }
+
+        avro_json_write(seq, (size_t)r);
+}
+
+
+/**
+ * @brief Write ASCII character \p c escaped, if needed.
+ */
+static RD_INLINE void avro_json_char (unsigned char c) {
+        switch (c)
+        {
+        case '"':  avro_json_write("\\\"", 2); break;
+        case '\\': avro_json_write("\\\\", 2); break;
+        case '\b': avro_json_write("\\b", 2); break;
+        case '\f': avro_json_write("\\f", 2); break;
+        case '\n': avro_json_write("\\n", 2); break;
+        case '\r': avro_json_write("\\r", 2); break;
+        case '\t': avro_json_write("\\t", 2); break;
+        default:
+                if (c < 0x20)
+                        avro_json_ucs(c);
+                else
+                        avro_json_putc((char)c);
+                break;
+        }
+}
+
+
+/**
+ * @brief Write UTF-8 string \p str of \p len bytes as a JSON string,
+ *        with non-ASCII characters escaped.
+ *        The string ends at the first nul byte, if any.
+ *
+ * @returns 0 on success or -1 if the string is not valid UTF-8.
+ */
+static int avro_json_string (const unsigned char *str, size_t len) {
+        const unsigned char *end = str + len;
+
+        avro_json_putc('"');
+
+        while (str < end && *str) {
+                uint32_t cp;
+                int n, i;
+
+                if (*str < 0x80) {
+                        avro_json_char(*str++);
+                        continue;
+                }
+
+                if (*str < 0xC2)
+                        return -1;  /* Continuation or overlong */
+                else if (*str < 0xE0) {
+                        n  = 2;
+                        cp = *str & 0x1F;
+                } else if (*str < 0xF0) {
+                        n  = 3;
+                        cp = *str & 0x0F;
+                } else if (*str < 0xF5) {
+                        n  = 4;
+                        cp = *str & 0x07;
+                } else
+                        return -1;
+
+                if ((size_t)(end - str) < (size_t)n)
+                        return -1;
+
+                for (i = 1 ; i < n ; i++) {
+                        if ((str[i] & 0xC0) != 0x80)
+                                return -1;
+                        cp = (cp << 6) | (str[i] & 0x3F);
+                }
+
+                if (cp > 0x10FFFF ||
+                    (cp >= 0xD800 && cp <= 0xDFFF) ||
+                    (n == 3 && cp < 0x800) ||
+                    (n == 4 && cp < 0x10000))
+                        return -1;
+
+                avro_json_ucs(cp);
+                str += n;
+        }
+
+        avro_json_putc('"');
+        return 0;
+}
+
+
+/**
+ * @brief Write the bytes in \p p as a JSON string with each byte
+ *        as a character (code point 0..255), as Avro's JSON encoding does.
+ *        The string ends at the first nul byte, if any.
+ */
+static void avro_json_bytes (const unsigned char *p, size_t len) {
+        const unsigned char *end = p + len;
+
+        avro_json_putc('"');
+        for ( ; p < end && *p ; p++) {
+                if (*p < 0x80)
+                        avro_json_char(*p);
+                else
+                        avro_json_ucs(*p);
+        }
+        avro_json_putc('"');
+}
+
+
+/**
+ * @brief Write \p v as a JSON integer.
+ */
+static void avro_json_i64 (int64_t v) {
+        char tmp[21];
+        char *p = tmp + sizeof(tmp);
+        /* Negate as unsigned to handle INT64_MIN */
+        uint64_t u = v < 0 ? (uint64_t)0 - (uint64_t)v : (uint64_t)v;
+
+        do {
+                *(--p) = (char)('0' + (u % 10));
+                u /= 10;
+        } while (u > 0);
+
+        if (v < 0)
+                *(--p) = '-';
+
+        avro_json_write(p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+
+/**
+ * @brief Write \p v as a JSON real, formatted as by Jansson.
+ *
+ * @returns 0 on success or -1 if \p v is not finite.
+ */
+static int avro_json_real (double v) {
+        char tmp[64];
+        char *e;
+        int len;
+
+        if (!isfinite(v))
+                return -1;
+
+        len = snprintf(tmp, sizeof(tmp) - 2, "%.17g", v);
+
+        /* Make sure the number is decoded as a real */
+        if (!strchr(tmp, '.') && !strchr(tmp, 'e')) {
+                memcpy(tmp + len, ".0", 3);
+                len += 2;
+        }
+
+        /* Remove leading '+' and zeros from the exponent */
+        if ((e = strchr(tmp, 'e'))) {
+                char *start = e + 1;
+                char *end = start + 1;
+
+                if (*start == '-')
+                        start++;
+
+                while (*end == '0')
+                        end++;
+
+                if (end != start) {
+                        memmove(start, end, len - (size_t)(end - tmp) + 1);
+                        len -= (int)(end - start);
+                }
+        }
+
+        avro_json_write(tmp, (size_t)len);
+        return 0;
+}
+
+
+
+/**
+ * @brief Avro binary decoder state.
+ */
+struct avro_rd {
+        const unsigned char *p;
+        const unsigned char *end;
+};
+
+/**
+ * @brief Read zig-zag varint encoded long.
+ */
+static RD_INLINE int avro_rd_long (struct avro_rd *rd, int64_t *vp) {
+        uint64_t v = 0;
+        int shift = 0;
+        unsigned char b;
+
+        do {
+                if (rd->p == rd->end || shift > 63)
+                        return -1;
+                b = *(rd->p++);
+                v |= (uint64_t)(b & 0x7f) << shift;
+                shift += 7;
+        } while (b & 0x80);
+
+        *vp = (int64_t)((v >> 1) ^ (uint64_t)-(int64_t)(v & 1));
+        return 0;
+}
+
+/**
+ * @brief Read \p len bytes.
+ */
+static RD_INLINE int avro_rd_fixed (struct avro_rd *rd,
+                                    const unsigned char **p, int64_t len) {
+        if (len < 0 || len > (int64_t)(rd->end - rd->p))
+                return -1;
+        *p = rd->p;
+        rd->p += len;
+        return 0;
+}
+
+/**
+ * @brief Read length-prefixed bytes or string.
+ */
+static RD_INLINE int avro_rd_bytes (struct avro_rd *rd,
+                                    const unsigned char **p, size_t *lenp) {
+        int64_t len;
+
+        if (avro_rd_long(rd, &len) == -1 ||
+            avro_rd_fixed(rd, p, len) == -1)
+                return -1;
+        *lenp = (size_t)len;
+        return 0;
+}
+
+
+/**
+ * @brief Decode a value of type \p node from \p rd and write it as JSON.
+ *
+ * @returns 0 on success or -1 on decoding error.
+ */
+static int avro_decode_json (const struct avro_node *node,
+                             struct avro_rd *rd, int depth) {
+        const unsigned char *p;
+        size_t len;
+        int64_t v;
+        int i;
+
+        if (depth > AVRO_MAX_DEPTH)
+                return -1;
+
+        switch (node->type)
+        {
+        case AVRO_NULL:
+                avro_json_write("null", 4);
+                return 0;
+
+        case AVRO_BOOLEAN:
+                if (rd->p == rd->end)
+                        return -1;
+                if (*(rd->p++))
+                        avro_json_write("true", 4);
+                else
+                        avro_json_write("false", 5);
+                return 0;
+
+        case AVRO_INT32:
+        case AVRO_INT64:
+                if (avro_rd_long(rd, &v) == -1)
+                        return -1;
+                if (node->type == AVRO_INT32)
+                        v = (int32_t)v;
+                avro_json_i64(v);
+                return 0;
+
+        case AVRO_FLOAT:
+        {
+                float f;
+                uint32_t u;
+
+                if (avro_rd_fixed(rd, &p, 4) == -1)
+                        return -1;
+                u = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+                memcpy(&f, &u, sizeof(f));
+                return avro_json_real((double)f);
+        }
+
+        case AVRO_DOUBLE:
+        {
+                double d;
+                uint64_t u = 0;
+
+                if (avro_rd_fixed(rd, &p, 8) == -1)
+                        return -1;
+                for (i = 7 ; i >= 0 ; i--)
+                        u = (u << 8) | p[i];
+                memcpy(&d, &u, sizeof(d));
+                return avro_json_real(d);
+        }
+
+        case AVRO_STRING:
+                if (avro_rd_bytes(rd, &p, &len) == -1)
+                        return -1;
+                return avro_json_string(p, len);
+
+        case AVRO_BYTES:
+                if (avro_rd_bytes(rd, &p, &len) == -1)
+                        return -1;
+                avro_json_bytes(p, len);
+                return 0;
+
+        case AVRO_FIXED:
+                if (avro_rd_fixed(rd, &p, node->cnt) == -1)
+                        return -1;
+                avro_json_bytes(p, (size_t)node->cnt);
+                return 0;
+
+        case AVRO_ENUM:
+                if (avro_rd_long(rd, &v) == -1 || v < 0 || v >= node->cnt)
+                        return -1;
+                avro_json_write(node->pre[v], node->pre_len[v]);
+                return 0;
+
+        case AVRO_RECORD:
+                if (node->cnt == 0) {
+                        avro_json_write("{}", 2);
+                        return 0;
+                }
+
+                for (i = 0 ; i < node->cnt ; i++) {
+                        avro_json_write(node->pre[i], node->pre_len[i]);
+                        if (avro_decode_json(node->sub[i], rd,
+                                             depth + 1) == -1)
+                                return -1;
+                }
+                avro_json_putc('}');
+                return 0;
+
+        case AVRO_UNION:
+                if (avro_rd_long(rd, &v) == -1 || v < 0 || v >= node->cnt)
+                        return -1;
+
+                if (!node->pre[v]) {
+                        /* null branch */
+                        avro_json_write("null", 4);
+                        return 0;
+                }
+
+                avro_json_write(node->pre[v], node->pre_len[v]);
+                if (avro_decode_json(node->sub[v], rd, depth + 1) == -1)
+                        return -1;
+                avro_json_putc('}');
+                return 0;
+
+        case AVRO_ARRAY:
+        case AVRO_MAP:
+        {
+                int is_map = node->type == AVRO_MAP;
+                int first = 1;
+
+                avro_json_putc(is_map ? '{' : '[');
+
+                while (1) {
+                        int64_t cnt;
+
+                        if (avro_rd_long(rd, &cnt) == -1)
+                                return -1;
+
+                        if (cnt == 0)
+                                break;
+
+                        if (cnt < 0) {
+                                /* Negative count is followed by the
+                                 * block's size in bytes. */
+                                int64_t size;
+                                if (cnt == INT64_MIN ||
+                                    avro_rd_long(rd, &size) == -1)
+                                        return -1;
+                                cnt = -cnt;
+                        }
+
+                        for ( ; cnt > 0 ; cnt--) {
+                                if (!first)
+                                        avro_json_write(", ", 2);
+                                first = 0;
+
+                                if (is_map) {
+                                        if (avro_rd_bytes(rd, &p,
+                                                          &len) == -1 ||
+                                            avro_json_string(p, len) == -1)
+                                                return -1;
+                                        avro_json_write(": ", 2);
+                                }
+
+                                if (avro_decode_json(node->sub[0], rd,
+                                                     depth + 1) == -1)
+                                        return -1;
+                        }
+                }
+
+                avro_json_putc(is_map ? '}' : ']');
+                return 0;
+        }
+
+        default:
+                return -1;
+        }
+}
+
+
+/**
+ * @brief Pre-render \p prefix, JSON string \p name and \p suffix.
+ */
+static char *avro_plan_render (const char *prefix, const char *name,
+                               const char *suffix, size_t *lenp) {
+        char *str;
+
+        avro_json.len = 0;
+        avro_json_write(prefix, strlen(prefix));
+        if (name &&
+            avro_json_string((const unsigned char *)name, strlen(name)) == -1)
+                return NULL;
+        avro_json_write(suffix, strlen(suffix));
+
+        *lenp = avro_json.len;
+        str = malloc(avro_json.len + 1);
+        memcpy(str, avro_json.buf, avro_json.len);
+        str[avro_json.len] = '\0';
+
+        return str;
+}
+
+
+/**
+ * @brief Allocate a node with \p cnt sub-nodes and pre-rendered strings.
+ */
+static struct avro_node *avro_node_new (struct avro_plan *plan,
+                                        avro_schema_t schema,
+                                        avro_type_t type, int cnt) {
+        struct avro_node *node = calloc(1, sizeof(*node));
+
+        node->type    = type;
+        node->cnt     = cnt;
+        node->schema  = schema;
+        node->sub     = calloc(MAX(cnt, 1), sizeof(*node->sub));
+        node->pre     = calloc(MAX(cnt, 1), sizeof(*node->pre));
+        node->pre_len = calloc(MAX(cnt, 1), sizeof(*node->pre_len));
+
+        node->next    = plan->nodes;
+        plan->nodes   = node;
+
+        return node;
+}
+
+
+/**
+ * @brief Compile \p schema to a decoding plan node.
+ *
+ * @returns the node, or NULL if the schema can't be decoded directly.
+ */
+static struct avro_node *avro_plan_compile (struct avro_plan *plan,
+                                            avro_schema_t schema) {
+        struct avro_node *node;
+        avro_type_t type;
+        int i;
+
+        if (!schema)
+                return NULL;
+
+        if (avro_typeof(schema) == AVRO_LINK) {
+                /* Recursive reference to a named type that is either
+                 * already compiled (an enclosing type) or is compiled
+                 * now. */
+                avro_schema_t target = avro_schema_link_target(schema);
+
+                for (node = plan->nodes ; node ; node = node->next)
+                        if (node->schema == target)
+                                return node;
+
+                return avro_plan_compile(plan, target);
+        }
+
+        type = avro_typeof(schema);
+
+        switch (type)
+        {
+        case AVRO_NULL:
+        case AVRO_BOOLEAN:
+        case AVRO_INT32:
+        case AVRO_INT64:
+        case AVRO_FLOAT:
+        case AVRO_DOUBLE:
+        case AVRO_STRING:
+        case AVRO_BYTES:
+                return avro_node_new(plan, schema, type, 0);
+
+        case AVRO_FIXED:
+                return avro_node_new(plan, schema, type,
+                                     (int)avro_schema_fixed_size(schema));
+
+        case AVRO_ENUM:
+                node = avro_node_new(plan, schema, type,
+                                     avro_schema_enum_number_of_symbols(
+                                             schema));
+                for (i = 0 ; i < node->cnt ; i++)
+                        if (!(node->pre[i] = avro_plan_render(
+                                      "",
+                                      avro_schema_enum_get(schema, i),
+                                      "", &node->pre_len[i])))
+                                return NULL;
+                return node;
+
+        case AVRO_RECORD:
+                node = avro_node_new(plan, schema, type,
+                                     (int)avro_schema_record_size(schema));
+                for (i = 0 ; i < node->cnt ; i++) {
+                        if (!(node->pre[i] = avro_plan_render(
+                                      i == 0 ? "{" : ", ",
+                                      avro_schema_record_field_name(schema,
+                                                                    i),
+                                      ": ", &node->pre_len[i])) ||
+                            !(node->sub[i] = avro_plan_compile(
+                                      plan,
+                                      avro_schema_record_field_get_by_index(
+                                              schema, i))))
+                                return NULL;
+                }
+                return node;
+
+        case AVRO_UNION:
+                node = avro_node_new(plan, schema, type,
+                                     (int)avro_schema_union_size(schema));
+                for (i = 0 ; i < node->cnt ; i++) {
+                        avro_schema_t branch =
+                                avro_schema_union_branch(schema, i);
+
+                        if (!(node->sub[i] = avro_plan_compile(plan,
+                                                               branch)))
+                                return NULL;
+
+                        /* Non-null branches are encoded as
+                         * {"<branch type name>": <value>} */
+                        if (node->sub[i]->type != AVRO_NULL &&
+                            !(node->pre[i] = avro_plan_render(
+                                      "{", avro_schema_type_name(branch),
+                                      ": ", &node->pre_len[i])))
+                                return NULL;
+                }
+                return node;
+
+        case AVRO_ARRAY:
+                node = avro_node_new(plan, schema, type, 1);
+                if (!(node->sub[0] =
+                      avro_plan_compile(plan,
+                                        avro_schema_array_items(schema))))
+                        return NULL;
+                return node;
+
+        case AVRO_MAP:
+                node = avro_node_new(plan, schema, type, 1);
+                if (!(node->sub[0] =
+                      avro_plan_compile(plan,
+                                        avro_schema_map_values(schema))))
+                        return NULL;
+                return node;
+
+        default:
+                return NULL;
+        }
+}
+
+
+static void avro_plan_destroy (struct avro_plan *plan) {
+        struct avro_node *node;
+
+        while ((node = plan->nodes)) {
+                int i;
+
+                plan->nodes = node->next;
+                for (i = 0 ; i < node->cnt ; i++)
+                        if (node->pre[i])
+                                free(node->pre[i]);
+                free(node->pre);
+                free(node->pre_len);
+                free(node->sub);
+                free(node);
+        }
+}
+
+
+/**
+ * @brief Get the cached decoding plan for \p schema, or compile it.
+ *
+ * @returns the plan, the plan's root is NULL if the schema can't be
+ *          decoded directly.
+ */
+static struct avro_plan *avro_plan_get (serdes_schema_t *schema) {
+        struct avro_plan *plan;
+        int i;
+
+        if (avro_last_plan && avro_last_plan->schema == schema) {
+                rd_atomic64_add(&avro_cache.hits, 1);
+                return avro_last_plan;
+        }
+
+        rd_mutex_lock(&avro_cache.lock);
+
+        for (i = 0 ; i < avro_cache.cnt ; i++) {
+                if (avro_cache.plans[i]->schema == schema) {
+                        plan = avro_cache.plans[i];
+                        rd_mutex_unlock(&avro_cache.lock);
+                        rd_atomic64_add(&avro_cache.hits, 1);
+                        avro_last_plan = plan;
+                        return plan;
+                }
+        }
+
+        avro_cache.misses++;
+
+        if (avro_cache.cnt == avro_cache.size) {
+                avro_cache.size = MAX(avro_cache.size * 2, 8);
+                avro_cache.plans = realloc(avro_cache.plans,
+                                           avro_cache.size *
+                                           sizeof(*avro_cache.plans));
+        }
+
+        plan = calloc(1, sizeof(*plan));
+        plan->schema    = schema;
+        plan->schema_id = serdes_schema_id(schema);
+        plan->root      = avro_plan_compile(plan,
+                                            serdes_schema_avro(schema));
+
+        if (!plan->root) {
+                KC_INFO(2, "Avro schema %d can't be decoded directly: "
+                        "using generic decoder\n", plan->schema_id);
+                avro_plan_destroy(plan);
+        }
+
+        avro_cache.plans[avro_cache.cnt++] = plan;
+
+        rd_mutex_unlock(&avro_cache.lock);
+
+        avro_last_plan = plan;
+
+        return plan;
+}
+
+
+/**
+ * @brief Add hint to framing error in \p errstr.
+ */
+static void avro_framing_error (char *errstr, size_t errstr_size) {
+        static const char badframing[] =
+                ": message not produced with "
+                "Schema-Registry Avro framing";
+        int len = strlen(errstr);
+
+        if (len + sizeof(badframing) < errstr_size)
+                snprintf(errstr+len, errstr_size-len,
+                         "%s", badframing);
+}
+
+
+/**
+ * @brief Decode with avro_value_to_json() into the JSON output buffer.
+ *
+ * @returns 0 on success or -1 on error.
+ */
+static int avro_generic_to_json (const void *data, size_t data_len,
+                                 int *schema_idp,
+                                 char *errstr, size_t errstr_size) {
+        avro_value_t avro;
+        serdes_schema_t *schema;
+        char *json;
+        serdes_err_t err;
+
+        rd_atomic64_add(&avro_cache.fallbacks, 1);
+
+        err = serdes_deserialize_avro(serdes, &avro, &schema, data, data_len,
+                                      errstr, errstr_size);
+        if (err) {
+                if (err == SERDES_ERR_FRAMING_INVALID ||
+                    strstr(errstr, "Invalid CP1 magic byte"))
+                        avro_framing_error(errstr, errstr_size);
+                return -1;
+        }
+
+        if (avro_value_to_json(&avro, 1/*one-line*/, &json)) {
+                snprintf(errstr, errstr_size, "Failed to encode Avro as JSON");
+                avro_value_decref(&avro);
+                return -1;
+        }
+
+        if (schema && schema_idp)
+                *schema_idp = serdes_schema_id(schema);
+
+        avro_value_decref(&avro);
+
+        avro_json.len = 0;
+        avro_json_write(json, strlen(json));
+        free(json);
+
+        return 0;
+}
+
+
+/**
+ * Persistent schema cache (-X kafkacat.schema.cache=<dir>) and subject
+ * prefetch (-X kafkacat.schema.prefetch=true).
+ *
+ * The definition of each schema fetched from the registry is stored in
+ * <dir>/sr-<registry>-<id>.avsc, where <registry> is a hash of the
+ * registry URL (which may contain credentials), and added from there
+ * to the serdes' own schema cache, without a registry request, the
+ * first time a later invocation sees the schema id.
+ *
+ * The prefetch fetches the latest schemas of the consumed topics'
+ * subjects (TopicNameStrategy: <topic>-key, <topic>-value) with
+ * background threads while the consumer starts up.
+ */
+#define SR_PREFETCH_THREADS 4
+
+static struct {
+        rd_mutex_t lock;          /**< Protects ids, cnt, size */
+        int     *ids;             /**< Schema ids known to the serdes */
+        int      cnt;
+        int      size;
+        uint64_t url_hash;        /**< Hash of schema.registry.url */
+
+        char   **subjects;        /**< Subjects to prefetch */
+        int      subject_cnt;
+        int      subject_next;    /**< Next subject to fetch. Atomic. */
+        rd_thread_t thrs[SR_PREFETCH_THREADS];
+        int      thr_cnt;
+
+        uint64_t loaded;          /**< Schemas loaded from files */
+        uint64_t fetched;         /**< Schemas fetched from the registry */
+} sr_cache;
+
+/* Last schema id seen by the thread */
+static RD_TLS int sr_last_id = -1;
+
+
+/**
+ * @returns true if schema \p id is known to the serdes, else marks it
+ *          as known (to be loaded by the caller).
+ */
+static int sr_cache_known (int id) {
+        int i;
+
+        rd_mutex_lock(&sr_cache.lock);
+
+        for (i = 0 ; i < sr_cache.cnt ; i++) {
+                if (sr_cache.ids[i] == id) {
+                        rd_mutex_unlock(&sr_cache.lock);
+                        return 1;
+                }
+        }
+
+        if (sr_cache.cnt == sr_cache.size) {
+                sr_cache.size = MAX(sr_cache.size * 2, 16);
+                sr_cache.ids = realloc(sr_cache.ids,
+                                       sr_cache.size * sizeof(*sr_cache.ids));
+        }
+        sr_cache.ids[sr_cache.cnt++] = id;
+
+        rd_mutex_unlock(&sr_cache.lock);
+
+        return 0;
+}
+
+
+static void sr_cache_path (char *path, size_t size, int id) {
+        snprintf(path, size, "%s/sr-%016"PRIx64"-%d.avsc",
+                 conf.schema_cache, sr_cache.url_hash, id);
+}
+
+
+/**
+ * @brief Store the definition of \p schema in the schema cache
+ *        directory, replacing any previous file atomically.
+ */
+static void sr_cache_store (serdes_schema_t *schema) {
+        const char *def = serdes_schema_definition(schema);
+        char path[1024], tmppath[1100];
+        FILE *fp;
+        int r;
+
+        if (!def)
+                return;
+
+        sr_cache_path(path, sizeof(path), serdes_schema_id(schema));
+        snprintf(tmppath, sizeof(tmppath), "%s.%d.tmp", path, (int)getpid());
+
+        if (!(fp = fopen(tmppath, "w"))) {
+                KC_INFO(1, "Failed to write schema cache file %s: %s\n",
+                        tmppath, strerror(errno));
+                return;
+        }
+
+        r = fwrite(def, strlen(def), 1, fp) != 1;
+        if (fclose(fp) == EOF || r) {
+                KC_INFO(1, "Failed to write schema cache file %s: %s\n",
+                        tmppath, strerror(errno));
+                remove(tmppath);
+                return;
+        }
+
+#ifdef _MSC_VER
+        /* rename() does not replace existing files on Windows */
+        remove(path);
+#endif
+        if (rename(tmppath, path) == -1) {
+                KC_INFO(1, "Failed to write schema cache file %s: %s\n",
+                        path, strerror(errno));
+                remove(tmppath);
+        }
+}
+
+
+/**
+ * @brief Make schema \p id known to the serdes, from the schema cache
+ *        directory or else by fetching it (storing it in the cache).
+ *
+ * Errors are left to be reported by the decoding that needs the schema.
+ */
+static void sr_cache_load (int id) {
+        serdes_schema_t *schema;
+        char path[1024];
+        char errstr[256];
+        FILE *fp;
+
+        sr_cache_path(path, sizeof(path), id);
+
+        if ((fp = fopen(path, "rb"))) {
+                char *buf = NULL;
+                long size;
+
+                if (fseek(fp, 0, SEEK_END) != -1 &&
+                    (size = ftell(fp)) > 0 &&
+                    fseek(fp, 0, SEEK_SET) != -1 &&
+                    (buf = malloc(size + 1)) &&
+                    fread(buf, size, 1, fp) == 1) {
+                        buf[size] = '\0';
+                        schema = serdes_schema_add(serdes, NULL, id,
+                                                   buf, (int)size,
+                                                   errstr, sizeof(errstr));
+                        if (schema) {
+                                rd_atomic64_add(&sr_cache.loaded, 1);
+                                free(buf);
+                                fclose(fp);
+                                return;
+                        }
+
+                        KC_INFO(1, "Ignoring schema cache file %s: %s\n",
+                                path, errstr);
+                }
+
+                if (buf)
+                        free(buf);
+                fclose(fp);
+        }
+
+        if (!(schema = serdes_schema_get(serdes, NULL, id,
+                                         errstr, sizeof(errstr))))
+                return;
+
+        rd_atomic64_add(&sr_cache.fetched, 1);
+        sr_cache_store(schema);
+}
+
+
+/**
+ * @brief Make sure the schema of the Schema-Registry framed \p data is
+ *        known to the serdes before it is decoded (-X kafkacat.schema.cache).
+ */
+static RD_INLINE void sr_cache_prepare (const void *data, size_t data_len) {
+        const unsigned char *p = data;
+        int id;
+
+        if (data_len < 5 || p[0] != 0)
+                return; /* Let the decoder report the framing error */
+
+        id = (int)(((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16) |
+                   ((uint32_t)p[3] << 8) | (uint32_t)p[4]);
+
+        if (id == sr_last_id)
+                return;
+
+        if (!sr_cache_known(id))
+                sr_cache_load(id);
+
+        sr_last_id = id;
+}
+
+
+static rd_thread_ret_t RD_THREAD_CC sr_prefetch_main (void *arg) {
+        int i;
+
+        while ((i = rd_atomic_add(&sr_cache.subject_next, 1) - 1) <
+               sr_cache.subject_cnt) {
+                const char *subject = sr_cache.subjects[i];
+                serdes_schema_t *schema;
+                char errstr[256];
+
+                if (!(schema = serdes_schema_get(serdes, subject, -1,
+                                                 errstr, sizeof(errstr)))) {
+                        KC_INFO(2, "Failed to prefetch schema of subject "
+                                "%s: %s\n", subject, errstr);
+                        continue;
+                }
+
+                KC_INFO(2, "Prefetched schema %d of subject %s\n",
+                        serdes_schema_id(schema), subject);
+
+                rd_atomic64_add(&sr_cache.fetched, 1);
+                if (!sr_cache_known(serdes_schema_id(schema)) &&
+                    conf.schema_cache)
+                        sr_cache_store(schema);
+        }
+
+        return (rd_thread_ret_t)0;
+}
+
+
+/**
+ * @brief Fetch the latest key and/or value (as decoded) schemas of the
+ *        \p topic_cnt \p topics in the background.
+ */
+void kc_avro_prefetch (char * const *topics, int topic_cnt) {
+        int i;
+
+        sr_cache.subjects = calloc(topic_cnt * 2 + 1,
+                                   sizeof(*sr_cache.subjects));
+
+        for (i = 0 ; i < topic_cnt ; i++) {
+                char subject[512];
+
+                /* Regex topics have no subjects of their own */
+                if (*topics[i] == '^')
+                        continue;
+
+                if (conf.flags & CONF_F_FMT_AVRO_KEY) {
+                        snprintf(subject, sizeof(subject), "%s-key",
+                                 topics[i]);
+                        sr_cache.subjects[sr_cache.subject_cnt++] =
+                                strdup(subject);
+                }
+                if (conf.flags & CONF_F_FMT_AVRO_VALUE) {
+                        snprintf(subject, sizeof(subject), "%s-value",
+                                 topics[i]);
+                        sr_cache.subjects[sr_cache.subject_cnt++] =
+                                strdup(subject);
+                }
+        }
+
+        for (i = 0 ; i < MIN(sr_cache.subject_cnt, SR_PREFETCH_THREADS) ;
+             i++) {
+                if (rd_thread_create(&sr_cache.thrs[i], sr_prefetch_main,
+                                     NULL) == -1)
+                        KC_FATAL("Failed to create schema prefetch "
+                                 "thread: %s", strerror(errno));
+                sr_cache.thr_cnt++;
+        }
+}
+
+
+/**
+ * @brief Decodes the schema-id framed Avro blob in \p data
+ *        and encodes it as JSON, which is returned in a buffer that
+ *        is valid until the next call.
+ *
+ * @param json_lenp is set to the length of the returned JSON
+ *                  (the JSON is also nul-terminated).
+ *
+ * @returns the JSON string, or NULL on error.
+ */
+static const char *kc_avro_to_json0 (const void *data, size_t data_len,
+                                     int *schema_idp, size_t *json_lenp,
+                                     char *errstr, size_t errstr_size) {
+        const void *payload = data;
+        size_t size = data_len;
+        serdes_schema_t *schema = NULL;
+        struct avro_plan *plan;
+        struct avro_rd rd;
+
+        if (conf.schema_cache)
+                sr_cache_prepare(data, data_len);
+
+        if (serdes_framing_read(serdes, &payload, &size, &schema,
+                                errstr, (int)errstr_size) == -1) {
+                avro_framing_error(errstr, errstr_size);
+                return NULL;
+        }
+
+        if (!schema) {
+                snprintf(errstr, errstr_size,
+                         "Unable to decode payload: "
+                         "No framing and no schema specified");
+                return NULL;
+        }
+
+        plan = avro_plan_get(schema);
+
+        avro_json.len = 0;
+        rd.p   = payload;
+        rd.end = rd.p + size;
+
+        if (!plan->root || avro_decode_json(plan->root, &rd, 0) == -1) {
+                /* Let the generic decoder decode the message or
+                 * report the error. */
+                if (avro_generic_to_json(data, data_len, schema_idp,
+                                         errstr, errstr_size) == -1)
+                        return NULL;
+        } else if (schema_idp)
+                *schema_idp = plan->schema_id;
+
+        avro_json_putc('\0');
+        *json_lenp = --avro_json.len;
+
+        return avro_json.buf;
+}
+
+
+/**
+ * @brief Decodes the schema-id framed Avro blob in \p data to JSON,
+ *        see kc_avro_to_json0().
+ */
+const char *kc_avro_to_json (const void *data, size_t data_len,
+                             int *schema_idp, size_t *json_lenp,
+                             char *errstr, size_t errstr_size) {
+        const char *json;
+
+        KC_INSTR_BEGIN(KC_STAGE_AVRO);
+        json = kc_avro_to_json0(data, data_len, schema_idp, json_lenp,
+                                errstr, errstr_size);
+        KC_INSTR_END(KC_STAGE_AVRO);
+
+        return json;
+}
+
+
 void kc_avro_init (const char *key_schema_name,
                    const char *key_schema_path,
                    const char *value_schema_name,
@@ -99,9 +1255,73 @@ void kc_avro_init (const char *key_schema_name,
                 value_schema = load_schema(value_schema_name,
                                            value_schema_path);
 
+        rd_mutex_init(&avro_cache.lock);
+        rd_mutex_init(&sr_cache.lock);
+
+        if (conf.schema_cache) {
+                /* FNV-1a hash of the registry URL */
+                const char *u = conf.schema_registry_url ?
+                        conf.schema_registry_url : "";
+
+                sr_cache.url_hash = 0xcbf29ce484222325ULL;
+                for ( ; *u ; u++)
+                        sr_cache.url_hash = (sr_cache.url_hash ^
+                                             (unsigned char)*u) *
+                                0x100000001b3ULL;
+        }
+}
+
+
+/**
+ * @brief Free the calling thread's decoding state.
+ */
+void kc_avro_thread_term (void) {
+        if (avro_json.buf)
+                free(avro_json.buf);
+        memset(&avro_json, 0, sizeof(avro_json));
+        avro_last_plan = NULL;
 }
 
+
 void kc_avro_term (void) {
+        int i;
+
+        for (i = 0 ; i < sr_cache.thr_cnt ; i++)
+                rd_thread_join(sr_cache.thrs[i]);
+        for (i = 0 ; i < sr_cache.subject_cnt ; i++)
+                free(sr_cache.subjects[i]);
+        if (sr_cache.subjects)
+                free(sr_cache.subjects);
+        if (conf.schema_cache)
+                KC_INFO(2, "Schema cache: %d schema(s), "
+                        "%"PRIu64" loaded from %s, "
+                        "%"PRIu64" fetched from the registry\n",
+                        sr_cache.cnt, sr_cache.loaded, conf.schema_cache,
+                        sr_cache.fetched);
+        if (sr_cache.ids)
+                free(sr_cache.ids);
+        if (serdes)
+                rd_mutex_destroy(&sr_cache.lock);
+        memset(&sr_cache, 0, sizeof(sr_cache));
+
+        if (avro_cache.hits + avro_cache.misses > 0)
+                KC_INFO(2, "Avro decode cache: %d schema(s), "
+                        "%"PRIu64" hit(s), %"PRIu64" miss(es), "
+                        "%"PRIu64" generic fallback(s)\n",
+                        avro_cache.cnt, avro_cache.hits, avro_cache.misses,
+                        avro_cache.fallbacks);
+
+        for (i = 0 ; i < avro_cache.cnt ; i++) {
+                avro_plan_destroy(avro_cache.plans[i]);
+                free(avro_cache.plans[i]);
+        }
+        if (avro_cache.plans)
+                free(avro_cache.plans);
+        if (serdes) /* Initialized by kc_avro_init() */
+                rd_mutex_destroy(&avro_cache.lock);
+        memset(&avro_cache, 0, sizeof(avro_cache));
+        kc_avro_thread_term();
+
         if (value_schema)
                 serdes_schema_destroy(value_schema);
         if (key_schema)
@@ -111,47 +1331,171 @@ void kc_avro_term (void) {
 }
 
 
+
 /**
- * @brief Decodes the schema-id framed Avro blob in \p data
- *        and encodes it as JSON, which is returned as a newly allocated
- *        buffer which the caller must free.
+ * @brief Append the Avro (zig-zag varint) encoding of \p v to \p p.
  *
- * @returns newly allocated JSON string, or NULL on error.
+ * @returns the end of the encoding.
  */
-char *kc_avro_to_json (const void *data, size_t data_len, int *schema_idp,
-                       char *errstr, size_t errstr_size) {
-        avro_value_t avro;
+static char *avro_bench_long (char *p, int64_t v) {
+        uint64_t n = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+
+        while (n > 0x7f) {
+                *p++ = (char)((n & 0x7f) | 0x80);
+                n >>= 7;
+        }
+        *p++ = (char)n;
+
+        return p;
+}
+
+/**
+ * @brief Append the Avro encoding of string \p str to \p p.
+ */
+static char *avro_bench_string (char *p, const char *str) {
+        size_t len = strlen(str);
+
+        p = avro_bench_long(p, (int64_t)len);
+        memcpy(p, str, len);
+
+        return p + len;
+}
+
+
+/**
+ * @brief Microbenchmark of kc_avro_to_json(), and of the generic
+ *        decoder it falls back on, decoding synthetic schema-id framed
+ *        records whose schema is added to the serdes without a
+ *        schema registry.
+ *        Results are printed to stdout, see ubench_result().
+ *
+ * @returns 0 on success or -1 on failure.
+ */
+int kc_avro_bench (void) {
+        static const char *definition =
+                "{\"type\":\"record\",\"name\":\"KafkacatBench\","
+                "\"fields\":["
+                "{\"name\":\"id\",\"type\":\"long\"},"
+                "{\"name\":\"name\",\"type\":\"string\"},"
+                "{\"name\":\"score\",\"type\":\"double\"},"
+                "{\"name\":\"active\",\"type\":\"boolean\"},"
+                "{\"name\":\"tags\",\"type\":"
+                "{\"type\":\"array\",\"items\":\"string\"}},"
+                "{\"name\":\"note\",\"type\":[\"null\",\"string\"]}"
+                "]}";
+        const int schema_id = 1;
+        const int msgcnt = 1000;
         serdes_schema_t *schema;
-        char *json;
-        serdes_err_t err;
+        char errstr[512];
+        char *data, *p;
+        size_t *offs;
+        int pass, i;
+        int r = 0;
 
-        err = serdes_deserialize_avro(serdes, &avro, &schema, data, data_len,
-                                      errstr, errstr_size);
-        if (err) {
-                if (err == SERDES_ERR_FRAMING_INVALID ||
-                    strstr(errstr, "Invalid CP1 magic byte")) {
-                        static const char badframing[] =
-                                ": message not produced with "
-                                "Schema-Registry Avro framing";
-                        int len = strlen(errstr);
+        if (!conf.srconf)
+                conf.srconf = serdes_conf_new(NULL, 0, NULL);
+        kc_avro_init(NULL, NULL, NULL, NULL);
 
-                        if (len + sizeof(badframing) < errstr_size)
-                                snprintf(errstr+len, errstr_size-len,
-                                         "%s", badframing);
-                }
-                return NULL;
+        schema = serdes_schema_add(serdes, "kafkacat_bench", schema_id,
+                                   definition, (int)strlen(definition),
+                                   errstr, sizeof(errstr));
+        if (!schema) {
+                fprintf(stderr, "%s: failed to add schema: %s\n",
+                        __FUNCTION__, errstr);
+                kc_avro_term();
+                return -1;
         }
 
-        if (avro_value_to_json(&avro, 1/*one-line*/, &json)) {
-                snprintf(errstr, errstr_size, "Failed to encode Avro as JSON");
-                avro_value_decref(&avro);
-                return NULL;
+        data = malloc((size_t)msgcnt * 256);
+        offs = malloc(sizeof(*offs) * (msgcnt + 1));
+
+        for (i = 0, p = data ; i < msgcnt ; i++) {
+                char str[64];
+                double score = (double)i * 0.25;
+                uint64_t bits;
+                int j;
+
+                offs[i] = (size_t)(p - data);
+
+                /* Framing: magic byte and big endian schema id */
+                *p++ = 0;
+                *p++ = (char)(schema_id >> 24);
+                *p++ = (char)(schema_id >> 16);
+                *p++ = (char)(schema_id >> 8);
+                *p++ = (char)schema_id;
+
+                p = avro_bench_long(p, (int64_t)i * 1000003 - 500000);
+
+                snprintf(str, sizeof(str),
+                         i % 8 == 0 ? "user \"%d\"\t" : "user-%d", i);
+                p = avro_bench_string(p, str);
+
+                memcpy(&bits, &score, sizeof(bits));
+                for (j = 0 ; j < 8 ; j++)
+                        *p++ = (char)(bits >> (j * 8));
+
+                *p++ = (char)(i & 1);
+
+                if (i % 4) {
+                        p = avro_bench_long(p, i % 4);
+                        for (j = 0 ; j < i % 4 ; j++) {
+                                snprintf(str, sizeof(str), "tag%d", j);
+                                p = avro_bench_string(p, str);
+                        }
+                }
+                p = avro_bench_long(p, 0);
+
+                if (i % 3 == 0) {
+                        p = avro_bench_long(p, 0);
+                } else {
+                        p = avro_bench_long(p, 1);
+                        snprintf(str, sizeof(str), "note for %d", i);
+                        p = avro_bench_string(p, str);
+                }
         }
+        offs[msgcnt] = (size_t)(p - data);
 
-        if (schema && schema_idp)
-                *schema_idp = serdes_schema_id(schema);
+        for (pass = 0 ; pass < 2 && !r ; pass++) {
+                uint64_t cnt = 0, bytes = 0;
+                int64_t ts_start = rd_clock();
 
-        avro_value_decref(&avro);
+                do {
+                        for (i = 0 ; i < msgcnt ; i++) {
+                                const char *d = data + offs[i];
+                                size_t len = offs[i+1] - offs[i];
+                                size_t json_len;
+                                int id, fail;
 
-        return json;
+                                if (pass == 0)
+                                        fail = !kc_avro_to_json(
+                                                d, len, &id, &json_len,
+                                                errstr, sizeof(errstr));
+                                else
+                                        fail = avro_generic_to_json(
+                                                d, len, &id,
+                                                errstr,
+                                                sizeof(errstr)) == -1;
+                                if (fail) {
+                                        fprintf(stderr, "%s: failed to "
+                                                "decode message %d: %s\n",
+                                                __FUNCTION__, i, errstr);
+                                        r = -1;
+                                        break;
+                                }
+                        }
+                        cnt   += msgcnt;
+                        bytes += offs[msgcnt];
+                } while (!r && !ubench_done(ts_start));
+
+                if (!r)
+                        ubench_result(pass == 0 ? "kc_avro_to_json" :
+                                      "kc_avro_to_json/generic",
+                                      cnt, bytes, rd_clock() - ts_start);
+        }
+
+        free(offs);
+        free(data);
+        kc_avro_term();
+
+        return r;
 }
@@ -0,0 +1,460 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Benchmark mode (-B)
+ *
+ * The producer produces synthetic messages of kafkacat.bench.msg.size
+ * bytes from an in-memory pool, the consumer consumes without output,
+ * and both periodically report their throughput along with latency
+ * percentiles from HDR histograms: delivery latency for the producer,
+ * and end-to-end latency (from the message timestamp) and offset lag
+ * for the consumer.
+ */
+
+#ifndef _MSC_VER
+#include <sys/time.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kafkacat.h"
+#include "bench.h"
+
+
+/* The values are slices of a pool of this many bytes more than the
+ * message size, starting at pseudo-random offsets. */
+#define BENCH_POOL_SIZE  (64 * 1024)
+
+static struct {
+        int64_t     ts_start;      /**< rd_clock() at bench_start() */
+        int64_t     ts_last;       /**< rd_clock() of the last report */
+        uint64_t    last_msgs;     /**< Counters at the last report */
+        uint64_t    last_bytes;
+        struct hist latency;       /**< Latency (us) */
+        struct hist latency_last;  /**< latency at the last report */
+        struct hist lag;           /**< Consumer offset lag (msgs) */
+        struct hist lag_last;      /**< lag at the last report */
+        char       *pool;          /**< Synthetic message values */
+} bench;
+
+
+/**
+ * @returns the histogram bucket of \p v
+ */
+static RD_INLINE int hist_index (uint64_t v) {
+        int msb, shift;
+
+        if (v < HIST_SUB_CNT)
+                return (int)v;
+
+#ifdef _MSC_VER
+        {
+                unsigned long idx;
+                _BitScanReverse64(&idx, v);
+                msb = (int)idx;
+        }
+#else
+        msb = 63 - __builtin_clzll(v);
+#endif
+        /* Keep the HIST_SUB_BITS most significant bits, of which the
+         * top one is always set. */
+        shift = msb - (HIST_SUB_BITS - 1);
+
+        return shift * (HIST_SUB_CNT / 2) + (int)(v >> shift);
+}
+
+/**
+ * @returns the highest value recorded to bucket \p idx
+ */
+static uint64_t hist_value (int idx) {
+        int shift;
+        uint64_t sub;
+
+        if (idx < HIST_SUB_CNT)
+                return (uint64_t)idx;
+
+        shift = idx / (HIST_SUB_CNT / 2) - 1;
+        sub   = (uint64_t)(idx % (HIST_SUB_CNT / 2) + HIST_SUB_CNT / 2);
+
+        return (sub << shift) + (((uint64_t)1 << shift) - 1);
+}
+
+
+/**
+ * @brief Record value \p v to histogram \p h, thread-safe.
+ */
+void hist_record (struct hist *h, uint64_t v) {
+        rd_atomic64_add(&h->buckets[hist_index(v)], 1);
+}
+
+/**
+ * @brief Record value \p v to histogram \p h, which must only be
+ *        used by the calling thread.
+ */
+void hist_record_unlocked (struct hist *h, uint64_t v) {
+        h->buckets[hist_index(v)]++;
+}
+
+/**
+ * @brief Copy histogram \p src to \p dst, for use as a baseline with
+ *        hist_cnt() and hist_percentile().
+ */
+void hist_copy (struct hist *dst, const struct hist *src) {
+        int i;
+
+        for (i = 0 ; i < HIST_BUCKET_CNT ; i++)
+                dst->buckets[i] = rd_atomic64_load(&src->buckets[i]);
+}
+
+/**
+ * @returns the number of values recorded to \p h since the \p since
+ *          copy of it was made (or in total if \p since is NULL).
+ */
+uint64_t hist_cnt (const struct hist *h, const struct hist *since) {
+        uint64_t cnt = 0;
+        int i;
+
+        for (i = 0 ; i < HIST_BUCKET_CNT ; i++)
+                cnt += rd_atomic64_load(&h->buckets[i]) -
+                        (since ? since->buckets[i] : 0);
+
+        return cnt;
+}
+
+/**
+ * @returns the \p pct percentile (0..100) of the values recorded to
+ *          \p h since \p since (may be NULL), or 0 if there are none.
+ */
+uint64_t hist_percentile (const struct hist *h, const struct hist *since,
+                          double pct) {
+        uint64_t cnt = hist_cnt(h, since);
+        uint64_t target, sum = 0;
+        int i;
+
+        if (cnt == 0)
+                return 0;
+
+        /* Rank of the percentile value, at least the first value. */
+        target = (uint64_t)((pct / 100.0) * (double)cnt + 0.5);
+        if (target < 1)
+                target = 1;
+        else if (target > cnt)
+                target = cnt;
+
+        for (i = 0 ; i < HIST_BUCKET_CNT ; i++) {
+                sum += rd_atomic64_load(&h->buckets[i]) -
+                        (since ? since->buckets[i] : 0);
+                if (sum >= target)
+                        return hist_value(i);
+        }
+
+        return hist_value(HIST_BUCKET_CNT - 1);
+}
+
+
+
+/**
+ * @returns a well-mixed hash of \p x (splitmix64 finalizer)
+ */
+static RD_INLINE uint64_t bench_mix (uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+}
+
+
+/**
+ * @brief Start the benchmark clock, and set up the producer's message pool.
+ *
+ * Each 64 byte run of the pool starts with kafkacat.bench.compressibility
+ * percent of a repeated text, the remainder is random bytes.
+ */
+void bench_start (void) {
+        static const char text[] = "kafkacat benchmark message ";
+        size_t size = (size_t)conf.bench_msg_size + BENCH_POOL_SIZE;
+        size_t run = 64 * (size_t)conf.bench_compressibility / 100;
+        size_t i;
+
+        bench.ts_start = bench.ts_last = rd_clock();
+
+        if (conf.mode != 'P')
+                return;
+
+        bench.pool = malloc(size);
+        if (!bench.pool)
+                KC_FATAL("Failed to allocate %zu bytes of benchmark "
+                         "messages", size);
+
+        for (i = 0 ; i < size ; i++) {
+                if (i % 64 < run)
+                        bench.pool[i] = text[i % (sizeof(text) - 1)];
+                else
+                        bench.pool[i] = (char)(bench_mix(i) >> 56);
+        }
+}
+
+
+/**
+ * @brief Free the message pool, the messages must have been delivered.
+ */
+void bench_term (void) {
+        free(bench.pool);
+        bench.pool = NULL;
+}
+
+
+/**
+ * @returns the value of synthetic message \p seq,
+ *          of kafkacat.bench.msg.size bytes.
+ */
+const char *bench_value (uint64_t seq) {
+        return bench.pool + bench_mix(seq) % BENCH_POOL_SIZE;
+}
+
+
+/**
+ * @brief Write the key of synthetic message \p seq, one of
+ *        kafkacat.bench.key.cnt keys, to \p key.
+ *
+ * @returns the key length, or 0 for no key.
+ */
+size_t bench_key (uint64_t seq, char *key, size_t size) {
+        int r;
+
+        if (conf.bench_key_cnt == 0)
+                return 0;
+
+        r = snprintf(key, size, "key%"PRIu64,
+                     bench_mix(~seq) % (uint64_t)conf.bench_key_cnt);
+
+        return r < 0 ? 0 : MIN((size_t)r, size - 1);
+}
+
+
+/**
+ * @brief Record a latency of \p us microseconds, thread-safe.
+ */
+void bench_latency (int64_t us) {
+        if (us >= 0)
+                hist_record(&bench.latency, (uint64_t)us);
+}
+
+
+/**
+ * @brief Record the end-to-end latency and offset lag of a
+ *        consumed message, thread-safe.
+ */
+void bench_consumed (const rd_kafka_message_t *rkmessage) {
+        int64_t ts, lo, hi;
+        struct timeval tv;
+
+        /* The timestamp has millisecond resolution */
+        ts = rd_kafka_message_timestamp(rkmessage, NULL);
+        if (ts > 0) {
+                rd_gettimeofday(&tv, NULL);
+                bench_latency(((int64_t)tv.tv_sec * 1000 +
+                               tv.tv_usec / 1000 - ts) * 1000);
+        }
+
+        /* The cached high watermark, as of the last fetch. */
+        if (!rd_kafka_get_watermark_offsets(
+                    conf.rk, rd_kafka_topic_name(rkmessage->rkt),
+                    rkmessage->partition, &lo, &hi) &&
+            hi > rkmessage->offset)
+                hist_record(&bench.lag,
+                            (uint64_t)(hi - rkmessage->offset - 1));
+}
+
+
+/**
+ * @returns 1 if the next periodic report is due
+ *          (every kafkacat.bench.report.ms), else 0.
+ */
+int bench_report_due (void) {
+        return conf.bench_report_ms > 0 &&
+                rd_clock() - bench.ts_last >=
+                (int64_t)conf.bench_report_ms * 1000;
+}
+
+
+/**
+ * @brief Print a latency histogram's percentiles in milliseconds.
+ */
+static void bench_print_latency (const char *what, const struct hist *h,
+                                 const struct hist *since) {
+        if (!hist_cnt(h, since))
+                return;
+
+        printf(", %s p50 %.2fms p99 %.2fms p99.9 %.2fms max %.2fms",
+               what,
+               (double)hist_percentile(h, since, 50.0) / 1000.0,
+               (double)hist_percentile(h, since, 99.0) / 1000.0,
+               (double)hist_percentile(h, since, 99.9) / 1000.0,
+               (double)hist_percentile(h, since, 100.0) / 1000.0);
+}
+
+
+/**
+ * @brief Print a benchmark report of \p what (e.g., "Produced") for
+ *        the interval since the last report, or for the entire run
+ *        if \p final, given the current message, byte and error counts.
+ */
+void bench_report (const char *what, uint64_t msgs, uint64_t bytes,
+                   uint64_t errors, int final) {
+        int64_t now = rd_clock();
+        int64_t since_ts = final ? bench.ts_start : bench.ts_last;
+        double secs = (double)(now - since_ts) / 1000000.0;
+        uint64_t imsgs = final ? msgs : msgs - bench.last_msgs;
+        uint64_t ibytes = final ? bytes : bytes - bench.last_bytes;
+        const struct hist *lat_since = final ? NULL : &bench.latency_last;
+        const struct hist *lag_since = final ? NULL : &bench.lag_last;
+
+        if (secs <= 0.0)
+                secs = 0.000001;
+
+        printf("%s%s %"PRIu64" messages (%"PRIu64" bytes) in %.3fs: "
+               "%.0f msgs/s, %.2f MB/s",
+               final ? "Total: " : "", what, imsgs, ibytes, secs,
+               (double)imsgs / secs,
+               (double)ibytes / secs / (1024.0 * 1024.0));
+
+        if (errors)
+                printf(", %"PRIu64" errors", errors);
+
+        bench_print_latency(conf.mode == 'P' ?
+                            "delivery latency" : "end-to-end latency",
+                            &bench.latency, lat_since);
+
+        if (hist_cnt(&bench.lag, lag_since))
+                printf(", lag p50 %"PRIu64" p99 %"PRIu64" max %"PRIu64
+                       " msgs",
+                       hist_percentile(&bench.lag, lag_since, 50.0),
+                       hist_percentile(&bench.lag, lag_since, 99.0),
+                       hist_percentile(&bench.lag, lag_since, 100.0));
+
+        printf("\n");
+        fflush(stdout);
+
+        bench.ts_last    = now;
+        bench.last_msgs  = msgs;
+        bench.last_bytes = bytes;
+        hist_copy(&bench.latency_last, &bench.latency);
+        hist_copy(&bench.lag_last, &bench.lag);
+}
+
+
+
+/**
+ * @brief Print the result of microbenchmark \p name, which performed
+ *        \p ops operations on \p bytes bytes in \p us microseconds,
+ *        as a "<name> <ns/op> <MB/s>" line.
+ *
+ * The output is compared against a baseline by tests/bench.sh.
+ */
+void ubench_result (const char *name, uint64_t ops, uint64_t bytes,
+                    int64_t us) {
+        if (us <= 0)
+                us = 1;
+        if (!ops)
+                ops = 1;
+
+        printf("%-40s %12.2f %10.2f\n", name,
+               (double)us * 1000.0 / (double)ops,
+               (double)bytes / ((double)us / 1000000.0) /
+               (1024.0 * 1024.0));
+        fflush(stdout);
+}
+
+
+
+/**
+ * @brief Verify the histogram's precision and percentiles.
+ */
+int bench_unittest (void) {
+        static struct hist h, base;
+        uint64_t v;
+        int idx = -1;
+        int fails = 0;
+
+#define BENCH_CHECK(COND, ...) do {                                     \
+                if (!(COND)) {                                          \
+                        fprintf(stderr, "%s: FAILED: ", __FUNCTION__); \
+                        fprintf(stderr, __VA_ARGS__);                   \
+                        fails++;                                        \
+                }                                                       \
+        } while (0)
+
+        /* Buckets are contiguous and within 1/64 of the value. */
+        for (v = 0 ; v < ((uint64_t)1 << 62) ; v += 1 + v / 256) {
+                int i = hist_index(v);
+                BENCH_CHECK(i >= idx && i <= idx + 1 && i < HIST_BUCKET_CNT,
+                            "value %"PRIu64" in bucket %d after %d\n",
+                            v, i, idx);
+                BENCH_CHECK(hist_value(i) >= v &&
+                            hist_value(i) - v <= v / 64,
+                            "value %"PRIu64" bucket %d value %"PRIu64"\n",
+                            v, i, hist_value(i));
+                idx = i;
+        }
+        BENCH_CHECK(hist_index(UINT64_MAX) == HIST_BUCKET_CNT - 1 &&
+                    hist_value(HIST_BUCKET_CNT - 1) == UINT64_MAX,
+                    "last bucket %d\n", hist_index(UINT64_MAX));
+
+        /* Small values are exact */
+        for (v = 1 ; v <= 100 ; v++)
+                hist_record(&h, v);
+        BENCH_CHECK(hist_cnt(&h, NULL) == 100, "count %"PRIu64"\n",
+                    hist_cnt(&h, NULL));
+        BENCH_CHECK(hist_percentile(&h, NULL, 50.0) == 50 &&
+                    hist_percentile(&h, NULL, 99.0) == 99 &&
+                    hist_percentile(&h, NULL, 100.0) == 100 &&
+                    hist_percentile(&h, NULL, 0.0) == 1,
+                    "small value percentiles\n");
+
+        /* Percentiles since a baseline */
+        hist_copy(&base, &h);
+        for (v = 1 ; v <= 100000 ; v++)
+                hist_record(&h, v * 1000);
+        BENCH_CHECK(hist_cnt(&h, &base) == 100000, "count %"PRIu64"\n",
+                    hist_cnt(&h, &base));
+        v = hist_percentile(&h, &base, 99.9);
+        BENCH_CHECK(v >= 99900000 && v <= 99900000 + 99900000 / 64,
+                    "p99.9 %"PRIu64"\n", v);
+        v = hist_percentile(&h, &base, 100.0);
+        BENCH_CHECK(v >= 100000000 && v <= 100000000 + 100000000 / 64,
+                    "max %"PRIu64"\n", v);
+        v = hist_percentile(&h, NULL, 0.05);
+        BENCH_CHECK(v == 50, "p0.05 %"PRIu64"\n", v);
+
+#undef BENCH_CHECK
+
+        return fails;
+}
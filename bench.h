@@ -0,0 +1,91 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+
+/**
+ * @brief HDR (high dynamic range) histogram of unsigned 64-bit values.
+ *
+ * Values below HIST_SUB_CNT are recorded exactly, larger values in
+ * log-linear buckets of HIST_SUB_CNT/2 per power of two, i.e., with
+ * a relative precision of 1/64, over the entire value range.
+ *
+ * Buckets are updated atomically so that multiple threads may record
+ * to the same histogram.
+ */
+#define HIST_SUB_BITS    7
+#define HIST_SUB_CNT     (1 << HIST_SUB_BITS)
+#define HIST_BUCKET_CNT  ((64 - HIST_SUB_BITS + 2) * (HIST_SUB_CNT / 2))
+
+struct hist {
+        uint64_t buckets[HIST_BUCKET_CNT];
+};
+
+void hist_record (struct hist *h, uint64_t v);
+void hist_record_unlocked (struct hist *h, uint64_t v);
+void hist_copy (struct hist *dst, const struct hist *src);
+uint64_t hist_cnt (const struct hist *h, const struct hist *since);
+uint64_t hist_percentile (const struct hist *h, const struct hist *since,
+                          double pct);
+
+
+/*
+ * Benchmark mode (-B)
+ */
+void bench_start (void);
+void bench_term (void);
+const char *bench_value (uint64_t seq);
+size_t bench_key (uint64_t seq, char *key, size_t size);
+void bench_latency (int64_t us);
+void bench_consumed (const rd_kafka_message_t *rkmessage);
+int bench_report_due (void);
+void bench_report (const char *what, uint64_t msgs, uint64_t bytes,
+                   uint64_t errors, int final);
+
+int bench_unittest (void);
+
+
+/*
+ * Microbenchmarks (-U bench)
+ */
+
+/**< Minimum run time of each microbenchmark, in microseconds. */
+#define UBENCH_MIN_US  300000
+
+/**
+ * @returns true once a microbenchmark started at \p ts_start
+ *          (rd_clock()) has run for long enough.
+ */
+#define ubench_done(ts_start) (rd_clock() - (ts_start) >= UBENCH_MIN_US)
+
+void ubench_result (const char *name, uint64_t ops, uint64_t bytes,
+                    int64_t us);
+
+#endif
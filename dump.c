@@ -0,0 +1,954 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Binary dump format (-X kafkacat.dump=true)
+ *
+ * A compact, length-prefixed encoding of consumed messages that retains
+ * the key, value, headers, timestamp, partition and offset of each
+ * message, and that the producer restores without parsing text.
+ *
+ * All integers are big endian:
+ *
+ *   dump    := header frame*
+ *   header  := "KCATDUMP" u32 version u32 flags(0)
+ *   frame   := u32 length(of what follows) u8 type ...
+ *
+ *   Message frame ('M'):
+ *     u8 tstype, i32 partition, i64 offset, i64 timestamp,
+ *     i32 key length, i32 value length (-1 for NULL), u32 header count,
+ *     key, value, and for each header:
+ *     u32 name length, name, i32 value length (-1 for NULL), value.
+ *
+ *   Index frame ('I'), the last frame of a dump written to a file
+ *   descriptor of its own, indexing blocks of conf.dump_index_interval
+ *   messages:
+ *     per block: u64 position of the block's first frame (relative to
+ *     the header), i64 max offset, i64 min timestamp, i64 max timestamp,
+ *     followed by u64 block count, u64 position of the index frame and
+ *     "KCATIDX1".
+ *
+ * The reader uses the index of memory mapped input to skip blocks
+ * without wanted messages, see dump_index_skip(), other input is
+ * filtered message by message. Concatenated dumps are read as one.
+ */
+
+#include "kafkacat.h"
+#include "input.h"
+#include "output.h"
+#include "dump.h"
+#include "rdendian.h"
+
+#include <stdio.h>
+#include <assert.h>
+
+
+#define DUMP_MAGIC         "KCATDUMP"
+#define DUMP_INDEX_MAGIC   "KCATIDX1"
+#define DUMP_VERSION       1
+
+#define DUMP_HEADER_SIZE   16
+#define DUMP_FRAME_SIZE    5      /* Frame length and type */
+#define DUMP_MSG_SIZE      (DUMP_FRAME_SIZE + 33) /* Fixed message fields */
+#define DUMP_INDEX_ENTRY_SIZE 32
+#define DUMP_INDEX_TAIL_SIZE  24
+
+/* Maximum frame size in excess of the producer's message size
+ * (message.max.bytes), for the message fields and header overhead. */
+#define DUMP_FRAME_OVERHEAD (64*1024)
+
+/* Input chunk size, unless kafkacat.input.chunk.size is set */
+#define DUMP_CHUNK_SIZE    (1024*1024)
+
+
+static RD_INLINE void dump_put32 (char *p, uint32_t v) {
+        v = htobe32(v);
+        memcpy(p, &v, sizeof(v));
+}
+
+static RD_INLINE void dump_put64 (char *p, uint64_t v) {
+        v = htobe64(v);
+        memcpy(p, &v, sizeof(v));
+}
+
+static RD_INLINE uint32_t dump_get32 (const char *p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return be32toh(v);
+}
+
+static RD_INLINE uint64_t dump_get64 (const char *p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return be64toh(v);
+}
+
+
+
+/**
+ * Dump writer
+ */
+
+struct dump_index_entry {
+        uint64_t pos;        /**< Position of the block's first frame */
+        int64_t  max_offset;
+        int64_t  min_ts;
+        int64_t  max_ts;
+};
+
+/**
+ * @brief Dump writer state of an output buffer (outbuf.dump).
+ */
+struct dump_output {
+        uint64_t base;       /**< Output position of the header */
+        int      indexed;    /**< Write an index when the dump ends */
+        struct dump_index_entry *idx;
+        int      idx_cnt;
+        int      idx_size;
+        int      block_cnt;  /**< Messages in the current block */
+};
+
+
+/**
+ * @brief Start a dump on \p ob, writing the dump header if \p header is
+ *        set and the index when the dump ends if \p index is set.
+ *
+ * Called on the first message for buffers of their own, buffers that
+ * share the file descriptor of another buffer (outbuf_set_lock()) write
+ * neither: the owner must write the header before they write any
+ * messages.
+ */
+struct dump_output *dump_output_begin (struct outbuf *ob,
+                                       int header, int index) {
+        struct dump_output *d = calloc(1, sizeof(*d));
+
+        d->base    = ob->written + ob->len;
+        d->indexed = index && conf.dump_index_interval > 0;
+        ob->dump   = d;
+
+        if (header) {
+                char hdr[DUMP_HEADER_SIZE];
+
+                memcpy(hdr, DUMP_MAGIC, 8);
+                dump_put32(hdr+8, DUMP_VERSION);
+                dump_put32(hdr+12, 0);
+                outbuf_write(ob, hdr, sizeof(hdr));
+        }
+
+        return d;
+}
+
+
+/**
+ * @brief Add the message at position \p pos to the index.
+ */
+static void dump_index_add (struct dump_output *d, uint64_t pos,
+                            int64_t offset, int64_t ts) {
+        struct dump_index_entry *e;
+
+        if (d->block_cnt == 0) {
+                /* First message of a new block */
+                if (d->idx_cnt == d->idx_size) {
+                        d->idx_size = d->idx_size ? d->idx_size * 2 : 64;
+                        d->idx = realloc(d->idx,
+                                         sizeof(*d->idx) * d->idx_size);
+                }
+
+                e = &d->idx[d->idx_cnt++];
+                e->pos        = pos;
+                e->max_offset = offset;
+                e->min_ts     = ts;
+                e->max_ts     = ts;
+
+        } else {
+                e = &d->idx[d->idx_cnt-1];
+                if (offset > e->max_offset)
+                        e->max_offset = offset;
+                if (ts < e->min_ts)
+                        e->min_ts = ts;
+                if (ts > e->max_ts)
+                        e->max_ts = ts;
+        }
+
+        if (++d->block_cnt == conf.dump_index_interval)
+                d->block_cnt = 0;
+}
+
+
+/**
+ * @brief Write \p rkmessage with timestamp \p ts of type \p tstype and
+ *        headers \p hdrs (may be NULL) as a message frame.
+ */
+static void dump_msg_write (struct outbuf *ob,
+                            const rd_kafka_message_t *rkmessage,
+                            int tstype, int64_t ts,
+                            const rd_kafka_headers_t *hdrs) {
+        struct dump_output *d = ob->dump;
+        char fixed[DUMP_MSG_SIZE];
+        size_t key_len = rkmessage->key ? rkmessage->key_len : 0;
+        size_t len = rkmessage->payload ? rkmessage->len : 0;
+        size_t hdrs_size = 0;
+        uint64_t frame_size;
+        int hdr_cnt = 0;
+
+        if (!d)
+                d = dump_output_begin(ob, !ob->lock, !ob->lock);
+
+        if (d->indexed)
+                dump_index_add(d, ob->written + ob->len - d->base,
+                               rkmessage->offset, ts);
+
+#if HAVE_HEADERS
+        if (hdrs) {
+                const char *name;
+                const void *val;
+                size_t size;
+
+                while (!rd_kafka_header_get_all(hdrs, hdr_cnt,
+                                                &name, &val, &size)) {
+                        hdrs_size += 4 + strlen(name) + 4 +
+                                (val ? size : 0);
+                        hdr_cnt++;
+                }
+        }
+#endif
+
+        frame_size = (uint64_t)DUMP_MSG_SIZE + key_len + len + hdrs_size;
+        if (frame_size - 4 > UINT32_MAX)
+                KC_FATAL("Message at offset %"PRId64" is too large "
+                         "for the dump format", rkmessage->offset);
+
+        dump_put32(fixed, (uint32_t)(frame_size - 4));
+        fixed[4] = 'M';
+        fixed[5] = (char)tstype;
+        dump_put32(fixed+6, (uint32_t)rkmessage->partition);
+        dump_put64(fixed+10, (uint64_t)rkmessage->offset);
+        dump_put64(fixed+18, (uint64_t)ts);
+        dump_put32(fixed+26, rkmessage->key ? (uint32_t)key_len :
+                   (uint32_t)-1);
+        dump_put32(fixed+30, rkmessage->payload ? (uint32_t)len :
+                   (uint32_t)-1);
+        dump_put32(fixed+34, (uint32_t)hdr_cnt);
+
+        outbuf_write(ob, fixed, sizeof(fixed));
+        if (key_len)
+                outbuf_write(ob, rkmessage->key, key_len);
+        if (len)
+                outbuf_write(ob, rkmessage->payload, len);
+
+#if HAVE_HEADERS
+        if (hdr_cnt > 0) {
+                const char *name;
+                const void *val;
+                size_t size;
+                int i;
+
+                for (i = 0 ; i < hdr_cnt ; i++) {
+                        char b[4];
+                        size_t name_len;
+
+                        rd_kafka_header_get_all(hdrs, i, &name, &val, &size);
+                        name_len = strlen(name);
+
+                        dump_put32(b, (uint32_t)name_len);
+                        outbuf_write(ob, b, sizeof(b));
+                        outbuf_write(ob, name, name_len);
+
+                        dump_put32(b, val ? (uint32_t)size : (uint32_t)-1);
+                        outbuf_write(ob, b, sizeof(b));
+                        if (val)
+                                outbuf_write(ob, val, size);
+                }
+        }
+#endif
+}
+
+
+/**
+ * @brief Output \p rkmessage as a message frame.
+ */
+void dump_msg_output (struct outbuf *ob,
+                      const rd_kafka_message_t *rkmessage) {
+        rd_kafka_timestamp_type_t tstype = RD_KAFKA_TIMESTAMP_NOT_AVAILABLE;
+        int64_t ts = -1;
+        rd_kafka_headers_t *hdrs = NULL;
+
+#if RD_KAFKA_VERSION >= 0x000902ff
+        ts = rd_kafka_message_timestamp(rkmessage, &tstype);
+#endif
+
+#if HAVE_HEADERS
+        {
+                rd_kafka_resp_err_t err;
+
+                err = rd_kafka_message_headers(rkmessage, &hdrs);
+                if (err == RD_KAFKA_RESP_ERR__NOENT) {
+                        /* No headers */
+                } else if (err) {
+                        KC_ERROR("Failed to parse headers of message in "
+                                 "%s [%"PRId32"] at offset %"PRId64": %s",
+                                 rd_kafka_topic_name(rkmessage->rkt),
+                                 rkmessage->partition, rkmessage->offset,
+                                 rd_kafka_err2str(err));
+                        hdrs = NULL;
+                }
+        }
+#endif
+
+        dump_msg_write(ob, rkmessage, (int)tstype, ts, hdrs);
+}
+
+
+/**
+ * @brief End the dump on \p ob, writing the index if enabled.
+ *        Called by outbuf_destroy().
+ */
+void dump_output_end (struct outbuf *ob) {
+        struct dump_output *d = ob->dump;
+
+        ob->dump = NULL;
+
+        if (d->indexed && d->idx_cnt > 0) {
+                uint64_t pos = ob->written + ob->len - d->base;
+                char b[DUMP_INDEX_TAIL_SIZE];
+                int i;
+
+                dump_put32(b, (uint32_t)(DUMP_FRAME_SIZE - 4 +
+                                         d->idx_cnt * DUMP_INDEX_ENTRY_SIZE +
+                                         DUMP_INDEX_TAIL_SIZE));
+                b[4] = 'I';
+                outbuf_write(ob, b, DUMP_FRAME_SIZE);
+
+                for (i = 0 ; i < d->idx_cnt ; i++) {
+                        char e[DUMP_INDEX_ENTRY_SIZE];
+
+                        dump_put64(e,    d->idx[i].pos);
+                        dump_put64(e+8,  (uint64_t)d->idx[i].max_offset);
+                        dump_put64(e+16, (uint64_t)d->idx[i].min_ts);
+                        dump_put64(e+24, (uint64_t)d->idx[i].max_ts);
+                        outbuf_write(ob, e, sizeof(e));
+                }
+
+                dump_put64(b,   (uint64_t)d->idx_cnt);
+                dump_put64(b+8, pos);
+                memcpy(b+16, DUMP_INDEX_MAGIC, 8);
+                outbuf_write(ob, b, DUMP_INDEX_TAIL_SIZE);
+        }
+
+        free(d->idx);
+        free(d);
+}
+
+
+
+/**
+ * Dump reader
+ */
+
+struct dump_reader {
+        struct inbuf inbuf;
+        FILE        *fp;
+        int          in_dump;      /**< A dump header has been read */
+
+        int64_t      start_offset; /**< Skip lower offsets, -1 = all */
+        int64_t      start_ts;     /**< Skip older messages, 0 = all */
+        int64_t      stop_ts;      /**< Skip messages at or after this
+                                    *   timestamp, 0 = all */
+
+        /* Index of mapped input, see dump_index_load() */
+        const char  *idx;          /**< First index entry, NULL if not
+                                    *   indexed. */
+        size_t       base;         /**< Mapping position of the header */
+        uint64_t     idx_cnt;
+        uint64_t     idx_next;     /**< Next block */
+        uint64_t     idx_pos;      /**< Position of the index frame */
+        uint64_t     skipped;      /**< Blocks skipped */
+};
+
+
+/**
+ * @brief Set up the index of memory mapped input if the input is a
+ *        single dump ending with an index frame.
+ */
+static void dump_index_load (struct dump_reader *dr) {
+        size_t size, of;
+        const char *map = inbuf_mapping(&dr->inbuf, &size, &of);
+        const char *tail, *frame;
+        uint64_t cnt, pos, frame_size;
+
+        if (!map ||
+            size - of < DUMP_HEADER_SIZE + DUMP_FRAME_SIZE +
+            DUMP_INDEX_TAIL_SIZE)
+                return;
+
+        tail = map + size - DUMP_INDEX_TAIL_SIZE;
+        if (memcmp(tail + 16, DUMP_INDEX_MAGIC, 8))
+                return;
+
+        cnt = dump_get64(tail);
+        pos = dump_get64(tail + 8);
+
+        if (cnt > (size - of) / DUMP_INDEX_ENTRY_SIZE)
+                return;
+
+        frame_size = DUMP_FRAME_SIZE + cnt * DUMP_INDEX_ENTRY_SIZE +
+                DUMP_INDEX_TAIL_SIZE;
+        frame = map + size - frame_size;
+
+        /* The index must be that of the dump at the read position,
+         * not of a dump concatenated to it. */
+        if (size - of < frame_size || size - frame_size - of != pos ||
+            dump_get32(frame) != frame_size - 4 || frame[4] != 'I') {
+                KC_INFO(3, "Not using dump index of %"PRIu64" blocks: "
+                        "input is not a single dump\n", cnt);
+                return;
+        }
+
+        dr->idx     = frame + DUMP_FRAME_SIZE;
+        dr->idx_cnt = cnt;
+        dr->idx_pos = pos;
+        dr->base    = of;
+
+        KC_INFO(3, "Using dump index of %"PRIu64" blocks\n", cnt);
+}
+
+
+/**
+ * @returns true if no messages of the index block at \p e are wanted.
+ */
+static int dump_index_block_unwanted (const struct dump_reader *dr,
+                                      const char *e) {
+        return (dr->start_offset >= 0 &&
+                (int64_t)dump_get64(e+8) < dr->start_offset) ||
+                (dr->start_ts && (int64_t)dump_get64(e+24) < dr->start_ts) ||
+                (dr->stop_ts && (int64_t)dump_get64(e+16) >= dr->stop_ts);
+}
+
+
+/**
+ * @brief Skip the index blocks starting at the read position, if any,
+ *        that have no wanted messages.
+ */
+static void dump_index_skip (struct dump_reader *dr) {
+        size_t size, of;
+
+        inbuf_mapping(&dr->inbuf, &size, &of);
+
+        while (dr->idx_next < dr->idx_cnt) {
+                const char *e = dr->idx +
+                        dr->idx_next * DUMP_INDEX_ENTRY_SIZE;
+                uint64_t pos = (uint64_t)(of - dr->base);
+                uint64_t next;
+
+                if (dump_get64(e) != pos)
+                        break; /* Not at the start of the next block */
+
+                dr->idx_next++;
+
+                if (!dump_index_block_unwanted(dr, e))
+                        break;
+
+                next = dr->idx_next < dr->idx_cnt ?
+                        dump_get64(e + DUMP_INDEX_ENTRY_SIZE) : dr->idx_pos;
+                if (next <= pos || next > dr->idx_pos)
+                        KC_FATAL("Dump input is corrupt: invalid index "
+                                 "block position %"PRIu64, next);
+
+                of = dr->base + (size_t)next;
+                inbuf_seek_mapped(&dr->inbuf, of);
+                dr->skipped++;
+        }
+}
+
+
+/**
+ * @brief Create a reader of the dump input \p fp, producing messages
+ *        only from \p start_offset (-1 for all) and in the timestamp
+ *        range \p start_ts .. \p stop_ts (0 for no limit).
+ *
+ * Regular files are memory mapped, unless compressed or disabled with
+ * kafkacat.input.mmap=false, other input is read in chunks.
+ */
+struct dump_reader *dump_reader_new (FILE *fp,
+                                     int64_t start_offset,
+                                     int64_t start_ts, int64_t stop_ts) {
+        struct dump_reader *dr = calloc(1, sizeof(*dr));
+        size_t max_size = (size_t)conf.msg_size + DUMP_FRAME_OVERHEAD;
+        int compressed = conf.input_compression != KC_COMPRESSION_NONE &&
+                conf.input_compression != KC_COMPRESSION_AUTO;
+
+        dr->fp           = fp;
+        dr->start_offset = start_offset;
+        dr->start_ts     = start_ts;
+        dr->stop_ts      = stop_ts;
+
+        if (conf.input_mmap && !compressed &&
+            inbuf_init_mmap(&dr->inbuf, max_size, "", 0, fp) == 0)
+                dump_index_load(dr);
+        else
+                inbuf_init_chunked(&dr->inbuf, max_size, "", 0,
+                                   conf.input_chunk_size ?
+                                   conf.input_chunk_size : DUMP_CHUNK_SIZE);
+
+        if (compressed)
+                inbuf_set_decompress(&dr->inbuf, conf.input_compression);
+
+        return dr;
+}
+
+
+/**
+ * @brief Parse the message frame \p p of \p size bytes (following the
+ *        frame length) into \p dm.
+ *
+ * @returns 0 on success or -1 if the frame is invalid.
+ */
+static int dump_msg_parse (struct dump_msg *dm, const char *p, size_t size) {
+        const char *end = p + size;
+        int32_t key_len, len;
+        int i;
+
+        if (size < DUMP_MSG_SIZE - 4)
+                return -1;
+
+        dm->tstype    = (unsigned char)p[1];
+        dm->partition = (int32_t)dump_get32(p+2);
+        dm->offset    = (int64_t)dump_get64(p+6);
+        dm->timestamp = (int64_t)dump_get64(p+14);
+        key_len       = (int32_t)dump_get32(p+22);
+        len           = (int32_t)dump_get32(p+26);
+        dm->hdr_cnt   = (int)dump_get32(p+30);
+        p += DUMP_MSG_SIZE - 4;
+
+        if (key_len < -1 || len < -1 || dm->hdr_cnt < 0 ||
+            (size_t)MAX(key_len, 0) + (size_t)MAX(len, 0) >
+            (size_t)(end - p))
+                return -1;
+
+        dm->key     = key_len == -1 ? NULL : p;
+        dm->key_len = (size_t)MAX(key_len, 0);
+        p += dm->key_len;
+
+        dm->value   = len == -1 ? NULL : p;
+        dm->len     = (size_t)MAX(len, 0);
+        p += dm->len;
+
+        /* Validate the headers, they're decoded by dump_msg_headers() */
+        dm->hdrs = p;
+        for (i = 0 ; i < dm->hdr_cnt ; i++) {
+                uint32_t name_len;
+                int32_t val_len;
+
+                if (end - p < 8 ||
+                    (name_len = dump_get32(p)) > (size_t)(end - p) - 8)
+                        return -1;
+                p += 4 + name_len;
+
+                val_len = (int32_t)dump_get32(p);
+                p += 4;
+                if (val_len < -1 || (size_t)MAX(val_len, 0) >
+                    (size_t)(end - p))
+                        return -1;
+                p += MAX(val_len, 0);
+        }
+
+        return p == end ? 0 : -1;
+}
+
+
+/**
+ * @returns true if \p dm is in the reader's offset and timestamp range.
+ */
+static int dump_msg_wanted (const struct dump_reader *dr,
+                            const struct dump_msg *dm) {
+        return !(dr->start_offset >= 0 && dm->offset < dr->start_offset) &&
+                !(dr->start_ts && dm->timestamp < dr->start_ts) &&
+                !(dr->stop_ts && dm->timestamp >= dr->stop_ts);
+}
+
+
+/**
+ * @brief Read the next wanted message into \p dm.
+ *
+ * The message is a slice of dm->chunk, the caller must acquire its own
+ * reference with buf_keep() if the message is to outlive the next call.
+ *
+ * Invalid or truncated input is fatal.
+ *
+ * @returns 1 if a message was read, or 0 at the end of the input.
+ */
+int dump_read (struct dump_reader *dr, struct dump_msg *dm) {
+
+        while (1) {
+                struct buf *chunk;
+                char *p;
+                uint32_t size;
+                int r;
+
+                if (dr->idx)
+                        dump_index_skip(dr);
+
+                r = inbuf_read_frame(&dr->inbuf, dr->fp, 4, &chunk, &p);
+                if (r == 0)
+                        return 0;
+                else if (r == -1)
+                        KC_FATAL("Dump input is truncated");
+
+                if (!memcmp(p, DUMP_MAGIC, 4)) {
+                        /* Header of the first, or a concatenated, dump */
+                        uint32_t version;
+
+                        r = inbuf_read_frame(&dr->inbuf, dr->fp,
+                                             DUMP_HEADER_SIZE - 4,
+                                             &chunk, &p);
+                        if (r != 1)
+                                KC_FATAL("Dump input is truncated");
+                        if (memcmp(p, DUMP_MAGIC + 4, 4))
+                                KC_FATAL("Input is not a kafkacat dump");
+
+                        version = dump_get32(p+4);
+                        if (version != DUMP_VERSION)
+                                KC_FATAL("Unsupported kafkacat dump "
+                                         "format version %"PRIu32
+                                         " (expected %d)",
+                                         version, DUMP_VERSION);
+
+                        dr->in_dump = 1;
+                        continue;
+                }
+
+                if (!dr->in_dump)
+                        KC_FATAL("Input is not a kafkacat dump");
+
+                size = dump_get32(p);
+                if (size < 1)
+                        KC_FATAL("Dump input is corrupt: empty frame");
+
+                r = inbuf_read_frame(&dr->inbuf, dr->fp, size, &chunk, &p);
+                if (r != 1)
+                        KC_FATAL("Dump input is truncated");
+
+                if (*p != 'M')
+                        continue; /* Index, or unknown, frame */
+
+                if (dump_msg_parse(dm, p, size) == -1)
+                        KC_FATAL("Dump input is corrupt: invalid message "
+                                 "frame of %"PRIu32" bytes", size);
+
+                if (!dump_msg_wanted(dr, dm))
+                        continue;
+
+                dm->chunk = chunk;
+                return 1;
+        }
+}
+
+
+/**
+ * @brief Destroy the reader, messages referencing its input chunks
+ *        remain valid.
+ */
+void dump_reader_destroy (struct dump_reader *dr) {
+        if (dr->idx)
+                KC_INFO(3, "Skipped %"PRIu64"/%"PRIu64" dump blocks "
+                        "using the index\n", dr->skipped, dr->idx_cnt);
+
+        inbuf_destroy(&dr->inbuf);
+        free(dr);
+}
+
+
+#if HAVE_HEADERS
+/**
+ * @returns a new list of \p dm's headers followed by the headers in
+ *          \p extra (may be NULL), or NULL if there are no headers.
+ */
+rd_kafka_headers_t *dump_msg_headers (const struct dump_msg *dm,
+                                      const rd_kafka_headers_t *extra) {
+        rd_kafka_headers_t *hdrs;
+        const char *p = dm->hdrs;
+        size_t extra_cnt = extra ? rd_kafka_header_cnt(extra) : 0;
+        const char *name;
+        const void *val;
+        size_t size;
+        size_t i;
+
+        if (dm->hdr_cnt == 0 && extra_cnt == 0)
+                return NULL;
+
+        hdrs = rd_kafka_headers_new((size_t)dm->hdr_cnt + extra_cnt);
+
+        for (i = 0 ; i < (size_t)dm->hdr_cnt ; i++) {
+                uint32_t name_len = dump_get32(p);
+                int32_t val_len;
+
+                name = p + 4;
+                p += 4 + name_len;
+                val_len = (int32_t)dump_get32(p);
+                p += 4;
+
+                rd_kafka_header_add(hdrs, name, (ssize_t)name_len,
+                                    val_len == -1 ? NULL : p,
+                                    (ssize_t)MAX(val_len, 0));
+                p += MAX(val_len, 0);
+        }
+
+        for (i = 0 ; i < extra_cnt ; i++) {
+                rd_kafka_header_get_all(extra, i, &name, &val, &size);
+                rd_kafka_header_add(hdrs, name, -1, val, (ssize_t)size);
+        }
+
+        return hdrs;
+}
+#endif
+
+
+
+/**
+ * @brief Read the dump \p fp with the given range and verify the
+ *        messages against the \p msgcnt messages of \p msgs, repeated
+ *        \p repeat times.
+ *
+ * @returns the number of failures.
+ */
+static int dump_unittest_read (const char *what, FILE *fp,
+                               const rd_kafka_message_t *msgs, int msgcnt,
+                               int repeat, int64_t start_offset,
+                               int64_t start_ts, int64_t stop_ts,
+                               int expect_skip) {
+        struct dump_reader *dr;
+        struct dump_msg dm;
+        int i = 0, cnt = 0, exp_cnt = 0;
+        int fails = 0;
+        uint64_t skipped;
+
+        rewind(fp);
+        dr = dump_reader_new(fp, start_offset, start_ts, stop_ts);
+
+        for (i = 0 ; i < msgcnt * repeat ; i++) {
+                const rd_kafka_message_t *rkm = &msgs[i % msgcnt];
+                int64_t ts = 1000 + (i % msgcnt);
+
+                if ((start_offset >= 0 && rkm->offset < start_offset) ||
+                    (start_ts && ts < start_ts) ||
+                    (stop_ts && ts >= stop_ts))
+                        continue;
+
+                exp_cnt++;
+
+                if (!dump_read(dr, &dm)) {
+                        fprintf(stderr, "%s: FAILED: %s: premature end "
+                                "of dump after %d messages\n",
+                                __FUNCTION__, what, cnt);
+                        fails++;
+                        break;
+                }
+
+                cnt++;
+
+                if (dm.partition != rkm->partition ||
+                    dm.offset != rkm->offset || dm.timestamp != ts ||
+                    dm.tstype != RD_KAFKA_TIMESTAMP_CREATE_TIME ||
+                    !dm.key != !rkm->key || dm.key_len != rkm->key_len ||
+                    (dm.key_len && memcmp(dm.key, rkm->key, dm.key_len)) ||
+                    !dm.value != !rkm->payload || dm.len != rkm->len ||
+                    (dm.len && memcmp(dm.value, rkm->payload, dm.len)) ||
+                    dm.hdr_cnt != (rkm->offset % 3 == 0 ? 2 : 0)) {
+                        fprintf(stderr, "%s: FAILED: %s: message #%d "
+                                "(partition %"PRId32", offset %"PRId64") "
+                                "differs\n",
+                                __FUNCTION__, what, i,
+                                rkm->partition, rkm->offset);
+                        fails++;
+                        break;
+                }
+
+#if HAVE_HEADERS
+                if (dm.hdr_cnt > 0) {
+                        rd_kafka_headers_t *hdrs = dump_msg_headers(&dm,
+                                                                    NULL);
+                        const void *val;
+                        size_t size;
+
+                        if (rd_kafka_header_get_last(hdrs, "k", &val,
+                                                     &size) ||
+                            size != rkm->key_len ||
+                            (size && memcmp(val, rkm->key, size)) ||
+                            rd_kafka_header_get_last(hdrs, "null", &val,
+                                                     &size) ||
+                            val) {
+                                fprintf(stderr, "%s: FAILED: %s: message "
+                                        "#%d headers differ\n",
+                                        __FUNCTION__, what, i);
+                                fails++;
+                        }
+                        rd_kafka_headers_destroy(hdrs);
+                }
+#endif
+        }
+
+        if (!fails && dump_read(dr, &dm)) {
+                fprintf(stderr, "%s: FAILED: %s: more than the expected "
+                        "%d messages\n", __FUNCTION__, what, exp_cnt);
+                fails++;
+        }
+
+        skipped = dr->skipped;
+        dump_reader_destroy(dr);
+
+        if (!!skipped != expect_skip) {
+                fprintf(stderr, "%s: FAILED: %s: %"PRIu64" blocks skipped, "
+                        "expected %s\n", __FUNCTION__, what, skipped,
+                        expect_skip ? "some" : "none");
+                fails++;
+        }
+
+        return fails;
+}
+
+
+/**
+ * @brief Verify that dumps of synthetic messages restore to the same
+ *        messages from mapped and read input, within offset and
+ *        timestamp ranges, and concatenated.
+ *
+ * @returns the number of failures.
+ */
+int dump_unittest (void) {
+        const int msgcnt = 3000;
+        rd_kafka_message_t *msgs = calloc(msgcnt, sizeof(*msgs));
+        static char data[512];
+        int saved_interval = conf.dump_index_interval;
+        int saved_mmap = conf.input_mmap;
+        size_t saved_chunk_size = conf.input_chunk_size;
+        struct outbuf ob;
+        FILE *fp;
+        int fails = 0;
+        int i;
+
+        if (!(fp = tmpfile())) {
+                fprintf(stderr, "%s: FAILED: tmpfile(): %s\n",
+                        __FUNCTION__, strerror(errno));
+                free(msgs);
+                return 1;
+        }
+
+        for (i = 0 ; i < (int)sizeof(data) ; i++)
+                data[i] = (char)i;
+
+        conf.dump_index_interval = 100;
+
+        /* Large enough to never be flushed (to the invalid fd) */
+        outbuf_init(&ob, -1, 16*1024*1024, 0);
+        dump_output_begin(&ob, 1, 1);
+
+        for (i = 0 ; i < msgcnt ; i++) {
+                rd_kafka_message_t *rkm = &msgs[i];
+                rd_kafka_headers_t *hdrs = NULL;
+
+                rkm->partition = i % 3;
+                rkm->offset    = i / 3;
+                if (i % 7 != 0) {
+                        rkm->key     = data + (i % 64);
+                        rkm->key_len = i % 5 == 0 ? 0 : 1 + i % 17;
+                }
+                if (i % 11 != 0) {
+                        rkm->payload = data + (i % 128);
+                        rkm->len     = i % 13 == 0 ? 0 : (i * 31) % 300;
+                }
+
+#if HAVE_HEADERS
+                if (rkm->offset % 3 == 0) {
+                        hdrs = rd_kafka_headers_new(2);
+                        rd_kafka_header_add(hdrs, "k", -1,
+                                            rkm->key, rkm->key_len);
+                        rd_kafka_header_add(hdrs, "null", -1, NULL, 0);
+                }
+#endif
+
+                dump_msg_write(&ob, rkm, RD_KAFKA_TIMESTAMP_CREATE_TIME,
+                               1000 + i, hdrs);
+
+#if HAVE_HEADERS
+                if (hdrs)
+                        rd_kafka_headers_destroy(hdrs);
+#endif
+        }
+
+        dump_output_end(&ob);
+
+        if (fwrite(ob.buf, ob.len, 1, fp) != 1 || fflush(fp)) {
+                fprintf(stderr, "%s: FAILED: writing dump: %s\n",
+                        __FUNCTION__, strerror(errno));
+                fails++;
+                goto done;
+        }
+
+        /* Mapped and indexed */
+        conf.input_mmap = 1;
+        fails += dump_unittest_read("mapped", fp, msgs, msgcnt, 1,
+                                    -1, 0, 0, 0);
+        fails += dump_unittest_read("mapped from offset", fp, msgs, msgcnt,
+                                    1, 800, 0, 0, 1);
+        fails += dump_unittest_read("mapped timestamp range", fp, msgs,
+                                    msgcnt, 1, -1, 1000 + 1234, 1000 + 2001,
+                                    1);
+
+        /* Read in small chunks */
+        conf.input_mmap = 0;
+        conf.input_chunk_size = 4096;
+        fails += dump_unittest_read("read", fp, msgs, msgcnt, 1,
+                                    -1, 0, 0, 0);
+        fails += dump_unittest_read("read from offset", fp, msgs, msgcnt, 1,
+                                    999, 0, 0, 0);
+
+        /* Concatenated dumps are read as one, without the index */
+        fseek(fp, 0, SEEK_END);
+        if (fwrite(ob.buf, ob.len, 1, fp) != 1 || fflush(fp)) {
+                fprintf(stderr, "%s: FAILED: writing dump: %s\n",
+                        __FUNCTION__, strerror(errno));
+                fails++;
+                goto done;
+        }
+
+        conf.input_mmap = 1;
+        fails += dump_unittest_read("concatenated", fp, msgs, msgcnt, 2,
+                                    500, 0, 0, 0);
+
+done:
+        fclose(fp);
+        ob.len = 0;
+        outbuf_destroy(&ob);
+        free(msgs);
+
+        conf.dump_index_interval = saved_interval;
+        conf.input_mmap = saved_mmap;
+        conf.input_chunk_size = saved_chunk_size;
+
+        return fails;
+}
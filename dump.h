@@ -0,0 +1,75 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _DUMP_H_
+#define _DUMP_H_
+
+
+/**
+ * @brief Message read from a binary dump, see dump_read().
+ *
+ * The key, value and headers point into the input chunk.
+ */
+struct dump_msg {
+        struct buf *chunk;    /**< Input chunk the message is a slice of,
+                               *   see inbuf_read_slice(). */
+        int32_t     partition;
+        int64_t     offset;
+        int64_t     timestamp; /**< -1 if not available */
+        int         tstype;    /**< rd_kafka_timestamp_type_t */
+        const char *key;       /**< NULL for NULL keys */
+        size_t      key_len;
+        const char *value;     /**< NULL for NULL values */
+        size_t      len;
+        int         hdr_cnt;
+        const char *hdrs;      /**< Encoded headers */
+};
+
+struct outbuf;
+struct dump_output;
+struct dump_reader;
+
+struct dump_output *dump_output_begin (struct outbuf *ob,
+                                       int header, int index);
+void dump_output_end (struct outbuf *ob);
+void dump_msg_output (struct outbuf *ob,
+                      const rd_kafka_message_t *rkmessage);
+
+struct dump_reader *dump_reader_new (FILE *fp,
+                                     int64_t start_offset,
+                                     int64_t start_ts, int64_t stop_ts);
+int dump_read (struct dump_reader *dr, struct dump_msg *dm);
+void dump_reader_destroy (struct dump_reader *dr);
+#if HAVE_HEADERS
+rd_kafka_headers_t *dump_msg_headers (const struct dump_msg *dm,
+                                      const rd_kafka_headers_t *extra);
+#endif
+
+int dump_unittest (void);
+
+#endif
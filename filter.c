@@ -0,0 +1,770 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Consumer message filters, see filter.h.
+ *
+ * A filter is <field><op><value> where field is one of
+ *   key, value, partition, timestamp, header.<name>, json.<path>
+ * and op one of = != ^= (prefix) ~= (contains), or < <= > >= for
+ * numbers. A field alone matches if it is present (non-NULL).
+ *
+ * json.<path> looks up the dot-separated <path> of object keys and
+ * array indexes in a JSON message value with a scanner that skips the
+ * parts of the document not on the path, without parsing them into a
+ * tree. Strings are compared as their raw (still escaped) JSON text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kafkacat.h"
+#include "input.h"
+#include "filter.h"
+
+
+typedef enum {
+        FILTER_KEY,
+        FILTER_VALUE,
+        FILTER_PARTITION,
+        FILTER_TIMESTAMP,
+        FILTER_HEADER,
+        FILTER_JSON,
+} filter_field_t;
+
+typedef enum {
+        FILTER_OP_EXISTS,
+        FILTER_OP_EQ,
+        FILTER_OP_NE,
+        FILTER_OP_PREFIX,
+        FILTER_OP_CONTAINS,
+        FILTER_OP_LT,
+        FILTER_OP_LE,
+        FILTER_OP_GT,
+        FILTER_OP_GE,
+} filter_op_t;
+
+#define FILTER_JSON_DEPTH_MAX 64  /* Max JSON nesting, and path length */
+
+struct filter {
+        struct filter  *next;
+        filter_field_t  field;
+        filter_op_t     op;
+        char           *name;       /**< Header name */
+        char          **path;       /**< JSON path components */
+        int             path_cnt;
+        char           *val;
+        size_t          val_len;
+        double          num;        /**< Value as a number, for < etc */
+        struct delim_scan scan;     /**< ~= substring scanner */
+};
+
+static struct {
+        struct filter  *head;
+        struct filter **tailp;
+        uint64_t        scanned;    /**< Messages filtered. Atomic. */
+        uint64_t        matched;    /**< Messages matched. Atomic. */
+} filters = { NULL, &filters.head };
+
+
+
+/**
+ * JSON path lookup
+ */
+
+static const char *json_ws (const char *p, const char *end) {
+        while (p < end && (*p == ' ' || *p == '\t' ||
+                           *p == '\n' || *p == '\r'))
+                p++;
+        return p;
+}
+
+/**
+ * @returns the end of the JSON string starting (at the opening quote)
+ *          at \p p, past the closing quote, or NULL if unterminated.
+ */
+static const char *json_skip_string (const char *p, const char *end) {
+        for (p++ ; p < end ; p++) {
+                if (*p == '\\')
+                        p++;
+                else if (*p == '"')
+                        return p + 1;
+        }
+        return NULL;
+}
+
+/**
+ * @returns the end of the JSON value starting at \p p,
+ *          or NULL if invalid.
+ */
+static const char *json_skip (const char *p, const char *end, int depth) {
+        char close;
+
+        if (p == end || depth > FILTER_JSON_DEPTH_MAX)
+                return NULL;
+
+        switch (*p)
+        {
+        case '"':
+                return json_skip_string(p, end);
+
+        case '{':
+        case '[':
+                close = *p == '{' ? '}' : ']';
+                p = json_ws(p + 1, end);
+                if (p < end && *p == close)
+                        return p + 1;
+
+                while (p < end) {
+                        if (close == '}') {
+                                if (*p != '"' ||
+                                    !(p = json_skip_string(p, end)))
+                                        return NULL;
+                                p = json_ws(p, end);
+                                if (p == end || *p != ':')
+                                        return NULL;
+                                p = json_ws(p + 1, end);
+                        }
+
+                        if (!(p = json_skip(p, end, depth + 1)))
+                                return NULL;
+
+                        p = json_ws(p, end);
+                        if (p == end)
+                                return NULL;
+                        if (*p == close)
+                                return p + 1;
+                        if (*p != ',')
+                                return NULL;
+                        p = json_ws(p + 1, end);
+                }
+                return NULL;
+
+        default:
+                /* Number, true, false or null */
+                while (p < end && !strchr(",}] \t\r\n", *p))
+                        p++;
+                return p;
+        }
+}
+
+
+/**
+ * @brief Look up \p path in the JSON value at \p p.
+ *
+ * @returns 1 if found with \p tokp and \p lenp set to the value's text,
+ *          excluding the quotes of strings, else 0.
+ */
+static int json_lookup (const char *p, const char *end,
+                        char **path, int path_cnt,
+                        const char **tokp, size_t *lenp) {
+        int depth;
+
+        for (depth = 0 ; depth < path_cnt ; depth++) {
+                const char *comp = path[depth];
+                size_t comp_len = strlen(comp);
+
+                p = json_ws(p, end);
+                if (p == end)
+                        return 0;
+
+                if (*p == '{') {
+                        int found = 0;
+
+                        p = json_ws(p + 1, end);
+                        while (!found && p < end && *p == '"') {
+                                const char *key = p + 1;
+                                const char *kend = json_skip_string(p, end);
+
+                                if (!kend)
+                                        return 0;
+                                p = json_ws(kend, end);
+                                if (p == end || *p != ':')
+                                        return 0;
+                                p = json_ws(p + 1, end);
+
+                                if ((size_t)(kend - 1 - key) == comp_len &&
+                                    !memcmp(key, comp, comp_len)) {
+                                        found = 1; /* Descend into value */
+                                        break;
+                                }
+
+                                if (!(p = json_skip(p, end, depth + 1)))
+                                        return 0;
+                                p = json_ws(p, end);
+                                if (p == end || *p != ',')
+                                        return 0; /* Not found */
+                                p = json_ws(p + 1, end);
+                        }
+
+                        if (!found)
+                                return 0;
+
+                } else if (*p == '[') {
+                        char *e;
+                        long idx = strtol(comp, &e, 10);
+
+                        if (e == comp || *e || idx < 0)
+                                return 0;
+
+                        p = json_ws(p + 1, end);
+                        for ( ; idx > 0 ; idx--) {
+                                if (!(p = json_skip(p, end, depth + 1)))
+                                        return 0;
+                                p = json_ws(p, end);
+                                if (p == end || *p != ',')
+                                        return 0;
+                                p = json_ws(p + 1, end);
+                        }
+
+                        if (p == end || *p == ']')
+                                return 0;
+
+                } else
+                        return 0;
+        }
+
+        p = json_ws(p, end);
+        if (p == end) {
+                return 0;
+        } else if (*p == '"') {
+                const char *send = json_skip_string(p, end);
+                if (!send)
+                        return 0;
+                *tokp = p + 1;
+                *lenp = (size_t)(send - 1 - *tokp);
+        } else {
+                const char *vend = json_skip(p, end, depth);
+                if (!vend)
+                        return 0;
+                *tokp = p;
+                *lenp = (size_t)(vend - p);
+        }
+
+        return 1;
+}
+
+
+
+/**
+ * Matching
+ */
+
+/**
+ * @returns true if \p buf (NULL if absent) matches the filter \p f
+ *          as a string.
+ */
+static int filter_match_str (struct filter *f, const char *buf, size_t len) {
+        size_t of;
+
+        if (!buf)
+                return f->op == FILTER_OP_NE;
+
+        switch (f->op)
+        {
+        case FILTER_OP_EXISTS:
+                return 1;
+        case FILTER_OP_EQ:
+                return len == f->val_len && !memcmp(buf, f->val, len);
+        case FILTER_OP_NE:
+                return len != f->val_len || memcmp(buf, f->val, len);
+        case FILTER_OP_PREFIX:
+                return len >= f->val_len && !memcmp(buf, f->val, f->val_len);
+        case FILTER_OP_CONTAINS:
+        {
+                /* The scanner is stateful, use a copy */
+                struct delim_scan ds = f->scan;
+                return delim_scan(&ds, buf, len, &of);
+        }
+        default:
+                break;
+        }
+
+        /* Numeric comparison */
+        {
+                char tmp[64];
+                char *e;
+                double v;
+
+                if (len == 0 || len >= sizeof(tmp))
+                        return 0;
+                memcpy(tmp, buf, len);
+                tmp[len] = '\0';
+                v = strtod(tmp, &e);
+                if (*e)
+                        return 0;
+
+                switch (f->op)
+                {
+                case FILTER_OP_LT: return v <  f->num;
+                case FILTER_OP_LE: return v <= f->num;
+                case FILTER_OP_GT: return v >  f->num;
+                default:           return v >= f->num;
+                }
+        }
+}
+
+
+/**
+ * @returns true if \p v matches the numeric filter \p f.
+ */
+static int filter_match_num (const struct filter *f, int64_t v) {
+        int64_t n = (int64_t)f->num;
+
+        switch (f->op)
+        {
+        case FILTER_OP_EQ: return v == n;
+        case FILTER_OP_NE: return v != n;
+        case FILTER_OP_LT: return v <  n;
+        case FILTER_OP_LE: return v <= n;
+        case FILTER_OP_GT: return v >  n;
+        case FILTER_OP_GE: return v >= n;
+        default:           return 1;
+        }
+}
+
+
+static int filter_match1 (struct filter *f,
+                          const rd_kafka_message_t *rkmessage) {
+        switch (f->field)
+        {
+        case FILTER_KEY:
+                return filter_match_str(f, rkmessage->key,
+                                        rkmessage->key_len);
+
+        case FILTER_VALUE:
+                return filter_match_str(f, rkmessage->payload,
+                                        rkmessage->len);
+
+        case FILTER_PARTITION:
+                return filter_match_num(f, rkmessage->partition);
+
+        case FILTER_TIMESTAMP:
+#if RD_KAFKA_VERSION >= 0x000902ff
+                return filter_match_num(
+                        f, rd_kafka_message_timestamp(rkmessage, NULL));
+#else
+                return 0;
+#endif
+
+        case FILTER_HEADER:
+        {
+#if HAVE_HEADERS
+                rd_kafka_headers_t *hdrs;
+                const char *name;
+                const void *val;
+                size_t size, i;
+
+                if (rd_kafka_message_headers(rkmessage, &hdrs))
+                        return filter_match_str(f, NULL, 0);
+
+                /* Any of the headers of this name */
+                for (i = 0 ;
+                     !rd_kafka_header_get_all(hdrs, i, &name, &val, &size) ;
+                     i++) {
+                        if (strcmp(name, f->name))
+                                continue;
+                        if (f->op == FILTER_OP_NE) {
+                                if (!filter_match_str(f, val ? val : "",
+                                                      size))
+                                        return 0;
+                        } else if (filter_match_str(f, val ? val : "",
+                                                    size))
+                                return 1;
+                }
+
+                return f->op == FILTER_OP_NE;
+#else
+                return 0;
+#endif
+        }
+
+        case FILTER_JSON:
+        {
+                const char *tok;
+                size_t len;
+
+                if (!rkmessage->payload ||
+                    !json_lookup(rkmessage->payload,
+                                 (const char *)rkmessage->payload +
+                                 rkmessage->len,
+                                 f->path, f->path_cnt, &tok, &len))
+                        return filter_match_str(f, NULL, 0);
+
+                return filter_match_str(f, tok, len);
+        }
+        }
+
+        return 0;
+}
+
+
+/**
+ * @returns true if \p rkmessage matches all filters.
+ */
+int filter_match (const rd_kafka_message_t *rkmessage) {
+        struct filter *f;
+
+        rd_atomic64_add(&filters.scanned, 1);
+
+        for (f = filters.head ; f ; f = f->next)
+                if (!filter_match1(f, rkmessage))
+                        return 0;
+
+        rd_atomic64_add(&filters.matched, 1);
+        return 1;
+}
+
+
+
+static void filter_destroy (struct filter *f) {
+        int i;
+
+        for (i = 0 ; i < f->path_cnt ; i++)
+                free(f->path[i]);
+        free(f->path);
+        free(f->name);
+        free(f->val);
+        free(f);
+}
+
+
+/**
+ * @brief Parse and add filter \p expr.
+ *
+ * @returns 0 on success or -1 with \p errstr set on error.
+ */
+int filter_add (const char *expr, char *errstr, size_t errstr_size) {
+        static const struct {
+                const char *str;
+                filter_op_t op;
+        } ops[] = {
+                /* Longest first */
+                { "!=", FILTER_OP_NE },
+                { "^=", FILTER_OP_PREFIX },
+                { "~=", FILTER_OP_CONTAINS },
+                { "<=", FILTER_OP_LE },
+                { ">=", FILTER_OP_GE },
+                { "==", FILTER_OP_EQ },
+                { "=",  FILTER_OP_EQ },
+                { "<",  FILTER_OP_LT },
+                { ">",  FILTER_OP_GT },
+        };
+        struct filter *f;
+        size_t flen = strcspn(expr, "=!^~<>");
+        const char *val = NULL;
+        int numeric, i;
+
+        if (!(f = calloc(1, sizeof(*f))))
+                KC_FATAL("Failed to allocate filter");
+
+        f->op = FILTER_OP_EXISTS;
+        if (expr[flen]) {
+                for (i = 0 ; i < (int)(sizeof(ops) / sizeof(*ops)) ; i++) {
+                        size_t olen = strlen(ops[i].str);
+                        if (!strncmp(expr + flen, ops[i].str, olen)) {
+                                f->op = ops[i].op;
+                                val   = expr + flen + olen;
+                                break;
+                        }
+                }
+                if (!val) {
+                        snprintf(errstr, errstr_size,
+                                 "Filter \"%s\": unknown operator", expr);
+                        goto fail;
+                }
+
+                f->val     = strdup(val);
+                f->val_len = strlen(val);
+        }
+
+        if (flen == 3 && !strncmp(expr, "key", 3)) {
+                f->field = FILTER_KEY;
+        } else if (flen == 5 && !strncmp(expr, "value", 5)) {
+                f->field = FILTER_VALUE;
+        } else if (flen == 9 && !strncmp(expr, "partition", 9)) {
+                f->field = FILTER_PARTITION;
+        } else if (flen == 9 && !strncmp(expr, "timestamp", 9)) {
+                f->field = FILTER_TIMESTAMP;
+        } else if (flen > 7 && !strncmp(expr, "header.", 7)) {
+                f->field = FILTER_HEADER;
+                f->name  = rd_strndup(expr + 7, flen - 7);
+        } else if (flen > 5 && !strncmp(expr, "json.", 5)) {
+                const char *s = expr + 5, *e = expr + flen;
+
+                f->field = FILTER_JSON;
+                f->path  = calloc(FILTER_JSON_DEPTH_MAX, sizeof(*f->path));
+                while (s < e) {
+                        const char *dot = memchr(s, '.', (size_t)(e - s));
+                        size_t clen = dot ? (size_t)(dot - s) :
+                                (size_t)(e - s);
+
+                        if (clen == 0 ||
+                            f->path_cnt == FILTER_JSON_DEPTH_MAX) {
+                                snprintf(errstr, errstr_size,
+                                         "Filter \"%s\": invalid JSON path",
+                                         expr);
+                                goto fail;
+                        }
+                        f->path[f->path_cnt++] = rd_strndup(s, clen);
+                        s += clen + 1;
+                }
+        } else {
+                snprintf(errstr, errstr_size,
+                         "Filter \"%s\": expected key, value, partition, "
+                         "timestamp, header.<name> or json.<path>", expr);
+                goto fail;
+        }
+
+        numeric = f->field == FILTER_PARTITION ||
+                f->field == FILTER_TIMESTAMP;
+
+        if (f->op == FILTER_OP_EXISTS && numeric) {
+                snprintf(errstr, errstr_size,
+                         "Filter \"%s\": expected a comparison", expr);
+                goto fail;
+        }
+
+        if ((f->op == FILTER_OP_PREFIX || f->op == FILTER_OP_CONTAINS) &&
+            (numeric || f->val_len == 0)) {
+                snprintf(errstr, errstr_size,
+                         "Filter \"%s\": ^= and ~= expect a string", expr);
+                goto fail;
+        }
+
+        if (numeric || f->op >= FILTER_OP_LT) {
+                char *e;
+
+                f->num = strtod(f->val, &e);
+                if (e == f->val || *e) {
+                        snprintf(errstr, errstr_size,
+                                 "Filter \"%s\": expected a number", expr);
+                        goto fail;
+                }
+
+                if (f->field == FILTER_KEY || f->field == FILTER_VALUE ||
+                    f->field == FILTER_HEADER) {
+                        /* Keys, values and headers are compared
+                         * as text, numbers only inside JSON. */
+                        if (f->op >= FILTER_OP_LT) {
+                                snprintf(errstr, errstr_size,
+                                         "Filter \"%s\": < <= > >= "
+                                         "compare numbers: use "
+                                         "partition, timestamp or "
+                                         "json.<path>", expr);
+                                goto fail;
+                        }
+                }
+        }
+
+        if (f->op == FILTER_OP_CONTAINS)
+                delim_scan_init(&f->scan, f->val, f->val_len);
+
+        *filters.tailp = f;
+        filters.tailp  = &f->next;
+        conf.filter_cnt++;
+
+        return 0;
+
+fail:
+        filter_destroy(f);
+        return -1;
+}
+
+
+static void filters_clear (void) {
+        while (filters.head) {
+                struct filter *f = filters.head;
+
+                filters.head = f->next;
+                filter_destroy(f);
+        }
+        filters.tailp   = &filters.head;
+        filters.scanned = 0;
+        filters.matched = 0;
+        conf.filter_cnt = 0;
+}
+
+
+/**
+ * @brief Print the filter counters (-v) and free the filters.
+ */
+void filter_term (void) {
+        if (!filters.head)
+                return;
+
+        KC_INFO(1, "Filter matched %"PRIu64" of %"PRIu64" messages\n",
+                rd_atomic64_load(&filters.matched),
+                rd_atomic64_load(&filters.scanned));
+
+        filters_clear();
+}
+
+
+
+int filter_unittest (void) {
+        static const struct {
+                const char *json;
+                const char *path;   /* Dot-separated */
+                const char *exp;    /* NULL if not found */
+        } lookups[] = {
+                { "{\"a\":1}", "a", "1" },
+                { " { \"x\" : [1,{\"y\":2}], \"a\" : { \"b\" : \"c\\\"d\" } } ",
+                  "a.b", "c\\\"d" },
+                { "{\"x\":[1,{\"y\":2}],\"a\":3}", "x.1.y", "2" },
+                { "{\"x\":[1,{\"y\":2}],\"a\":3}", "x.1", "{\"y\":2}" },
+                { "{\"x\":[1,{\"y\":2}],\"a\":3}", "x.2", NULL },
+                { "{\"x\":{\"a\":1},\"a\":true}", "a", "true" },
+                { "{\"x\":{\"a\":1}}", "a", NULL },
+                { "{\"a\":{}}", "a.b", NULL },
+                { "{\"a\":", "a", NULL },
+                { "[0,1]", "1", "1" },
+                { "\"a\"", "a", NULL },
+                { NULL }
+        };
+        static const struct {
+                const char *expr;
+                int ok;
+        } parses[] = {
+                { "key=abc", 1 },
+                { "key", 1 },
+                { "header.trace-id^=ab", 1 },
+                { "json.a.b>=2.5", 1 },
+                { "partition!=3", 1 },
+                { "timestamp<1600000000000", 1 },
+                { "partition", 0 },
+                { "partition~=1", 0 },
+                { "timestamp>=now", 0 },
+                { "key<5", 0 },
+                { "value~=", 0 },
+                { "json.a..b=1", 0 },
+                { "offset=5", 0 },
+                { "key=!x", 1 },
+                { NULL }
+        };
+        static const struct {
+                const char *filters[3];
+                const char *key;
+                const char *value;
+                int32_t partition;
+                int match;
+        } matches[] = {
+                { { "key=k1" }, "k1", "v", 0, 1 },
+                { { "key=k1" }, "k12", "v", 0, 0 },
+                { { "key^=k1" }, "k12", "v", 0, 1 },
+                { { "key!=k1" }, NULL, "v", 0, 1 },
+                { { "key" }, NULL, "v", 0, 0 },
+                { { "value~=needle" }, "k",
+                  "a haystack of bytes with a needle in it", 0, 1 },
+                { { "value~=needle" }, "k", "a haystack of bytes", 0, 0 },
+                { { "partition>=2", "value~=x" }, "k", "xyz", 2, 1 },
+                { { "partition>=2", "value~=x" }, "k", "xyz", 1, 0 },
+                { { "json.user.id=42" }, "k",
+                  "{\"user\":{\"name\":\"x\",\"id\":42}}", 0, 1 },
+                { { "json.user.id>41.5", "json.user.name=x" }, "k",
+                  "{\"user\":{\"name\":\"x\",\"id\":42}}", 0, 1 },
+                { { "json.user.id<42" }, "k",
+                  "{\"user\":{\"id\":42}}", 0, 0 },
+                { { "json.user.id" }, "k", "not json", 0, 0 },
+                { { NULL } }
+        };
+        char errstr[256];
+        int fails = 0;
+        int i, j;
+
+#define FILTER_CHECK(COND, ...) do {                                    \
+                if (!(COND)) {                                          \
+                        fprintf(stderr, "%s: FAILED: ", __FUNCTION__); \
+                        fprintf(stderr, __VA_ARGS__);                   \
+                        fails++;                                        \
+                }                                                       \
+        } while (0)
+
+        for (i = 0 ; lookups[i].json ; i++) {
+                char *path[8], *s, *t;
+                int path_cnt = 0;
+                const char *tok = NULL;
+                size_t len = 0;
+                int r;
+
+                s = strdup(lookups[i].path);
+                for (t = strtok(s, ".") ; t ; t = strtok(NULL, "."))
+                        path[path_cnt++] = t;
+
+                r = json_lookup(lookups[i].json,
+                                lookups[i].json + strlen(lookups[i].json),
+                                path, path_cnt, &tok, &len);
+                if (!lookups[i].exp)
+                        FILTER_CHECK(!r, "lookup #%d: found %.*s\n",
+                                     i, (int)len, tok);
+                else
+                        FILTER_CHECK(r && len == strlen(lookups[i].exp) &&
+                                     !memcmp(tok, lookups[i].exp, len),
+                                     "lookup #%d: expected %s, not %.*s\n",
+                                     i, lookups[i].exp,
+                                     r ? (int)len : 9,
+                                     r ? tok : "not found");
+                free(s);
+        }
+
+        for (i = 0 ; parses[i].expr ; i++) {
+                int r = filter_add(parses[i].expr, errstr, sizeof(errstr));
+                FILTER_CHECK((r == 0) == parses[i].ok,
+                             "parse \"%s\": expected %s, got %s\n",
+                             parses[i].expr,
+                             parses[i].ok ? "success" : "failure",
+                             r == 0 ? "success" : errstr);
+                filters_clear();
+        }
+
+        for (i = 0 ; matches[i].filters[0] ; i++) {
+                rd_kafka_message_t rkm;
+
+                memset(&rkm, 0, sizeof(rkm));
+                rkm.key       = (void *)matches[i].key;
+                rkm.key_len   = matches[i].key ? strlen(matches[i].key) : 0;
+                rkm.payload   = (void *)matches[i].value;
+                rkm.len       = strlen(matches[i].value);
+                rkm.partition = matches[i].partition;
+
+                for (j = 0 ; j < 3 && matches[i].filters[j] ; j++)
+                        if (filter_add(matches[i].filters[j],
+                                       errstr, sizeof(errstr)) == -1)
+                                FILTER_CHECK(0, "match #%d: %s\n",
+                                             i, errstr);
+
+                FILTER_CHECK(filter_match(&rkm) == matches[i].match,
+                             "match #%d: expected %s\n", i,
+                             matches[i].match ? "match" : "no match");
+                filters_clear();
+        }
+
+#undef FILTER_CHECK
+
+        return fails;
+}
@@ -27,7 +27,12 @@
  */
 
 #include "kafkacat.h"
+#include "output.h"
+#include "dump.h"
 #include "rdendian.h"
+#include "bench.h"
+
+static void fmt_compile (void);
 
 static void fmt_add (fmt_type_t type, const char *str, int len) {
         if (conf.fmt_cnt == KC_FMT_MAX_SIZE)
@@ -159,6 +164,8 @@ void fmt_parse (const char *fmt) {
                 }
 
         }
+
+        fmt_compile();
 }
 
 
@@ -172,28 +179,42 @@ void fmt_init (void) {
 }
 
 void fmt_term (void) {
+        fmt_thread_term();
+}
+
+/**
+ * @brief Free the calling thread's formatter state,
+ *        called by each consumer thread before exiting.
+ */
+void fmt_thread_term (void) {
 #if ENABLE_JSON
         if (conf.flags & CONF_F_FMT_JSON)
                 fmt_term_json();
 #endif
+#if ENABLE_AVRO
+        kc_avro_thread_term();
+#endif
 }
 
 
 #if HAVE_HEADERS
-static int print_headers (FILE *fp, const rd_kafka_headers_t *hdrs) {
+static void print_headers (struct outbuf *ob,
+                           const rd_kafka_headers_t *hdrs) {
         size_t idx = 0;
         const char *name;
         const void *value;
         size_t size;
 
         while (!rd_kafka_header_get_all(hdrs, idx++, &name, &value, &size)) {
-                fprintf(fp, "%s%s=", idx > 1 ? "," : "", name);
+                if (idx > 1)
+                        outbuf_putc(ob, ',');
+                outbuf_str(ob, name);
+                outbuf_putc(ob, '=');
                 if (value && size > 0)
-                        fprintf(fp, "%.*s", (int)size, (const char *)value);
+                        outbuf_write(ob, value, size);
                 else if (!value)
-                        fprintf(fp, "NULL");
+                        outbuf_write(ob, "NULL", 4);
         }
-        return 1;
 }
 #endif
 
@@ -222,13 +243,13 @@ void pack_check (const char *what, const char *fmt) {
  * @brief Unpack (deserialize) the data at \p buf using the
  *        pack-format string \p fmt.
  *        \p fmt must be a valid pack-format string.
- *        Prints result to \p fp.
+ *        Prints result to \p ob.
  *
  * Format is inspired by Python's struct.unpack()
  *
  * @returns 0 on success or -1 on error.
  */
-static int unpack (FILE *fp, const char *what, const char *fmt,
+static int unpack (struct outbuf *ob, const char *what, const char *fmt,
                    const char *buf, size_t len,
                    char *errstr, size_t errstr_size) {
         const char *b = buf;
@@ -261,7 +282,7 @@ static int unpack (FILE *fp, const char *what, const char *fmt,
                 switch ((int)*f)
                 {
                 case ' ':
-                        fprintf(fp, " ");
+                        outbuf_putc(ob, ' ');
                         break;
                 case '<':
                         endian = little_endian;
@@ -273,14 +294,14 @@ static int unpack (FILE *fp, const char *what, const char *fmt,
                 {
                         int8_t v;
                         fup_copy(&v, sizeof(v));
-                        fprintf(fp, "%d", (int)v);
+                        outbuf_i64(ob, v);
                 }
                 break;
                 case 'B':
                 {
                         uint8_t v;
                         fup_copy(&v, sizeof(v));
-                        fprintf(fp, "%u", (unsigned int)v);
+                        outbuf_u64(ob, v);
                 }
                 break;
                 case 'h':
@@ -288,7 +309,7 @@ static int unpack (FILE *fp, const char *what, const char *fmt,
                         int16_t v;
                         fup_copy(&v, sizeof(v));
                         v = endian_swap(v, be16toh, be16toh);
-                        fprintf(fp, "%hd", v);
+                        outbuf_i64(ob, v);
                 }
                 break;
                 case 'H':
@@ -296,7 +317,7 @@ static int unpack (FILE *fp, const char *what, const char *fmt,
                         uint16_t v;
                         fup_copy(&v, sizeof(v));
                         v = endian_swap(v, be16toh, be16toh);
-                        fprintf(fp, "%hu", v);
+                        outbuf_u64(ob, v);
                 }
                 break;
                 case 'i':
@@ -304,7 +325,7 @@ static int unpack (FILE *fp, const char *what, const char *fmt,
                         int32_t v;
                         fup_copy(&v, sizeof(v));
                         v = endian_swap(v, be32toh, htobe32);
-                        fprintf(fp, "%d", v);
+                        outbuf_i64(ob, v);
                 }
                 break;
                 case 'I':
@@ -312,7 +333,7 @@ static int unpack (FILE *fp, const char *what, const char *fmt,
                         uint32_t v;
                         fup_copy(&v, sizeof(v));
                         v = endian_swap(v, be32toh, htobe32);
-                        fprintf(fp, "%u", v);
+                        outbuf_u64(ob, v);
                 }
                 break;
                 case 'q':
@@ -320,7 +341,7 @@ static int unpack (FILE *fp, const char *what, const char *fmt,
                         int64_t v;
                         fup_copy(&v, sizeof(v));
                         v = endian_swap(v, be64toh, htobe64);
-                        fprintf(fp, "%"PRId64, v);
+                        outbuf_i64(ob, v);
                 }
                 break;
                 case 'Q':
@@ -328,16 +349,16 @@ static int unpack (FILE *fp, const char *what, const char *fmt,
                         uint64_t v;
                         fup_copy(&v, sizeof(v));
                         v = endian_swap(v, be64toh, htobe64);
-                        fprintf(fp, "%"PRIu64, v);
+                        outbuf_u64(ob, v);
                 }
                 break;
                 case 'c':
-                        fprintf(fp, "%c", (int)*b);
+                        outbuf_putc(ob, *b);
                         b++;
                         break;
                 case 's':
                 {
-                        fprintf(fp, "%.*s", (int)remaining, b);
+                        outbuf_write(ob, b, remaining);
                         b += remaining;
                 }
                 break;
@@ -373,213 +394,740 @@ static int unpack (FILE *fp, const char *what, const char *fmt,
 
 
 /**
- * Delimited output
+ * @brief Compiled format program.
+ *
+ * fmt_compile() translates conf.fmt[] to a flat list of operations
+ * where everything that does not depend on the message itself
+ * (Avro and unpack deserialization, -Z NULL strings, ..) is resolved
+ * once, up front, to a direct emitter function.
+ * Adjacent literal strings are merged and emitted inline as the prefix
+ * of the operation that follows them, or as the program's trailer.
  */
-static void fmt_msg_output_str (FILE *fp,
-                                const rd_kafka_message_t *rkmessage) {
-        int i;
-        char errstr[256];
+struct fmt_op;
 
-        *errstr = '\0';
+/**
+ * @brief Emit \p op for \p rkmessage to \p ob.
+ *
+ * @returns 0 on success or -1 on error with \p errstr set.
+ */
+typedef int (fmt_emit_t) (struct outbuf *ob, const struct fmt_op *op,
+                          const rd_kafka_message_t *rkmessage,
+                          char *errstr, size_t errstr_size);
+
+struct fmt_op {
+        const char *pre;          /**< Literal string emitted before op */
+        size_t      pre_len;
+        fmt_emit_t *emit;
+        const char *str;          /**< Unpack-format */
+        const char *null_str;     /**< Emitted for empty keys and values,
+                                   *   NULL to emit nothing (no -Z). */
+        size_t      null_str_len;
+        const char *what;         /**< Description of failed operation,
+                                   *   for error messages. */
+};
+
+static struct fmt_op fmt_prog[KC_FMT_MAX_SIZE];
+static int fmt_prog_cnt;
+static const char *fmt_prog_trailer;  /**< Literal string emitted after
+                                       *   the last op */
+static size_t fmt_prog_trailer_len;
+static char *fmt_prog_strs;  /**< Literal strings of fmt_prog[] */
+
+
+static int fmt_emit_offset (struct outbuf *ob, const struct fmt_op *op,
+                            const rd_kafka_message_t *rkmessage,
+                            char *errstr, size_t errstr_size) {
+        outbuf_i64(ob, rkmessage->offset);
+        return 0;
+}
 
-        for (i = 0 ; i < conf.fmt_cnt ; i++) {
-                int r = 1;
-                uint32_t belen;
-                const char *what_failed = "";
+static RD_INLINE void fmt_emit_null (struct outbuf *ob,
+                                     const struct fmt_op *op) {
+        if (op->null_str)
+                outbuf_write(ob, op->null_str, op->null_str_len);
+}
 
-                switch (conf.fmt[i].type)
-                {
-                case KC_FMT_OFFSET:
-                        r = fprintf(fp, "%"PRId64, rkmessage->offset);
-                        break;
+static int fmt_emit_key (struct outbuf *ob, const struct fmt_op *op,
+                         const rd_kafka_message_t *rkmessage,
+                         char *errstr, size_t errstr_size) {
+        if (rkmessage->key_len)
+                outbuf_write(ob, rkmessage->key, rkmessage->key_len);
+        else
+                fmt_emit_null(ob, op);
+        return 0;
+}
+
+static int fmt_emit_key_unpack (struct outbuf *ob, const struct fmt_op *op,
+                                const rd_kafka_message_t *rkmessage,
+                                char *errstr, size_t errstr_size) {
+        if (!rkmessage->key_len) {
+                fmt_emit_null(ob, op);
+                return 0;
+        }
+
+        return unpack(ob, "key", op->str,
+                      rkmessage->key, rkmessage->key_len,
+                      errstr, errstr_size);
+}
+
+static int fmt_emit_key_len (struct outbuf *ob, const struct fmt_op *op,
+                             const rd_kafka_message_t *rkmessage,
+                             char *errstr, size_t errstr_size) {
+        /* Use -1 to indicate NULL keys */
+        outbuf_i64(ob, rkmessage->key ? (int64_t)rkmessage->key_len : -1);
+        return 0;
+}
+
+static int fmt_emit_payload (struct outbuf *ob, const struct fmt_op *op,
+                             const rd_kafka_message_t *rkmessage,
+                             char *errstr, size_t errstr_size) {
+        if (rkmessage->len)
+                outbuf_write(ob, rkmessage->payload, rkmessage->len);
+        else
+                fmt_emit_null(ob, op);
+        return 0;
+}
+
+static int fmt_emit_payload_unpack (struct outbuf *ob,
+                                    const struct fmt_op *op,
+                                    const rd_kafka_message_t *rkmessage,
+                                    char *errstr, size_t errstr_size) {
+        if (!rkmessage->len) {
+                fmt_emit_null(ob, op);
+                return 0;
+        }
+
+        return unpack(ob, "value", op->str,
+                      rkmessage->payload, rkmessage->len,
+                      errstr, errstr_size);
+}
 
-                case KC_FMT_KEY:
-                        if (rkmessage->key_len) {
-                                if (conf.flags & CONF_F_FMT_AVRO_KEY) {
 #if ENABLE_AVRO
-                                        char *json = kc_avro_to_json(
-                                                rkmessage->key,
-                                                rkmessage->key_len,
-                                                NULL,
-                                                errstr, sizeof(errstr));
-
-                                        if (!json) {
-                                                what_failed =
-                                                        "Avro/Schema-registry "
-                                                        "key deserialization";
-                                                goto fail;
-                                        }
+/**
+ * @brief Emit Avro-encoded \p data as JSON.
+ */
+static int fmt_emit_avro0 (struct outbuf *ob, const struct fmt_op *op,
+                           const void *data, size_t len,
+                           char *errstr, size_t errstr_size) {
+        const char *json;
+        size_t json_len;
+
+        if (!len) {
+                fmt_emit_null(ob, op);
+                return 0;
+        }
+
+        if (!(json = kc_avro_to_json(data, len, NULL, &json_len,
+                                     errstr, errstr_size)))
+                return -1;
+
+        outbuf_write(ob, json, json_len);
+        return 0;
+}
+
+static int fmt_emit_key_avro (struct outbuf *ob, const struct fmt_op *op,
+                              const rd_kafka_message_t *rkmessage,
+                              char *errstr, size_t errstr_size) {
+        return fmt_emit_avro0(ob, op, rkmessage->key, rkmessage->key_len,
+                              errstr, errstr_size);
+}
+
+static int fmt_emit_payload_avro (struct outbuf *ob, const struct fmt_op *op,
+                                  const rd_kafka_message_t *rkmessage,
+                                  char *errstr, size_t errstr_size) {
+        return fmt_emit_avro0(ob, op, rkmessage->payload, rkmessage->len,
+                              errstr, errstr_size);
+}
+#endif
+
+static int fmt_emit_payload_len (struct outbuf *ob, const struct fmt_op *op,
+                                 const rd_kafka_message_t *rkmessage,
+                                 char *errstr, size_t errstr_size) {
+        /* Use -1 to indicate NULL messages */
+        outbuf_i64(ob, rkmessage->payload ? (int64_t)rkmessage->len : -1);
+        return 0;
+}
+
+static int fmt_emit_payload_len_binary (struct outbuf *ob,
+                                        const struct fmt_op *op,
+                                        const rd_kafka_message_t *rkmessage,
+                                        char *errstr, size_t errstr_size) {
+        /* Use -1 to indicate NULL messages */
+        uint32_t belen = htobe32((uint32_t)(rkmessage->payload ?
+                                            (ssize_t)rkmessage->len : -1));
+        outbuf_write(ob, &belen, sizeof(belen));
+        return 0;
+}
 
-                                        r = fprintf(fp, "%s", json);
-                                        free(json);
+static int fmt_emit_topic (struct outbuf *ob, const struct fmt_op *op,
+                           const rd_kafka_message_t *rkmessage,
+                           char *errstr, size_t errstr_size) {
+        outbuf_str(ob, rd_kafka_topic_name(rkmessage->rkt));
+        return 0;
+}
+
+static int fmt_emit_partition (struct outbuf *ob, const struct fmt_op *op,
+                               const rd_kafka_message_t *rkmessage,
+                               char *errstr, size_t errstr_size) {
+        outbuf_i64(ob, rkmessage->partition);
+        return 0;
+}
+
+static int fmt_emit_timestamp (struct outbuf *ob, const struct fmt_op *op,
+                               const rd_kafka_message_t *rkmessage,
+                               char *errstr, size_t errstr_size) {
+#if RD_KAFKA_VERSION >= 0x000902ff
+        rd_kafka_timestamp_type_t tstype;
+        outbuf_i64(ob, rd_kafka_message_timestamp(rkmessage, &tstype));
 #else
-                                        KC_FATAL("NOTREACHED");
+        outbuf_write(ob, "-1", 2);
 #endif
-                                } else if (conf.pack[KC_MSG_FIELD_KEY]) {
-                                        if (unpack(fp,
-                                                   "key",
-                                                   conf.pack[KC_MSG_FIELD_KEY],
-                                                   rkmessage->key,
-                                                   rkmessage->key_len,
-                                                   errstr, sizeof(errstr)) ==
-                                            -1)
-                                                goto fail;
-                                } else
-                                        r = fwrite(rkmessage->key,
-                                                   rkmessage->key_len, 1, fp);
-
-                        } else if (conf.flags & CONF_F_NULL)
-                                r = fwrite(conf.null_str,
-                                           conf.null_str_len, 1, fp);
+        return 0;
+}
+
+#if HAVE_HEADERS
+static int fmt_emit_headers (struct outbuf *ob, const struct fmt_op *op,
+                             const rd_kafka_message_t *rkmessage,
+                             char *errstr, size_t errstr_size) {
+        rd_kafka_headers_t *hdrs;
+        rd_kafka_resp_err_t err;
+
+        err = rd_kafka_message_headers(rkmessage, &hdrs);
+        if (err == RD_KAFKA_RESP_ERR__NOENT) {
+                /* No headers */
+        } else if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+                snprintf(errstr, errstr_size, "%s", rd_kafka_err2str(err));
+                return -1;
+        } else {
+                print_headers(ob, hdrs);
+        }
+
+        return 0;
+}
+#endif
+
+
+/**
+ * @brief Free the compiled format program.
+ */
+static void fmt_prog_destroy (void) {
+        free(fmt_prog_strs);
+        fmt_prog_strs = NULL;
+        fmt_prog_cnt = 0;
+        fmt_prog_trailer = NULL;
+        fmt_prog_trailer_len = 0;
+}
 
+
+/**
+ * @brief Compile conf.fmt[] to fmt_prog[].
+ *
+ * Must be called after the -s, -Z, etc, configuration is final.
+ */
+static void fmt_compile (void) {
+        size_t strs_len = 0;
+        char *strs, *pre;
+        int i;
+
+        fmt_prog_destroy();
+
+        /* All literal strings are copied back to back to a single
+         * buffer so that adjacent literals are contiguous and can be
+         * merged to a single prefix. */
+        for (i = 0 ; i < conf.fmt_cnt ; i++)
+                if (conf.fmt[i].type == KC_FMT_STR)
+                        strs_len += conf.fmt[i].str_len;
+
+        fmt_prog_strs = pre = strs = malloc(strs_len + 1);
+
+        for (i = 0 ; i < conf.fmt_cnt ; i++) {
+                struct fmt_op *op;
+                kc_msg_field_t field = KC_MSG_FIELD_KEY;
+
+                if (conf.fmt[i].type == KC_FMT_STR) {
+                        /* Append to the pending prefix */
+                        memcpy(strs, conf.fmt[i].str, conf.fmt[i].str_len);
+                        strs += conf.fmt[i].str_len;
+                        continue;
+                }
+
+                op = &fmt_prog[fmt_prog_cnt++];
+                memset(op, 0, sizeof(*op));
+                op->pre     = pre;
+                op->pre_len = (size_t)(strs - pre);
+                op->what    = "";
+                pre = strs;
+
+                switch (conf.fmt[i].type)
+                {
+                case KC_FMT_STR:
+                        /* Handled above */
                         break;
 
-                case KC_FMT_KEY_LEN:
-                        r = fprintf(fp, "%zd",
-                                    /* Use -1 to indicate NULL keys */
-                                    rkmessage->key ? (ssize_t)rkmessage->key_len : -1);
+                case KC_FMT_OFFSET:
+                        op->emit = fmt_emit_offset;
                         break;
 
                 case KC_FMT_PAYLOAD:
-                        if (rkmessage->len) {
-                                if (conf.flags & CONF_F_FMT_AVRO_VALUE) {
-#if ENABLE_AVRO
-                                        char *json = kc_avro_to_json(
-                                                rkmessage->payload,
-                                                rkmessage->len,
-                                                NULL,
-                                                errstr, sizeof(errstr));
-
-                                        if (!json) {
-                                                what_failed =
-                                                        "Avro/Schema-registry "
-                                                        "message "
-                                                        "deserialization";
-                                                goto fail;
-                                        }
+                        field = KC_MSG_FIELD_VALUE;
+                        /* FALLTHRU */
+                case KC_FMT_KEY:
+                        if (conf.flags & CONF_F_NULL) {
+                                op->null_str     = conf.null_str;
+                                op->null_str_len = conf.null_str_len;
+                        }
 
-                                        r = fprintf(fp, "%s", json);
-                                        free(json);
+                        if (conf.flags & (field == KC_MSG_FIELD_KEY ?
+                                          CONF_F_FMT_AVRO_KEY :
+                                          CONF_F_FMT_AVRO_VALUE)) {
+#if ENABLE_AVRO
+                                if (field == KC_MSG_FIELD_KEY) {
+                                        op->emit = fmt_emit_key_avro;
+                                        op->what = "Avro/Schema-registry "
+                                                "key deserialization";
+                                } else {
+                                        op->emit = fmt_emit_payload_avro;
+                                        op->what = "Avro/Schema-registry "
+                                                "message deserialization";
+                                }
 #else
-                                        KC_FATAL("NOTREACHED");
+                                KC_FATAL("NOTREACHED");
 #endif
-                                } else if (conf.pack[KC_MSG_FIELD_VALUE]) {
-                                        if (unpack(fp,
-                                                   "value",
-                                                   conf.pack[KC_MSG_FIELD_VALUE],
-                                                   rkmessage->payload,
-                                                   rkmessage->len,
-                                                   errstr, sizeof(errstr)) ==
-                                            -1)
-                                                goto fail;
-                                } else
-                                        r = fwrite(rkmessage->payload,
-                                                   rkmessage->len, 1, fp);
-
-                        } else if (conf.flags & CONF_F_NULL)
-                                r = fwrite(conf.null_str,
-                                           conf.null_str_len, 1, fp);
+                        } else if (conf.pack[field]) {
+                                op->emit = field == KC_MSG_FIELD_KEY ?
+                                        fmt_emit_key_unpack :
+                                        fmt_emit_payload_unpack;
+                                op->str = conf.pack[field];
+                        } else {
+                                op->emit = field == KC_MSG_FIELD_KEY ?
+                                        fmt_emit_key : fmt_emit_payload;
+                        }
                         break;
 
-                case KC_FMT_PAYLOAD_LEN:
-                        r = fprintf(fp, "%zd",
-                                    /* Use -1 to indicate NULL messages */
-                                    rkmessage->payload ? (ssize_t)rkmessage->len : -1);
+                case KC_FMT_KEY_LEN:
+                        op->emit = fmt_emit_key_len;
                         break;
 
-                case KC_FMT_PAYLOAD_LEN_BINARY:
-                        /* Use -1 to indicate NULL messages */
-                        belen = htobe32((uint32_t)(rkmessage->payload ?
-                                                   (ssize_t)rkmessage->len :
-                                                   -1));
-                        r = fwrite(&belen, sizeof(uint32_t), 1, fp);
+                case KC_FMT_PAYLOAD_LEN:
+                        op->emit = fmt_emit_payload_len;
                         break;
 
-                case KC_FMT_STR:
-                        r = fwrite(conf.fmt[i].str, conf.fmt[i].str_len, 1, fp);
+                case KC_FMT_PAYLOAD_LEN_BINARY:
+                        op->emit = fmt_emit_payload_len_binary;
                         break;
 
                 case KC_FMT_TOPIC:
-                        r = fprintf(fp, "%s",
-                                    rd_kafka_topic_name(rkmessage->rkt));
+                        op->emit = fmt_emit_topic;
                         break;
 
                 case KC_FMT_PARTITION:
-                        r = fprintf(fp, "%"PRId32, rkmessage->partition);
+                        op->emit = fmt_emit_partition;
                         break;
 
                 case KC_FMT_TIMESTAMP:
-                {
-#if RD_KAFKA_VERSION >= 0x000902ff
-                        rd_kafka_timestamp_type_t tstype;
-                        r = fprintf(fp, "%"PRId64,
-                                    rd_kafka_message_timestamp(rkmessage,
-                                                               &tstype));
-#else
-                        r = fprintf(fp, "-1");
-#endif
+                        op->emit = fmt_emit_timestamp;
                         break;
-                }
 
                 case KC_FMT_HEADERS:
-                {
 #if HAVE_HEADERS
-                        rd_kafka_headers_t *hdrs;
-                        rd_kafka_resp_err_t err;
-
-                        err = rd_kafka_message_headers(rkmessage, &hdrs);
-                        if (err == RD_KAFKA_RESP_ERR__NOENT) {
-                                r = 1; /* Fake it to continue */
-                        } else if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
-                                what_failed = "Failed to parse headers";
-                                snprintf(errstr, sizeof(errstr), "%s",
-                                         rd_kafka_err2str(err));
-                                goto fail;
-                        } else {
-                                r = print_headers(fp, hdrs);
-                        }
+                        op->emit = fmt_emit_headers;
+                        op->what = "Failed to parse headers";
+#else
+                        KC_FATAL("NOTREACHED");
 #endif
                         break;
                 }
-                }
+        }
+
+        *strs = '\0';
+
+        fmt_prog_trailer     = pre;
+        fmt_prog_trailer_len = (size_t)(strs - pre);
+}
+
+
+/**
+ * Delimited output
+ */
+static void fmt_msg_output_str (struct outbuf *ob,
+                                const rd_kafka_message_t *rkmessage) {
+        const struct fmt_op *op = fmt_prog;
+        const struct fmt_op *end = fmt_prog + fmt_prog_cnt;
+        char errstr[256];
 
+        *errstr = '\0';
 
-                if (r < 1)
-                        KC_FATAL("Write error for message "
-                                 "of %zd bytes in %s [%"PRId32"] "
-                                 "at offset %"PRId64": %s",
-                                 rkmessage->len,
-                                 rd_kafka_topic_name(rkmessage->rkt),
-                                 rkmessage->partition,
-                                 rkmessage->offset,
-                                 strerror(errno));
+        for ( ; op < end ; op++) {
+                if (op->pre_len)
+                        outbuf_write(ob, op->pre, op->pre_len);
 
-                continue;
+                if (op->emit(ob, op, rkmessage, errstr, sizeof(errstr)) == 0)
+                        continue;
 
-        fail:
                 KC_ERROR("Failed to format message in %s [%"PRId32"] "
                          "at offset %"PRId64": %s%s%s",
                          rd_kafka_topic_name(rkmessage->rkt),
                          rkmessage->partition,
                          rkmessage->offset,
-                         what_failed, *what_failed ? ": " : "",
+                         op->what, *op->what ? ": " : "",
                          errstr);
                 return;
         }
 
+        if (fmt_prog_trailer_len)
+                outbuf_write(ob, fmt_prog_trailer, fmt_prog_trailer_len);
 }
 
 
 /**
  * Format and output a received message.
  */
-void fmt_msg_output (FILE *fp, const rd_kafka_message_t *rkmessage) {
+void fmt_msg_output (struct outbuf *ob, const rd_kafka_message_t *rkmessage) {
 
+        if (conf.flags & CONF_F_FMT_DUMP)
+                dump_msg_output(ob, rkmessage);
 #if ENABLE_JSON
-        if (conf.flags & CONF_F_FMT_JSON)
-                fmt_msg_output_json(fp, rkmessage);
+        else if (conf.flags & CONF_F_FMT_JSON)
+                fmt_msg_output_json(ob, rkmessage);
         else
 #endif
-                fmt_msg_output_str(fp, rkmessage);
+                fmt_msg_output_str(ob, rkmessage);
+
+        outbuf_msg_done(ob);
+}
+
+
+
+/**
+ * @brief Set up format string \p fmt, unpack-formats, and -Z for
+ *        the unittests and benchmarks.
+ */
+static void fmt_test_setup (const char *fmt, const char *key_pack,
+                            const char *value_pack, int null) {
+        int i;
+
+        for (i = 0 ; i < conf.fmt_cnt ; i++)
+                if (conf.fmt[i].type == KC_FMT_STR && conf.fmt[i].str)
+                        free((char *)conf.fmt[i].str);
+        memset(conf.fmt, 0, sizeof(conf.fmt));
+        conf.fmt_cnt = 0;
+
+        conf.pack[KC_MSG_FIELD_KEY]   = key_pack;
+        conf.pack[KC_MSG_FIELD_VALUE] = value_pack;
+        if (null) {
+                conf.flags |= CONF_F_NULL;
+                conf.null_str_len = strlen(conf.null_str);
+        } else
+                conf.flags &= ~CONF_F_NULL;
+
+        fmt_parse(fmt);
+}
+
+
+/**
+ * @brief Create \p cnt synthetic messages with a mix of NULL, empty and
+ *        non-empty keys and values of at least \p min_len bytes.
+ *
+ * The messages have no topic, timestamp or headers.
+ */
+static rd_kafka_message_t *fmt_test_msgs (int cnt, size_t min_len) {
+        static char data[1024];
+        rd_kafka_message_t *msgs = calloc(cnt, sizeof(*msgs));
+        int i;
+
+        for (i = 0 ; i < (int)sizeof(data) ; i++)
+                data[i] = (char)('!' + (i * 7) % 90);
+
+        for (i = 0 ; i < cnt ; i++) {
+                rd_kafka_message_t *rkm = &msgs[i];
+
+                rkm->partition = i % 4;
+                rkm->offset    = (int64_t)i * 1000 - 3;
+
+                if (i % 11 != 0) {
+                        rkm->key     = data + (i % 64);
+                        rkm->key_len = i % 7 == 0 ? 0 : min_len + i % 13;
+                }
+
+                if (i % 10 != 0) {
+                        rkm->payload = data + (i % 128);
+                        rkm->len     = i % 5 == 0 ? 0 :
+                                min_len + (i * 31) % 300;
+                }
+        }
+
+        return msgs;
+}
 
+
+/**
+ * @brief Unittest messages: NULL, empty, binary and text keys and values.
+ *
+ * The messages have no topic, timestamp or headers.
+ */
+#define FMT_UT_MSGCNT 4
+static const struct {
+        const char *key;
+        size_t      key_len;
+        const char *value;
+        size_t      len;
+        int32_t     partition;
+        int64_t     offset;
+} fmt_ut_msgs[FMT_UT_MSGCNT] = {
+        { NULL, 0, NULL, 0, 0, 0 },
+        { "", 0, "", 0, 1, 1 },
+        { "\000\000\000*", 4,
+          "\000\000\000\000\000\000\001\000abc", 11, 2, 42 },
+        { "keyA", 4, "payload-value", 13, 3, 1234567890123 },
+};
+
+/* Expected output literal and its length, the output may contain NULs. */
+#define _EXP(S) S, sizeof(S) - 1
+
+static const struct {
+        const char *fmt;
+        const char *key_pack;
+        const char *value_pack;
+        int         null;      /**< -Z */
+        size_t      min_len;   /**< Minimum key and value size (bench) */
+        int         ops;       /**< Expected number of compiled ops */
+        const char *exp;       /**< Expected output for fmt_ut_msgs[] */
+        size_t      exp_len;
+} fmt_tests[] = {
+        { "%k\t%s\n", NULL, NULL, 0, 1, 2,
+          _EXP("\t\n"
+               "\t\n"
+               "\000\000\000*\t\000\000\000\000\000\000\001\000abc\n"
+               "keyA\tpayload-value\n") },
+        { "%s\n", NULL, NULL, 1, 1, 1,
+          _EXP("NULL\n"
+               "NULL\n"
+               "\000\000\000\000\000\000\001\000abc\n"
+               "payload-value\n") },
+        { "Key: %k (%K bytes), Value: %s (%S bytes) "
+          "at offset %o in partition %p\\n%%%%\n",
+          NULL, NULL, 1, 1, 6,
+          _EXP("Key: NULL (-1 bytes), Value: NULL (-1 bytes) "
+               "at offset 0 in partition 0\n%%\n"
+               "Key: NULL (0 bytes), Value: NULL (0 bytes) "
+               "at offset 1 in partition 1\n%%\n"
+               "Key: \000\000\000* (4 bytes), "
+               "Value: \000\000\000\000\000\000\001\000abc (11 bytes) "
+               "at offset 42 in partition 2\n%%\n"
+               "Key: keyA (4 bytes), Value: payload-value (13 bytes) "
+               "at offset 1234567890123 in partition 3\n%%\n") },
+        { "%R%s", NULL, NULL, 0, 1, 2,
+          _EXP("\377\377\377\377"
+               "\000\000\000\000"
+               "\000\000\000\013\000\000\000\000\000\000\001\000abc"
+               "\000\000\000\015payload-value") },
+        { "%k=%s\n", ">I", ">Q s", 1, 8, 2,
+          _EXP("NULL=NULL\n"
+               "NULL=NULL\n"
+               "42=256 abc\n"
+               "1801812289=8097887111620944941 value\n") },
+        { "%%literal only\n", NULL, NULL, 0, 1, 0,
+          _EXP("%literal only\n"
+               "%literal only\n"
+               "%literal only\n"
+               "%literal only\n") },
+        { NULL }
+};
+
+#undef _EXP
+
+
+/**
+ * @brief Verify that the compiled format program renders the expected
+ *        output for the fmt_ut_msgs[] messages.
+ *
+ * @returns the number of failed tests.
+ */
+int fmt_unittest (void) {
+        const int msgcnt = FMT_UT_MSGCNT;
+        rd_kafka_message_t msgs[FMT_UT_MSGCNT];
+        const char *saved_pack[KC_MSG_FIELD_CNT];
+        int saved_flags = conf.flags;
+        int fails = 0;
+        int i, j;
+
+        memcpy(saved_pack, conf.pack, sizeof(saved_pack));
+
+        memset(msgs, 0, sizeof(msgs));
+        for (j = 0 ; j < msgcnt ; j++) {
+                msgs[j].key       = (void *)fmt_ut_msgs[j].key;
+                msgs[j].key_len   = fmt_ut_msgs[j].key_len;
+                msgs[j].payload   = (void *)fmt_ut_msgs[j].value;
+                msgs[j].len       = fmt_ut_msgs[j].len;
+                msgs[j].partition = fmt_ut_msgs[j].partition;
+                msgs[j].offset    = fmt_ut_msgs[j].offset;
+        }
+
+        for (i = 0 ; fmt_tests[i].fmt ; i++) {
+                struct outbuf out;
+
+                fmt_test_setup(fmt_tests[i].fmt, fmt_tests[i].key_pack,
+                               fmt_tests[i].value_pack, fmt_tests[i].null);
+
+                /* Large enough to never be flushed (to the invalid fd) */
+                outbuf_init(&out, -1, 64*1024, 0);
+
+                for (j = 0 ; j < msgcnt ; j++)
+                        fmt_msg_output_str(&out, &msgs[j]);
+
+                if (fmt_prog_cnt != fmt_tests[i].ops) {
+                        fprintf(stderr,
+                                "%s: FAILED: format \"%s\" compiled to "
+                                "%d ops, expected %d\n",
+                                __FUNCTION__, fmt_tests[i].fmt,
+                                fmt_prog_cnt, fmt_tests[i].ops);
+                        fails++;
+                }
+
+                if (out.len != fmt_tests[i].exp_len ||
+                    memcmp(out.buf, fmt_tests[i].exp, out.len)) {
+                        fprintf(stderr,
+                                "%s: FAILED: format \"%s\" output "
+                                "(%"PRIu64" bytes) differs from "
+                                "expected output (%"PRIu64" bytes)\n",
+                                __FUNCTION__, fmt_tests[i].fmt,
+                                (uint64_t)out.len,
+                                (uint64_t)fmt_tests[i].exp_len);
+                        fails++;
+                }
+
+                out.len = 0;
+                outbuf_destroy(&out);
+        }
+
+        memcpy(conf.pack, saved_pack, sizeof(saved_pack));
+        conf.flags = saved_flags;
+
+        return fails;
+}
+
+
+/**
+ * @brief Render \p msgs repeatedly with \p render and report the
+ *        result of microbenchmark \p name, see ubench_result().
+ */
+static void fmt_bench_run (const char *name,
+                           void (*render) (struct outbuf *ob,
+                                           const rd_kafka_message_t *),
+                           rd_kafka_message_t * const *msgs, int msgcnt) {
+        struct outbuf ob;
+        int64_t ts_start;
+        uint64_t cnt = 0, bytes = 0;
+
+        outbuf_init(&ob, -1, 1024*1024, 0);
+
+        ts_start = rd_clock();
+        do {
+                int i;
+                for (i = 0 ; i < msgcnt ; i++) {
+                        render(&ob, msgs[i]);
+                        /* Discard instead of writing the output
+                         * to only measure rendering. */
+                        if (ob.len > ob.size / 2) {
+                                bytes += ob.len;
+                                ob.len = 0;
+                        }
+                }
+                cnt += msgcnt;
+        } while (!ubench_done(ts_start));
+
+        ubench_result(name, cnt, bytes + ob.len, rd_clock() - ts_start);
+
+        ob.len = 0;
+        outbuf_destroy(&ob);
+}
+
+
+/**
+ * @brief Microbenchmark of the compiled format program and of
+ *        the -J JSON envelope over synthetic messages.
+ *        Results are printed to stdout, see ubench_result().
+ *
+ * @returns 0 on success or -1 on failure.
+ */
+int fmt_bench (void) {
+        const int msgcnt = 1000;
+        const char *saved_pack[KC_MSG_FIELD_CNT];
+        int saved_flags = conf.flags;
+        rd_kafka_message_t **msgp = malloc(sizeof(*msgp) * msgcnt);
+        int i, j;
+
+        memcpy(saved_pack, conf.pack, sizeof(saved_pack));
+
+        for (i = 0 ; fmt_tests[i].fmt ; i++) {
+                rd_kafka_message_t *msgs;
+                char name[64];
+
+                fmt_test_setup(fmt_tests[i].fmt, fmt_tests[i].key_pack,
+                               fmt_tests[i].value_pack, fmt_tests[i].null);
+                msgs = fmt_test_msgs(msgcnt, fmt_tests[i].min_len);
+                for (j = 0 ; j < msgcnt ; j++)
+                        msgp[j] = &msgs[j];
+
+                snprintf(name, sizeof(name), "fmt_msg_output_str/%d", i);
+                fmt_bench_run(name, fmt_msg_output_str, msgp, msgcnt);
+
+                free(msgs);
+        }
+
+        memcpy(conf.pack, saved_pack, sizeof(saved_pack));
+        conf.flags = saved_flags;
+
+#if ENABLE_JSON
+        {
+                /* The JSON envelope includes the topic name and
+                 * librdkafka's per-message timestamp, broker and
+                 * headers, which are read from its private message
+                 * fields following the rd_kafka_message_t:
+                 * pad the synthetic messages with zeroes (no timestamp
+                 * nor headers) and give them a topic. */
+                struct fmt_bench_msg {
+                        rd_kafka_message_t rkm;
+                        char pad[1024];
+                } *bmsgs;
+                rd_kafka_message_t *msgs;
+                rd_kafka_t *rk;
+                rd_kafka_topic_t *rkt;
+                char errstr[512];
+
+                rk = rd_kafka_new(RD_KAFKA_PRODUCER, NULL,
+                                  errstr, sizeof(errstr));
+                if (!rk) {
+                        fprintf(stderr, "%s: failed to create "
+                                "handle: %s\n", __FUNCTION__, errstr);
+                        free(msgp);
+                        return -1;
+                }
+                rkt = rd_kafka_topic_new(rk, "kafkacat_bench", NULL);
+
+                conf.flags &= ~(CONF_F_FMT_AVRO_KEY|CONF_F_FMT_AVRO_VALUE);
+
+                msgs  = fmt_test_msgs(msgcnt, 1);
+                bmsgs = calloc(msgcnt, sizeof(*bmsgs));
+                for (j = 0 ; j < msgcnt ; j++) {
+                        bmsgs[j].rkm     = msgs[j];
+                        bmsgs[j].rkm.rkt = rkt;
+                        msgp[j] = &bmsgs[j].rkm;
+                }
+
+                fmt_bench_run("fmt_msg_output_json", fmt_msg_output_json,
+                              msgp, msgcnt);
+
+                free(bmsgs);
+                free(msgs);
+                rd_kafka_topic_destroy(rkt);
+                rd_kafka_destroy(rk);
+
+                conf.flags = saved_flags;
+        }
+#endif
+
+        free(msgp);
+
+        return 0;
 }
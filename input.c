@@ -28,19 +28,263 @@
 
 #include "kafkacat.h"
 #include "input.h"
+#include "bench.h"
 
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #ifndef _MSC_VER
 #include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <io.h>
 #endif
 
 #include <assert.h>
 
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+#if HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DELIM_SCAN_AVX2  1
+#define DELIM_SCAN_WIDTH 32
+#define DELIM_SCAN_SHIFT 0  /* log2 of mask bits per candidate */
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define DELIM_SCAN_SSE2  1
+#define DELIM_SCAN_WIDTH 16
+#define DELIM_SCAN_SHIFT 0
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DELIM_SCAN_NEON  1
+#define DELIM_SCAN_WIDTH 16
+#define DELIM_SCAN_SHIFT 2
+#else
+#define DELIM_SCAN_SHIFT 0
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/**
+ * @brief Initialize delimiter scanner \p ds for \p delim of
+ *        \p dsize bytes. The delimiter memory must remain valid
+ *        for the lifetime of the scanner.
+ */
+void delim_scan_init (struct delim_scan *ds,
+                      const char *delim, size_t dsize) {
+        memset(ds, 0, sizeof(*ds));
+        ds->delim = delim;
+        ds->dsize = dsize;
+}
+
+
+#ifdef DELIM_SCAN_WIDTH
+/**
+ * @returns the index of the lowest set bit in \p mask (which must not be 0).
+ */
+static RD_INLINE unsigned int delim_scan_ctz (uint64_t mask) {
+#ifdef _MSC_VER
+        unsigned long idx;
+        _BitScanForward64(&idx, mask);
+        return (unsigned int)idx;
+#else
+        return (unsigned int)__builtin_ctzll(mask);
+#endif
+}
+
+
+/**
+ * @brief Match the delimiter's first byte at \p p and its last byte at
+ *        \p p + dsize - 1 for DELIM_SCAN_WIDTH consecutive candidate
+ *        positions.
+ *
+ * @returns a bitmask with (1 << DELIM_SCAN_SHIFT) bits per candidate
+ *          position, where the lowest bit of each candidate is set if
+ *          both bytes matched.
+ */
+static RD_INLINE uint64_t delim_scan_block (const struct delim_scan *ds,
+                                            const char *p) {
+        const char *l = p + ds->dsize - 1;
+#if DELIM_SCAN_AVX2
+        const __m256i first = _mm256_set1_epi8(ds->delim[0]);
+        const __m256i last  = _mm256_set1_epi8(ds->delim[ds->dsize-1]);
+        __m256i eq = _mm256_and_si256(
+                _mm256_cmpeq_epi8(first,
+                                  _mm256_loadu_si256((const __m256i *)p)),
+                _mm256_cmpeq_epi8(last,
+                                  _mm256_loadu_si256((const __m256i *)l)));
+        return (uint64_t)(uint32_t)_mm256_movemask_epi8(eq);
+#elif DELIM_SCAN_SSE2
+        const __m128i first = _mm_set1_epi8(ds->delim[0]);
+        const __m128i last  = _mm_set1_epi8(ds->delim[ds->dsize-1]);
+        __m128i eq = _mm_and_si128(
+                _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *)p)),
+                _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *)l)));
+        return (uint64_t)(uint32_t)_mm_movemask_epi8(eq);
+#elif DELIM_SCAN_NEON
+        const uint8x16_t first = vdupq_n_u8((uint8_t)ds->delim[0]);
+        const uint8x16_t last  = vdupq_n_u8((uint8_t)ds->delim[ds->dsize-1]);
+        uint8x16_t eq = vandq_u8(
+                vceqq_u8(first, vld1q_u8((const uint8_t *)p)),
+                vceqq_u8(last, vld1q_u8((const uint8_t *)l)));
+        /* Narrow to 4 bits per byte and keep one bit per candidate. */
+        return vget_lane_u64(vreinterpret_u64_u8(
+                                     vshrn_n_u16(vreinterpretq_u16_u8(eq),
+                                                 4)), 0) &
+                0x1111111111111111llu;
+#endif
+}
+#endif
+
+
+/**
+ * @brief Discard candidates from the pending block mask that start
+ *        before offset \p of.
+ */
+static void delim_scan_skip (struct delim_scan *ds, size_t of) {
+        if (ds->pos < of)
+                ds->pos = of;
+
+        if (!ds->mask || ds->mof >= of)
+                return;
+
+        if (((of - ds->mof) << DELIM_SCAN_SHIFT) >= 64)
+                ds->mask = 0;
+        else
+                ds->mask >>= (of - ds->mof) << DELIM_SCAN_SHIFT;
+
+        ds->mof = of;
+}
+
+
+/**
+ * @brief Find the next delimiter in \p buf of \p len bytes, starting
+ *        at the scanner's current position, and set \p dofp to the
+ *        delimiter's offset in \p buf.
+ *
+ * Matches are returned left to right and never overlap. All of \p buf
+ * up to the previous \p len must be unmodified between calls, but \p len
+ * may grow as more data is appended to the buffer.
+ *
+ * @returns 1 if a delimiter was found, else 0.
+ */
+int delim_scan (struct delim_scan *ds, const char *buf, size_t len,
+                size_t *dofp) {
+        const char *delim = ds->delim;
+        size_t dsize = ds->dsize;
+        size_t c;
+
+        if (dsize == 0 || len < dsize)
+                return 0;
+
+#ifdef DELIM_SCAN_WIDTH
+        while (1) {
+                /* Verify remaining candidates from the last block. */
+                while (ds->mask) {
+                        c = ds->mof + (delim_scan_ctz(ds->mask) >>
+                                       DELIM_SCAN_SHIFT);
+                        ds->mask &= ds->mask - 1;
+
+                        if (dsize <= 2 ||
+                            !memcmp(buf+c+1, delim+1, dsize-2)) {
+                                *dofp = c;
+                                delim_scan_skip(ds, c + dsize);
+                                return 1;
+                        }
+                }
+
+                /* Load the next full block, if there is enough data. */
+                if (ds->pos + dsize - 1 + DELIM_SCAN_WIDTH > len)
+                        break;
+
+                ds->mask = delim_scan_block(ds, buf + ds->pos);
+                ds->mof = ds->pos;
+                ds->pos += DELIM_SCAN_WIDTH;
+        }
+#endif
+
+        /* Scalar scan of the remaining candidates that don't fill a block,
+         * or of the entire buffer if SIMD is not available. */
+        while (ds->pos + dsize <= len) {
+                const char *t;
+
+                t = (const char *)memchr((void *)(buf + ds->pos),
+                                         (int)delim[0],
+                                         len - dsize + 1 - ds->pos);
+                if (!t) {
+                        ds->pos = len - dsize + 1;
+                        break;
+                }
+
+                c = (size_t)(t - buf);
+
+                if (t[dsize-1] == delim[dsize-1] &&
+                    (dsize <= 2 || !memcmp(t+1, delim+1, dsize-2))) {
+                        *dofp = c;
+                        ds->pos = c + dsize;
+                        return 1;
+                }
+
+                ds->pos = c + 1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * @brief Rebase the scanner after the first \p of bytes of the scanned
+ *        buffer have been removed, e.g., after the buffer was split at
+ *        a delimiter.
+ */
+void delim_scan_rebase (struct delim_scan *ds, size_t of) {
+        delim_scan_skip(ds, of);
+        ds->pos -= of;
+        if (ds->mask)
+                ds->mof -= of;
+        else
+                ds->mof = 0;
+}
+
+
+
+/**
+ * @brief Acquire a new reference to \p b.
+ *
+ * @returns \p b
+ */
+struct buf *buf_keep (struct buf *b) {
+        rd_atomic_add(&b->refcnt, 1);
+        return b;
+}
+
+/**
+ * @brief Release a reference to \p b, the buffer is freed when the
+ *        last reference is released.
+ */
 void buf_destroy (struct buf *b) {
+        int r = rd_atomic_sub(&b->refcnt, 1);
+
+        assert(r >= 0);
+        if (r > 0)
+                return;
+
+#ifndef _MSC_VER
+        if (b->mapped)
+                munmap(b->buf, b->size);
+        else
+#endif
 #ifdef MREMAP_MAYMOVE
-        munmap(b->buf, b->size);
+                munmap(b->buf, b->size);
 #else
-        free(b->buf);
+                free(b->buf);
 #endif
 
         free(b);
@@ -52,6 +296,8 @@ static struct buf *buf_new (void *buf, size_t size) {
 
         b->buf = buf;
         b->size = size;
+        b->refcnt = 1;
+        b->mapped = 0;
 
         return b;
 }
@@ -59,15 +305,27 @@ static struct buf *buf_new (void *buf, size_t size) {
 
 
 
+static void indecomp_destroy (struct indecomp *d);
+
 void inbuf_destroy (struct inbuf *inbuf) {
 
-        if (inbuf->buf) {
+        if (inbuf->decomp) {
+                indecomp_destroy(inbuf->decomp);
+                inbuf->decomp = NULL;
+        }
+
+        if (inbuf->chunk) {
+                buf_destroy(inbuf->chunk);
+                inbuf->chunk = NULL;
+        } else if (inbuf->buf) {
 #ifdef MREMAP_MAYMOVE
                 munmap(inbuf->buf, inbuf->size);
 #else
                 free(inbuf->buf);
 #endif
         }
+
+        inbuf->buf = NULL;
 }
 
 
@@ -163,15 +421,22 @@ static void inbuf_grow (struct inbuf *inbuf, size_t min_size) {
 }
 
 
+/**
+ * @brief Initialize \p inbuf for reading messages of at most \p max_size
+ *        bytes separated by \p delim, reading up to \p read_size bytes
+ *        from the input at a time.
+ */
 void inbuf_init (struct inbuf *inbuf, size_t max_size,
-                 const char *delim, size_t delim_size) {
+                 const char *delim, size_t delim_size,
+                 size_t read_size) {
         memset(inbuf, 0, sizeof(*inbuf));
 
         inbuf->max_size = max_size + delim_size;
+        inbuf->read_size = MIN(MAX(read_size, 1), inbuf->max_size);
 
         inbuf->delim = delim;
         inbuf->dsize = delim_size;
-        inbuf->sof = inbuf->dsize - 1;
+        delim_scan_init(&inbuf->scan, delim, delim_size);
 
         inbuf_grow(inbuf, inbuf_get_alloc_size(inbuf, 0));
 }
@@ -188,6 +453,20 @@ static size_t inbuf_ensure (struct inbuf *inbuf, size_t min_size) {
         if (remaining > min_size)
                 return remaining;
 
+        if (inbuf->of > 0) {
+                /* Reclaim the space of messages already split off
+                 * from the start of the buffer. */
+                memmove(inbuf->buf, inbuf->buf + inbuf->of,
+                        inbuf->len - inbuf->of);
+                delim_scan_rebase(&inbuf->scan, inbuf->of);
+                inbuf->len -= inbuf->of;
+                inbuf->of = 0;
+
+                remaining = inbuf->size - inbuf->len;
+                if (remaining > min_size)
+                        return remaining;
+        }
+
         inbuf_grow(inbuf, min_size);
 
         return inbuf->size - inbuf->len;
@@ -200,41 +479,7 @@ static size_t inbuf_ensure (struct inbuf *inbuf, size_t min_size) {
  * @returns 1 if delimiter is found, else 0.
  */
 static int inbuf_scan (struct inbuf *inbuf, size_t *dofp) {
-        const char *dstart = inbuf->delim;
-        const char *dend = inbuf->delim + inbuf->dsize - 1;
-        const char *t;
-
-        if (inbuf->len < inbuf->sof)
-                return 0; /* Input buffer smaller than delimiter. */
-
-        /* Use Boyer-Moore inspired scan by matching the delimiter from
-         * right-to-left. */
-        while (inbuf->sof < inbuf->len &&
-               (t = (const char *)memchr((void *)(inbuf->buf + inbuf->sof),
-                                         (int)*dend,
-                                         inbuf->len - inbuf->sof))) {
-                /* Found delimiter's last byte and we know that there's at
-                 * least the delimiter's size of data to left, so start
-                 * scanning backwards. */
-                const char *p = t;    /* buffer pointer */
-                const char *d = dend; /* delimiter pointer */
-
-                do {
-                        d--;
-                        p--;
-                } while (d >= dstart && *d == *p);
-
-                if (d < dstart) {
-                        /* Found a full delimiter. */
-                        *dofp = (size_t)(p+1 - inbuf->buf);
-                        return 1;
-                }
-
-                /* Incomplete delimiter, scan forward. */
-                inbuf->sof = (size_t)(t - inbuf->buf) + 1;
-        }
-
-        return 0;
+        return delim_scan(&inbuf->scan, inbuf->buf, inbuf->len, dofp);
 }
 
 /*
@@ -246,17 +491,39 @@ dof=sof-sz
 */
 
 /**
- * @brief Split input buffer at delimiter offset \d dof and return it in
- *        \p outp and \p out_sizep, and copy the remaining bytes, if any,
- *        to a new buffer in \p inbuf.
+ * @brief Split input buffer at delimiter offset \d dof and return the
+ *        message in \p outp and \p out_sizep.
+ *
+ * Whichever side of the delimiter is smaller is copied: if more input
+ * remains in the buffer than the size of the message the message is copied
+ * out and the input buffer is kept as is, else the input buffer itself is
+ * returned and the remaining bytes, if any, are copied to a new buffer
+ * in \p inbuf.
  */
 static void inbuf_split (struct inbuf *inbuf, size_t dof,
                          char **outp, size_t *out_sizep) {
+        size_t mlen = dof - inbuf->of;
         size_t nof = dof + inbuf->dsize;
         size_t remaining = inbuf->len - nof;
         void *rbuf = NULL;
         size_t rsize = 0;
 
+        *out_sizep = mlen;
+
+        if (remaining > mlen) {
+                /* Copy out the message, the remaining input stays
+                 * in place until the buffer is compacted
+                 * by inbuf_ensure(). */
+                if (mlen > 0) {
+                        *outp = inbuf_alloc_buf(mlen);
+                        memcpy(*outp, inbuf->buf + inbuf->of, mlen);
+                } else
+                        *outp = NULL;
+
+                inbuf->of = nof;
+                return;
+        }
+
         /* Copy right side of buffer (past the delimiter) to a temporary
          * buffer that will be stored on inbuf when the left side is extracted.
          */
@@ -265,35 +532,264 @@ static void inbuf_split (struct inbuf *inbuf, size_t dof,
         if (remaining > 0)
                 memcpy(rbuf, inbuf->buf+nof, remaining);
 
+        /* Move the message to the start of the buffer if messages
+         * have previously been copied out from the buffer. */
+        if (inbuf->of > 0)
+                memmove(inbuf->buf, inbuf->buf + inbuf->of, mlen);
+
         /* Shrink the returned buffer to the actual size of the left side. */
         if (remaining + inbuf->dsize > 4096/2) {
 #ifdef MREMAP_MAYMOVE
-                *outp = mremap((void *)inbuf->buf, inbuf->size, dof,
+                *outp = mremap((void *)inbuf->buf, inbuf->size, mlen,
                                MREMAP_MAYMOVE);
                 if (!*outp)
                         KC_FATAL("Failed to shrink(mremap) buffer to %"
                                  PRIu64" bytes: %s",
-                                 (uint64_t)dof, strerror(errno));
+                                 (uint64_t)mlen, strerror(errno));
 #else
-                *outp = realloc((void *)inbuf->buf, MAX(dof, 16));
+                *outp = realloc((void *)inbuf->buf, MAX(mlen, 16));
                 if (!*outp)
                         KC_FATAL("Failed to shrink(REALLOC) buffer to %"
                                  PRIu64" bytes: %s",
-                                 (uint64_t)dof, strerror(errno));
+                                 (uint64_t)mlen, strerror(errno));
 #endif
         } else {
                 *outp = inbuf->buf;
         }
 
 
-        *out_sizep = dof;
-
-
         /* Set up a new (or the remaining) input buffer. */
         inbuf->buf = rbuf;
         inbuf->size = rsize;
         inbuf->len = remaining;
-        inbuf->sof = inbuf->dsize - 1;
+        inbuf->of = 0;
+        delim_scan_rebase(&inbuf->scan, nof);
+}
+
+
+/**
+ * @brief Read up to \p size bytes from \p fd into \p buf, returning
+ *        as soon as any data is available.
+ *
+ * The inbuf's idle_cb, if set, is called prior to reading since
+ * the read may block.
+ *
+ * @returns the number of bytes read, or 0 on EOF or termination.
+ *          Read errors are fatal.
+ */
+static size_t inbuf_read_raw (struct inbuf *inbuf, int fd,
+                              char *buf, size_t size) {
+        if (inbuf->idle_cb)
+                inbuf->idle_cb(inbuf->idle_opaque);
+
+        while (1) {
+                ssize_t r = _COMPAT(read)(fd, buf,
+#ifdef _MSC_VER
+                                          (unsigned int)
+#endif
+                                          size);
+                if (r >= 0)
+                        return (size_t)r;
+
+                if (errno != EINTR)
+                        KC_FATAL("Unable to read message: %s",
+                                 strerror(errno));
+                else if (!conf.run)
+                        return 0; /* Terminating */
+        }
+}
+
+
+
+/**
+ * Compressed input (-X kafkacat.input.compression=zstd|lz4)
+ *
+ * The compressed input is read into the decompressor's buffer and
+ * decompressed into the inbuf's buffer, which is otherwise used as
+ * for uncompressed input. Concatenated frames are decompressed as a
+ * single stream.
+ */
+
+/* Compressed input read size */
+#define INDECOMP_READ_SIZE (128*1024)
+
+struct indecomp {
+        kc_compression_t type;
+#if HAVE_ZSTD
+        ZSTD_DCtx *zstd;
+#endif
+#if HAVE_LZ4
+        LZ4F_dctx *lz4;
+#endif
+        char    *buf;        /**< Compressed input */
+        size_t   size;       /**< Allocated size of buf */
+        size_t   len;        /**< How much of buf is used */
+        size_t   of;         /**< Next compressed byte to decompress */
+        int      more;       /**< Decompressor may have more output
+                              *   without further input. */
+        int      in_frame;   /**< Last decompression ended mid-frame */
+        int      eof;        /**< End of compressed input */
+};
+
+
+/**
+ * @brief Decompress the input of \p inbuf as \p type.
+ *        Must be called after inbuf_init() or inbuf_init_chunked().
+ */
+void inbuf_set_decompress (struct inbuf *inbuf, kc_compression_t type) {
+        struct indecomp *d = calloc(1, sizeof(*d));
+
+        d->type = type;
+
+        switch (type)
+        {
+#if HAVE_ZSTD
+        case KC_COMPRESSION_ZSTD:
+                if (!(d->zstd = ZSTD_createDCtx()))
+                        KC_FATAL("Failed to create zstd decompressor");
+                break;
+#endif
+#if HAVE_LZ4
+        case KC_COMPRESSION_LZ4:
+        {
+                LZ4F_errorCode_t r;
+
+                r = LZ4F_createDecompressionContext(&d->lz4, LZ4F_VERSION);
+                if (LZ4F_isError(r))
+                        KC_FATAL("Failed to create lz4 decompressor: %s",
+                                 LZ4F_getErrorName(r));
+                break;
+        }
+#endif
+        default:
+                KC_FATAL("kafkacat was built without %s input support",
+                         type == KC_COMPRESSION_ZSTD ? "zstd" : "lz4");
+        }
+
+        d->size = INDECOMP_READ_SIZE;
+        d->buf  = malloc(d->size);
+
+        inbuf->decomp = d;
+
+        KC_INFO(3, "Decompressing %s input\n",
+                type == KC_COMPRESSION_ZSTD ? "zstd" : "lz4");
+}
+
+
+static void indecomp_destroy (struct indecomp *d) {
+#if HAVE_ZSTD
+        if (d->zstd)
+                ZSTD_freeDCtx(d->zstd);
+#endif
+#if HAVE_LZ4
+        if (d->lz4)
+                LZ4F_freeDecompressionContext(d->lz4);
+#endif
+        free(d->buf);
+        free(d);
+}
+
+
+/**
+ * @brief Decompress buffered compressed input into \p buf.
+ *
+ * @returns the number of bytes decompressed, which may be 0 even if
+ *          compressed input was consumed.
+ */
+static size_t indecomp_run (struct indecomp *d, char *buf, size_t size) {
+        switch (d->type)
+        {
+#if HAVE_ZSTD
+        case KC_COMPRESSION_ZSTD:
+        {
+                ZSTD_inBuffer in = { d->buf + d->of, d->len - d->of, 0 };
+                ZSTD_outBuffer out = { buf, size, 0 };
+                size_t r;
+
+                r = ZSTD_decompressStream(d->zstd, &out, &in);
+                if (ZSTD_isError(r))
+                        KC_FATAL("Failed to decompress zstd input: %s",
+                                 ZSTD_getErrorName(r));
+
+                d->of      += in.pos;
+                d->in_frame = r != 0;
+                d->more     = out.pos == out.size;
+                return out.pos;
+        }
+#endif
+#if HAVE_LZ4
+        case KC_COMPRESSION_LZ4:
+        {
+                size_t in_size = d->len - d->of;
+                size_t out_size = size;
+                size_t r;
+
+                r = LZ4F_decompress(d->lz4, buf, &out_size,
+                                    d->buf + d->of, &in_size, NULL);
+                if (LZ4F_isError(r))
+                        KC_FATAL("Failed to decompress lz4 input: %s",
+                                 LZ4F_getErrorName(r));
+
+                d->of      += in_size;
+                d->in_frame = r != 0;
+                d->more     = out_size == size;
+                return out_size;
+        }
+#endif
+        default:
+                return 0;
+        }
+}
+
+
+/**
+ * @brief Read and decompress up to \p size bytes of input into \p buf,
+ *        see inbuf_read_raw().
+ *
+ * The decompressor is destroyed when the end of input is reached.
+ */
+static size_t inbuf_read_decompress (struct inbuf *inbuf, int fd,
+                                     char *buf, size_t size) {
+        struct indecomp *d = inbuf->decomp;
+
+        while (1) {
+                if (d->of < d->len || d->more) {
+                        size_t r = indecomp_run(d, buf, size);
+
+                        if (r > 0)
+                                return r;
+                        if (d->of < d->len)
+                                continue; /* Consumed input (headers) */
+                }
+
+                if (d->eof) {
+                        if (d->in_frame)
+                                KC_FATAL("Compressed input is truncated");
+                        indecomp_destroy(d);
+                        inbuf->decomp = NULL;
+                        return 0;
+                }
+
+                d->of  = 0;
+                d->len = inbuf_read_raw(inbuf, fd, d->buf, d->size);
+                if (d->len == 0) {
+                        if (!conf.run)
+                                return 0; /* Terminating */
+                        d->eof = 1;
+                }
+        }
+}
+
+
+/**
+ * @brief Read up to \p size bytes of input, decompressed if
+ *        configured, into \p buf, see inbuf_read_raw().
+ */
+static size_t inbuf_read_fd (struct inbuf *inbuf, int fd,
+                             char *buf, size_t size) {
+        if (inbuf->decomp)
+                return inbuf_read_decompress(inbuf, fd, buf, size);
+        return inbuf_read_raw(inbuf, fd, buf, size);
 }
 
 
@@ -307,16 +803,17 @@ static void inbuf_split (struct inbuf *inbuf, size_t dof,
  */
 int inbuf_read_to_delimeter (struct inbuf *inbuf, FILE *fp,
                              struct buf **outbuf) {
-        int read_size = MIN(1024, inbuf->max_size);
+        int fd = _COMPAT(fileno)(fp);
 
         /*
          * 1. Make sure there is enough output buffer room for read_size.
          * 2. Read up to read_size from input stream.
-         * 3. Scan output buffer from current scan position for delimiter using
-         *    Boyer-Moore (searched right-to-left).
+         * 3. Scan output buffer from current scan position for delimiter,
+         *    see delim_scan().
          * 4. If delimiter is not found, go to 1.
-         * 5. Skip delimiter and copy remaining buffer to new buffer.
-         * 6. Return original buffer to caller.
+         * 5. Split off the message, copying the smaller side of the buffer,
+         *    see inbuf_split().
+         * 6. Return the message buffer to caller.
          */
 
         if (!inbuf->buf)
@@ -341,19 +838,24 @@ int inbuf_read_to_delimeter (struct inbuf *inbuf, FILE *fp,
                         return 1;
                 }
 
-                inbuf_ensure(inbuf, read_size);
+                inbuf_ensure(inbuf, inbuf->read_size);
 
-                r = fread(inbuf->buf+inbuf->len, 1, read_size, fp);
+                r = inbuf_read_fd(inbuf, fd, inbuf->buf+inbuf->len,
+                                  MIN(inbuf->read_size,
+                                      inbuf->size - inbuf->len));
                 if (r == 0) {
-                        if (inbuf->len == 0) {
+                        if (inbuf->len == inbuf->of) {
                                 /* EOF with no accumulated data */
                                 inbuf_destroy(inbuf);
                                 return 0;
                         } else {
                                 /* EOF but we have accumulated data, return what
                                  * we have. */
-                                dof = inbuf->len;
-                                *outbuf = buf_new(inbuf->buf, inbuf->len);
+                                size_t mlen = inbuf->len - inbuf->of;
+                                if (inbuf->of > 0)
+                                        memmove(inbuf->buf,
+                                                inbuf->buf + inbuf->of, mlen);
+                                *outbuf = buf_new(inbuf->buf, mlen);
                                 inbuf->buf = NULL;
                                 return 1;
                         }
@@ -365,3 +867,1040 @@ int inbuf_read_to_delimeter (struct inbuf *inbuf, FILE *fp,
 
         return 0; /* NOTREACHED */
 }
+
+
+
+/**
+ * @brief Set up the next input chunk, moving the unconsumed bytes
+ *        (the partial message at the end) of the current chunk, if any,
+ *        to the start of the new chunk.
+ *
+ * The current chunk is reused if there are no outstanding references
+ * to it, else a new chunk is allocated and the inbuf's reference to the
+ * current chunk is released.
+ *
+ * @param min_size is the minimum size of the new chunk.
+ */
+static void inbuf_chunk_next (struct inbuf *inbuf, size_t min_size) {
+        size_t remaining = inbuf->len - inbuf->of;
+        size_t size = MAX(MAX(inbuf->chunk_size, remaining * 2), min_size);
+        struct buf *chunk;
+
+        if (remaining >= inbuf->max_size)
+                KC_FATAL("Input is too large, maximum size is %"PRIu64,
+                         (uint64_t)inbuf->max_size);
+
+        if (inbuf->chunk && rd_atomic_load(&inbuf->chunk->refcnt) == 1 &&
+            inbuf->chunk->size >= size) {
+                /* No messages reference the current chunk:
+                 * reuse it. */
+                chunk = inbuf->chunk;
+                if (remaining > 0)
+                        memmove(chunk->buf, inbuf->buf + inbuf->of,
+                                remaining);
+        } else {
+                chunk = buf_new(inbuf_alloc_buf(size), size);
+                if (remaining > 0)
+                        memcpy(chunk->buf, inbuf->buf + inbuf->of,
+                               remaining);
+                if (inbuf->chunk)
+                        buf_destroy(inbuf->chunk);
+        }
+
+        delim_scan_rebase(&inbuf->scan, inbuf->of);
+
+        inbuf->chunk = chunk;
+        inbuf->buf = chunk->buf;
+        inbuf->size = chunk->size;
+        inbuf->len = remaining;
+        inbuf->of = 0;
+}
+
+
+/**
+ * @brief Initialize \p inbuf for chunked input, see inbuf_read_slice().
+ *
+ * @param chunk_size is the input chunk size to read at a time.
+ */
+void inbuf_init_chunked (struct inbuf *inbuf, size_t max_size,
+                         const char *delim, size_t delim_size,
+                         size_t chunk_size) {
+        memset(inbuf, 0, sizeof(*inbuf));
+
+        inbuf->max_size = max_size + delim_size;
+
+        inbuf->delim = delim;
+        inbuf->dsize = delim_size;
+        delim_scan_init(&inbuf->scan, delim, delim_size);
+
+        inbuf->chunk_size = MAX(chunk_size, 4096);
+
+        inbuf_chunk_next(inbuf, 0);
+}
+
+
+/**
+ * @brief Read up to the next delimiter in chunked input mode and
+ *        return the message as a slice of the current input chunk.
+ *
+ * Input is read in large chunks and all messages in a chunk share the
+ * same refcounted chunk buffer, avoiding per-message allocations
+ * and copies.
+ *
+ * @param chunkp is set to the chunk the message is located in, the caller
+ *               must acquire its own reference with buf_keep() if the
+ *               message is to outlive the next call to this function.
+ * @param bufp is set to the start of the message in the chunk.
+ * @param sizep is set to the message size.
+ *
+ * @returns 0 on eof, else 1 if a message is returned.
+ */
+int inbuf_read_slice (struct inbuf *inbuf, FILE *fp,
+                      struct buf **chunkp, char **bufp, size_t *sizep) {
+        int fd = _COMPAT(fileno)(fp);
+
+        if (inbuf->eof) {
+                inbuf_destroy(inbuf);
+                return 0;
+        }
+
+        while (1) {
+                size_t r;
+                size_t dof;
+
+                /* Scan for delimiter */
+                if (delim_scan(&inbuf->scan, inbuf->buf, inbuf->len, &dof)) {
+                        if (dof - inbuf->of + inbuf->dsize > inbuf->max_size)
+                                KC_FATAL("Input is too large, maximum size "
+                                         "is %"PRIu64,
+                                         (uint64_t)inbuf->max_size);
+                        *chunkp = inbuf->chunk;
+                        *bufp = inbuf->buf + inbuf->of;
+                        *sizep = dof - inbuf->of;
+                        inbuf->of = dof + inbuf->dsize;
+                        return 1;
+                }
+
+                /* A mapped file is a single chunk of the entire input. */
+                if (inbuf->chunk->mapped)
+                        r = 0;
+                else {
+                        /* Move on to a new chunk if there's too little
+                         * room left in the current one for an
+                         * efficient read. */
+                        if (inbuf->size - inbuf->len < inbuf->size / 8)
+                                inbuf_chunk_next(inbuf, 0);
+
+                        r = inbuf_read_fd(inbuf, fd, inbuf->buf + inbuf->len,
+                                          inbuf->size - inbuf->len);
+                }
+
+                if (r == 0) {
+                        inbuf->eof = 1;
+
+                        if (inbuf->len == inbuf->of) {
+                                /* EOF with no accumulated data */
+                                inbuf_destroy(inbuf);
+                                return 0;
+                        }
+
+                        /* EOF but we have accumulated data, return what
+                         * we have. */
+                        if (inbuf->len - inbuf->of >= inbuf->max_size)
+                                KC_FATAL("Input is too large, maximum size "
+                                         "is %"PRIu64,
+                                         (uint64_t)inbuf->max_size);
+                        *chunkp = inbuf->chunk;
+                        *bufp = inbuf->buf + inbuf->of;
+                        *sizep = inbuf->len - inbuf->of;
+                        inbuf->of = inbuf->len;
+                        return 1;
+                }
+
+                inbuf->len += r;
+        }
+
+        return 0; /* NOTREACHED */
+}
+
+
+/**
+ * @brief Read exactly \p size bytes in chunked input mode and return
+ *        them as a slice of the current input chunk, regardless of
+ *        delimiters. See inbuf_read_slice() for \p chunkp and \p bufp.
+ *
+ * @returns 1 if \p size bytes are returned, 0 on eof, or -1 if the
+ *          input ended after less than \p size bytes.
+ */
+int inbuf_read_frame (struct inbuf *inbuf, FILE *fp, size_t size,
+                      struct buf **chunkp, char **bufp) {
+        int fd = _COMPAT(fileno)(fp);
+
+        if (size > inbuf->max_size)
+                KC_FATAL("Input is too large, maximum size is %"PRIu64,
+                         (uint64_t)inbuf->max_size);
+
+        while (inbuf->len - inbuf->of < size) {
+                size_t r;
+
+                /* A mapped file is a single chunk of the entire input. */
+                if (inbuf->eof || inbuf->chunk->mapped)
+                        return inbuf->len == inbuf->of ? 0 : -1;
+
+                /* Move on to a new chunk if the frame won't fit in the
+                 * current one, or there's too little room left in it
+                 * for an efficient read. */
+                if (inbuf->size - inbuf->of < size ||
+                    inbuf->size - inbuf->len < inbuf->size / 8)
+                        inbuf_chunk_next(inbuf, size);
+
+                r = inbuf_read_fd(inbuf, fd, inbuf->buf + inbuf->len,
+                                  inbuf->size - inbuf->len);
+                if (r == 0)
+                        inbuf->eof = 1;
+                else
+                        inbuf->len += r;
+        }
+
+        *chunkp = inbuf->chunk;
+        *bufp = inbuf->buf + inbuf->of;
+        inbuf->of += size;
+
+        return 1;
+}
+
+
+/**
+ * @returns the memory mapping of input set up by inbuf_init_mmap(), with
+ *          its size in \p sizep and the current read position in \p ofp,
+ *          or NULL if the input is not mapped.
+ */
+const char *inbuf_mapping (const struct inbuf *inbuf,
+                           size_t *sizep, size_t *ofp) {
+        if (!inbuf->chunk || !inbuf->chunk->mapped)
+                return NULL;
+
+        *sizep = inbuf->len;
+        *ofp = inbuf->of;
+        return inbuf->buf;
+}
+
+
+/**
+ * @brief Move the read position of mapped input to \p of,
+ *        see inbuf_mapping().
+ */
+void inbuf_seek_mapped (struct inbuf *inbuf, size_t of) {
+        assert(inbuf->chunk && inbuf->chunk->mapped && of <= inbuf->len);
+        inbuf->of = of;
+        inbuf->scan.pos = of;
+        inbuf->scan.mask = 0;
+}
+
+
+/**
+ * @brief Initialize \p inbuf for chunked input from a memory mapping of
+ *        the regular file \p fp, starting at the file's current position.
+ *        The entire file is a single chunk and messages are returned by
+ *        inbuf_read_slice() as slices of the mapping, which is unmapped
+ *        when the last message referencing it has been released.
+ *
+ * @returns 0 on success, or -1 if \p fp is not a regular file or can't be
+ *          mapped, in which case the caller should fall back on reading
+ *          the input.
+ */
+int inbuf_init_mmap (struct inbuf *inbuf, size_t max_size,
+                     const char *delim, size_t delim_size, FILE *fp) {
+#ifndef _MSC_VER
+        int fd = fileno(fp);
+        struct stat st;
+        off_t pos, aligned;
+        void *p;
+
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+                return -1;
+
+        if ((pos = lseek(fd, 0, SEEK_CUR)) == -1 || pos >= st.st_size)
+                return -1;
+
+        /* Map from the current position, aligned down to the page size. */
+        aligned = pos - (pos % (off_t)sysconf(_SC_PAGESIZE));
+
+        if ((uint64_t)(st.st_size - aligned) > (uint64_t)SIZE_MAX)
+                return -1;
+
+        p = mmap(NULL, (size_t)(st.st_size - aligned), PROT_READ,
+                 MAP_PRIVATE, fd, aligned);
+        if (p == MAP_FAILED) {
+                KC_INFO(2, "Failed to mmap input file (%s): "
+                        "falling back on reading\n", strerror(errno));
+                return -1;
+        }
+
+#ifdef MADV_SEQUENTIAL
+        madvise(p, (size_t)(st.st_size - aligned), MADV_SEQUENTIAL);
+#endif
+
+        memset(inbuf, 0, sizeof(*inbuf));
+
+        inbuf->max_size = max_size + delim_size;
+
+        inbuf->delim = delim;
+        inbuf->dsize = delim_size;
+        delim_scan_init(&inbuf->scan, delim, delim_size);
+
+        inbuf->chunk = buf_new(p, (size_t)(st.st_size - aligned));
+        inbuf->chunk->mapped = 1;
+        inbuf->chunk_size = inbuf->chunk->size;
+        inbuf->buf = inbuf->chunk->buf;
+        inbuf->size = inbuf->chunk->size;
+        inbuf->len = inbuf->size;
+        inbuf->of = (size_t)(pos - aligned);
+        inbuf->scan.pos = inbuf->of;
+
+        KC_INFO(3, "Producing from memory mapped input file "
+                "(%"PRIu64" bytes)\n", (uint64_t)(st.st_size - pos));
+
+        return 0;
+#else
+        return -1;
+#endif
+}
+
+
+/**
+ * JSON envelope input (-P -J)
+ *
+ * Each input message is a JSON object as emitted by the -J consumer
+ * (see fmt_msg_output_json()) that is parsed in place: strings without
+ * escapes are returned as slices of the input, others are unescaped to
+ * the envelope's scratch buffer, which is sized for the entire message
+ * so that it is never reallocated during parsing.
+ * String contents are scanned for their end a block at a time using
+ * the delimiter scanner's SIMD instructions.
+ */
+
+struct json_parser {
+        const char *p;
+        const char *end;
+        struct json_envelope *je;
+        size_t of;              /**< Scratch buffer offset */
+        char *errstr;
+        size_t errstr_size;
+};
+
+
+/**
+ * @returns the offset of the first '"' or '\\' in \p p of \p len bytes,
+ *          or \p len if there is none.
+ */
+static size_t json_str_scan (const char *p, size_t len) {
+        size_t i = 0;
+
+#ifdef DELIM_SCAN_WIDTH
+        for ( ; i + DELIM_SCAN_WIDTH <= len ; i += DELIM_SCAN_WIDTH) {
+                uint64_t mask;
+#if DELIM_SCAN_AVX2
+                __m256i v = _mm256_loadu_si256((const __m256i *)(p+i));
+                mask = (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                        _mm256_or_si256(
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                _mm256_cmpeq_epi8(v,
+                                                  _mm256_set1_epi8('\\'))));
+#elif DELIM_SCAN_SSE2
+                __m128i v = _mm_loadu_si128((const __m128i *)(p+i));
+                mask = (uint64_t)(uint32_t)_mm_movemask_epi8(
+                        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+#elif DELIM_SCAN_NEON
+                uint8x16_t v = vld1q_u8((const uint8_t *)(p+i));
+                uint8x16_t eq = vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+                                         vceqq_u8(v, vdupq_n_u8('\\')));
+                mask = vget_lane_u64(vreinterpret_u64_u8(
+                                             vshrn_n_u16(
+                                                     vreinterpretq_u16_u8(eq),
+                                                     4)), 0) &
+                        0x1111111111111111llu;
+#endif
+                if (mask)
+                        return i + (delim_scan_ctz(mask) >> DELIM_SCAN_SHIFT);
+        }
+#endif
+
+        for ( ; i < len ; i++)
+                if (p[i] == '"' || p[i] == '\\')
+                        return i;
+
+        return len;
+}
+
+
+static int json_fail (struct json_parser *jp, const char *reason) {
+        snprintf(jp->errstr, jp->errstr_size, "%s at byte %d",
+                 reason, (int)(jp->p - (jp->end - jp->je->len)));
+        return -1;
+}
+
+static void json_ws (struct json_parser *jp) {
+        while (jp->p < jp->end &&
+               (*jp->p == ' ' || *jp->p == '\t' ||
+                *jp->p == '\r' || *jp->p == '\n'))
+                jp->p++;
+}
+
+static int json_hex4 (const char *p, unsigned int *cpp) {
+        unsigned int cp = 0;
+        int i;
+
+        for (i = 0 ; i < 4 ; i++) {
+                char c = p[i];
+                cp <<= 4;
+                if (c >= '0' && c <= '9')
+                        cp |= (unsigned int)(c - '0');
+                else if (c >= 'a' && c <= 'f')
+                        cp |= (unsigned int)(c - 'a' + 10);
+                else if (c >= 'A' && c <= 'F')
+                        cp |= (unsigned int)(c - 'A' + 10);
+                else
+                        return -1;
+        }
+
+        *cpp = cp;
+        return 0;
+}
+
+/**
+ * @brief Unescape the escape sequence at \p jp->p (after the '\\')
+ *        to \p d.
+ *
+ * @returns the number of bytes written to \p d, or -1 on error.
+ */
+static int json_unescape (struct json_parser *jp, char *d) {
+        unsigned int cp;
+
+        if (jp->p == jp->end)
+                return json_fail(jp, "Truncated escape sequence");
+
+        switch (*jp->p++)
+        {
+        case '"':  *d = '"';  return 1;
+        case '\\': *d = '\\'; return 1;
+        case '/':  *d = '/';  return 1;
+        case 'b':  *d = '\b'; return 1;
+        case 'f':  *d = '\f'; return 1;
+        case 'n':  *d = '\n'; return 1;
+        case 'r':  *d = '\r'; return 1;
+        case 't':  *d = '\t'; return 1;
+        case 'u':
+                break;
+        default:
+                jp->p--;
+                return json_fail(jp, "Invalid escape sequence");
+        }
+
+        if (jp->end - jp->p < 4 || json_hex4(jp->p, &cp) == -1)
+                return json_fail(jp, "Invalid \\u escape sequence");
+        jp->p += 4;
+
+        /* Combine surrogate pairs */
+        if (cp >= 0xd800 && cp <= 0xdbff) {
+                unsigned int lo;
+
+                if (jp->end - jp->p < 6 || jp->p[0] != '\\' ||
+                    jp->p[1] != 'u' || json_hex4(jp->p+2, &lo) == -1 ||
+                    lo < 0xdc00 || lo > 0xdfff)
+                        return json_fail(jp, "Invalid \\u surrogate pair");
+                jp->p += 6;
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+        }
+
+        /* Encode as UTF-8, which is never longer than the escape. */
+        if (cp < 0x80) {
+                d[0] = (char)cp;
+                return 1;
+        } else if (cp < 0x800) {
+                d[0] = (char)(0xc0 | (cp >> 6));
+                d[1] = (char)(0x80 | (cp & 0x3f));
+                return 2;
+        } else if (cp < 0x10000) {
+                d[0] = (char)(0xe0 | (cp >> 12));
+                d[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+                d[2] = (char)(0x80 | (cp & 0x3f));
+                return 3;
+        }
+
+        d[0] = (char)(0xf0 | (cp >> 18));
+        d[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+        d[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        d[3] = (char)(0x80 | (cp & 0x3f));
+        return 4;
+}
+
+/**
+ * @brief Parse the string at \p jp->p, which must start with '"'.
+ *
+ * @param unescapedp is set to 1 if the string was unescaped to the
+ *        scratch buffer, else the string is a slice of the input.
+ */
+static int json_str (struct json_parser *jp, const char **strp,
+                     size_t *lenp, int *unescapedp) {
+        const char *s;
+        char *d;
+        size_t n;
+
+        jp->p++;
+        s = jp->p;
+        n = json_str_scan(jp->p, (size_t)(jp->end - jp->p));
+        jp->p += n;
+
+        if (jp->p == jp->end)
+                return json_fail(jp, "Unterminated string");
+
+        if (*jp->p == '"') {
+                jp->p++;
+                *strp = s;
+                *lenp = n;
+                if (unescapedp)
+                        *unescapedp = 0;
+                return 0;
+        }
+
+        /* Unescape to the scratch buffer */
+        d = jp->je->scratch + jp->of;
+        memcpy(d, s, n);
+        d += n;
+
+        while (1) {
+                if (*jp->p == '"')
+                        break;
+
+                /* Escape */
+                jp->p++;
+                if ((n = (size_t)json_unescape(jp, d)) == (size_t)-1)
+                        return -1;
+                d += n;
+
+                n = json_str_scan(jp->p, (size_t)(jp->end - jp->p));
+                memcpy(d, jp->p, n);
+                d += n;
+                jp->p += n;
+
+                if (jp->p == jp->end)
+                        return json_fail(jp, "Unterminated string");
+        }
+
+        jp->p++;
+        *strp = jp->je->scratch + jp->of;
+        *lenp = (size_t)(d - *strp);
+        jp->of += *lenp;
+        if (unescapedp)
+                *unescapedp = 1;
+
+        return 0;
+}
+
+static int json_int (struct json_parser *jp, int64_t *vp) {
+        int neg = 0;
+        uint64_t v = 0;
+        const char *s;
+
+        if (jp->p < jp->end && *jp->p == '-') {
+                neg = 1;
+                jp->p++;
+        }
+
+        s = jp->p;
+        while (jp->p < jp->end && *jp->p >= '0' && *jp->p <= '9') {
+                if (v > (uint64_t)INT64_MAX / 10)
+                        return json_fail(jp, "Integer out of range");
+                v = v * 10 + (uint64_t)(*jp->p++ - '0');
+        }
+
+        if (jp->p == s || v > (uint64_t)INT64_MAX)
+                return json_fail(jp, "Expected integer");
+
+        *vp = neg ? -(int64_t)v : (int64_t)v;
+        return 0;
+}
+
+static int json_literal (struct json_parser *jp, const char *lit) {
+        size_t len = strlen(lit);
+
+        if ((size_t)(jp->end - jp->p) < len || memcmp(jp->p, lit, len))
+                return 0;
+        jp->p += len;
+        return 1;
+}
+
+/**
+ * @brief Skip the value at \p jp->p.
+ */
+static int json_skip (struct json_parser *jp) {
+        int depth = 0;
+
+        do {
+                const char *s;
+                size_t len;
+
+                json_ws(jp);
+                if (jp->p == jp->end)
+                        return json_fail(jp, "Truncated value");
+
+                switch (*jp->p)
+                {
+                case '{':
+                case '[':
+                        depth++;
+                        jp->p++;
+                        break;
+                case '}':
+                case ']':
+                        if (depth == 0)
+                                return json_fail(jp, "Unexpected end of "
+                                                 "object or array");
+                        depth--;
+                        jp->p++;
+                        break;
+                case ',':
+                case ':':
+                        if (depth == 0)
+                                return json_fail(jp, "Expected value");
+                        jp->p++;
+                        break;
+                case '"':
+                        if (json_str(jp, &s, &len, NULL) == -1)
+                                return -1;
+                        break;
+                default:
+                        /* Number or literal */
+                        s = jp->p;
+                        while (jp->p < jp->end &&
+                               !strchr(",:]} \t\r\n", *jp->p))
+                                jp->p++;
+                        if (jp->p == s)
+                                return json_fail(jp, "Expected value");
+                        break;
+                }
+        } while (depth > 0);
+
+        return 0;
+}
+
+/**
+ * @brief Parse a key or payload: a string, null, or any other value
+ *        which is returned verbatim (e.g., Avro decoded to JSON).
+ */
+static int json_msg_field (struct json_parser *jp, const char **strp,
+                           size_t *lenp, int *unescapedp) {
+        const char *s = jp->p;
+
+        *unescapedp = 0;
+
+        if (*jp->p == '"')
+                return json_str(jp, strp, lenp, unescapedp);
+
+        if (json_literal(jp, "null")) {
+                *strp = NULL;
+                *lenp = 0;
+                return 0;
+        }
+
+        if (json_skip(jp) == -1)
+                return -1;
+
+        *strp = s;
+        *lenp = (size_t)(jp->p - s);
+        return 0;
+}
+
+/**
+ * @brief Parse the "headers" array of alternating names and (string or
+ *        null) values.
+ */
+static int json_headers (struct json_parser *jp) {
+        struct json_envelope *je = jp->je;
+
+        if (*jp->p != '[')
+                return json_fail(jp, "Expected headers array");
+        jp->p++;
+
+        je->hdr_cnt = 0;
+
+        while (1) {
+                struct json_envelope_hdr *hdr;
+
+                json_ws(jp);
+                if (jp->p < jp->end && *jp->p == ']') {
+                        jp->p++;
+                        return 0;
+                }
+
+                if (je->hdr_cnt > 0) {
+                        if (jp->p == jp->end || *jp->p != ',')
+                                return json_fail(jp, "Expected , or ]");
+                        jp->p++;
+                        json_ws(jp);
+                }
+
+                if (je->hdr_cnt == je->hdr_size) {
+                        je->hdr_size = je->hdr_size ? je->hdr_size * 2 : 8;
+                        je->hdrs = realloc(je->hdrs, sizeof(*je->hdrs) *
+                                           je->hdr_size);
+                }
+                hdr = &je->hdrs[je->hdr_cnt++];
+
+                if (jp->p == jp->end || *jp->p != '"')
+                        return json_fail(jp, "Expected header name");
+                if (json_str(jp, &hdr->name, &hdr->name_len, NULL) == -1)
+                        return -1;
+
+                json_ws(jp);
+                if (jp->p == jp->end || *jp->p != ',')
+                        return json_fail(jp, "Expected header value");
+                jp->p++;
+                json_ws(jp);
+
+                if (json_literal(jp, "null")) {
+                        hdr->value = NULL;
+                        hdr->value_len = 0;
+                } else if (jp->p < jp->end && *jp->p == '"') {
+                        if (json_str(jp, &hdr->value, &hdr->value_len,
+                                     NULL) == -1)
+                                return -1;
+                } else
+                        return json_fail(jp, "Expected header value "
+                                         "string or null");
+        }
+}
+
+
+/**
+ * @brief Parse the JSON envelope in \p buf of \p len bytes to \p je,
+ *        which references \p buf until the next call.
+ *
+ * @returns 0 on success or -1 on error (with \p errstr set).
+ */
+int json_envelope_parse (struct json_envelope *je,
+                         const char *buf, size_t len,
+                         char *errstr, size_t errstr_size) {
+        struct json_parser jp = {
+                .p = buf, .end = buf + len, .je = je,
+                .errstr = errstr, .errstr_size = errstr_size
+        };
+        int first = 1;
+
+        je->len       = len;
+        je->partition = RD_KAFKA_PARTITION_UA;
+        je->ts        = 0;
+        je->key       = NULL;
+        je->key_len   = 0;
+        je->value     = NULL;
+        je->value_len = 0;
+        je->value_unescaped = 0;
+        je->hdr_cnt   = 0;
+
+        /* Unescaped strings are never longer than their input. */
+        if (je->scratch_size < len) {
+                je->scratch_size = len;
+                je->scratch = realloc(je->scratch, je->scratch_size);
+        }
+
+        json_ws(&jp);
+        if (jp.p == jp.end || *jp.p != '{')
+                return json_fail(&jp, "Expected JSON object");
+        jp.p++;
+
+        while (1) {
+                const char *name;
+                size_t name_len;
+                int64_t v;
+                int unescaped;
+
+                json_ws(&jp);
+                if (jp.p == jp.end)
+                        return json_fail(&jp, "Truncated object");
+
+                if (*jp.p == '}') {
+                        jp.p++;
+                        break;
+                }
+
+                if (!first) {
+                        if (*jp.p != ',')
+                                return json_fail(&jp, "Expected , or }");
+                        jp.p++;
+                        json_ws(&jp);
+                }
+                first = 0;
+
+                if (jp.p == jp.end || *jp.p != '"')
+                        return json_fail(&jp, "Expected field name");
+                if (json_str(&jp, &name, &name_len, NULL) == -1)
+                        return -1;
+
+                json_ws(&jp);
+                if (jp.p == jp.end || *jp.p != ':')
+                        return json_fail(&jp, "Expected :");
+                jp.p++;
+                json_ws(&jp);
+                if (jp.p == jp.end)
+                        return json_fail(&jp, "Truncated object");
+
+#define JSON_FIELD_IS(S) (name_len == sizeof(S)-1 && !memcmp(name, S, name_len))
+                if (JSON_FIELD_IS("partition")) {
+                        if (json_int(&jp, &v) == -1)
+                                return -1;
+                        if (v < 0 || v > INT32_MAX)
+                                return json_fail(&jp, "Invalid partition");
+                        je->partition = (int32_t)v;
+
+                } else if (JSON_FIELD_IS("ts")) {
+                        if (json_int(&jp, &je->ts) == -1)
+                                return -1;
+
+                } else if (JSON_FIELD_IS("key")) {
+                        if (json_msg_field(&jp, &je->key, &je->key_len,
+                                           &unescaped) == -1)
+                                return -1;
+
+                } else if (JSON_FIELD_IS("payload")) {
+                        if (json_msg_field(&jp, &je->value, &je->value_len,
+                                           &je->value_unescaped) == -1)
+                                return -1;
+
+                } else if (JSON_FIELD_IS("headers")) {
+                        if (json_headers(&jp) == -1)
+                                return -1;
+
+                } else if (json_skip(&jp) == -1) {
+                        /* topic, offset, tstype, broker, .. */
+                        return -1;
+                }
+#undef JSON_FIELD_IS
+        }
+
+        json_ws(&jp);
+        if (jp.p != jp.end)
+                return json_fail(&jp, "Trailing garbage after object");
+
+        return 0;
+}
+
+
+/**
+ * @brief Free the envelope's buffers.
+ */
+void json_envelope_destroy (struct json_envelope *je) {
+        free(je->hdrs);
+        free(je->scratch);
+        memset(je, 0, sizeof(*je));
+}
+
+
+/**
+ * @brief Unittests for json_envelope_parse()
+ */
+int json_envelope_unittest (void) {
+        static const struct {
+                const char *json;
+                int32_t partition;    /* -2: expect parse failure */
+                int64_t ts;
+                const char *key;      /* NULL for null key */
+                const char *value;    /* NULL for null value */
+                const char *hdrs;     /* "name=value,name,.." */
+                int unescaped;
+        } tests[] = {
+                { "{\"topic\":\"t\",\"partition\":3,\"offset\":12,"
+                  "\"tstype\":\"create\",\"ts\":1600000000001,\"broker\":1,"
+                  "\"headers\":[\"a\",\"1\",\"b\",null],"
+                  "\"key\":\"k1\",\"payload\":\"hello\"}",
+                  3, 1600000000001, "k1", "hello", "a=1,b", 0 },
+                { "{\"topic\":\"t\",\"partition\":0,\"offset\":0,"
+                  "\"tstype\":\"none\",\"broker\":-1,"
+                  "\"key\":null,\"payload\":null}\r\n",
+                  0, 0, NULL, NULL, "", 0 },
+                { " { \"payload\" : \"a\\\"b\\\\c\\nd\\u00e5\\ud83d\\ude00"
+                  "0123456789abcdefghijklmnopqrstuvwxyz\" } ",
+                  -1, 0, NULL, "a\"b\\c\nd\xc3\xa5\xf0\x9f\x98\x80"
+                  "0123456789abcdefghijklmnopqrstuvwxyz", "", 1 },
+                { "{\"key\":{\"id\":[1,2,{\"x\":\"}\"}]},"
+                  "\"payload\":[true, 2.5e3],\"key_schema_id\":1,"
+                  "\"unknown\":{\"a\":[]}}",
+                  -1, 0, "{\"id\":[1,2,{\"x\":\"}\"}]}", "[true, 2.5e3]",
+                  "", 0 },
+                { "{\"headers\":[],\"payload\":\"\"}",
+                  -1, 0, NULL, "", "", 0 },
+                { "{}", -1, 0, NULL, NULL, "", 0 },
+                { "", -2 },
+                { "[]", -2 },
+                { "{\"payload\":\"abc}", -2 },
+                { "{\"payload\":\"a\\x\"}", -2 },
+                { "{\"payload\":\"\\ud83d\"}", -2 },
+                { "{\"partition\":\"1\"}", -2 },
+                { "{\"partition\":-1}", -2 },
+                { "{\"headers\":[\"a\"]}", -2 },
+                { "{\"headers\":[\"a\",1]}", -2 },
+                { "{\"key\":\"k\"} x", -2 },
+                { "{\"key\":\"k\",}", -2 },
+                { "{\"ts\":99999999999999999999}", -2 },
+                { NULL }
+        };
+        struct json_envelope je = { 0 };
+        char errstr[256];
+        int fails = 0;
+        int i;
+
+#define JE_CHECK(COND, ...) do {                                        \
+                if (!(COND)) {                                          \
+                        fprintf(stderr, "%s: FAILED: #%d: ",            \
+                                __FUNCTION__, i);                       \
+                        fprintf(stderr, __VA_ARGS__);                   \
+                        fails++;                                        \
+                }                                                       \
+        } while (0)
+
+#define JE_STR_EQ(S, LEN, EXP)                                          \
+        ((EXP) ? (S) && (LEN) == strlen(EXP) && !memcmp(S, EXP, LEN) : !(S))
+
+        for (i = 0 ; tests[i].json ; i++) {
+                char hdrs[256];
+                size_t of = 0;
+                int r, j;
+
+                r = json_envelope_parse(&je, tests[i].json,
+                                        strlen(tests[i].json),
+                                        errstr, sizeof(errstr));
+                if (tests[i].partition == -2) {
+                        JE_CHECK(r == -1, "expected parse failure\n");
+                        continue;
+                }
+
+                JE_CHECK(r == 0, "%s\n", errstr);
+                JE_CHECK(je.partition == tests[i].partition,
+                         "expected partition %"PRId32", not %"PRId32"\n",
+                         tests[i].partition, je.partition);
+                JE_CHECK(je.ts == tests[i].ts,
+                         "expected ts %"PRId64", not %"PRId64"\n",
+                         tests[i].ts, je.ts);
+                JE_CHECK(JE_STR_EQ(je.key, je.key_len, tests[i].key),
+                         "expected key %s, not %.*s\n",
+                         tests[i].key ? tests[i].key : "null",
+                         je.key ? (int)je.key_len : 4,
+                         je.key ? je.key : "null");
+                JE_CHECK(JE_STR_EQ(je.value, je.value_len, tests[i].value),
+                         "expected payload %s, not %.*s\n",
+                         tests[i].value ? tests[i].value : "null",
+                         je.value ? (int)je.value_len : 4,
+                         je.value ? je.value : "null");
+                JE_CHECK(je.value_unescaped == tests[i].unescaped,
+                         "expected payload to be %s\n",
+                         tests[i].unescaped ? "unescaped" : "a slice");
+
+                for (j = 0 ; j < je.hdr_cnt ; j++)
+                        of += (size_t)snprintf(hdrs+of, sizeof(hdrs)-of,
+                                               "%s%.*s%s%.*s",
+                                               j > 0 ? "," : "",
+                                               (int)je.hdrs[j].name_len,
+                                               je.hdrs[j].name,
+                                               je.hdrs[j].value ? "=" : "",
+                                               (int)je.hdrs[j].value_len,
+                                               je.hdrs[j].value ?
+                                               je.hdrs[j].value : "");
+                hdrs[of] = '\0';
+                JE_CHECK(!strcmp(hdrs, tests[i].hdrs),
+                         "expected headers %s, not %s\n",
+                         tests[i].hdrs, hdrs);
+        }
+
+#undef JE_CHECK
+#undef JE_STR_EQ
+
+        json_envelope_destroy(&je);
+
+        return fails;
+}
+
+
+
+/**
+ * @brief Microbenchmark of inbuf_read_to_delimeter() reading synthetic
+ *        messages, separated by single- and multi-byte delimiters,
+ *        from a temporary file.
+ *        Results are printed to stdout, see ubench_result().
+ *
+ * @returns 0 on success or -1 on failure.
+ */
+int inbuf_bench (void) {
+        static const struct {
+                const char *name;
+                const char *delim;
+                size_t max_len;    /**< Maximum message size */
+        } tests[] = {
+                { "inbuf_read_to_delimeter/nl", "\n", 200 },
+                { "inbuf_read_to_delimeter/nl-4k", "\n", 8000 },
+                { "inbuf_read_to_delimeter/multibyte", ";;SEP;;", 200 },
+                { NULL }
+        };
+        const size_t total = 16*1024*1024;
+        char *data = malloc(total);
+        int i;
+
+        for (i = 0 ; tests[i].name ; i++) {
+                size_t dsize = strlen(tests[i].delim);
+                size_t of = 0;
+                uint64_t cnt = 0, bytes = 0;
+                int64_t ts_start;
+                FILE *fp;
+                int n;
+
+                /* Messages of 1..max_len printable characters */
+                for (n = 0 ; of + tests[i].max_len + dsize <= total ; n++) {
+                        size_t len = 1 + ((size_t)n * 7919) %
+                                tests[i].max_len;
+                        size_t j;
+
+                        for (j = 0 ; j < len ; j++)
+                                data[of+j] = (char)('A' + (n + j) % 26);
+                        of += len;
+                        memcpy(data+of, tests[i].delim, dsize);
+                        of += dsize;
+                }
+
+                if (!(fp = tmpfile()) ||
+                    fwrite(data, 1, of, fp) != of || fflush(fp)) {
+                        fprintf(stderr, "%s: failed to write temporary "
+                                "file: %s\n", __FUNCTION__, strerror(errno));
+                        if (fp)
+                                fclose(fp);
+                        free(data);
+                        return -1;
+                }
+
+                ts_start = rd_clock();
+                do {
+                        struct inbuf inbuf;
+                        struct buf *b;
+
+                        rewind(fp);
+                        inbuf_init(&inbuf, 1024*1024, tests[i].delim, dsize,
+                                   64*1024);
+
+                        while (inbuf_read_to_delimeter(&inbuf, fp, &b)) {
+                                cnt++;
+                                buf_destroy(b);
+                        }
+                        inbuf_destroy(&inbuf);
+
+                        bytes += of;
+                } while (!ubench_done(ts_start));
+
+                ubench_result(tests[i].name, cnt, bytes,
+                              rd_clock() - ts_start);
+
+                fclose(fp);
+        }
+
+        free(data);
+
+        return 0;
+}
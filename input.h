@@ -33,29 +33,130 @@
 struct buf {
         void *buf;
         size_t size;
+        int refcnt;  /**< The buffer is freed when the last reference
+                      *   is released with buf_destroy().
+                      *   Atomic: references may be released by
+                      *   another thread. */
+        int mapped;  /**< buf is a file mapping */
 };
 
 
+/**
+ * @brief Delimiter scanner state.
+ *
+ * Candidate positions are found a block at a time by matching the
+ * delimiter's first and last bytes simultaneously, the candidates of the
+ * last block are kept in .mask so that subsequent scans continue where
+ * the previous match left off rather than reloading the block.
+ */
+struct delim_scan {
+        const char *delim;
+        size_t dsize;
+
+        size_t pos;     /**< Next candidate offset not yet loaded */
+        size_t mof;     /**< Candidate offset of bit 0 in .mask */
+        uint64_t mask;  /**< Unverified candidates of the last loaded block */
+};
+
+
+struct indecomp;
+
 struct inbuf {
         const char *delim;
         size_t dsize;
 
-        size_t sof;  /**< Scan-offset */
+        struct delim_scan scan;  /**< Delimiter scanner */
 
         char *buf;
         size_t size;  /**< Allocated size of buf */
         size_t len;   /**< How much of buf is used */
 
         size_t max_size;  /**< Including dsize */
+        size_t read_size; /**< Maximum number of bytes to read at a time */
+        size_t of;        /**< Start of next message in buf */
+
+        /* Chunked input mode, see inbuf_read_slice() */
+        size_t chunk_size;  /**< Chunk size, 0 if chunked mode is disabled */
+        struct buf *chunk;  /**< Current chunk, buf points to chunk->buf */
+        int eof;            /**< End of input reached */
+
+        struct indecomp *decomp; /**< Optional input decompressor,
+                                  *   see inbuf_set_decompress() */
+
+        /**< Optional callback triggered prior to reading (and possibly
+         *   blocking on) the input, e.g., to flush pending messages. */
+        void (*idle_cb) (void *opaque);
+        void *idle_opaque;
 };
 
 
+void delim_scan_init (struct delim_scan *ds,
+                      const char *delim, size_t dsize);
+int delim_scan (struct delim_scan *ds, const char *buf, size_t len,
+                size_t *dofp);
+void delim_scan_rebase (struct delim_scan *ds, size_t of);
+
+struct buf *buf_keep (struct buf *buf);
 void buf_destroy (struct buf *buf);
 
 void inbuf_free_buf (void *buf, size_t size);
 void inbuf_init (struct inbuf *inbuf, size_t max_size,
-                 const char *delim, size_t delim_size);
+                 const char *delim, size_t delim_size,
+                 size_t read_size);
+void inbuf_init_chunked (struct inbuf *inbuf, size_t max_size,
+                         const char *delim, size_t delim_size,
+                         size_t chunk_size);
+int inbuf_init_mmap (struct inbuf *inbuf, size_t max_size,
+                     const char *delim, size_t delim_size, FILE *fp);
+void inbuf_set_decompress (struct inbuf *inbuf, kc_compression_t type);
+void inbuf_destroy (struct inbuf *inbuf);
 int inbuf_read_to_delimeter (struct inbuf *inbuf, FILE *fp,
                              struct buf **outbuf);
+int inbuf_read_slice (struct inbuf *inbuf, FILE *fp,
+                      struct buf **chunkp, char **bufp, size_t *sizep);
+int inbuf_read_frame (struct inbuf *inbuf, FILE *fp, size_t size,
+                      struct buf **chunkp, char **bufp);
+const char *inbuf_mapping (const struct inbuf *inbuf,
+                           size_t *sizep, size_t *ofp);
+void inbuf_seek_mapped (struct inbuf *inbuf, size_t of);
+
+
+/**
+ * @brief A parsed JSON envelope (-P -J), as emitted by the -J consumer.
+ *
+ * Strings reference either the parsed input or the scratch buffer,
+ * and are valid until the next json_envelope_parse() call.
+ */
+struct json_envelope_hdr {
+        const char *name;
+        size_t name_len;
+        const char *value;  /**< NULL for null headers */
+        size_t value_len;
+};
+
+struct json_envelope {
+        int32_t partition;  /**< RD_KAFKA_PARTITION_UA if not set */
+        int64_t ts;         /**< 0 if not set */
+        const char *key;    /**< NULL if null or not set */
+        size_t key_len;
+        const char *value;  /**< NULL if null or not set */
+        size_t value_len;
+        int value_unescaped; /**< value is in scratch, not in the input */
+
+        struct json_envelope_hdr *hdrs;
+        int hdr_cnt;
+        int hdr_size;
+
+        size_t len;          /**< Length of the parsed input */
+        char *scratch;       /**< Unescaped strings */
+        size_t scratch_size;
+};
+
+int json_envelope_parse (struct json_envelope *je,
+                         const char *buf, size_t len,
+                         char *errstr, size_t errstr_size);
+void json_envelope_destroy (struct json_envelope *je);
+int json_envelope_unittest (void);
+int inbuf_bench (void);
 
 #endif
@@ -0,0 +1,295 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Hot-path instrumentation, see instr.h.
+ *
+ * Each thread records its spans to a thread-local state, without
+ * atomics or locks, which is merged when printing the report at exit.
+ * Trace events are buffered per thread and appended to the trace file
+ * (Chrome's JSON array trace format, see about:tracing) when the buffer
+ * is full.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kafkacat.h"
+#include "bench.h"
+#include "instr.h"
+
+#if ENABLE_INSTR
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define INSTR_TSC 1
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define INSTR_TSC 1
+#endif
+
+
+#define INSTR_EVENT_CNT  4096  /* Trace events buffered per thread */
+
+struct instr_event {
+        uint64_t   start;      /**< Start tick */
+        uint64_t   ticks;      /**< Duration */
+        kc_stage_t stage;
+};
+
+struct instr_thread {
+        struct instr_thread *next;
+        int         tid;                     /**< Trace thread id */
+        uint64_t    start[KC_STAGE__CNT];    /**< Start of open spans */
+        uint64_t    ticks[KC_STAGE__CNT];    /**< Total span ticks */
+        struct hist hist[KC_STAGE__CNT];     /**< Span durations (ns) */
+        struct instr_event *events;          /**< Buffered trace events,
+                                              *   NULL if not tracing. */
+        int         event_cnt;
+};
+
+int instr_enabled = 0;
+
+static struct {
+        rd_mutex_t  lock;          /**< Protects threads and the trace */
+        struct instr_thread *threads;
+        int         thread_cnt;
+        uint64_t    tick0;         /**< instr_now() at instr_init() */
+        double      ns_per_tick;
+        FILE       *fp;            /**< Trace file, or NULL */
+        uint64_t    event_cnt;     /**< Trace events written */
+} instr;
+
+static RD_TLS struct instr_thread *instr_thr;
+
+static const char *instr_stage_names[KC_STAGE__CNT] = {
+        "read", "parse", "produce", "backoff", "format", "avro", "write"
+};
+
+
+/**
+ * @returns the current tick: the CPU's time stamp counter where
+ *          available, else the monotonic clock in nanoseconds.
+ */
+static RD_INLINE uint64_t instr_now (void) {
+#if INSTR_TSC
+        return __rdtsc();
+#elif defined(__aarch64__)
+        uint64_t v;
+        __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+        return v;
+#else
+        return (uint64_t)rd_clock_ns();
+#endif
+}
+
+
+/**
+ * @returns the calling thread's instrumentation state, created and
+ *          registered on first use.
+ */
+static struct instr_thread *instr_thread_get (void) {
+        struct instr_thread *t = instr_thr;
+
+        if (t)
+                return t;
+
+        if (!(t = calloc(1, sizeof(*t))) ||
+            (instr.fp && !(t->events = malloc(sizeof(*t->events) *
+                                              INSTR_EVENT_CNT))))
+                KC_FATAL("Failed to allocate instrumentation state");
+
+        rd_mutex_lock(&instr.lock);
+        t->tid = ++instr.thread_cnt;
+        t->next = instr.threads;
+        instr.threads = t;
+        rd_mutex_unlock(&instr.lock);
+
+        instr_thr = t;
+        return t;
+}
+
+
+/**
+ * @brief Write the buffered trace events of \p t to the trace file.
+ *
+ * @locks instr.lock must be held
+ */
+static void instr_events_write (struct instr_thread *t) {
+        int i;
+
+        for (i = 0 ; i < t->event_cnt ; i++) {
+                const struct instr_event *ev = &t->events[i];
+
+                fprintf(instr.fp,
+                        "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                        "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                        instr.event_cnt++ > 0 ? ",\n" : "",
+                        instr_stage_names[ev->stage], t->tid,
+                        (double)(ev->start - instr.tick0) *
+                        instr.ns_per_tick / 1000.0,
+                        (double)ev->ticks * instr.ns_per_tick / 1000.0);
+        }
+
+        t->event_cnt = 0;
+}
+
+
+/**
+ * @brief Begin a span of \p stage on the calling thread.
+ */
+void instr_begin (kc_stage_t stage) {
+        instr_thread_get()->start[stage] = instr_now();
+}
+
+
+/**
+ * @brief End the span of \p stage begun by instr_begin() on the
+ *        calling thread.
+ */
+void instr_end (kc_stage_t stage) {
+        uint64_t now = instr_now();
+        struct instr_thread *t = instr_thread_get();
+        uint64_t ticks = now - t->start[stage];
+
+        t->ticks[stage] += ticks;
+        hist_record_unlocked(&t->hist[stage],
+                             (uint64_t)((double)ticks * instr.ns_per_tick));
+
+        if (!t->events)
+                return;
+
+        t->events[t->event_cnt].start = t->start[stage];
+        t->events[t->event_cnt].ticks = ticks;
+        t->events[t->event_cnt].stage = stage;
+
+        if (++t->event_cnt == INSTR_EVENT_CNT) {
+                rd_mutex_lock(&instr.lock);
+                instr_events_write(t);
+                rd_mutex_unlock(&instr.lock);
+        }
+}
+
+
+/**
+ * @brief Enable instrumentation, for -v -v -v or kafkacat.trace.path.
+ *
+ * The tick rate is calibrated against the monotonic clock over 10ms.
+ */
+void instr_init (void) {
+        int64_t ns0;
+
+        rd_mutex_init(&instr.lock);
+
+        if (conf.trace_path) {
+                if (!(instr.fp = fopen(conf.trace_path, "w")))
+                        KC_FATAL("Failed to open trace file %s: %s",
+                                 conf.trace_path, strerror(errno));
+                fprintf(instr.fp, "[\n");
+        }
+
+        ns0 = rd_clock_ns();
+        instr.tick0 = instr_now();
+        rd_usleep(10000);
+        instr.ns_per_tick = (double)(rd_clock_ns() - ns0) /
+                (double)(instr_now() - instr.tick0);
+
+        instr_enabled = 1;
+}
+
+
+/**
+ * @brief Print the per-stage span statistics (-v -v -v), write the
+ *        remaining trace events and free the instrumentation state.
+ *
+ * All instrumented threads must have exited.
+ */
+void instr_term (void) {
+        static struct hist h;
+        int s;
+
+        instr_enabled = 0;
+
+        if (conf.verbosity >= 4) {
+                KC_INFO(4, "Stage instrumentation: "
+                        "span count, total time and "
+                        "percentiles in microseconds:\n");
+                KC_INFO(4, "  %-8s %10s %12s %10s %10s %10s %10s\n",
+                        "stage", "count", "total ms",
+                        "p50", "p99", "p99.9", "max");
+        }
+
+        for (s = 0 ; s < KC_STAGE__CNT && conf.verbosity >= 4 ; s++) {
+                struct instr_thread *t;
+                uint64_t ticks = 0;
+                int i;
+
+                memset(&h, 0, sizeof(h));
+                for (t = instr.threads ; t ; t = t->next) {
+                        for (i = 0 ; i < HIST_BUCKET_CNT ; i++)
+                                h.buckets[i] += t->hist[s].buckets[i];
+                        ticks += t->ticks[s];
+                }
+
+                if (!hist_cnt(&h, NULL))
+                        continue;
+
+                KC_INFO(4, "  %-8s %10"PRIu64" %12.3f "
+                        "%10.3f %10.3f %10.3f %10.3f\n",
+                        instr_stage_names[s], hist_cnt(&h, NULL),
+                        (double)ticks * instr.ns_per_tick / 1000000.0,
+                        (double)hist_percentile(&h, NULL, 50.0) / 1000.0,
+                        (double)hist_percentile(&h, NULL, 99.0) / 1000.0,
+                        (double)hist_percentile(&h, NULL, 99.9) / 1000.0,
+                        (double)hist_percentile(&h, NULL, 100.0) / 1000.0);
+        }
+
+        while (instr.threads) {
+                struct instr_thread *t = instr.threads;
+
+                if (instr.fp)
+                        instr_events_write(t);
+
+                instr.threads = t->next;
+                free(t->events);
+                free(t);
+        }
+        instr_thr = NULL;
+
+        if (instr.fp) {
+                fprintf(instr.fp, "\n]\n");
+                if (fclose(instr.fp))
+                        KC_ERROR("Failed to write trace file %s: %s",
+                                 conf.trace_path, strerror(errno));
+                instr.fp = NULL;
+        }
+
+        rd_mutex_destroy(&instr.lock);
+}
+
+#endif /* ENABLE_INSTR */
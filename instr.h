@@ -0,0 +1,79 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INSTR_H_
+#define _INSTR_H_
+
+/**
+ * Hot-path instrumentation (./configure --enable-instrumentation)
+ *
+ * Spans around each stage of the producer and consumer pipelines are
+ * timed with the CPU's cycle counter and aggregated into per-stage
+ * histograms, printed at exit with -v -v -v, and/or written as Chrome
+ * trace events to -X kafkacat.trace.path=<file>.
+ *
+ * Without ENABLE_INSTR the KC_INSTR_..() macros compile to nothing,
+ * and with it they are a single branch unless enabled at runtime.
+ */
+
+typedef enum {
+        KC_STAGE_READ,      /**< Producer: read a message from the input */
+        KC_STAGE_PARSE,     /**< Producer: split the key from the value */
+        KC_STAGE_PRODUCE,   /**< Producer: produce, including back-off */
+        KC_STAGE_BACKOFF,   /**< Producer: wait for a full queue */
+        KC_STAGE_FORMAT,    /**< Consumer: format a message, including
+                             *   Avro decoding and output writes */
+        KC_STAGE_AVRO,      /**< Consumer: decode Avro to JSON */
+        KC_STAGE_WRITE,     /**< Consumer: write output */
+        KC_STAGE__CNT
+} kc_stage_t;
+
+#if ENABLE_INSTR
+extern int instr_enabled;
+
+void instr_begin (kc_stage_t stage);
+void instr_end (kc_stage_t stage);
+
+#define KC_INSTR_BEGIN(STAGE) do {                      \
+                if (instr_enabled)                      \
+                        instr_begin(STAGE);             \
+        } while (0)
+#define KC_INSTR_END(STAGE) do {                        \
+                if (instr_enabled)                      \
+                        instr_end(STAGE);               \
+        } while (0)
+
+void instr_init (void);
+void instr_term (void);
+
+#else
+#define KC_INSTR_BEGIN(STAGE) do { } while (0)
+#define KC_INSTR_END(STAGE)   do { } while (0)
+#endif
+
+#endif
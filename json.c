@@ -27,6 +27,7 @@
  */
 
 #include "kafkacat.h"
+#include "output.h"
 
 #include <yajl/yajl_gen.h>
 
@@ -36,13 +37,39 @@
         } while (0)
 #define JS_INT(G, INT) yajl_gen_integer(g, INT)
 
-void fmt_msg_output_json (FILE *fp, const rd_kafka_message_t *rkmessage) {
-        yajl_gen g;
+
+/**
+ * Per-thread message output generator, reused for all messages of
+ * the thread, see json_gen_get().
+ * Writes directly to the current message's output buffer json_gen_ob.
+ */
+static RD_TLS yajl_gen json_gen;
+static RD_TLS struct outbuf *json_gen_ob;
+
+static void json_gen_print (void *ctx, const char *str, size_t len) {
+        outbuf_write(*(struct outbuf **)ctx, str, len);
+}
+
+/**
+ * @returns the calling thread's message output generator.
+ */
+static yajl_gen json_gen_get (void) {
+        if (!json_gen) {
+                json_gen = yajl_gen_alloc(NULL);
+                yajl_gen_config(json_gen, yajl_gen_print_callback,
+                                json_gen_print, &json_gen_ob);
+        }
+        return json_gen;
+}
+
+
+void fmt_msg_output_json (struct outbuf *ob,
+                          const rd_kafka_message_t *rkmessage) {
+        yajl_gen g = json_gen_get();
         const char *topic = rd_kafka_topic_name(rkmessage->rkt);
-        const unsigned char *buf;
-        size_t len;
 
-        g = yajl_gen_alloc(NULL);
+        json_gen_ob = ob;
+        yajl_gen_reset(g, NULL);
 
         yajl_gen_map_open(g);
         JS_STR(g, "topic");
@@ -119,10 +146,11 @@ void fmt_msg_output_json (FILE *fp, const rd_kafka_message_t *rkmessage) {
                 if (conf.flags & CONF_F_FMT_AVRO_KEY) {
                         char errstr[256];
                         int schema_id = -1;
-                        char *json = kc_avro_to_json(
+                        size_t json_len;
+                        const char *json = kc_avro_to_json(
                                 rkmessage->key,
                                 rkmessage->key_len,
-                                &schema_id,
+                                &schema_id, &json_len,
                                 errstr, sizeof(errstr));
 
                         if (!json) {
@@ -136,11 +164,10 @@ void fmt_msg_output_json (FILE *fp, const rd_kafka_message_t *rkmessage) {
                                 JS_STR(g, "key_error");
                                 JS_STR(g, errstr);
                         } else {
-                                yajl_gen_verbatim(g, json, strlen(json));
+                                yajl_gen_verbatim(g, json, json_len);
                                 JS_STR(g, "key_schema_id");
                                 JS_INT(g, schema_id);
                         }
-                        free(json);
                 } else
 #endif
                         yajl_gen_string(g,
@@ -155,10 +182,11 @@ void fmt_msg_output_json (FILE *fp, const rd_kafka_message_t *rkmessage) {
                 if (conf.flags & CONF_F_FMT_AVRO_VALUE) {
                         char errstr[256];
                         int schema_id = -1;
-                        char *json = kc_avro_to_json(
+                        size_t json_len;
+                        const char *json = kc_avro_to_json(
                                 rkmessage->payload,
                                 rkmessage->len,
-                                &schema_id,
+                                &schema_id, &json_len,
                                 errstr, sizeof(errstr));
 
                         if (!json) {
@@ -172,12 +200,10 @@ void fmt_msg_output_json (FILE *fp, const rd_kafka_message_t *rkmessage) {
                                 JS_STR(g, "payload_error");
                                 JS_STR(g, errstr);
                         } else {
-                                yajl_gen_verbatim(g, json, strlen(json));
+                                yajl_gen_verbatim(g, json, json_len);
                                 JS_STR(g, "value_schema_id");
                                 JS_INT(g, schema_id);
                         }
-
-                        free(json);
                 } else
 #endif
                         yajl_gen_string(g,
@@ -189,27 +215,41 @@ void fmt_msg_output_json (FILE *fp, const rd_kafka_message_t *rkmessage) {
 
         yajl_gen_map_close(g);
 
+        if (conf.fmt[0].str_len > 0)
+                outbuf_write(ob, conf.fmt[0].str, conf.fmt[0].str_len);
+}
+
+
+
+/**
+ * @brief Write the JSON generated so far to stdout and clear the
+ *        generator, so that large metadata is output as it is
+ *        generated rather than buffered in full.
+ */
+static void metadata_json_flush (yajl_gen g) {
+        const unsigned char *buf;
+        size_t len;
+
         yajl_gen_get_buf(g, &buf, &len);
 
-        if (fwrite(buf, len, 1, fp) != 1 ||
-            (conf.fmt[0].str_len > 0 &&
-             fwrite(conf.fmt[0].str, conf.fmt[0].str_len, 1, fp) != 1))
+        if (len > 0 && fwrite(buf, len, 1, stdout) != 1)
                 KC_FATAL("Output write error: %s", strerror(errno));
 
-        yajl_gen_free(g);
+        yajl_gen_clear(g);
 }
 
 
-
 /**
- * Print metadata information
+ * Print metadata information, with the partitions' watermarks
+ * in \p lows and \p highs (in metadata order) unless NULL.
  */
 void metadata_print_json (const struct rd_kafka_metadata *metadata,
-                          int32_t controllerid) {
+                          int32_t controllerid,
+                          const rd_kafka_topic_partition_list_t *lows,
+                          const rd_kafka_topic_partition_list_t *highs) {
         yajl_gen g;
         int i, j, k;
-        const unsigned char *buf;
-        size_t len;
+        int n = 0;
 
         g = yajl_gen_alloc(NULL);
 
@@ -290,6 +330,23 @@ void metadata_print_json (const struct rd_kafka_metadata *metadata,
                         JS_STR(g, "leader");
                         yajl_gen_integer(g, (long long int)p->leader);
 
+                        if (lows) {
+                                const rd_kafka_topic_partition_t *lo, *hi;
+                                lo = &lows->elems[n];
+                                hi = &highs->elems[n++];
+                                if (lo->err || hi->err) {
+                                        JS_STR(g, "watermarks_error");
+                                        JS_STR(g, rd_kafka_err2str(
+                                                       lo->err ?
+                                                       lo->err : hi->err));
+                                } else {
+                                        JS_STR(g, "low");
+                                        yajl_gen_integer(g, lo->offset);
+                                        JS_STR(g, "high");
+                                        yajl_gen_integer(g, hi->offset);
+                                }
+                        }
+
                         /* Iterate partition's replicas */
                         JS_STR(g, "replicas");
                         yajl_gen_array_open(g);
@@ -320,15 +377,14 @@ void metadata_print_json (const struct rd_kafka_metadata *metadata,
                 yajl_gen_array_close(g);
 
                 yajl_gen_map_close(g);
+
+                metadata_json_flush(g);
         }
         yajl_gen_array_close(g);
 
         yajl_gen_map_close(g);
 
-        yajl_gen_get_buf(g, &buf, &len);
-
-        if (fwrite(buf, len, 1, stdout) != 1)
-                KC_FATAL("Output write error: %s", strerror(errno));
+        metadata_json_flush(g);
 
         yajl_gen_free(g);
 }
@@ -403,10 +459,98 @@ void partition_list_print_json (const rd_kafka_topic_partition_list_t *parts,
 
 
 
+/**
+ * @brief Print the lag mode's (-A) partition offsets and lag as a
+ *        single line JSON object:
+ *
+ * { "group": "<group>"|null, "lag": <total>,
+ *   "partitions": [ { "topic": "<topic>", "partition": <partition>,
+ *                     ["low": <o>,] ["high": <o>,] ["committed": <o>,]
+ *                     "lag": <lag>|null, ["error": "..."] }, .. ] }
+ */
+void lag_print_json (const char *group,
+                     const rd_kafka_topic_partition_list_t *highs,
+                     const rd_kafka_topic_partition_list_t *lows,
+                     const rd_kafka_topic_partition_list_t *committed,
+                     const int64_t *lag, const rd_kafka_resp_err_t *errs,
+                     int64_t total) {
+        yajl_gen g;
+        const unsigned char *buf;
+        size_t len;
+        int i;
+
+        g = yajl_gen_alloc(NULL);
+
+        yajl_gen_map_open(g);
+        JS_STR(g, "group");
+        if (group)
+                JS_STR(g, group);
+        else
+                yajl_gen_null(g);
+        JS_STR(g, "lag");
+        JS_INT(g, total);
+
+        JS_STR(g, "partitions");
+        yajl_gen_array_open(g);
+        for (i = 0 ; i < highs->cnt ; i++) {
+                const rd_kafka_topic_partition_t *hi = &highs->elems[i];
+
+                yajl_gen_map_open(g);
+                JS_STR(g, "topic");
+                JS_STR(g, hi->topic);
+                JS_STR(g, "partition");
+                JS_INT(g, hi->partition);
+
+                if (lows->elems[i].offset >= 0) {
+                        JS_STR(g, "low");
+                        JS_INT(g, lows->elems[i].offset);
+                }
+                if (!hi->err) {
+                        JS_STR(g, "high");
+                        JS_INT(g, hi->offset);
+                }
+                if (committed && !committed->elems[i].err &&
+                    committed->elems[i].offset >= 0) {
+                        JS_STR(g, "committed");
+                        JS_INT(g, committed->elems[i].offset);
+                }
+
+                JS_STR(g, "lag");
+                if (errs[i]) {
+                        yajl_gen_null(g);
+                        JS_STR(g, "error");
+                        JS_STR(g, rd_kafka_err2str(errs[i]));
+                } else
+                        JS_INT(g, lag[i]);
+
+                yajl_gen_map_close(g);
+        }
+        yajl_gen_array_close(g);
+
+        yajl_gen_map_close(g);
+
+        yajl_gen_get_buf(g, &buf, &len);
+
+        if (fwrite(buf, len, 1, stdout) != 1 || putchar('\n') == EOF)
+                KC_FATAL("Output write error: %s", strerror(errno));
+
+        yajl_gen_free(g);
+}
+
+
+
 void fmt_init_json (void) {
+        json_gen_get();
 }
 
+/**
+ * @brief Free the calling thread's message output generator.
+ */
 void fmt_term_json (void) {
+        if (!json_gen)
+                return;
+        yajl_gen_free(json_gen);
+        json_gen = NULL;
 }
 
 
@@ -31,6 +31,7 @@
 #include <syslog.h>
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <regex.h>
 #else
 #pragma comment(lib, "ws2_32.lib")
 #include "win32/wingetopt.h"
@@ -41,6 +42,7 @@
 #include <stdarg.h>
 #include <signal.h>
 #include <ctype.h>
+#include <limits.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -50,6 +52,14 @@
 
 #include "kafkacat.h"
 #include "input.h"
+#include "output.h"
+#include "dump.h"
+#include "bench.h"
+#include "instr.h"
+#include "filter.h"
+#include "offsets.h"
+#include "ratelimit.h"
+#include "mdcache.h"
 
 #if RD_KAFKA_VERSION >= 0x01040000
 #define ENABLE_TXNS 1
@@ -66,28 +76,54 @@ struct conf conf = {
         .exitonerror = 1,
         .partition = RD_KAFKA_PARTITION_UA,
         .msg_size = 1024*1024,
+        .input_read_size = 64*1024,
+        .input_mmap = 1,
+        .input_compression = KC_COMPRESSION_AUTO,
+        .produce_batch_bytes = 1024*1024,
+        .produce_batch_ms = 100,
         .null_str = "NULL",
         .fixed_key = NULL,
         .metadata_timeout = 5,
+        .metadata_cache_ttl_ms = 60*1000,
+        .threads = 1,
+        .output_buffer_size = 64*1024,
+        .output_flush_ms = -1,
+        .consume_batch_size = 1000,
+        .offset_store = KC_OFFSET_STORE_BATCH,
+        .rate_burst_ms = 100,
+        .produce_files_ordered = -1,
+        .dump_index_interval = 1000,
+        .bench_msg_size = 100,
+        .bench_compressibility = 50,
+        .bench_report_ms = 1000,
         .offset = RD_KAFKA_OFFSET_INVALID,
 };
 
-static struct stats {
-        uint64_t tx;
-        uint64_t tx_err_q;
-        uint64_t tx_err_dr;
-        uint64_t tx_delivered;
+struct stats stats;
 
-        uint64_t rx;
-} stats;
 
+/**
+ * Simple consumer (-C) topic, the opaque of its topic handle.
+ */
+struct ctopic {
+        rd_kafka_topic_t *rkt;
+        const rd_kafka_metadata_topic_t *mdt; /**< Topic metadata */
+        int     *part_stop;   /**< Partition's stopped state, by
+                               *   partition, if -e or -o e@.. */
+        int64_t *offsets;     /**< Start offset by partition, if -o s@.. */
+        int64_t *end_offsets; /**< Stop offset (the first message at or
+                               *   after the stop timestamp) by partition,
+                               *   -1 if not yet produced, if -o e@.. */
+        int      stats_base;  /**< First stats.part_next element */
+};
 
-/* Partition's stopped state array */
-int *part_stop = NULL;
-/* Number of partitions that are stopped */
-int part_stop_cnt = 0;
-/* Threshold level (partitions stopped) before exiting */
-int part_stop_thres = 0;
+static struct {
+        struct ctopic **topics;
+        int      cnt;
+        int      stop_cnt;    /**< Number of partitions that are stopped */
+        int      stop_thres;  /**< Threshold level (partitions stopped)
+                               *   before exiting */
+} ctopics;
 
 
 
@@ -167,43 +203,178 @@ static void dr_msg_cb (rd_kafka_t *rk, const rd_kafka_message_t *rkmessage,
                 say_once = 0;
         }
         stats.tx_delivered++;
+        stats.tx_bytes += rkmessage->len;
+
+#if RD_KAFKA_VERSION >= 0x010000ff
+        if (conf.flags & CONF_F_BENCH)
+                bench_latency(rd_kafka_message_latency(rkmessage));
+        if (conf.rate_adaptive)
+                ratelimit_latency(rd_kafka_message_latency(rkmessage));
+#endif
 }
 
 
 /**
- * Produces a single message, retries on queue congestion, and
- * exits hard on error.
+ * Producer pipeline state for -X kafkacat.produce.pipeline.depth=..
+ *
+ * The main thread reads and parses the input into message descriptors
+ * which are passed through a lock-free single-producer single-consumer
+ * ring to the produce thread, while delivery reports are served by
+ * the poll thread.
  */
-static void produce (void *buf, size_t len,
-                     const void *key, size_t key_len, int msgflags,
-                     void *msg_opaque) {
-        rd_kafka_headers_t *hdrs = NULL;
+struct msgdesc {
+        void   *buf;
+        size_t  len;
+        void   *key;
+        size_t  key_len;
+        char   *hdrs;       /**< Input headers (kafkacat.input.headers) */
+        size_t  hdrs_len;
+        int     msgflags;
+        struct buf *b;      /**< Input buffer reference */
+};
 
-        /* Headers are freed on successful producev(), pass a copy. */
-        if (conf.headers)
-                hdrs = rd_kafka_headers_copy(conf.headers);
+static struct {
+        struct msgdesc *ring;   /**< Ring of size slots, NULL if the
+                                 *   pipeline is disabled. */
+        int     size;           /**< Number of slots (power of two),
+                                 *   one slot is always kept free. */
+        char    pad0[64];
+        int     head;           /**< Next slot to write (reader thread).
+                                 *   Atomic. */
+        char    pad1[64];
+        int     tail;           /**< Next slot to read (produce thread).
+                                 *   Atomic. */
+        char    pad2[64];
+        int     eof;            /**< Reader is done. Atomic. */
+        int     idle;           /**< Reader is waiting for input,
+                                 *   flush pending batch. Atomic. */
+
+        rd_thread_t produce_thread;
+} pipeline;
+
+
+/**
+ * Background poll thread serving delivery reports for the
+ * multi-threaded producer modes.
+ */
+static struct {
+        int     running;        /**< Poll thread is running */
+        int     stop;           /**< Stop the poll thread. Atomic. */
+        rd_thread_t thread;
+} bgpoll;
+
+
+/**
+ * @brief Serve delivery reports, or just wait if the background
+ *        poll thread is serving them.
+ */
+static void producer_poll (int timeout_ms) {
+        if (!bgpoll.running)
+                rd_kafka_poll(conf.rk, timeout_ms);
+        else if (timeout_ms > 0)
+                rd_usleep((int64_t)timeout_ms * 1000);
+}
+
+
+/**
+ * @brief Serve delivery reports until \p due (rd_clock()) or until
+ *        kafkacat is terminated.
+ */
+static void producer_wait_until (int64_t due) {
+        int64_t wait_us;
+
+        while (conf.run && (wait_us = due - rd_clock()) > 0)
+                producer_poll((int)((wait_us + 999) / 1000));
+}
+
+
+/**
+ * @brief Wait for the rate limiter (kafkacat.rate.*) to admit
+ *        \p msgs messages of \p bytes bytes.
+ */
+static void producer_pace (int msgs, size_t bytes) {
+        int64_t wait_us = ratelimit_take(msgs, bytes);
+
+        if (wait_us > 0)
+                producer_wait_until(rd_clock() + wait_us);
+}
+
+
+/**
+ * @brief Poll thread: serve delivery reports until stopped.
+ */
+static rd_thread_ret_t RD_THREAD_CC bgpoll_main (void *arg) {
+        while (!rd_atomic_load(&bgpoll.stop))
+                rd_kafka_poll(conf.rk, 100);
+
+        return 0;
+}
+
+
+/**
+ * @brief Start serving delivery reports from the background poll thread.
+ */
+static void bgpoll_start (void) {
+        if (rd_thread_create(&bgpoll.thread, bgpoll_main, NULL) == -1)
+                KC_FATAL("Failed to create poll thread");
+        bgpoll.running = 1;
+}
+
+
+/**
+ * @brief Stop the background poll thread.
+ */
+static void bgpoll_stop (void) {
+        rd_atomic_store(&bgpoll.stop, 1);
+        rd_thread_join(bgpoll.thread);
+        bgpoll.running = 0;
+        bgpoll.stop = 0;
+}
+
+
+/**
+ * Produces a single message to \p partition with timestamp \p timestamp
+ * (0 for now) and headers \p hdrs (may be NULL, freed on success),
+ * retries on queue congestion, and exits hard on error.
+ *
+ * @returns 0 on success or -1 if the program is terminated before the
+ *          message is produced, in which case \p hdrs is freed and
+ *          the caller keeps ownership of \p buf and \p msg_opaque.
+ *
+ * May be called from multiple threads if the background poll thread
+ * is serving delivery reports.
+ */
+static int produce_try (int32_t partition, void *buf, size_t len,
+                        const void *key, size_t key_len, int64_t timestamp,
+                        rd_kafka_headers_t *hdrs, int msgflags,
+                        void *msg_opaque) {
+
+        producer_pace(1, len + key_len);
 
         /* Produce message: keep trying until it succeeds. */
         do {
                 rd_kafka_resp_err_t err;
 
-                if (!conf.run)
-                        KC_FATAL("Program terminated while "
-                                 "producing message of %zd bytes", len);
+                if (!conf.run) {
+                        if (hdrs)
+                                rd_kafka_headers_destroy(hdrs);
+                        return -1;
+                }
 
                 err = rd_kafka_producev(
                         conf.rk,
                         RD_KAFKA_V_RKT(conf.rkt),
-                        RD_KAFKA_V_PARTITION(conf.partition),
+                        RD_KAFKA_V_PARTITION(partition),
                         RD_KAFKA_V_MSGFLAGS(msgflags),
                         RD_KAFKA_V_VALUE(buf, len),
                         RD_KAFKA_V_KEY(key, key_len),
+                        RD_KAFKA_V_TIMESTAMP(timestamp),
                         RD_KAFKA_V_HEADERS(hdrs),
                         RD_KAFKA_V_OPAQUE(msg_opaque),
                         RD_KAFKA_V_END);
 
                 if (!err) {
-                        stats.tx++;
+                        rd_atomic64_add(&stats.tx, 1);
                         break;
                 }
 
@@ -211,24 +382,508 @@ static void produce (void *buf, size_t len,
                         KC_FATAL("Failed to produce message (%zd bytes): %s",
                                  len, rd_kafka_err2str(err));
 
-                stats.tx_err_q++;
+                rd_atomic64_add(&stats.tx_err_q, 1);
 
                 /* Internal queue full, sleep to allow
                  * messages to be produced/time out
                  * before trying again. */
-                rd_kafka_poll(conf.rk, 5);
+                KC_INSTR_BEGIN(KC_STAGE_BACKOFF);
+                producer_poll(5);
+                KC_INSTR_END(KC_STAGE_BACKOFF);
         } while (1);
 
         /* Poll for delivery reports, errors, etc. */
-        rd_kafka_poll(conf.rk, 0);
+        producer_poll(0);
+
+        return 0;
+}
+
+
+/**
+ * Produces a single message, see produce_try(), and exits hard
+ * if the program is terminated before the message is produced.
+ */
+static void produce0 (int32_t partition, void *buf, size_t len,
+                      const void *key, size_t key_len, int64_t timestamp,
+                      rd_kafka_headers_t *hdrs, int msgflags,
+                      void *msg_opaque) {
+        if (produce_try(partition, buf, len, key, key_len, timestamp,
+                        hdrs, msgflags, msg_opaque) == -1)
+                KC_FATAL("Program terminated while "
+                         "producing message of %zd bytes", len);
+}
+
+
+/**
+ * @brief Create a header list with the -H headers and room for
+ *        \p cnt more.
+ */
+static rd_kafka_headers_t *msg_headers_new (size_t cnt) {
+        rd_kafka_headers_t *hdrs;
+        size_t i;
+
+        hdrs = rd_kafka_headers_new(conf.header_cnt + cnt);
+
+        for (i = 0 ; i < conf.header_cnt ; i++) {
+                const char *name;
+                const void *val;
+                size_t size;
+
+                rd_kafka_header_get_all(conf.headers, i, &name, &val, &size);
+                rd_kafka_header_add(hdrs, name, -1,
+                                    val, val ? (ssize_t)size : 0);
+        }
+
+        return hdrs;
+}
+
+
+/**
+ * @brief Create the headers of a JSON envelope message (-P -J):
+ *        the -H headers followed by the envelope's headers.
+ *
+ * @returns the headers, or NULL if there are none.
+ */
+static rd_kafka_headers_t *
+json_envelope_headers (const struct json_envelope *je) {
+        rd_kafka_headers_t *hdrs;
+        int i;
+
+        if (je->hdr_cnt == 0)
+                return conf.headers ? rd_kafka_headers_copy(conf.headers) :
+                        NULL;
+
+        hdrs = msg_headers_new((size_t)je->hdr_cnt);
+
+        for (i = 0 ; i < je->hdr_cnt ; i++)
+                rd_kafka_header_add(hdrs,
+                                    je->hdrs[i].name,
+                                    (ssize_t)je->hdrs[i].name_len,
+                                    je->hdrs[i].value,
+                                    je->hdrs[i].value ?
+                                    (ssize_t)je->hdrs[i].value_len : 0);
+
+        return hdrs;
+}
+
+
+/**
+ * @brief Create the headers of a message: the -H headers followed by the
+ *        comma-separated "name=value" or "name" headers in the
+ *        \p field_len bytes of \p field (kafkacat.input.headers).
+ *
+ * The input headers are added to the message's header list directly
+ * from the input buffer, which is sized for all headers up front.
+ * Headers without a name are ignored.
+ *
+ * @returns the headers, or NULL if there are none.
+ */
+static rd_kafka_headers_t *msg_headers (const char *field, size_t field_len) {
+        rd_kafka_headers_t *hdrs;
+        const char *p, *end = field + field_len;
+        size_t cnt = 1;
+
+        /* Headers are freed on successful producev(), pass a copy. */
+        if (field_len == 0)
+                return conf.headers ? rd_kafka_headers_copy(conf.headers) :
+                        NULL;
+
+        for (p = field ; (p = memchr(p, ',', (size_t)(end - p))) ; p++)
+                cnt++;
+
+        hdrs = msg_headers_new(cnt);
+
+        for (p = field ; p < end ; ) {
+                const char *t = memchr(p, ',', (size_t)(end - p));
+                const char *v;
+
+                if (!t)
+                        t = end;
+
+                v = memchr(p, '=', (size_t)(t - p));
+                if (v != p && t != p)
+                        rd_kafka_header_add(hdrs, p,
+                                            (ssize_t)((v ? v : t) - p),
+                                            v ? v + 1 : NULL,
+                                            v ? (ssize_t)(t - (v + 1)) : 0);
+                p = t + 1;
+        }
+
+        return hdrs;
+}
+
+
+/**
+ * Produces a single message with the -p partition and -H headers,
+ * and the input headers \p hdrs of \p hdrs_len bytes, see produce0().
+ */
+static void produce (void *buf, size_t len,
+                     const void *key, size_t key_len,
+                     const char *hdrs, size_t hdrs_len, int msgflags,
+                     void *msg_opaque) {
+        produce0(conf.partition, buf, len, key, key_len, 0,
+                 msg_headers(hdrs, hdrs_len), msgflags, msg_opaque);
+}
+
+
+/**
+ * Producer batch state for -X kafkacat.produce.batch.size=..
+ */
+static struct {
+        rd_kafka_message_t *msgs; /**< Pending messages */
+        int     cnt;              /**< Number of pending messages */
+        int     size;             /**< Size of msgs array */
+        size_t  bytes;            /**< Pending key and value bytes */
+        int64_t ts_first;         /**< rd_clock() of first pending message */
+        int     term_drop;        /**< Release the pending messages on
+                                   *   termination rather than failing
+                                   *   (pipeline produce thread). */
+} batch;
+
+
+/**
+ * @brief Release the pending batched messages without producing them.
+ *
+ * @returns the number of released messages.
+ */
+static int produce_batch_drop (void) {
+        int i, cnt = batch.cnt;
+
+        for (i = 0 ; i < batch.cnt ; i++)
+                buf_destroy(batch.msgs[i]._private);
+
+        batch.cnt   = 0;
+        batch.bytes = 0;
+
+        return cnt;
+}
+
+
+/**
+ * @brief Produce all pending batched messages with
+ *        rd_kafka_produce_batch(), resubmitting the messages that failed
+ *        on queue congestion until all are enqueued.
+ *        Exits hard on other errors.
+ */
+static void produce_batch_flush (void) {
+
+        while (batch.cnt > 0) {
+                int i, failed = 0;
+                rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
+                int good;
+
+                good = rd_kafka_produce_batch(conf.rkt, conf.partition, 0,
+                                              batch.msgs, batch.cnt);
+                rd_atomic64_add(&stats.tx, good);
+
+                if (good == batch.cnt)
+                        break;
+
+                /* Move the failed messages to the head of the batch,
+                 * retaining their order, to resubmit them. */
+                for (i = 0 ; i < batch.cnt ; i++) {
+                        if (!batch.msgs[i].err)
+                                continue;
+
+                        err = batch.msgs[i].err;
+                        if (err != RD_KAFKA_RESP_ERR__QUEUE_FULL)
+                                KC_FATAL("Failed to produce message "
+                                         "(%zd bytes): %s",
+                                         batch.msgs[i].len,
+                                         rd_kafka_err2str(err));
+
+                        batch.msgs[i].err = RD_KAFKA_RESP_ERR_NO_ERROR;
+                        batch.msgs[failed++] = batch.msgs[i];
+                }
+
+                batch.cnt = failed;
+                rd_atomic64_add(&stats.tx_err_q, 1);
+
+                /* conf.run is only cleared on termination, not
+                 * by -c <cnt>, so that the final flush is retried
+                 * until the whole batch is enqueued. */
+                if (!conf.run) {
+                        if (!batch.term_drop)
+                                KC_FATAL("Program terminated while "
+                                         "producing batch of %d messages",
+                                         failed);
+                        KC_INFO(1, "Dropped %d batched message(s) "
+                                "on termination\n", produce_batch_drop());
+                        return;
+                }
+
+                /* Internal queue full, sleep to allow
+                 * messages to be produced/time out
+                 * before trying again. */
+                KC_INSTR_BEGIN(KC_STAGE_BACKOFF);
+                producer_poll(5);
+                KC_INSTR_END(KC_STAGE_BACKOFF);
+        }
+
+        batch.cnt   = 0;
+        batch.bytes = 0;
+
+        /* Poll for delivery reports, errors, etc. */
+        producer_poll(0);
+}
+
+
+/**
+ * @brief inbuf idle callback: flush pending messages before
+ *        blocking on input.
+ */
+static void produce_batch_idle_cb (void *opaque) {
+        if (batch.cnt > 0)
+                produce_batch_flush();
+}
+
+
+/**
+ * @brief Add a message to the current batch, flushing the batch when
+ *        the message count, byte or time budget is exhausted.
+ *
+ * The buffers must remain valid until the message is delivered,
+ * \p msg_opaque is passed to the delivery report callback.
+ */
+static void produce_batch_add (void *buf, size_t len,
+                               const void *key, size_t key_len,
+                               void *msg_opaque) {
+        rd_kafka_message_t *rkm;
+        int64_t wait_us;
+
+        /* Produce the pending messages rather than holding on to them
+         * while waiting for the rate limiter. */
+        if ((wait_us = ratelimit_take(1, len + key_len)) > 0) {
+                int64_t due = rd_clock() + wait_us;
+
+                if (batch.cnt > 0)
+                        produce_batch_flush();
+                producer_wait_until(due);
+        }
+
+        if (batch.cnt == 0)
+                batch.ts_first = rd_clock();
+
+        rkm = &batch.msgs[batch.cnt++];
+        memset(rkm, 0, sizeof(*rkm));
+        rkm->payload  = buf;
+        rkm->len      = len;
+        rkm->key      = (void *)key;
+        rkm->key_len  = key_len;
+        rkm->_private = msg_opaque;
+
+        batch.bytes += len + key_len;
+
+        if (batch.cnt == batch.size ||
+            batch.bytes >= conf.produce_batch_bytes ||
+            rd_clock() - batch.ts_first >=
+            (int64_t)conf.produce_batch_ms * 1000)
+                produce_batch_flush();
+}
+
+
+/**
+ * @brief Back off while waiting for another thread.
+ *        Spins briefly before sleeping.
+ */
+static void wait_backoff (int *spinsp) {
+        if (++(*spinsp) > 64)
+                rd_usleep(50);
+}
+
+
+/**
+ * @brief Pass message descriptor \p md to the produce thread,
+ *        waiting for a free ring slot if needed.
+ *
+ * Must only be called from the reader thread.
+ */
+static void pipeline_push (const struct msgdesc *md) {
+        int head = pipeline.head; /* Only written by this thread */
+        int next = (head + 1) & (pipeline.size - 1);
+        int spins = 0;
+
+        while (next == rd_atomic_load(&pipeline.tail)) {
+                if (!conf.run) {
+                        /* Terminating: the produce thread will not
+                         * free up a slot, drop the message. */
+                        buf_destroy(md->b);
+                        return;
+                }
+                wait_backoff(&spins);
+        }
+
+        pipeline.ring[head] = *md;
+        rd_atomic_store(&pipeline.head, next);
+}
+
+
+/**
+ * @brief inbuf idle callback for the pipeline: have the produce thread
+ *        flush its pending batch while the reader waits for input.
+ */
+static void pipeline_idle_cb (void *opaque) {
+        rd_atomic_store(&pipeline.idle, 1);
+}
+
+
+/**
+ * @brief Produce thread: produce messages from the pipeline ring
+ *        until the reader is done and the ring is empty.
+ *
+ * On termination the remaining messages in the ring are released
+ * rather than produced.
+ */
+static rd_thread_ret_t RD_THREAD_CC pipeline_produce_main (void *arg) {
+        int spins = 0;
+        int dropped = 0;
+
+        while (1) {
+                int tail = pipeline.tail; /* Only written by this thread */
+                struct msgdesc *md;
+
+                if (tail == rd_atomic_load(&pipeline.head)) {
+                        /* Ring is empty */
+                        if (batch.cnt > 0 &&
+                            (rd_atomic_load(&pipeline.idle) ||
+                             rd_clock() - batch.ts_first >=
+                             (int64_t)conf.produce_batch_ms * 1000)) {
+                                rd_atomic_store(&pipeline.idle, 0);
+                                produce_batch_flush();
+                                continue;
+                        }
+
+                        /* eof is set after the last message is pushed,
+                         * so check the ring again once eof is seen. */
+                        if (rd_atomic_load(&pipeline.eof)) {
+                                if (tail == rd_atomic_load(&pipeline.head))
+                                        break;
+                                continue;
+                        }
+
+                        wait_backoff(&spins);
+                        continue;
+                }
+
+                spins = 0;
+                md = &pipeline.ring[tail];
+
+                if (!conf.run) {
+                        /* Terminating: release the message, its
+                         * input headers point into the same buffer. */
+                        buf_destroy(md->b);
+                        dropped++;
+
+                } else if (batch.size > 0)
+                        produce_batch_add(md->buf, md->len,
+                                          md->key, md->key_len, md->b);
+                else if (produce_try(conf.partition,
+                                     md->buf, md->len,
+                                     md->key, md->key_len, 0,
+                                     msg_headers(md->hdrs, md->hdrs_len),
+                                     md->msgflags,
+                                     (md->msgflags & RD_KAFKA_MSG_F_COPY) ?
+                                     NULL : md->b) == -1) {
+                        /* Terminated while producing the message. */
+                        buf_destroy(md->b);
+                        dropped++;
+
+                } else if (md->msgflags & RD_KAFKA_MSG_F_COPY) {
+                        /* librdkafka made a copy of the input. */
+                        buf_destroy(md->b);
+                }
+
+                rd_atomic_store(&pipeline.tail,
+                                (tail + 1) & (pipeline.size - 1));
+        }
+
+        if (batch.cnt > 0) {
+                if (conf.run)
+                        produce_batch_flush();
+                else
+                        dropped += produce_batch_drop();
+        }
+
+        if (dropped > 0)
+                KC_INFO(1, "Dropped %d pipelined message(s) "
+                        "on termination\n", dropped);
+
+        return 0;
+}
+
+
+
+
+/**
+ * @brief Start the producer pipeline with a ring of at least
+ *        \p depth message descriptors.
+ */
+static void pipeline_start (int depth) {
+        int size = 2;
+
+        while (size <= depth)
+                size <<= 1;
+
+        pipeline.size = size;
+        pipeline.ring = calloc(size, sizeof(*pipeline.ring));
+
+        KC_INFO(3, "Starting producer pipeline with %d message slots\n",
+                size - 1);
+
+        bgpoll_start();
+
+        if (rd_thread_create(&pipeline.produce_thread,
+                             pipeline_produce_main, NULL) == -1)
+                KC_FATAL("Failed to create producer pipeline thread");
+}
+
+
+/**
+ * @brief Wait for the produce thread to produce all messages in the
+ *        pipeline and stop the pipeline.
+ */
+static void pipeline_stop (void) {
+        rd_atomic_store(&pipeline.eof, 1);
+        rd_thread_join(pipeline.produce_thread);
+
+        bgpoll_stop();
+
+        free(pipeline.ring);
+        pipeline.ring = NULL;
+}
+
+
+/**
+ * Multi-threaded file producer state (-j <threads>)
+ */
+static struct {
+        char  **paths;
+        int     cnt;
+        int     next;           /**< Next file to pick. Atomic. */
+        int     turn;           /**< Next file to produce in ordered
+                                 *   mode. Atomic. */
+        int     good;           /**< Successfully produced files. Atomic. */
+} files;
+
+
+/**
+ * @brief Wait for file \p seq's turn to be produced in ordered mode.
+ */
+static void files_wait_turn (int seq) {
+        int spins = 0;
+
+        while (rd_atomic_load(&files.turn) != seq)
+                wait_backoff(&spins);
 }
 
 
 /**
  * Produce contents of file as a single message.
+ * If \p seq is not -1 the message is not produced until it is file
+ * \p seq's turn, see files_wait_turn().
  * Returns the file length on success, else -1.
  */
-static ssize_t produce_file (const char *path) {
+static ssize_t produce_file (const char *path, int seq) {
         int fd;
         void *ptr;
         struct stat st;
@@ -282,9 +937,13 @@ static ssize_t produce_file (const char *path) {
         msgflags = RD_KAFKA_MSG_F_FREE;
 #endif
 
+        if (seq != -1)
+                files_wait_turn(seq);
+
         KC_INFO(4, "Producing file %s (%"PRIdMAX" bytes)\n",
                 path, (intmax_t)st.st_size);
-        produce(ptr, sz, conf.fixed_key, conf.fixed_key_len, msgflags, NULL);
+        produce(ptr, sz, conf.fixed_key, conf.fixed_key_len, NULL, 0,
+                msgflags, NULL);
 
         _COMPAT(close)(fd);
 
@@ -301,29 +960,209 @@ static ssize_t produce_file (const char *path) {
 
 static char *rd_strnstr (const char *haystack, size_t size,
                          const char *needle, size_t needle_len) {
-        const char *nend = needle + needle_len - 1;
-        const char *t;
-        size_t of = needle_len - 1;
+        struct delim_scan ds;
+        size_t of;
 
-        while (of < size &&
-               (t = (const char *)memchr((void *)(haystack + of),
-                                         (int)*nend,
-                                         size - of))) {
-                const char *n = nend;
-                const char *p = t;
+        delim_scan_init(&ds, needle, needle_len);
 
-                do {
-                        n--;
-                        p--;
-                } while (n >= needle && *n == *p);
+        if (!delim_scan(&ds, haystack, size, &of))
+                return NULL;
+
+        return (char *)haystack + of;
+}
+
+
+/**
+ * @brief File producer worker thread: produce files until all
+ *        files have been picked.
+ *
+ * In ordered mode the files are opened and mapped in parallel but
+ * produced in the order they were given.
+ */
+static rd_thread_ret_t RD_THREAD_CC files_worker_main (void *arg) {
+        int ordered = *(int *)arg;
+        int i;
 
-                if (n < needle)
-                        return (char *)p+1;
+        while (conf.run &&
+               (i = rd_atomic_add(&files.next, 1) - 1) < files.cnt) {
+                if (produce_file(files.paths[i], ordered ? i : -1) != -1)
+                        rd_atomic_add(&files.good, 1);
 
-                of = (size_t)(t - haystack) + 1;
+                if (ordered) {
+                        /* Also pass the turn on failed or
+                         * empty files. */
+                        files_wait_turn(i);
+                        rd_atomic_store(&files.turn, i + 1);
+                }
         }
 
-        return NULL;
+        return 0;
+}
+
+
+/**
+ * @brief Produce the files in \p paths, one message per file,
+ *        using \p thread_cnt worker threads.
+ *
+ * @returns the number of successfully produced files.
+ */
+static int produce_files (char **paths, int pathcnt, int thread_cnt) {
+        rd_thread_t *thrs;
+        int ordered;
+        int i;
+
+        if (thread_cnt <= 1) {
+                int good = 0;
+
+                for (i = 0 ; i < pathcnt ; i++)
+                        if (produce_file(paths[i], -1) != -1)
+                                good++;
+                return good;
+        }
+
+        /* Produce files in order by default if all messages have
+         * the same key, i.e., end up on the same partition. */
+        if (conf.produce_files_ordered == -1)
+                ordered = conf.fixed_key != NULL;
+        else
+                ordered = conf.produce_files_ordered;
+
+        if (thread_cnt > pathcnt)
+                thread_cnt = pathcnt;
+
+        KC_INFO(3, "Producing %d files using %d threads%s\n",
+                pathcnt, thread_cnt, ordered ? " in order" : "");
+
+        files.paths = paths;
+        files.cnt   = pathcnt;
+
+        bgpoll_start();
+
+        thrs = calloc(thread_cnt, sizeof(*thrs));
+        for (i = 0 ; i < thread_cnt ; i++)
+                if (rd_thread_create(&thrs[i], files_worker_main,
+                                     &ordered) == -1)
+                        KC_FATAL("Failed to create producer thread");
+
+        for (i = 0 ; i < thread_cnt ; i++)
+                rd_thread_join(thrs[i]);
+        free(thrs);
+
+        bgpoll_stop();
+
+        return files.good;
+}
+
+
+/**
+ * @brief Restore the messages of the binary dump read from \p fp
+ *        (-X kafkacat.dump=true), see dump.c.
+ *
+ * Messages are produced with their original key, timestamp and headers,
+ * plus any -H headers, to their original partition unless -p is set.
+ * The messages are produced directly from the input chunk (the mapped
+ * file for regular files) which is released when all its messages
+ * have been delivered.
+ */
+static void produce_dump (FILE *fp) {
+        struct dump_reader *dr;
+        struct dump_msg dm;
+        int64_t start_offset = conf.offset >= 0 ? conf.offset : -1;
+        int64_t start_ts = 0, stop_ts = 0;
+        uint64_t msgcnt = 0;
+
+#if RD_KAFKA_VERSION >= 0x00090300
+        start_ts = conf.startts;
+        stop_ts  = conf.stopts;
+#endif
+
+        dr = dump_reader_new(fp, start_offset, start_ts, stop_ts);
+
+        while (conf.run && dump_read(dr, &dm)) {
+                rd_kafka_headers_t *hdrs = NULL;
+
+#if HAVE_HEADERS
+                hdrs = dump_msg_headers(&dm, conf.headers);
+#endif
+
+                produce0(conf.partition != RD_KAFKA_PARTITION_UA ?
+                         conf.partition : dm.partition,
+                         (void *)dm.value, dm.len, dm.key, dm.key_len,
+                         dm.timestamp > 0 ? dm.timestamp : 0, hdrs,
+                         0, buf_keep(dm.chunk));
+
+                /* Enforce -c <cnt> */
+                if (++msgcnt == (uint64_t)conf.msg_cnt)
+                        conf.run = 0;
+        }
+
+        dump_reader_destroy(dr);
+}
+
+
+/**
+ * @brief Print a benchmark report (-B) of the producer's or consumer's
+ *        progress, see bench_report().
+ */
+static void bench_stats_report (int final) {
+        uint64_t rx;
+
+        if (conf.mode == 'P') {
+                bench_report("Produced", stats.tx_delivered, stats.tx_bytes,
+                             stats.tx_err_dr, final);
+                return;
+        }
+
+        /* Consumers may claim more than -c <cnt> messages, see
+         * consume_cb(). */
+        rx = rd_atomic64_load(&stats.rx);
+        if (conf.msg_cnt > 0 && rx > (uint64_t)conf.msg_cnt)
+                rx = (uint64_t)conf.msg_cnt;
+
+        bench_report("Consumed", rx, rd_atomic64_load(&stats.rx_bytes),
+                     0, final);
+}
+
+
+/**
+ * @brief Produce synthetic messages (-B) from the in-memory message pool
+ *        at kafkacat.bench.rate messages per second, or as fast as
+ *        possible, until -c <cnt> messages have been produced or
+ *        kafkacat is terminated.
+ *
+ * The values are produced without copying, the keys are copied
+ * by librdkafka.
+ */
+static void produce_bench (void) {
+        uint64_t msgcnt = 0;
+        int64_t ts_start = rd_clock();
+
+        while (conf.run) {
+                char key[32];
+                size_t key_len = bench_key(msgcnt, key, sizeof(key));
+
+                if (conf.bench_rate > 0) {
+                        /* Wait for the message's time slot */
+                        producer_wait_until(ts_start +
+                                            (int64_t)((double)msgcnt *
+                                                      1000000.0 /
+                                                      conf.bench_rate));
+
+                        if (!conf.run)
+                                break;
+                }
+
+                produce((void *)bench_value(msgcnt),
+                        (size_t)conf.bench_msg_size,
+                        key_len ? key : NULL, key_len, NULL, 0, 0, NULL);
+
+                if (bench_report_due())
+                        bench_stats_report(0);
+
+                /* Enforce -c <cnt> */
+                if (++msgcnt == (uint64_t)conf.msg_cnt)
+                        conf.run = 0;
+        }
 }
 
 
@@ -389,14 +1228,19 @@ static void producer_run (FILE *fp, char **paths, int pathcnt) {
         conf.rkt_conf = NULL;
 
 
-        if (pathcnt > 0 && !(conf.flags & CONF_F_LINE)) {
-                int i;
-                int good = 0;
+        if (conf.flags & CONF_F_BENCH) {
+                /* Produce synthetic messages */
+                produce_bench();
+
+        } else if (conf.flags & CONF_F_FMT_DUMP) {
+                /* Restore messages from a binary dump */
+                produce_dump(fp);
+
+        } else if (pathcnt > 0 && !(conf.flags & CONF_F_LINE)) {
+                int good;
                 /* Read messages from files, each file is its own message. */
 
-                for (i = 0 ; i < pathcnt ; i++)
-                        if (produce_file(paths[i]) != -1)
-                                good++;
+                good = produce_files(paths, pathcnt, conf.threads);
 
                 if (!good)
                         conf.exitcode = 1;
@@ -407,25 +1251,159 @@ static void producer_run (FILE *fp, char **paths, int pathcnt) {
         } else {
                 struct inbuf inbuf;
                 struct buf *b;
+                int sliced = 1; /* Messages are slices of a shared chunk */
+                int batched = conf.produce_batch_size > 0;
+                int pipelined = conf.produce_pipeline_depth > 0;
+                int json = !!(conf.flags & CONF_F_FMT_JSON);
+                struct json_envelope je = { 0 };
+                uint64_t msgcnt = 0;
+                int compressed = conf.input_compression !=
+                        KC_COMPRESSION_NONE &&
+                        conf.input_compression != KC_COMPRESSION_AUTO;
+
+                /* Regular files are memory mapped and messages are
+                 * produced directly from the mapping, else the input
+                 * is read in chunks or per message.
+                 * Compressed input is always read. */
+                if (conf.input_mmap && !compressed &&
+                    inbuf_init_mmap(&inbuf, conf.msg_size,
+                                    conf.delim, conf.delim_size, fp) == 0)
+                        ;
+                else if (conf.input_chunk_size)
+                        inbuf_init_chunked(&inbuf, conf.msg_size,
+                                           conf.delim, conf.delim_size,
+                                           conf.input_chunk_size);
+                else {
+                        inbuf_init(&inbuf, conf.msg_size,
+                                   conf.delim, conf.delim_size,
+                                   conf.input_read_size);
+                        sliced = 0;
+                }
 
-                inbuf_init(&inbuf, conf.msg_size, conf.delim, conf.delim_size);
+                if (compressed)
+                        inbuf_set_decompress(&inbuf, conf.input_compression);
+
+                if (batched && (conf.headers || conf.input_hdr_delim)) {
+                        /* produce_batch() does not support headers. */
+                        KC_INFO(1, "Message headers (-H) are not supported "
+                                "by the batch producer: "
+                                "producing messages one by one\n");
+                        batched = 0;
+                }
+
+                if ((batched || pipelined) && json) {
+                        /* Envelopes carry their own partition, timestamp
+                         * and headers, which neither the batch nor the
+                         * pipeline producer pass on. */
+                        KC_INFO(1, "JSON envelope input (-J) is not "
+                                "supported by the batch and pipeline "
+                                "producers: producing messages one by one\n");
+                        batched = 0;
+                        pipelined = 0;
+                }
+
+                if (batched) {
+                        batch.size = conf.produce_batch_size;
+                        batch.msgs = malloc(sizeof(*batch.msgs) * batch.size);
+                        batch.term_drop = pipelined;
+                        /* Don't hold on to pending messages while
+                         * waiting for more input. */
+                        inbuf.idle_cb = pipelined ? pipeline_idle_cb :
+                                produce_batch_idle_cb;
+                }
+
+                if (pipelined)
+                        pipeline_start(conf.produce_pipeline_depth);
 
                 /* Read messages from input, delimited by conf.delim */
-                while (conf.run &&
-                       inbuf_read_to_delimeter(&inbuf, fp, &b)) {
+                while (conf.run) {
                         int msgflags = 0;
-                        char *buf = b->buf;
+                        char *buf;
                         char *key = NULL;
                         size_t key_len = 0;
-                        size_t len = b->size;
+                        char *hdrs = NULL;
+                        size_t hdrs_len = 0;
+                        int32_t partition = conf.partition;
+                        int64_t timestamp = 0;
+                        size_t len;
+                        const char *tee_buf;
+                        size_t tee_len;
+
+                        KC_INSTR_BEGIN(KC_STAGE_READ);
+                        if (sliced) {
+                                /* Message is a slice of the shared
+                                 * input chunk, hold a reference to the
+                                 * chunk until the message is delivered. */
+                                if (!inbuf_read_slice(&inbuf, fp,
+                                                      &b, &buf, &len)) {
+                                        KC_INSTR_END(KC_STAGE_READ);
+                                        break;
+                                }
+                                buf_keep(b);
+                        } else {
+                                if (!inbuf_read_to_delimeter(&inbuf, fp,
+                                                             &b)) {
+                                        KC_INSTR_END(KC_STAGE_READ);
+                                        break;
+                                }
+                                buf = b->buf;
+                                len = b->size;
+                        }
+                        KC_INSTR_END(KC_STAGE_READ);
+
+                        tee_buf = buf;
+                        tee_len = len;
 
                         if (len == 0) {
                                 buf_destroy(b);
                                 continue;
                         }
 
+                        /* Extract the leading header column,
+                         * if desired and found. */
+                        KC_INSTR_BEGIN(KC_STAGE_PARSE);
+                        if (json) {
+                                /* The message is a JSON envelope which
+                                 * the key and value are parsed from,
+                                 * mostly without copying. */
+                                char errstr[256];
+
+                                if (json_envelope_parse(&je, buf, len,
+                                                        errstr,
+                                                        sizeof(errstr)) ==
+                                    -1) {
+                                        KC_INSTR_END(KC_STAGE_PARSE);
+                                        buf_destroy(b);
+                                        KC_ERROR("Skipping invalid JSON "
+                                                 "envelope: %s\n", errstr);
+                                        continue;
+                                }
+
+                                buf     = (char *)je.value;
+                                len     = je.value_len;
+                                key     = (char *)je.key;
+                                key_len = je.key_len;
+                                timestamp = je.ts;
+                                /* -p takes precedence */
+                                if (partition == RD_KAFKA_PARTITION_UA)
+                                        partition = je.partition;
+
+                        } else if (conf.input_hdr_delim) {
+                                char *t;
+                                if ((t = rd_strnstr(buf, len,
+                                                    conf.input_hdr_delim,
+                                                    conf.input_hdr_delim_size))) {
+                                        hdrs     = buf;
+                                        hdrs_len = (size_t)(t-buf);
+                                        buf      = t +
+                                                conf.input_hdr_delim_size;
+                                        len     -= hdrs_len +
+                                                conf.input_hdr_delim_size;
+                                }
+                        }
+
                         /* Extract key, if desired and found. */
-                        if (conf.flags & CONF_F_KEY_DELIM) {
+                        if (!json && (conf.flags & CONF_F_KEY_DELIM)) {
                                 char *t;
                                 if ((t = rd_strnstr(buf, len,
                                                     conf.key_delim,
@@ -448,40 +1426,92 @@ static void producer_run (FILE *fp, char **paths, int pathcnt) {
                                 key = conf.fixed_key;
                                 key_len = conf.fixed_key_len;
                         }
+                        KC_INSTR_END(KC_STAGE_PARSE);
 
-                        if (len < 1024) {
+                        if ((len < 1024 && !sliced && !batched) ||
+                            je.value_unescaped) {
                                 /* If message is smaller than this arbitrary
                                  * threshold it will be more effective to
-                                 * copy the data in librdkafka. */
+                                 * copy the data in librdkafka.
+                                 * Not needed for chunked input where
+                                 * the message buffer is shared, nor for
+                                 * batches which are produced without
+                                 * copying.
+                                 * Unescaped JSON values are in the
+                                 * envelope's scratch buffer which is
+                                 * reused for the next message. */
                                 msgflags |= RD_KAFKA_MSG_F_COPY;
                         }
 
-                        /* Produce message */
-                        produce(buf, len, key, key_len, msgflags,
-                                (msgflags & RD_KAFKA_MSG_F_COPY) ?
-                                NULL : b);
-
+                        /* Tee prior to producing since the input
+                         * buffer is released once produced. */
                         if (conf.flags & CONF_F_TEE &&
-                            fwrite(b->buf, b->size, 1, stdout) != 1)
+                            fwrite(tee_buf, tee_len, 1, stdout) != 1)
                                 KC_FATAL("Tee write error for message "
                                          "of %zd bytes: %s",
-                                         b->size, strerror(errno));
+                                         tee_len, strerror(errno));
 
-                        if (msgflags & RD_KAFKA_MSG_F_COPY) {
-                                /* librdkafka made a copy of the input. */
-                                buf_destroy(b);
+                        /* Produce message */
+                        KC_INSTR_BEGIN(KC_STAGE_PRODUCE);
+                        if (pipelined) {
+                                struct msgdesc md = {
+                                        buf, len, key, key_len,
+                                        hdrs, hdrs_len, msgflags, b
+                                };
+                                pipeline_push(&md);
+
+                        } else if (batched) {
+                                produce_batch_add(buf, len, key, key_len, b);
+
+                        } else if (json) {
+                                produce0(partition, buf, len, key, key_len,
+                                         timestamp,
+                                         json_envelope_headers(&je),
+                                         msgflags,
+                                         (msgflags & RD_KAFKA_MSG_F_COPY) ?
+                                         NULL : b);
+
+                                if (msgflags & RD_KAFKA_MSG_F_COPY)
+                                        buf_destroy(b);
+
+                        } else {
+                                produce(buf, len, key, key_len,
+                                        hdrs, hdrs_len, msgflags,
+                                        (msgflags & RD_KAFKA_MSG_F_COPY) ?
+                                        NULL : b);
+
+                                if (msgflags & RD_KAFKA_MSG_F_COPY) {
+                                        /* librdkafka made a copy of
+                                         * the input. */
+                                        buf_destroy(b);
+                                }
                         }
+                        KC_INSTR_END(KC_STAGE_PRODUCE);
 
-                        /* Enforce -c <cnt> */
-                        if (stats.tx == (uint64_t)conf.msg_cnt)
-                                conf.run = 0;
+                        /* Enforce -c <cnt>.
+                         * conf.run is left set so that the pipeline
+                         * and batch still produce the pending
+                         * messages, it is only cleared on termination. */
+                        if (++msgcnt == (uint64_t)conf.msg_cnt)
+                                break;
                 }
 
-                if (conf.run) {
-                        if (!feof(fp))
-                                KC_FATAL("Unable to read message: %s",
-                                         strerror(errno));
+                /* Wait for the produce thread to produce
+                 * the remaining messages. */
+                if (pipelined)
+                        pipeline_stop();
+
+                if (batched) {
+                        /* Produce remaining messages */
+                        produce_batch_flush();
+                        free(batch.msgs);
+                        batch.msgs = NULL;
                 }
+
+                json_envelope_destroy(&je);
+
+                /* Read errors are fatal in inbuf_read_..(). */
+                inbuf_destroy(&inbuf);
         }
 
 #if ENABLE_TXNS
@@ -514,9 +1544,13 @@ static void producer_run (FILE *fp, char **paths, int pathcnt) {
 
         /* Wait for all messages to be transmitted */
         conf.run = 1;
-        while (conf.run && rd_kafka_outq_len(conf.rk))
+        while (conf.run && rd_kafka_outq_len(conf.rk)) {
                 rd_kafka_poll(conf.rk, 50);
 
+                if ((conf.flags & CONF_F_BENCH) && bench_report_due())
+                        bench_stats_report(0);
+        }
+
         rd_kafka_topic_destroy(conf.rkt);
         rd_kafka_destroy(conf.rk);
 
@@ -524,16 +1558,65 @@ static void producer_run (FILE *fp, char **paths, int pathcnt) {
                 conf.exitcode = 1;
 }
 
+/**
+ * Partition-parallel consumer worker (-C -j <threads>)
+ */
+struct consume_worker {
+        int               idx;
+        rd_thread_t       thr;
+        rd_kafka_queue_t *rkqu;  /**< Queue of the worker's partitions */
+        struct outbuf     ob;    /**< Worker's output buffer */
+};
+
+static struct {
+        struct consume_worker *workers;
+        int        cnt;          /**< Number of workers, 0 if the
+                                  *   consumer is single-threaded. */
+        rd_mutex_t stop_lock;    /**< Protects the ctopics stop state */
+        rd_mutex_t out_lock;     /**< Shared stdout lock */
+} consumers;
+
+
 static void stop_partition (rd_kafka_message_t *rkmessage) {
-        if (!part_stop[rkmessage->partition]) {
+        struct ctopic *ct = rd_kafka_topic_opaque(rkmessage->rkt);
+
+        if (!ct || !ct->part_stop)
+                return;
+
+        if (consumers.cnt > 0)
+                rd_mutex_lock(&consumers.stop_lock);
+
+        if (!ct->part_stop[rkmessage->partition]) {
                 /* Stop consuming this partition */
+                offsets_partition_stop(rkmessage->rkt, rkmessage->partition);
                 rd_kafka_consume_stop(rkmessage->rkt,
                                       rkmessage->partition);
-                part_stop[rkmessage->partition] = 1;
-                part_stop_cnt++;
-                if (part_stop_cnt >= part_stop_thres)
+                ct->part_stop[rkmessage->partition] = 1;
+                ctopics.stop_cnt++;
+                if (ctopics.stop_cnt >= ctopics.stop_thres)
                         conf.run = 0;
         }
+
+        if (consumers.cnt > 0)
+                rd_mutex_unlock(&consumers.stop_lock);
+}
+
+
+/**
+ * @brief Record the next offset of the consumed partition for the
+ *        lag statistics (-C).
+ */
+static void stats_partition_next (const rd_kafka_message_t *rkmessage) {
+        const struct ctopic *ct;
+
+        if (!stats.part_next ||
+            !(ct = rd_kafka_topic_opaque(rkmessage->rkt)) ||
+            rkmessage->partition >= ct->mdt->partition_cnt)
+                return;
+
+        rd_atomic64_store(&stats.part_next[ct->stats_base +
+                                           rkmessage->partition],
+                          rkmessage->offset + 1);
 }
 
 
@@ -564,16 +1647,16 @@ static void partition_not_eof (const rd_kafka_message_t *rkmessage) {
 /**
  * @brief Mark partition as at EOF
  */
-static void partition_at_eof (rd_kafka_message_t *rkmessage) {
+static void partition_at_eof (rd_kafka_message_t *rkmessage,
+                              struct outbuf *ob) {
 
         if (conf.mode == 'C') {
                 /* Store EOF offset.
                  * If partition is empty and at offset 0,
                  * store future first message (0). */
-                rd_kafka_offset_store(rkmessage->rkt,
-                                      rkmessage->partition,
-                                      rkmessage->offset == 0 ?
-                                      0 : rkmessage->offset-1);
+                offsets_mark(rkmessage,
+                             rkmessage->offset == 0 ?
+                             0 : rkmessage->offset-1, ob, NULL);
                 if (conf.exit_eof) {
                         stop_partition(rkmessage);
                 }
@@ -605,18 +1688,60 @@ static void partition_at_eof (rd_kafka_message_t *rkmessage) {
 }
 
 
+/**
+ * @brief Wait for the rate limiter (kafkacat.rate.*) to admit the
+ *        consumed message, writing the output that is due first.
+ */
+static void consumer_pace (struct outbuf *out,
+                           const rd_kafka_message_t *rkmessage) {
+        int64_t wait_us, due;
+
+        if ((wait_us = ratelimit_take(1, rkmessage->len +
+                                      rkmessage->key_len)) <= 0)
+                return;
+
+        due = rd_clock() + wait_us;
+
+        if (out)
+                outbuf_idle(out);
+
+        while (conf.run && (wait_us = due - rd_clock()) > 0)
+                rd_usleep(MIN(wait_us, 100 * 1000));
+}
+
+
+/**
+ * @brief Stop consuming the partition of \p rkmessage, which has
+ *        reached the stop timestamp at \p offset (-o e@..).
+ */
+static void partition_at_stop (rd_kafka_message_t *rkmessage,
+                               int64_t offset) {
+        stop_partition(rkmessage);
+        KC_INFO(1, "Reached stop timestamp for topic "
+                "%s [%"PRId32"] "
+                "at offset %"PRId64"%s\n",
+                rd_kafka_topic_name(rkmessage->rkt),
+                rkmessage->partition,
+                offset,
+                !conf.run ? ": exiting" : "");
+}
+
+
 /**
  * Consume callback, called for each message consumed.
  */
 static void consume_cb (rd_kafka_message_t *rkmessage, void *opaque) {
-        FILE *fp = opaque;
+        struct outbuf *ob = opaque;
+        struct outbuf *out = ob;
+        int64_t stop_offset = -1;
+        uint64_t rx;
 
         if (!conf.run)
                 return;
 
         if (rkmessage->err) {
                 if (rkmessage->err == RD_KAFKA_RESP_ERR__PARTITION_EOF) {
-                        partition_at_eof(rkmessage);
+                        partition_at_eof(rkmessage, ob);
                         return;
                 }
 
@@ -634,33 +1759,106 @@ static void consume_cb (rd_kafka_message_t *rkmessage, void *opaque) {
         }
 
         if (conf.stopts) {
-                int64_t ts = rd_kafka_message_timestamp(rkmessage, NULL);
-                if (ts >= conf.stopts) {
-                        stop_partition(rkmessage);
-                        KC_INFO(1, "Reached stop timestamp for topic "
-                                "%s [%"PRId32"] "
-                                "at offset %"PRId64"%s\n",
-                                rd_kafka_topic_name(rkmessage->rkt),
-                                rkmessage->partition,
-                                rkmessage->offset,
-                                !conf.run ? ": exiting" : "");
+                const struct ctopic *ct = rd_kafka_topic_opaque(
+                        rkmessage->rkt);
+
+                /* Messages of stopped partitions that were already
+                 * fetched. */
+                if (ct && ct->part_stop &&
+                    ct->part_stop[rkmessage->partition])
+                        return;
+
+                /* Stop at the first message at or after the stop
+                 * timestamp: by its offset if it is known, so that the
+                 * partition is stopped after the last message before
+                 * it rather than once it has been fetched, or else by
+                 * the message timestamps. */
+                stop_offset = ct && ct->end_offsets ?
+                        ct->end_offsets[rkmessage->partition] : -1;
+
+                if (stop_offset >= 0 ?
+                    rkmessage->offset >= stop_offset :
+                    rd_kafka_message_timestamp(rkmessage, NULL) >=
+                    conf.stopts) {
+                        partition_at_stop(rkmessage, rkmessage->offset);
                         return;
                 }
         }
 
-        /* Print message */
-        fmt_msg_output(fp, rkmessage);
+        /* Drop messages not matching the filters before they are
+         * counted, decoded or formatted, but do store their offsets. */
+        if (conf.filter_cnt && !filter_match(rkmessage)) {
+                stats_partition_next(rkmessage);
+                offsets_mark(rkmessage, rkmessage->offset, ob, NULL);
+                if (rkmessage->offset + 1 == stop_offset)
+                        partition_at_stop(rkmessage, stop_offset);
+                return;
+        }
+
+        /* Claim the message's place in the -c count before output
+         * since multiple consumer threads may race for the last one. */
+        rx = rd_atomic64_add(&stats.rx, 1);
+        if (conf.msg_cnt > 0 && rx > (uint64_t)conf.msg_cnt)
+                return;
+
+        if ((conf.flags & CONF_F_BENCH) || conf.stats_interval_ms)
+                rd_atomic64_add(&stats.rx_bytes, rkmessage->len);
+
+        stats_partition_next(rkmessage);
+
+        if (conf.flags & CONF_F_BENCH) {
+                /* Measure instead of output */
+                bench_consumed(rkmessage);
+        } else {
+                /* Print message, timing the formatter for the
+                 * statistics. */
+                int64_t ts = conf.stats_interval_ms ? rd_clock_ns() : 0;
+
+                if (conf.output_path)
+                        out = &outfile_get(rkmessage)->ob;
+
+                KC_INSTR_BEGIN(KC_STAGE_FORMAT);
+                fmt_msg_output(out, rkmessage);
+                KC_INSTR_END(KC_STAGE_FORMAT);
+
+                if (conf.stats_interval_ms)
+                        rd_atomic64_add(&stats.fmt_ns, rd_clock_ns() - ts);
+        }
+
+        offsets_mark(rkmessage, rkmessage->offset, ob, out);
+
+        if (rkmessage->offset + 1 == stop_offset)
+                partition_at_stop(rkmessage, stop_offset);
+
+        consumer_pace(out, rkmessage);
+
+        if (rx == (uint64_t)conf.msg_cnt) {
+                conf.run = 0;
+                rd_kafka_yield(conf.rk);
+        }
+}
+
 
-        if (conf.mode == 'C') {
-                rd_kafka_offset_store(rkmessage->rkt,
-                                      rkmessage->partition,
-                                      rkmessage->offset);
-        }
+/**
+ * @brief Consumer worker thread: consume and output the messages of
+ *        the worker's partitions.
+ */
+static rd_thread_ret_t RD_THREAD_CC consume_worker_main (void *arg) {
+        struct consume_worker *w = arg;
 
-        if (++stats.rx == (uint64_t)conf.msg_cnt) {
-                conf.run = 0;
-                rd_kafka_yield(conf.rk);
+        while (conf.run) {
+                rd_kafka_consume_callback_queue(w->rkqu, 100,
+                                                consume_cb, &w->ob);
+                offsets_store(&w->ob);
+
+                /* Flush output if no more messages arrive. */
+                outbuf_idle(&w->ob);
         }
+
+        outbuf_flush(&w->ob);
+        fmt_thread_term();
+
+        return 0;
 }
 
 
@@ -669,6 +1867,8 @@ static void throttle_cb (rd_kafka_t *rk, const char *broker_name,
                          int32_t broker_id, int throttle_time_ms, void *opaque){
         KC_INFO(1, "Broker %s (%"PRId32") throttled request for %dms\n",
                 broker_name, broker_id, throttle_time_ms);
+        rd_atomic64_add(&stats.throttle_ms, throttle_time_ms);
+        ratelimit_throttled(throttle_time_ms);
 }
 #endif
 
@@ -774,6 +1974,11 @@ static void rebalance_cb (rd_kafka_t *rk, rd_kafka_resp_err_t err,
                           void *opaque) {
         rd_kafka_resp_err_t ret_err = RD_KAFKA_RESP_ERR_NO_ERROR;
 
+        /* Store the offsets of the partitions before they are revoked
+         * and their offsets committed. */
+        if (err == RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS)
+                offsets_revoke();
+
 #if ENABLE_INCREMENTAL_ASSIGN
         if (!strcmp(rd_kafka_rebalance_protocol(rk), "COOPERATIVE")) {
                 incremental_rebalance_cb(rk, err, partitions, opaque);
@@ -834,7 +2039,65 @@ static void rebalance_cb (rd_kafka_t *rk, rd_kafka_resp_err_t err,
 /**
  * Run high-level KafkaConsumer, write messages to 'fp'
  */
-static void kafkaconsumer_run (FILE *fp, char *const *topics, int topic_cnt) {
+#if RD_KAFKA_VERSION >= 0x000902ff
+/**
+ * @brief Read messages from the consumer queue in batches of up to
+ *        kafkacat.consume.batch.size messages and write each batch's
+ *        output to 'ob' at once.
+ */
+static void kafkaconsumer_run_batched (struct outbuf *ob) {
+        rd_kafka_queue_t *rkqu = rd_kafka_queue_get_consumer(conf.rk);
+        rd_kafka_message_t **msgs;
+        int max = conf.consume_batch_size;
+
+        msgs = malloc(sizeof(*msgs) * max);
+
+        while (conf.run) {
+                ssize_t cnt, i;
+                size_t n = (size_t)max;
+
+                if ((conf.flags & CONF_F_BENCH) && bench_report_due())
+                        bench_stats_report(0);
+
+                /* With kafkacat.offset.store=message the consumer
+                 * stores the offsets of the messages it returns:
+                 * don't read past the -c count. */
+                if (conf.msg_cnt > 0 &&
+                    conf.offset_store == KC_OFFSET_STORE_MESSAGE) {
+                        uint64_t rx = rd_atomic64_load(&stats.rx);
+                        if (rx < (uint64_t)conf.msg_cnt &&
+                            (uint64_t)conf.msg_cnt - rx < n)
+                                n = (size_t)(conf.msg_cnt - rx);
+                }
+
+                cnt = rd_kafka_consume_batch_queue(rkqu, 100, msgs, n);
+                if (cnt == -1)
+                        KC_FATAL("Failed to consume: %s",
+                                 rd_kafka_err2str(rd_kafka_last_error()));
+
+                outbuf_batch_begin(ob);
+                for (i = 0 ; i < cnt ; i++) {
+                        consume_cb(msgs[i], ob);
+                        rd_kafka_message_destroy(msgs[i]);
+                }
+                outbuf_batch_end(ob);
+
+                if (cnt > 0)
+                        offsets_store(ob);
+
+                /* Flush output if we've caught up. */
+                if ((size_t)cnt < n)
+                        outbuf_idle(ob);
+        }
+
+        free(msgs);
+        rd_kafka_queue_destroy(rkqu);
+}
+#endif
+
+
+static void kafkaconsumer_run (struct outbuf *ob,
+                               char *const *topics, int topic_cnt) {
         char    errstr[512];
         rd_kafka_resp_err_t err;
         rd_kafka_topic_partition_list_t *topiclist;
@@ -844,6 +2107,13 @@ static void kafkaconsumer_run (FILE *fp, char *const *topics, int topic_cnt) {
         rd_kafka_conf_set_default_topic_conf(conf.rk_conf, conf.rkt_conf);
         conf.rkt_conf = NULL;
 
+        /* Offsets are stored by kafkacat once output, see offsets.h */
+        if (conf.offset_store != KC_OFFSET_STORE_MESSAGE &&
+            rd_kafka_conf_set(conf.rk_conf, "enable.auto.offset.store",
+                              "false", errstr, sizeof(errstr)) !=
+            RD_KAFKA_CONF_OK)
+                KC_FATAL("%s", errstr);
+
         /* Create consumer */
         if (!(conf.rk = rd_kafka_new(RD_KAFKA_CONSUMER, conf.rk_conf,
                                      errstr, sizeof(errstr))))
@@ -854,6 +2124,8 @@ static void kafkaconsumer_run (FILE *fp, char *const *topics, int topic_cnt) {
          * serve both queues with a single consumer_poll() call. */
         rd_kafka_poll_set_consumer(conf.rk);
 
+        offsets_init();
+
         if (conf.debug)
                 rd_kafka_set_log_level(conf.rk, LOG_DEBUG);
         else if (conf.verbosity == 0)
@@ -873,19 +2145,39 @@ static void kafkaconsumer_run (FILE *fp, char *const *topics, int topic_cnt) {
 
         rd_kafka_topic_partition_list_destroy(topiclist);
 
-        /* Read messages from Kafka, write to 'fp'. */
+#if RD_KAFKA_VERSION >= 0x000902ff
+        if (conf.consume_batch_size > 1) {
+                kafkaconsumer_run_batched(ob);
+                goto done;
+        }
+#endif
+
+        /* Read messages from Kafka, write to 'ob'. */
         while (conf.run) {
                 rd_kafka_message_t *rkmessage;
 
+                if ((conf.flags & CONF_F_BENCH) && bench_report_due())
+                        bench_stats_report(0);
+
                 rkmessage = rd_kafka_consumer_poll(conf.rk, 100);
-                if (!rkmessage)
+                if (!rkmessage) {
+                        outbuf_idle(ob);
                         continue;
+                }
 
-                consume_cb(rkmessage, fp);
+                consume_cb(rkmessage, ob);
 
                 rd_kafka_message_destroy(rkmessage);
+
+                offsets_store(ob);
         }
 
+#if RD_KAFKA_VERSION >= 0x000902ff
+ done:
+#endif
+        /* Store the final offsets before they are committed. */
+        offsets_term();
+
         if ((err = rd_kafka_consumer_close(conf.rk)))
                 KC_FATAL("Failed to close consumer: %s\n",
                          rd_kafka_err2str(err));
@@ -903,56 +2195,405 @@ static void kafkaconsumer_run (FILE *fp, char *const *topics, int topic_cnt) {
 #endif
 
 /**
- * Get offsets from conf.startts for consumer_run
+ * Get the start offsets (from conf.startts) and stop offsets (from
+ * conf.stopts) of all consumed topics' partitions for consumer_run,
+ * with one query per partition leader for both.
  */
-static int64_t *get_offsets (rd_kafka_metadata_topic_t *topic) {
-        int i;
-        int64_t *offsets;
+static void get_offsets (const rd_kafka_metadata_t *metadata) {
+        int i, j, l;
         rd_kafka_resp_err_t err;
-        rd_kafka_topic_partition_list_t *rktparlistp =
-                rd_kafka_topic_partition_list_new(1);
-
-        for (i = 0 ; i < topic->partition_cnt ; i++) {
-                int32_t partition = topic->partitions[i].id;
+        rd_kafka_topic_partition_list_t *lists[2];
+        const int64_t tss[2] = { conf.startts, conf.stopts };
+        int list_cnt = 0;
 
-                /* If -p <part> was specified: skip unwanted partitions */
-                if (conf.partition != RD_KAFKA_PARTITION_UA &&
-                    conf.partition != partition)
+        for (l = 0 ; l < 2 ; l++) {
+                if (!tss[l])
                         continue;
 
-                rd_kafka_topic_partition_list_add(
-                        rktparlistp,
-                        rd_kafka_topic_name(conf.rkt),
-                        partition)->offset = conf.startts;
+                lists[list_cnt] = rd_kafka_topic_partition_list_new(1);
 
-                if (conf.partition != RD_KAFKA_PARTITION_UA)
-                        break;
+                for (j = 0 ; j < ctopics.cnt ; j++) {
+                        struct ctopic *ct = ctopics.topics[j];
+                        const rd_kafka_metadata_topic_t *topic = ct->mdt;
+
+                        for (i = 0 ; i < topic->partition_cnt ; i++) {
+                                int32_t partition = topic->partitions[i].id;
+
+                                /* If -p <part> was specified: skip
+                                 * unwanted partitions */
+                                if (conf.partition !=
+                                    RD_KAFKA_PARTITION_UA &&
+                                    conf.partition != partition)
+                                        continue;
+
+                                rd_kafka_topic_partition_list_add(
+                                        lists[list_cnt], topic->topic,
+                                        partition)->offset = tss[l];
+                                lists[list_cnt]->elems[
+                                        lists[list_cnt]->cnt-1].opaque = ct;
+
+                                if (conf.partition != RD_KAFKA_PARTITION_UA)
+                                        break;
+                        }
+
+                        if (l == 0)
+                                ct->offsets = calloc(sizeof(int64_t),
+                                                     topic->partition_cnt);
+                        else
+                                ct->end_offsets = calloc(
+                                        sizeof(int64_t),
+                                        topic->partition_cnt);
+                }
+
+                list_cnt++;
         }
-        err = rd_kafka_offsets_for_times(conf.rk, rktparlistp,
-                                         conf.metadata_timeout * 1000);
+
+        err = offsets_for_times_by_leader(lists, list_cnt,
+                                          metadata->topics,
+                                          metadata->topic_cnt,
+                                          conf.metadata_timeout * 1000);
         if (err)
                 KC_FATAL("offsets_for_times failed: %s", rd_kafka_err2str(err));
 
-        offsets = calloc(sizeof(int64_t), topic->partition_cnt);
-        for (i = 0 ; i < rktparlistp->cnt ; i++) {
-                const rd_kafka_topic_partition_t *p = &rktparlistp->elems[i];
-                offsets[p->partition] = p->offset;
+        for (l = 0 ; l < list_cnt ; l++) {
+                /* The stop offsets are the last list */
+                int is_end = conf.stopts && l == list_cnt - 1;
+
+                for (i = 0 ; i < lists[l]->cnt ; i++) {
+                        const rd_kafka_topic_partition_t *p =
+                                &lists[l]->elems[i];
+                        struct ctopic *ct = p->opaque;
+
+                        if (p->err)
+                                KC_FATAL("Failed to get offset for "
+                                         "timestamp %"PRId64" of topic %s "
+                                         "[%"PRId32"]: %s",
+                                         is_end ? conf.stopts : conf.startts,
+                                         p->topic, p->partition,
+                                         rd_kafka_err2str(p->err));
+
+                        if (is_end)
+                                ct->end_offsets[p->partition] = p->offset;
+                        else
+                                ct->offsets[p->partition] = p->offset;
+                }
+
+                rd_kafka_topic_partition_list_destroy(lists[l]);
+        }
+}
+
+/**
+ * Consumer output (stdout)
+ */
+static struct outbuf consumer_out;
+
+
+/**
+ * @brief Write buffered consumer output when exiting, e.g., on
+ *        fatal error.
+ */
+static void consumer_output_atexit (void) {
+        int i;
+
+        for (i = 0 ; i < consumers.cnt ; i++)
+                outbuf_flush_atexit(&consumers.workers[i].ob);
+        outbuf_flush_atexit(&consumer_out);
+        if (conf.output_path)
+                outfiles_flush_atexit();
+}
+
+
+/**
+ * @brief Set up buffered consumer output to stdout.
+ *
+ * Unless configured, output to a terminal is flushed after each message
+ * and other output is flushed when the buffer is full or 100ms after
+ * the last flush.
+ */
+static void consumer_output_init (void) {
+        int fd = _COMPAT(fileno)(stdout);
+        int flush_ms = conf.output_flush_ms;
+
+        if (flush_ms == -1)
+                flush_ms = _COMPAT(isatty)(fd) ? 0 : 100;
+
+        /* Anything written through stdio must precede the messages. */
+        fflush(stdout);
+
+        outbuf_init(&consumer_out, fd, conf.output_buffer_size, flush_ms);
+
+        if (conf.output_compression != KC_COMPRESSION_NONE &&
+            !conf.output_path)
+                outbuf_set_codec(&consumer_out, outcodec_new(), 1/*owner*/);
+
+        if (conf.output_path)
+                outfiles_init();
+
+        atexit(consumer_output_atexit);
+}
+
+
+/**
+ * @brief Write any remaining consumer output and close output files.
+ */
+static void consumer_output_term (void) {
+        outbuf_destroy(&consumer_out);
+
+        if (conf.output_path)
+                outfiles_term();
+}
+
+
+/**
+ * @brief Create \p cnt consumer workers, each with its own queue and
+ *        output buffer: sharing the file descriptor of \p ob, or
+ *        writing to a file of its own (kafkacat.consume.output=worker).
+ */
+static void consume_workers_init (int cnt, struct outbuf *ob) {
+        int i;
+
+        if (conf.consume_output == KC_CONSUME_OUTPUT_WORKER &&
+            !conf.consume_output_path)
+                KC_FATAL("kafkacat.consume.output=worker requires "
+                         "kafkacat.consume.output.path");
+
+        /* Workers sharing the output write neither the binary dump
+         * header nor an index: write the header up front. */
+        if ((conf.flags & CONF_F_FMT_DUMP) &&
+            conf.consume_output != KC_CONSUME_OUTPUT_WORKER) {
+                dump_output_begin(ob, 1/*header*/, 0/*no index*/);
+                outbuf_flush(ob);
+        }
+
+        rd_mutex_init(&consumers.stop_lock);
+        rd_mutex_init(&consumers.out_lock);
+
+        consumers.workers = calloc(cnt, sizeof(*consumers.workers));
+
+        for (i = 0 ; i < cnt ; i++) {
+                struct consume_worker *w = &consumers.workers[i];
+                int flush_ms = (int)(ob->flush_us / 1000);
+
+                w->idx  = i;
+                w->rkqu = rd_kafka_queue_new(conf.rk);
+
+                if (conf.consume_output == KC_CONSUME_OUTPUT_WORKER) {
+                        char path[1024];
+                        int fd;
+
+                        snprintf(path, sizeof(path), "%s.%d",
+                                 conf.consume_output_path, i);
+                        if ((fd = _COMPAT(open)(path,
+                                                O_WRONLY|O_CREAT|O_TRUNC,
+                                                0644)) == -1)
+                                KC_FATAL("Failed to open %s: %s",
+                                         path, strerror(errno));
+
+                        outbuf_init(&w->ob, fd, ob->size, flush_ms);
+                        if (conf.output_compression != KC_COMPRESSION_NONE)
+                                outbuf_set_codec(&w->ob, outcodec_new(),
+                                                 1/*owner*/);
+
+                } else {
+                        if (conf.consume_output ==
+                            KC_CONSUME_OUTPUT_INTERLEAVED)
+                                flush_ms = 0;
+
+                        outbuf_init(&w->ob, ob->fd, ob->size, flush_ms);
+                        outbuf_set_lock(&w->ob, &consumers.out_lock);
+                        if (ob->codec)
+                                outbuf_set_codec(&w->ob, ob->codec, 0);
+                }
+        }
+
+        /* Now visible to stop_partition() and the atexit handler */
+        consumers.cnt = cnt;
+
+        KC_INFO(3, "Consuming using %d threads\n", cnt);
+}
+
+
+/**
+ * @brief Start the consumer worker threads.
+ */
+static void consume_workers_start (void) {
+        int i;
+
+        for (i = 0 ; i < consumers.cnt ; i++)
+                if (rd_thread_create(&consumers.workers[i].thr,
+                                     consume_worker_main,
+                                     &consumers.workers[i]) == -1)
+                        KC_FATAL("Failed to create consumer thread");
+}
+
+
+/**
+ * @brief Wait for the consumer worker threads to exit.
+ */
+static void consume_workers_join (void) {
+        int i;
+
+        for (i = 0 ; i < consumers.cnt ; i++)
+                rd_thread_join(consumers.workers[i].thr);
+}
+
+
+/**
+ * @brief Destroy the consumer workers' queues and output buffers,
+ *        the workers must have exited.
+ */
+static void consume_workers_destroy (void) {
+        int cnt = consumers.cnt;
+        int i;
+
+        consumers.cnt = 0;
+
+        for (i = 0 ; i < cnt ; i++) {
+                struct consume_worker *w = &consumers.workers[i];
+
+                rd_kafka_queue_destroy(w->rkqu);
+                outbuf_destroy(&w->ob);
+                if (conf.consume_output == KC_CONSUME_OUTPUT_WORKER)
+                        _COMPAT(close)(w->ob.fd);
+        }
+
+        free(consumers.workers);
+        consumers.workers = NULL;
+
+        rd_mutex_destroy(&consumers.stop_lock);
+        rd_mutex_destroy(&consumers.out_lock);
+}
+
+
+/**
+ * @returns the consumed topic \p name, or NULL if not (yet) consumed.
+ */
+static struct ctopic *ctopic_find (const char *name) {
+        int i;
+
+        for (i = 0 ; i < ctopics.cnt ; i++)
+                if (!strcmp(rd_kafka_topic_name(ctopics.topics[i]->rkt),
+                            name))
+                        return ctopics.topics[i];
+
+        return NULL;
+}
+
+
+/**
+ * @brief Create the topic handle of consumed topic \p name, with the
+ *        topic's struct ctopic as its opaque.
+ */
+static struct ctopic *ctopic_add (const char *name) {
+        struct ctopic *ct = calloc(1, sizeof(*ct));
+        rd_kafka_topic_conf_t *rkt_conf = rd_kafka_topic_conf_dup(
+                conf.rkt_conf);
+
+        rd_kafka_topic_conf_set_opaque(rkt_conf, ct);
+
+        if (!(ct->rkt = rd_kafka_topic_new(conf.rk, name, rkt_conf)))
+                KC_FATAL("Failed to create topic %s: %s", name,
+                         rd_kafka_err2str(rd_kafka_last_error()));
+
+        ctopics.topics = realloc(ctopics.topics,
+                                 sizeof(*ctopics.topics) * (ctopics.cnt + 1));
+        ctopics.topics[ctopics.cnt++] = ct;
+
+        return ct;
+}
+
+
+/**
+ * @brief Add the cluster's topics that match the -t ^regex topics.
+ */
+static void ctopics_add_matching (const rd_kafka_metadata_t *metadata) {
+#ifndef _MSC_VER
+        int i, j;
+
+        for (i = 0 ; i < conf.topic_cnt ; i++) {
+                regex_t re;
+                char errstr[256];
+                int r;
+
+                if (*conf.topics[i] != '^')
+                        continue;
+
+                if ((r = regcomp(&re, conf.topics[i],
+                                 REG_EXTENDED|REG_NOSUB))) {
+                        regerror(r, &re, errstr, sizeof(errstr));
+                        KC_FATAL("Invalid topic regex %s: %s",
+                                 conf.topics[i], errstr);
+                }
+
+                for (j = 0 ; j < metadata->topic_cnt ; j++) {
+                        const char *name = metadata->topics[j].topic;
+
+                        if (regexec(&re, name, 0, NULL, 0))
+                                continue;
+
+                        /* Matched by an earlier -t */
+                        if (ctopic_find(name))
+                                continue;
+
+                        KC_INFO(2, "Topic %s matches %s\n",
+                                name, conf.topics[i]);
+                        ctopic_add(name);
+                }
+
+                regfree(&re);
+        }
+#else
+        KC_FATAL("Topic regexes are not supported on this platform");
+#endif
+}
+
+
+/**
+ * @brief Destroy the consumed topics.
+ */
+static void ctopics_destroy (void) {
+        int i;
+
+        for (i = 0 ; i < ctopics.cnt ; i++) {
+                struct ctopic *ct = ctopics.topics[i];
+
+                rd_kafka_topic_destroy(ct->rkt);
+                if (ct->part_stop)
+                        free(ct->part_stop);
+                if (ct->offsets)
+                        free(ct->offsets);
+                if (ct->end_offsets)
+                        free(ct->end_offsets);
+                free(ct);
         }
-        rd_kafka_topic_partition_list_destroy(rktparlistp);
 
-        return offsets;
+        free(ctopics.topics);
+        memset(&ctopics, 0, sizeof(ctopics));
 }
 
+
 /**
- * Run consumer, consuming messages from Kafka and writing to 'fp'.
+ * Run consumer, consuming messages from Kafka and writing to 'ob'.
+ *
+ * All -t topics (and the cluster's topics matching -t ^regex's) are
+ * consumed by the one consumer instance: the metadata of all topics is
+ * requested at once and the wanted partitions are started on a shared
+ * queue, or with -j <threads> spread over the consumer worker threads
+ * which consume and output them in parallel.
  */
-static void consumer_run (FILE *fp) {
+static void consumer_run (struct outbuf *ob) {
         char    errstr[512];
         rd_kafka_resp_err_t err;
         const rd_kafka_metadata_t *metadata;
-        int i;
-        int64_t *offsets = NULL;
-        rd_kafka_queue_t *rkqu;
+        int i, j;
+        rd_kafka_queue_t *rkqu = NULL;
+        int part_cnt = 0;
+        int started = 0;
+        int regex_cnt = 0;
+        rd_kafka_topic_t **rkts;
+
+        /* Set up the metadata cache for the configured cluster */
+        mdcache_init(conf.rk_conf);
 
         /* Create consumer */
         if (!(conf.rk = rd_kafka_new(RD_KAFKA_CONSUMER, conf.rk_conf,
@@ -970,120 +2611,223 @@ static void consumer_run (FILE *fp) {
                                     errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK)
                 KC_FATAL("%s", errstr);
 
-        /* Create topic */
-        if (!(conf.rkt = rd_kafka_topic_new(conf.rk, conf.topic,
-                                            conf.rkt_conf)))
-                KC_FATAL("Failed to create topic %s: %s", conf.topic,
-                         rd_kafka_err2str(rd_kafka_last_error()));
+        /* Create the named topics, the regex topics are matched
+         * once the cluster's topics are known. */
+        for (i = 0 ; i < conf.topic_cnt ; i++) {
+                if (*conf.topics[i] == '^')
+                        regex_cnt++;
+                else if (!ctopic_find(conf.topics[i]))
+                        ctopic_add(conf.topics[i]);
+        }
 
         conf.rk_conf  = NULL;
+
+        /* Query broker (or the metadata cache) for the partitions of
+         * all the topics, or of all the cluster's topics for the
+         * regexes. */
+        rkts = malloc(sizeof(*rkts) * (ctopics.cnt + 1));
+        for (i = 0 ; i < ctopics.cnt ; i++)
+                rkts[i] = ctopics.topics[i]->rkt;
+        err = mdcache_metadata(conf.rk, regex_cnt > 0, rkts, ctopics.cnt,
+                               &metadata, conf.metadata_timeout * 1000);
+        free(rkts);
+        if (err)
+                KC_FATAL("Failed to query metadata for %d topic(s): %s",
+                         conf.topic_cnt, rd_kafka_err2str(err));
+
+        if (regex_cnt > 0) {
+                ctopics_add_matching(metadata);
+                if (ctopics.cnt == 0)
+                        KC_FATAL("No topics in cluster match the topic "
+                                 "regex(es)");
+        }
+
+        rd_kafka_topic_conf_destroy(conf.rkt_conf);
         conf.rkt_conf = NULL;
 
+        /* Look up each topic's metadata. Error handling */
+        for (i = 0 ; i < ctopics.cnt ; i++) {
+                struct ctopic *ct = ctopics.topics[i];
+                const char *name = rd_kafka_topic_name(ct->rkt);
 
-        /* Query broker for topic + partition information. */
-        if ((err = rd_kafka_metadata(conf.rk, 0, conf.rkt, &metadata,
-                                     conf.metadata_timeout * 1000)))
-                KC_FATAL("Failed to query metadata for topic %s: %s",
-                         rd_kafka_topic_name(conf.rkt), rd_kafka_err2str(err));
+                for (j = 0 ; j < metadata->topic_cnt ; j++)
+                        if (!strcmp(metadata->topics[j].topic, name))
+                                break;
 
-        /* Error handling */
-        if (metadata->topic_cnt == 0)
-                KC_FATAL("No such topic in cluster: %s",
-                         rd_kafka_topic_name(conf.rkt));
+                if (j == metadata->topic_cnt)
+                        KC_FATAL("No such topic in cluster: %s", name);
 
-        if ((err = metadata->topics[0].err))
-                KC_FATAL("Topic %s error: %s",
-                         rd_kafka_topic_name(conf.rkt), rd_kafka_err2str(err));
+                ct->mdt = &metadata->topics[j];
 
-        if (metadata->topics[0].partition_cnt == 0)
-                KC_FATAL("Topic %s has no partitions",
-                         rd_kafka_topic_name(conf.rkt));
+                if ((err = ct->mdt->err))
+                        KC_FATAL("Topic %s error: %s",
+                                 name, rd_kafka_err2str(err));
 
-        /* If Exit-at-EOF is enabled, set up array to track EOF
-         * state for each partition. */
-        if (conf.exit_eof || conf.stopts) {
-                part_stop = calloc(sizeof(*part_stop),
-                                   metadata->topics[0].partition_cnt);
+                if (ct->mdt->partition_cnt == 0)
+                        KC_FATAL("Topic %s has no partitions", name);
 
-                if (conf.partition != RD_KAFKA_PARTITION_UA)
-                        part_stop_thres = 1;
-                else
-                        part_stop_thres = metadata->topics[0].partition_cnt;
+                if (conf.partition != RD_KAFKA_PARTITION_UA &&
+                    conf.partition >= ct->mdt->partition_cnt)
+                        KC_FATAL("Topic %s (with partitions 0..%i): "
+                                 "partition %i does not exist",
+                                 name, ct->mdt->partition_cnt-1,
+                                 conf.partition);
+
+                part_cnt += conf.partition != RD_KAFKA_PARTITION_UA ? 1 :
+                        ct->mdt->partition_cnt;
+
+                /* If Exit-at-EOF is enabled, set up array to track EOF
+                 * state for each partition. */
+                if (conf.exit_eof || conf.stopts)
+                        ct->part_stop = calloc(sizeof(*ct->part_stop),
+                                               ct->mdt->partition_cnt);
+
+                /* Track consumed offsets for the lag statistics */
+                if (conf.stats_interval_ms)
+                        ct->stats_base = stats_partitions_add(
+                                name, ct->mdt->partition_cnt);
         }
 
+        if (conf.exit_eof || conf.stopts)
+                ctopics.stop_thres = part_cnt;
+
 #if RD_KAFKA_VERSION >= 0x00090300
-        if (conf.startts) {
-                offsets = get_offsets(&metadata->topics[0]);
-        }
+        if (conf.startts || conf.stopts)
+                get_offsets(metadata);
 #endif
 
-        /* Create a shared queue that combines messages from
-         * all wanted partitions. */
-        rkqu = rd_kafka_queue_new(conf.rk);
+        offsets_init();
+        for (i = 0 ; i < ctopics.cnt ; i++)
+                offsets_topic_add(ctopics.topics[i]->rkt,
+                                  ctopics.topics[i]->mdt->partition_cnt);
+
+        if (conf.threads > 1 && part_cnt > 1)
+                /* One queue per worker thread, combining messages from
+                 * the worker's partitions. */
+                consume_workers_init(MIN(conf.threads, part_cnt), ob);
+        else
+                /* Create a shared queue that combines messages from
+                 * all wanted partitions. */
+                rkqu = rd_kafka_queue_new(conf.rk);
 
         /* Start consuming from all wanted partitions. */
-        for (i = 0 ; i < metadata->topics[0].partition_cnt ; i++) {
-                int32_t partition = metadata->topics[0].partitions[i].id;
+        for (j = 0 ; j < ctopics.cnt ; j++) {
+                const struct ctopic *ct = ctopics.topics[j];
 
-                /* If -p <part> was specified: skip unwanted partitions */
-                if (conf.partition != RD_KAFKA_PARTITION_UA &&
-                    conf.partition != partition)
-                        continue;
+                for (i = 0 ; i < ct->mdt->partition_cnt ; i++) {
+                        int32_t partition = ct->mdt->partitions[i].id;
 
-                /* Start consumer for this partition */
-                if (rd_kafka_consume_start_queue(conf.rkt, partition,
-                                                 offsets ? offsets[i] :
-                                                 (conf.offset ==
-                                                  RD_KAFKA_OFFSET_INVALID ?
-                                                  RD_KAFKA_OFFSET_BEGINNING :
-                                                  conf.offset),
-                                                 rkqu) == -1)
-                        KC_FATAL("Failed to start consuming "
-                                 "topic %s [%"PRId32"]: %s",
-                                 conf.topic, partition,
-                                 rd_kafka_err2str(rd_kafka_last_error()));
+                        /* If -p <part> was specified: skip unwanted
+                         * partitions */
+                        if (conf.partition != RD_KAFKA_PARTITION_UA &&
+                            conf.partition != partition)
+                                continue;
 
-                if (conf.partition != RD_KAFKA_PARTITION_UA)
-                        break;
+                        /* Don't fetch from partitions without messages
+                         * between the start and stop timestamps. */
+                        if (ct->offsets && ct->end_offsets &&
+                            ct->end_offsets[partition] >= 0 &&
+                            (ct->offsets[partition] < 0 ||
+                             ct->offsets[partition] >=
+                             ct->end_offsets[partition])) {
+                                KC_INFO(1, "No messages between the start "
+                                        "and stop timestamps in topic %s "
+                                        "[%"PRId32"]\n",
+                                        rd_kafka_topic_name(ct->rkt),
+                                        partition);
+                                ct->part_stop[partition] = 1;
+                                if (++ctopics.stop_cnt >= ctopics.stop_thres)
+                                        conf.run = 0;
+                                continue;
+                        }
+
+                        /* Start consumer for this partition,
+                         * assigning partitions to workers round-robin. */
+                        if (rd_kafka_consume_start_queue(
+                                    ct->rkt, partition,
+                                    ct->offsets ? ct->offsets[partition] :
+                                    (conf.offset == RD_KAFKA_OFFSET_INVALID ?
+                                     RD_KAFKA_OFFSET_BEGINNING :
+                                     conf.offset),
+                                    consumers.cnt > 0 ?
+                                    consumers.workers[started++ %
+                                                      consumers.cnt].rkqu :
+                                    rkqu) == -1)
+                                KC_FATAL("Failed to start consuming "
+                                         "topic %s [%"PRId32"]: %s",
+                                         rd_kafka_topic_name(ct->rkt),
+                                         partition,
+                                         rd_kafka_err2str(
+                                                 rd_kafka_last_error()));
+                }
         }
-        free(offsets);
 
-        if (conf.partition != RD_KAFKA_PARTITION_UA &&
-            i == metadata->topics[0].partition_cnt)
-                KC_FATAL("Topic %s (with partitions 0..%i): "
-                         "partition %i does not exist",
-                         rd_kafka_topic_name(conf.rkt),
-                         metadata->topics[0].partition_cnt-1,
-                         conf.partition);
+        KC_INFO(2, "Consuming %d partition(s) of %d topic(s)\n",
+                part_cnt, ctopics.cnt);
 
 
-        /* Read messages from Kafka, write to 'fp'. */
-        while (conf.run) {
-                rd_kafka_consume_callback_queue(rkqu, 100,
-                                                consume_cb, fp);
+        if (consumers.cnt > 0) {
+                /* The workers read messages from Kafka and write them
+                 * to their output, while this thread polls for
+                 * errors, etc. */
+                consume_workers_start();
+
+                while (conf.run) {
+                        rd_kafka_poll(conf.rk, 100);
+
+                        if ((conf.flags & CONF_F_BENCH) &&
+                            bench_report_due())
+                                bench_stats_report(0);
+                }
+
+                consume_workers_join();
+
+        } else {
+                /* Read messages from Kafka, write to 'ob'. */
+                while (conf.run) {
+                        rd_kafka_consume_callback_queue(rkqu, 100,
+                                                        consume_cb, ob);
+                        offsets_store(ob);
 
-                /* Poll for errors, etc */
-                rd_kafka_poll(conf.rk, 0);
+                        /* Flush output if no more messages arrive. */
+                        outbuf_idle(ob);
+
+                        /* Poll for errors, etc */
+                        rd_kafka_poll(conf.rk, 0);
+
+                        if ((conf.flags & CONF_F_BENCH) &&
+                            bench_report_due())
+                                bench_stats_report(0);
+                }
         }
 
+        /* Store the final offsets before they are committed. */
+        offsets_term();
+
         /* Stop consuming */
-        for (i = 0 ; i < metadata->topics[0].partition_cnt ; i++) {
-                int32_t partition = metadata->topics[0].partitions[i].id;
+        for (j = 0 ; j < ctopics.cnt ; j++) {
+                const struct ctopic *ct = ctopics.topics[j];
 
-                /* If -p <part> was specified: skip unwanted partitions */
-                if (conf.partition != RD_KAFKA_PARTITION_UA &&
-                    conf.partition != partition)
-                        continue;
+                for (i = 0 ; i < ct->mdt->partition_cnt ; i++) {
+                        int32_t partition = ct->mdt->partitions[i].id;
 
-                /* Dont stop already stopped partitions */
-                if (!part_stop || !part_stop[partition])
-                        rd_kafka_consume_stop(conf.rkt, partition);
+                        /* If -p <part> was specified: skip unwanted
+                         * partitions */
+                        if (conf.partition != RD_KAFKA_PARTITION_UA &&
+                            conf.partition != partition)
+                                continue;
 
-                rd_kafka_consume_stop(conf.rkt, partition);
+                        /* Dont stop already stopped partitions */
+                        if (!ct->part_stop || !ct->part_stop[partition])
+                                rd_kafka_consume_stop(ct->rkt, partition);
+                }
         }
 
-        /* Destroy shared queue */
-        rd_kafka_queue_destroy(rkqu);
+        /* Destroy shared queue or the workers' queues */
+        if (consumers.cnt > 0)
+                consume_workers_destroy();
+        else
+                rd_kafka_queue_destroy(rkqu);
 
         /* Wait for outstanding requests to finish. */
         conf.run = 1;
@@ -1093,8 +2837,9 @@ static void consumer_run (FILE *fp) {
         if (conf.assignment)
                 rd_kafka_topic_partition_list_destroy(conf.assignment);
 
-        rd_kafka_metadata_destroy(metadata);
-        rd_kafka_topic_destroy(conf.rkt);
+        ctopics_destroy();
+        mdcache_metadata_destroy(metadata);
+        mdcache_term();
         rd_kafka_destroy(conf.rk);
 }
 
@@ -1103,8 +2848,11 @@ static void consumer_run (FILE *fp) {
  * Print metadata information
  */
 static void metadata_print (const rd_kafka_metadata_t *metadata,
-                            int32_t controllerid) {
+                            int32_t controllerid,
+                            const rd_kafka_topic_partition_list_t *lows,
+                            const rd_kafka_topic_partition_list_t *highs) {
         int i, j, k;
+        int n = 0;
 
         printf("Metadata for %s (from broker %"PRId32": %s):\n",
                conf.topic ? conf.topic : "all topics",
@@ -1152,6 +2900,23 @@ static void metadata_print (const rd_kafka_metadata_t *metadata,
                         for (k = 0 ; k < p->isr_cnt ; k++)
                                 printf("%s%"PRId32,
                                        k > 0 ? ",":"", p->isrs[k]);
+
+                        /* Watermarks, in the order of the metadata */
+                        if (lows) {
+                                const rd_kafka_topic_partition_t *lo, *hi;
+                                lo = &lows->elems[n];
+                                hi = &highs->elems[n++];
+                                if (lo->err || hi->err)
+                                        printf(", watermarks: %s",
+                                               rd_kafka_err2str(
+                                                       lo->err ?
+                                                       lo->err : hi->err));
+                                else
+                                        printf(", low %"PRId64
+                                               ", high %"PRId64,
+                                               lo->offset, hi->offset);
+                        }
+
                         if (p->err)
                                 printf(", %s\n", rd_kafka_err2str(p->err));
                         else
@@ -1169,6 +2934,7 @@ static void metadata_list (void) {
         rd_kafka_resp_err_t err;
         const rd_kafka_metadata_t *metadata;
         int32_t controllerid = -1;
+        rd_kafka_topic_partition_list_t *lows = NULL, *highs = NULL;
 
         /* Create handle */
         if (!(conf.rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf.rk_conf,
@@ -1204,13 +2970,57 @@ static void metadata_list (void) {
         controllerid = rd_kafka_controllerid(conf.rk, 0);
 #endif
 
+#if RD_KAFKA_VERSION >= 0x00090300
+        /* Query the low and high watermarks of all partitions,
+         * with a batched request per leader. */
+        if (conf.metadata_watermarks) {
+                rd_kafka_topic_partition_list_t *lists[2];
+                int i, j;
+
+                for (j = 0 ; j < 2 ; j++)
+                        lists[j] = rd_kafka_topic_partition_list_new(
+                                metadata->topic_cnt);
+
+                for (i = 0 ; i < metadata->topic_cnt ; i++) {
+                        const rd_kafka_metadata_topic_t *t =
+                                &metadata->topics[i];
+                        int k;
+
+                        for (k = 0 ; k < t->partition_cnt ; k++) {
+                                rd_kafka_topic_partition_list_add(
+                                        lists[0], t->topic,
+                                        t->partitions[k].id)->offset =
+                                        RD_KAFKA_OFFSET_BEGINNING;
+                                rd_kafka_topic_partition_list_add(
+                                        lists[1], t->topic,
+                                        t->partitions[k].id)->offset =
+                                        RD_KAFKA_OFFSET_END;
+                        }
+                }
+
+                if ((err = offsets_for_times_by_leader(
+                             lists, 2, metadata->topics, metadata->topic_cnt,
+                             conf.metadata_timeout * 1000)))
+                        KC_ERROR("Failed to query watermarks: %s",
+                                 rd_kafka_err2str(err));
+
+                lows  = lists[0];
+                highs = lists[1];
+        }
+#endif
+
         /* Print metadata */
 #if ENABLE_JSON
         if (conf.flags & CONF_F_FMT_JSON)
-                metadata_print_json(metadata, controllerid);
+                metadata_print_json(metadata, controllerid, lows, highs);
         else
 #endif
-                metadata_print(metadata, controllerid);
+                metadata_print(metadata, controllerid, lows, highs);
+
+        if (lows) {
+                rd_kafka_topic_partition_list_destroy(lows);
+                rd_kafka_topic_partition_list_destroy(highs);
+        }
 
         rd_kafka_metadata_destroy(metadata);
 
@@ -1279,12 +3089,15 @@ static void RD_NORETURN usage (const char *argv0, int exitcode,
         fprintf(out, "\n"
                 "General options:\n"
                 "  -C | -P | -L | -Q  Mode: Consume, Produce, Metadata List, Query mode\n"
+                "  -A                 Mode: Lag summary, see below\n"
 #if ENABLE_KAFKACONSUMER
                 "  -G <group-id>      Mode: High-level KafkaConsumer (Kafka >=0.9 balanced consumer groups)\n"
                 "                     Expects a list of topics to subscribe to\n"
 #endif
                 "  -t <topic>         Topic to consume from, produce to, "
                 "or list\n"
+                "                     (-C: may be specified multiple times,\n"
+                "                     ^<regex> consumes all matching topics)\n"
                 "  -p <partition>     Partition\n"
                 "  -b <brokers,..>    Bootstrap broker(s) (host[:port])\n"
                 "  -D <delim>         Message delimiter string:\n"
@@ -1314,11 +3127,18 @@ static void RD_NORETURN usage (const char *argv0, int exitcode,
                 "  -X schema.registry.prop=val Set libserdes configuration property "
                 "for the Avro/Schema-Registry client.\n"
 #endif
+                "  -X kafkacat.prop=val Set kafkacat property, "
+                "see \"kafkacat properties\" below.\n"
                 "  -X dump            Dump configuration and exit.\n"
                 "  -d <dbg1,...>      Enable librdkafka debugging:\n"
                 "                     " RD_KAFKA_DEBUG_CONTEXTS "\n"
                 "  -q                 Be quiet (verbosity set to 0)\n"
                 "  -v                 Increase verbosity\n"
+                "  -B                 Benchmark mode: produce synthetic\n"
+                "                     messages (-P), or consume without\n"
+                "                     output (-C, -G), and report throughput\n"
+                "                     and latency percentiles, see\n"
+                "                     kafkacat.bench.* properties\n"
                 "  -E                 Do not exit on non-fatal error\n"
                 "  -V                 Print version\n"
                 "  -h                 Print usage help\n"
@@ -1340,10 +3160,18 @@ static void RD_NORETURN usage (const char *argv0, int exitcode,
                 "  -c <cnt>           Exit after producing this number "
                 "of messages\n"
                 "  -Z                 Send empty messages as NULL messages\n"
+#if ENABLE_JSON
+                "  -J                 Read messages as JSON envelopes, as\n"
+                "                     output by the -J consumer, and produce\n"
+                "                     them with their key, partition (unless\n"
+                "                     -p), timestamp and headers\n"
+#endif
                 "  file1 file2..      Read messages from files.\n"
                 "                     With -l, only one file permitted.\n"
                 "                     Otherwise, the entire file contents will\n"
                 "                     be sent as one single message.\n"
+                "  -j <threads>       Open, map and produce files using this\n"
+                "                     many threads. Default: 1\n"
                 "  -X transactional.id=.. Enable transactions and send all\n"
                 "                     messages in a single transaction which\n"
                 "                     is committed when stdin is closed or the\n"
@@ -1363,6 +3191,9 @@ static void RD_NORETURN usage (const char *argv0, int exitcode,
 #endif
                 "  -e                 Exit successfully when last message "
                 "received\n"
+                "  -j <threads>       Consume and output partitions using this\n"
+                "                     many threads (-C only), see\n"
+                "                     kafkacat.consume.output. Default: 1\n"
                 "  -f <fmt..>         Output formatting string, see below.\n"
                 "                     Takes precedence over -D and -K.\n"
 #if ENABLE_JSON
@@ -1410,6 +3241,8 @@ static void RD_NORETURN usage (const char *argv0, int exitcode,
                 "\n"
                 "Metadata options (-L):\n"
                 "  -t <topic>         Topic to query (optional)\n"
+                "  -j <threads>       Query this many partition leaders in\n"
+                "                     parallel. Default: 16\n"
                 "\n"
                 "Query options (-Q):\n"
                 "  -t <t>:<p>:<ts>    Get offset for topic <t>,\n"
@@ -1419,6 +3252,223 @@ static void RD_NORETURN usage (const char *argv0, int exitcode,
                 "                     Requires broker >= 0.10.0.0 and librdkafka >= 0.9.3.\n"
                 "                     Multiple -t .. are allowed but a partition\n"
                 "                     must only occur once.\n"
+                "  -j <threads>       Query this many partition leaders in\n"
+                "                     parallel. Default: 16\n"
+                "\n"
+                "Lag options (-A):\n"
+                "  -A [-G <group>] <topic1> [<topic2> ..]\n"
+                "                     Print the lag of each partition of the\n"
+                "                     topics (also -t <topic>) and in total:\n"
+                "                     the high watermark minus the group's\n"
+                "                     committed offset, or minus the low\n"
+                "                     watermark without a committed offset.\n"
+                "                     Output is a table, or JSON with -J.\n"
+                "  -j <threads>       Query this many partition leaders in\n"
+                "                     parallel. Default: 16\n"
+                "  -X kafkacat.lag.watch.ms=<ms> Refresh every this many\n"
+                "                     milliseconds, printing the partitions\n"
+                "                     whose lag changed.\n"
+                "\n"
+                "kafkacat properties (-X kafkacat.<prop>=<val>):\n"
+                "  input.chunk.size=<bytes> Producer: read input in chunks of\n"
+                "                     this size and produce messages directly from\n"
+                "                     the shared chunk buffer rather than\n"
+                "                     copying each message, e.g. 4194304.\n"
+                "                     Default: 0 (disabled)\n"
+                "  input.read.size=<bytes> Producer: maximum number of bytes\n"
+                "                     to read from non-chunked, non-mapped\n"
+                "                     input at a time. Default: 65536\n"
+                "  input.mmap=true|false Producer: memory map regular input\n"
+                "                     files (stdin or -l <file>) and produce\n"
+                "                     messages directly from the mapping.\n"
+                "                     Default: true\n"
+#if HAVE_ZSTD || HAVE_LZ4
+                "  input.compression=auto|none|zstd|lz4 Producer: decompress\n"
+                "                     the input stream, auto decompresses\n"
+                "                     -l <file> by its .zst or .lz4\n"
+                "                     extension. Default: auto\n"
+#endif
+                "  input.headers=<delim> Producer: each input message\n"
+                "                     starts with a column of comma-separated\n"
+                "                     name=value or name headers ending with\n"
+                "                     <delim>, which are added to the -H\n"
+                "                     headers, e.g., with input.headers='|':\n"
+                "                     trace=ab12,tenant=7|key:value\n"
+                "  produce.batch.size=<msgs> Producer: accumulate up to this\n"
+                "                     many messages and produce them with a\n"
+                "                     single produce_batch() call.\n"
+                "                     Not used with -H. Default: 0 (disabled)\n"
+                "  produce.batch.bytes=<bytes> Producer: flush the batch when\n"
+                "                     it holds this many key and value bytes.\n"
+                "                     Default: 1048576\n"
+                "  produce.batch.ms=<ms> Producer: flush the batch when its\n"
+                "                     first message is this old.\n"
+                "                     Default: 100\n"
+                "  produce.pipeline.depth=<msgs> Producer: parse input and\n"
+                "                     produce messages in separate threads,\n"
+                "                     passing up to this many messages\n"
+                "                     between them. Delivery reports are\n"
+                "                     served by a background thread.\n"
+                "                     Default: 0 (disabled)\n"
+                "  produce.files.ordered=true|false Producer: with -j, produce\n"
+                "                     files in the order given while still\n"
+                "                     opening and mapping them in parallel.\n"
+                "                     Default: true if -k is set, else false\n"
+                "  output.buffer.size=<bytes> Consumer: output buffer size,\n"
+                "                     output is written when the buffer is\n"
+                "                     full. Default: 65536\n"
+                "  output.flush.ms=<ms> Consumer: also write buffered output\n"
+                "                     this long after the last write,\n"
+                "                     0 writes every message.\n"
+                "                     Default: 0 for terminals and -u, else 100\n"
+                "  output.path=<template> Consumer: write each partition to\n"
+                "                     a file of its own rather than stdout.\n"
+                "                     %%t is replaced by the topic, %%p by the\n"
+                "                     partition, %%o by the first offset in\n"
+                "                     the file, e.g., dump/%%t/%%p-%%o.log\n"
+                "                     Missing directories are created.\n"
+                "  output.rotate.bytes=<bytes> Consumer: start a new file\n"
+                "                     when an output.path file reaches this\n"
+                "                     size. Requires %%o. Default: 0 (disabled)\n"
+                "  output.rotate.offsets=<cnt> Consumer: start a new file\n"
+                "                     every this many offsets.\n"
+                "                     Requires %%o. Default: 0 (disabled)\n"
+#if HAVE_FALLOCATE
+                "  output.preallocate=<bytes> Consumer: reserve this much\n"
+                "                     disk space for each output.path file\n"
+                "                     when it is opened. Default: 0 (disabled)\n"
+#endif
+#if HAVE_ZSTD || HAVE_LZ4
+                "  output.compression=none|zstd|lz4 Consumer: compress the\n"
+                "                     output stream (stdout or each file).\n"
+                "                     Default: none\n"
+                "  output.compression.level=<level> Consumer: compression\n"
+                "                     level. Default: 0 (codec's default)\n"
+                "  output.compression.threads=<cnt> Consumer: zstd worker\n"
+                "                     threads compressing the output.\n"
+                "                     Default: 0 (compress when writing)\n"
+#endif
+                "  offset.store=message|batch|flush Consumer: pass the\n"
+                "                     offsets of output messages to the\n"
+                "                     offset store (to be committed) per\n"
+                "                     message, per consumed batch, or once\n"
+                "                     their output has been written (flush).\n"
+                "                     Default: batch\n"
+                "  output.fsync=true|false Consumer: with offset.store=flush,\n"
+                "                     also fsync() the output file before\n"
+                "                     storing offsets. Default: false\n"
+#if ENABLE_KAFKACONSUMER
+                "  consume.batch.size=<msgs> Consumer: with -G, read up to\n"
+                "                     this many messages per call from the\n"
+                "                     consumer queue and write their output\n"
+                "                     at once, 1 polls per message.\n"
+                "                     Default: 1000\n"
+#endif
+                "  consume.output=partition|interleaved|worker Consumer: with\n"
+                "                     -C -j, how the worker threads write\n"
+                "                     their output: to stdout in buffered\n"
+                "                     message-aligned chunks (partition),\n"
+                "                     to stdout as each message is consumed\n"
+                "                     (interleaved), or to a file per worker\n"
+                "                     (worker). Messages of a partition are\n"
+                "                     always output in order.\n"
+                "                     Default: partition\n"
+                "  consume.output.path=<path> Consumer: worker output file\n"
+                "                     prefix for consume.output=worker,\n"
+                "                     worker N writes to <path>.N\n"
+                "  dump=true|false    Consumer: write messages in kafkacat's\n"
+                "                     binary dump format, retaining keys,\n"
+                "                     values, headers, timestamps, partitions\n"
+                "                     and offsets, instead of -f or -J.\n"
+                "                     Producer: restore a dump from stdin or\n"
+                "                     -l <file> to the original partitions\n"
+                "                     (unless -p), optionally only from\n"
+                "                     -o <offset>, -o s@<ts> or to -o e@<ts>.\n"
+                "                     Default: false\n"
+                "  dump.index.interval=<msgs> Consumer: index every this many\n"
+                "                     messages of a dump to stdout or a file\n"
+                "                     so that restores from an offset or\n"
+                "                     timestamp skip to the wanted messages.\n"
+                "                     Default: 1000, 0 disables the index\n"
+                "  rate.msgs=<msgs/s> Producer and consumer: limit the rate\n"
+                "                     of produced or consumed messages.\n"
+                "                     Default: 0 (unlimited)\n"
+                "  rate.bytes=<bytes/s> Producer and consumer: limit the rate\n"
+                "                     of key and value bytes.\n"
+                "                     Default: 0 (unlimited)\n"
+                "  rate.burst.ms=<ms> Allow bursts of this many milliseconds\n"
+                "                     worth of the rate limits. Default: 100\n"
+                "  rate.adaptive=true|false Lower the rate when a broker\n"
+                "                     throttles requests or the delivery\n"
+                "                     latency exceeds rate.adaptive.latency.ms\n"
+                "                     and raise it back towards the rate\n"
+                "                     limits (if any) otherwise.\n"
+                "                     Default: false\n"
+                "  rate.adaptive.latency.ms=<ms> Producer: target delivery\n"
+                "                     latency for rate.adaptive.\n"
+                "                     Default: 0 (four times the lowest\n"
+                "                     latency seen, at least 10ms)\n"
+                "  stats.interval.ms=<ms> Print statistics every this many\n"
+                "                     milliseconds: message and byte rates,\n"
+                "                     producer queue depth and QUEUE_FULL\n"
+                "                     retries, broker throttle time, consumer\n"
+                "                     lag per partition and formatting time\n"
+                "                     per message. Default: 0 (disabled)\n"
+                "  stats.output=<dest> Statistics destination: - (stderr),\n"
+                "                     a file (JSON lines, including\n"
+                "                     librdkafka's statistics), udp://host:port\n"
+                "                     (JSON datagrams) or statsd://host:port.\n"
+                "                     Default: -\n"
+                "  metadata.watermarks=true|false -L: also query the low\n"
+                "                     and high watermark offsets of each\n"
+                "                     partition. Default: false\n"
+#if ENABLE_AVRO
+                "  schema.cache=<dir> -s avro: keep the schemas fetched from\n"
+                "                     the schema registry in this directory\n"
+                "                     and load them from there rather than\n"
+                "                     from the registry\n"
+                "  schema.prefetch=true|false -s avro: fetch the latest\n"
+                "                     schemas of the topics' <topic>-key\n"
+                "                     and <topic>-value subjects in the\n"
+                "                     background on startup.\n"
+                "                     Default: false\n"
+#endif
+                "  metadata.cache=<path> -C: cache the topics' metadata in\n"
+                "                     this file and start consuming without\n"
+                "                     waiting for the metadata while the\n"
+                "                     cached metadata is fresh\n"
+                "  metadata.cache.ttl.ms=<ms> Time the cached metadata of\n"
+                "                     a topic is used. Default: 60000\n"
+                "  lag.watch.ms=<ms> -A: refresh the lag every this many\n"
+                "                     milliseconds. Default: 0 (once)\n"
+                "  filter=<field><op><value> Consumer: only output messages\n"
+                "                     matching this filter, and all other\n"
+                "                     filters if given more than once.\n"
+                "                     <field>: key, value, partition,\n"
+                "                     timestamp, header.<name> or\n"
+                "                     json.<path> (e.g., json.user.id, of\n"
+                "                     a JSON value). <op>: = != ^= (prefix)\n"
+                "                     ~= (contains), and < <= > >= for\n"
+                "                     numbers. <field> alone matches if\n"
+                "                     present.\n"
+#if ENABLE_INSTR
+                "  trace.path=<file> Write the timed producer and consumer\n"
+                "                     stages as Chrome trace events\n"
+                "                     (about:tracing) to this file.\n"
+                "                     -v -v -v prints a summary on exit.\n"
+#endif
+                "  bench.msg.size=<bytes> -B producer: message value size.\n"
+                "                     Default: 100\n"
+                "  bench.key.cnt=<keys> -B producer: number of distinct\n"
+                "                     message keys. Default: 0 (no keys)\n"
+                "  bench.compressibility=<percent> -B producer: how much of\n"
+                "                     each message is repeated text, the\n"
+                "                     rest is random bytes. Default: 50\n"
+                "  bench.rate=<msgs/s> -B producer: produce at this rate.\n"
+                "                     Default: 0 (as fast as possible)\n"
+                "  bench.report.ms=<ms> -B: print a report every this many\n"
+                "                     milliseconds, and a final report on exit.\n"
+                "                     Default: 1000, 0 for only the final report\n"
                 "\n"
                 "Format string tokens:\n"
                 "  %%s                 Message payload\n"
@@ -1480,6 +3530,9 @@ static void RD_NORETURN usage (const char *argv0, int exitcode,
                 "\n"
                 "Query offset by timestamp:\n"
                 "  kafkacat -Q -b broker -t <topic>:<partition>:<timestamp>\n"
+                "\n"
+                "Consumer group lag:\n"
+                "  kafkacat -A -b <broker> -G <group> <topic1> [topic2 ..]\n"
                 "\n",
                 conf.null_str
                 );
@@ -1629,6 +3682,497 @@ static void conf_dump (void) {
 }
 
 
+/**
+ * @brief Set a kafkacat-specific "kafkacat." prefixed configuration property.
+ *
+ * @returns -1 on failure or 0 on success.
+ */
+/**
+ * @brief Parse compression type \p val, \p allow_auto allows "auto".
+ *
+ * @returns the compression type, or -1 on error.
+ */
+static int compression_parse (const char *name, const char *val,
+                              int allow_auto,
+                              char *errstr, size_t errstr_size) {
+        if (!strcmp(val, "none"))
+                return KC_COMPRESSION_NONE;
+        else if (allow_auto && !strcmp(val, "auto"))
+                return KC_COMPRESSION_AUTO;
+        else if (!strcmp(val, "zstd")) {
+#if HAVE_ZSTD
+                return KC_COMPRESSION_ZSTD;
+#endif
+        } else if (!strcmp(val, "lz4")) {
+#if HAVE_LZ4
+                return KC_COMPRESSION_LZ4;
+#endif
+        } else {
+                snprintf(errstr, errstr_size,
+                         "kafkacat.%s expects %snone, zstd or lz4",
+                         name, allow_auto ? "auto, " : "");
+                return -1;
+        }
+
+        snprintf(errstr, errstr_size,
+                 "kafkacat.%s: kafkacat was built without %s support",
+                 name, val);
+        return -1;
+}
+
+
+/**
+ * @returns the compression type of the file \p path by its extension.
+ */
+static kc_compression_t compression_by_path (const char *path) {
+        const char *ext = strrchr(path, '.');
+
+        if (ext && (!strcmp(ext, ".zst") || !strcmp(ext, ".zstd")))
+                return KC_COMPRESSION_ZSTD;
+        else if (ext && !strcmp(ext, ".lz4"))
+                return KC_COMPRESSION_LZ4;
+        else
+                return KC_COMPRESSION_NONE;
+}
+
+
+static int try_kc_conf_set (const char *name, const char *val,
+                            char *errstr, size_t errstr_size) {
+        char *end;
+        long long v;
+
+        v = strtoll(val, &end, 10);
+
+        if (!strcmp(name, "input.chunk.size")) {
+                if (end == val || *end || v < 0) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a size in bytes "
+                                 "(0 to disable)", name);
+                        return -1;
+                }
+                conf.input_chunk_size = (size_t)v;
+
+        } else if (!strcmp(name, "input.read.size")) {
+                if (end == val || *end || v < 1) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a size in bytes", name);
+                        return -1;
+                }
+                conf.input_read_size = (size_t)v;
+
+        } else if (!strcmp(name, "input.mmap")) {
+                if (!strcmp(val, "true"))
+                        conf.input_mmap = 1;
+                else if (!strcmp(val, "false"))
+                        conf.input_mmap = 0;
+                else {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects true or false", name);
+                        return -1;
+                }
+
+        } else if (!strcmp(name, "metadata.watermarks")) {
+                if (!strcmp(val, "true"))
+                        conf.metadata_watermarks = 1;
+                else if (!strcmp(val, "false"))
+                        conf.metadata_watermarks = 0;
+                else {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects true or false", name);
+                        return -1;
+                }
+
+        } else if (!strcmp(name, "metadata.cache")) {
+                if (conf.metadata_cache)
+                        free(conf.metadata_cache);
+                conf.metadata_cache = *val ? strdup(val) : NULL;
+
+        } else if (!strcmp(name, "metadata.cache.ttl.ms")) {
+                if (end == val || *end || v < 0) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a time in "
+                                 "milliseconds", name);
+                        return -1;
+                }
+                conf.metadata_cache_ttl_ms = v;
+
+        } else if (!strcmp(name, "schema.cache")) {
+#if ENABLE_AVRO
+                if (conf.schema_cache)
+                        free(conf.schema_cache);
+                conf.schema_cache = *val ? strdup(val) : NULL;
+#else
+                snprintf(errstr, errstr_size,
+                         "kafkacat.%s requires Avro/Schema-Registry "
+                         "support", name);
+                return -1;
+#endif
+
+        } else if (!strcmp(name, "schema.prefetch")) {
+#if ENABLE_AVRO
+                if (!strcmp(val, "true"))
+                        conf.schema_prefetch = 1;
+                else if (!strcmp(val, "false"))
+                        conf.schema_prefetch = 0;
+                else {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects true or false", name);
+                        return -1;
+                }
+#else
+                snprintf(errstr, errstr_size,
+                         "kafkacat.%s requires Avro/Schema-Registry "
+                         "support", name);
+                return -1;
+#endif
+
+        } else if (!strcmp(name, "filter")) {
+                if (filter_add(val, errstr, errstr_size) == -1)
+                        return -1;
+
+        } else if (!strcmp(name, "lag.watch.ms")) {
+                if (end == val || *end || v < 0 || v > 86400000) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects an interval in "
+                                 "milliseconds (0 to disable)", name);
+                        return -1;
+                }
+                conf.lag_watch_ms = (int)v;
+
+        } else if (!strcmp(name, "input.compression")) {
+                int r = compression_parse(name, val, 1, errstr, errstr_size);
+                if (r == -1)
+                        return -1;
+                conf.input_compression = (kc_compression_t)r;
+
+        } else if (!strcmp(name, "input.headers")) {
+                if (!*val) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a delimiter", name);
+                        return -1;
+                }
+                if (conf.input_hdr_delim)
+                        free(conf.input_hdr_delim);
+                conf.input_hdr_delim = parse_delim(val);
+                conf.input_hdr_delim_size = strlen(conf.input_hdr_delim);
+
+        } else if (!strcmp(name, "produce.batch.size")) {
+                if (end == val || *end || v < 0 || v > INT_MAX) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a message count "
+                                 "(0 to disable)", name);
+                        return -1;
+                }
+                conf.produce_batch_size = (int)v;
+
+        } else if (!strcmp(name, "produce.batch.bytes")) {
+                if (end == val || *end || v < 1) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a size in bytes", name);
+                        return -1;
+                }
+                conf.produce_batch_bytes = (size_t)v;
+
+        } else if (!strcmp(name, "produce.batch.ms")) {
+                if (end == val || *end || v < 0 || v > INT_MAX) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a time in milliseconds",
+                                 name);
+                        return -1;
+                }
+                conf.produce_batch_ms = (int)v;
+
+        } else if (!strcmp(name, "produce.files.ordered")) {
+                if (!strcmp(val, "true"))
+                        conf.produce_files_ordered = 1;
+                else if (!strcmp(val, "false"))
+                        conf.produce_files_ordered = 0;
+                else {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects true or false", name);
+                        return -1;
+                }
+
+        } else if (!strcmp(name, "output.buffer.size")) {
+                if (end == val || *end || v < 1) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a size in bytes", name);
+                        return -1;
+                }
+                conf.output_buffer_size = (size_t)v;
+
+        } else if (!strcmp(name, "output.flush.ms")) {
+                if (end == val || *end || v < 0 || v > INT_MAX) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a time in milliseconds",
+                                 name);
+                        return -1;
+                }
+                conf.output_flush_ms = (int)v;
+
+        } else if (!strcmp(name, "output.path")) {
+                if (!*val) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a path template", name);
+                        return -1;
+                }
+                if (conf.output_path)
+                        free(conf.output_path);
+                conf.output_path = strdup(val);
+
+        } else if (!strcmp(name, "output.rotate.bytes") ||
+                   !strcmp(name, "output.rotate.offsets") ||
+                   !strcmp(name, "output.preallocate")) {
+                if (end == val || *end || v < 0) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a %s "
+                                 "(0 to disable)", name,
+                                 !strcmp(name, "output.rotate.offsets") ?
+                                 "number of offsets" : "size in bytes");
+                        return -1;
+                }
+                if (!strcmp(name, "output.rotate.bytes"))
+                        conf.output_rotate_bytes = (int64_t)v;
+                else if (!strcmp(name, "output.rotate.offsets"))
+                        conf.output_rotate_offsets = (int64_t)v;
+                else
+                        conf.output_preallocate = (int64_t)v;
+
+        } else if (!strcmp(name, "output.compression")) {
+                int r = compression_parse(name, val, 0, errstr, errstr_size);
+                if (r == -1)
+                        return -1;
+                conf.output_compression = (kc_compression_t)r;
+
+        } else if (!strcmp(name, "output.compression.level")) {
+                if (end == val || *end || v < INT_MIN || v > INT_MAX) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a compression level",
+                                 name);
+                        return -1;
+                }
+                conf.output_compression_level = (int)v;
+
+        } else if (!strcmp(name, "output.compression.threads")) {
+                if (end == val || *end || v < 0 || v > 256) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a thread count "
+                                 "between 0 and 256", name);
+                        return -1;
+                }
+                conf.output_compression_threads = (int)v;
+
+        } else if (!strcmp(name, "consume.batch.size")) {
+                if (end == val || *end || v < 1 || v > INT_MAX) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a message count", name);
+                        return -1;
+                }
+                conf.consume_batch_size = (int)v;
+
+        } else if (!strcmp(name, "offset.store")) {
+                if (!strcmp(val, "message"))
+                        conf.offset_store = KC_OFFSET_STORE_MESSAGE;
+                else if (!strcmp(val, "batch"))
+                        conf.offset_store = KC_OFFSET_STORE_BATCH;
+                else if (!strcmp(val, "flush"))
+                        conf.offset_store = KC_OFFSET_STORE_FLUSH;
+                else {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects message, batch "
+                                 "or flush", name);
+                        return -1;
+                }
+
+        } else if (!strcmp(name, "output.fsync")) {
+                if (!strcmp(val, "true"))
+                        conf.output_fsync = 1;
+                else if (!strcmp(val, "false"))
+                        conf.output_fsync = 0;
+                else {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects true or false", name);
+                        return -1;
+                }
+
+        } else if (!strcmp(name, "consume.output")) {
+                if (!strcmp(val, "partition"))
+                        conf.consume_output = KC_CONSUME_OUTPUT_PARTITION;
+                else if (!strcmp(val, "interleaved"))
+                        conf.consume_output = KC_CONSUME_OUTPUT_INTERLEAVED;
+                else if (!strcmp(val, "worker"))
+                        conf.consume_output = KC_CONSUME_OUTPUT_WORKER;
+                else {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects partition, "
+                                 "interleaved or worker", name);
+                        return -1;
+                }
+
+        } else if (!strcmp(name, "consume.output.path")) {
+                if (!*val) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a path", name);
+                        return -1;
+                }
+                if (conf.consume_output_path)
+                        free(conf.consume_output_path);
+                conf.consume_output_path = strdup(val);
+
+        } else if (!strcmp(name, "dump")) {
+                if (!strcmp(val, "true"))
+                        conf.flags |= CONF_F_FMT_DUMP;
+                else if (!strcmp(val, "false"))
+                        conf.flags &= ~CONF_F_FMT_DUMP;
+                else {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects true or false", name);
+                        return -1;
+                }
+
+        } else if (!strcmp(name, "dump.index.interval")) {
+                if (end == val || *end || v < 0 || v > INT_MAX) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a message count "
+                                 "(0 to disable)", name);
+                        return -1;
+                }
+                conf.dump_index_interval = (int)v;
+
+        } else if (!strcmp(name, "bench.msg.size")) {
+                if (end == val || *end || v < 0 || v > (1 << 30)) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a size in bytes "
+                                 "between 0 and %d", name, 1 << 30);
+                        return -1;
+                }
+                conf.bench_msg_size = (int)v;
+
+        } else if (!strcmp(name, "bench.key.cnt")) {
+                if (end == val || *end || v < 0 || v > INT_MAX) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a key count "
+                                 "(0 for no keys)", name);
+                        return -1;
+                }
+                conf.bench_key_cnt = (int)v;
+
+        } else if (!strcmp(name, "bench.compressibility")) {
+                if (end == val || *end || v < 0 || v > 100) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a percentage "
+                                 "between 0 and 100", name);
+                        return -1;
+                }
+                conf.bench_compressibility = (int)v;
+
+        } else if (!strcmp(name, "bench.rate")) {
+                if (end == val || *end || v < 0 || v > INT_MAX) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects messages per second "
+                                 "(0 for unlimited)", name);
+                        return -1;
+                }
+                conf.bench_rate = (int)v;
+
+        } else if (!strcmp(name, "bench.report.ms")) {
+                if (end == val || *end || v < 0 || v > INT_MAX) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects an interval in "
+                                 "milliseconds (0 for only the final report)",
+                                 name);
+                        return -1;
+                }
+                conf.bench_report_ms = (int)v;
+
+        } else if (!strcmp(name, "rate.msgs") ||
+                   !strcmp(name, "rate.bytes")) {
+                if (end == val || *end || v < 0) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a rate per second "
+                                 "(0 for unlimited)", name);
+                        return -1;
+                }
+                if (!strcmp(name, "rate.msgs"))
+                        conf.rate_msgs = (int64_t)v;
+                else
+                        conf.rate_bytes = (int64_t)v;
+
+        } else if (!strcmp(name, "rate.burst.ms")) {
+                if (end == val || *end || v < 0 || v > INT_MAX) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a duration in "
+                                 "milliseconds", name);
+                        return -1;
+                }
+                conf.rate_burst_ms = (int)v;
+
+        } else if (!strcmp(name, "rate.adaptive")) {
+                if (!strcmp(val, "true"))
+                        conf.rate_adaptive = 1;
+                else if (!strcmp(val, "false"))
+                        conf.rate_adaptive = 0;
+                else {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects true or false", name);
+                        return -1;
+                }
+
+        } else if (!strcmp(name, "rate.adaptive.latency.ms")) {
+                if (end == val || *end || v < 0 || v > INT_MAX) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a latency in "
+                                 "milliseconds (0 for automatic)", name);
+                        return -1;
+                }
+                conf.rate_latency_ms = (int)v;
+
+        } else if (!strcmp(name, "stats.interval.ms")) {
+                if (end == val || *end || v < 0 || v > 86400000) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects an interval in "
+                                 "milliseconds (0 to disable)", name);
+                        return -1;
+                }
+                conf.stats_interval_ms = (int)v;
+
+        } else if (!strcmp(name, "stats.output")) {
+                if (conf.stats_output)
+                        free(conf.stats_output);
+                conf.stats_output = strdup(val);
+
+        } else if (!strcmp(name, "trace.path")) {
+#if ENABLE_INSTR
+                if (conf.trace_path)
+                        free(conf.trace_path);
+                conf.trace_path = strdup(val);
+#else
+                snprintf(errstr, errstr_size,
+                         "kafkacat.%s requires kafkacat to be built with "
+                         "./configure --enable-instrumentation", name);
+                return -1;
+#endif
+
+        } else if (!strcmp(name, "produce.pipeline.depth")) {
+                if (end == val || *end || v < 0 || v > (1 << 24)) {
+                        snprintf(errstr, errstr_size,
+                                 "kafkacat.%s expects a message count "
+                                 "between 0 (disabled) and %d",
+                                 name, 1 << 24);
+                        return -1;
+                }
+                conf.produce_pipeline_depth = (int)v;
+
+        } else {
+                snprintf(errstr, errstr_size,
+                         "Unknown kafkacat property kafkacat.%s", name);
+                return -1;
+        }
+
+        return 0;
+}
+
+
 /**
  * @brief Try setting a config property. Provides "topic." fallthru.
  *
@@ -1639,6 +4183,11 @@ static int try_conf_set (const char *name, const char *val,
         rd_kafka_conf_res_t res = RD_KAFKA_CONF_UNKNOWN;
         size_t srlen = strlen("schema.registry.");
 
+        /* kafkacat's own properties */
+        if (!strncmp(name, "kafkacat.", strlen("kafkacat.")))
+                return try_kc_conf_set(name + strlen("kafkacat."), val,
+                                       errstr, errstr_size);
+
         /* Pass schema.registry. config to the serdes */
         if (!strncmp(name, "schema.registry.", srlen)) {
 #if ENABLE_AVRO
@@ -1902,6 +4451,236 @@ static int unittest_strnstr (void) {
         return fails;
 }
 
+
+/**
+ * @brief Microbenchmark of rd_strnstr() finding all occurrences of
+ *        single- and multi-byte needles in a synthetic haystack,
+ *        and scanning it for a needle that is not found.
+ */
+static int bench_strnstr (void) {
+        static const struct {
+                const char *name;
+                const char *needle;
+                size_t every;     /**< Needle every ~N bytes, 0 = never */
+        } tests[] = {
+                { "rd_strnstr/1", "\n", 128 },
+                { "rd_strnstr/7", ";;SEP;;", 128 },
+                { "rd_strnstr/7-nomatch", ";;SEP;;", 0 },
+                { NULL }
+        };
+        const size_t size = 1024*1024;
+        char *hay = malloc(size);
+        int i;
+
+        for (i = 0 ; tests[i].name ; i++) {
+                size_t nlen = strlen(tests[i].needle);
+                uint64_t cnt = 0, bytes = 0;
+                int64_t ts_start;
+                size_t of;
+
+                /* Near-misses (the needle's first byte) every 16 bytes */
+                for (of = 0 ; of < size ; of++)
+                        hay[of] = of % 16 == 15 ? tests[i].needle[0] :
+                                (char)('a' + of % 23);
+                if (tests[i].every)
+                        for (of = tests[i].every ; of + nlen < size ;
+                             of += tests[i].every + of % 61)
+                                memcpy(hay+of, tests[i].needle, nlen);
+
+                ts_start = rd_clock();
+                do {
+                        const char *p = hay, *end = hay + size;
+
+                        while ((p = rd_strnstr(p, (size_t)(end - p),
+                                               tests[i].needle, nlen))) {
+                                p += nlen;
+                                cnt++;
+                        }
+                        cnt++;
+                        bytes += size;
+                } while (!ubench_done(ts_start));
+
+                ubench_result(tests[i].name, cnt, bytes,
+                              rd_clock() - ts_start);
+        }
+
+        free(hay);
+
+        return 0;
+}
+
+
+/**
+ * @brief Verify msg_headers()' parsing of input header columns.
+ */
+static int unittest_msg_headers (void) {
+        static const struct {
+                const char *field;
+                const char *exp;  /* name[=value] per header, ' '-separated */
+        } tests[] = {
+                { "", "" },
+                { "a=1", "a=1" },
+                { "a=1,b=two,c", "a=1 b=two c" },
+                { "a=,=x,,b=x=y,", "a= b=x=y" },
+                { NULL },
+        };
+        int i;
+        int fails = 0;
+
+        for (i = 0 ; tests[i].field ; i++) {
+                rd_kafka_headers_t *hdrs;
+                char res[256];
+                size_t of = 0;
+                size_t j;
+                const char *name;
+                const void *val;
+                size_t size;
+
+                /* The field is not nul-terminated in the input buffer. */
+                hdrs = msg_headers(tests[i].field, strlen(tests[i].field));
+
+                res[0] = '\0';
+                for (j = 0 ; hdrs &&
+                             !rd_kafka_header_get_all(hdrs, j, &name,
+                                                      &val, &size) ; j++)
+                        of += snprintf(res+of, sizeof(res)-of, "%s%s%s%.*s",
+                                       j > 0 ? " " : "", name,
+                                       val ? "=" : "",
+                                       val ? (int)size : 0,
+                                       val ? (const char *)val : "");
+
+                if (strcmp(res, tests[i].exp)) {
+                        fprintf(stderr,
+                                "%s: FAILED: headers of \"%s\" are "
+                                "\"%s\", not \"%s\"\n",
+                                __FUNCTION__, tests[i].field,
+                                res, tests[i].exp);
+                        fails++;
+                }
+
+                if (hdrs)
+                        rd_kafka_headers_destroy(hdrs);
+        }
+
+        return fails;
+}
+
+/**
+ * @brief Verify delim_scan() against a naive search, both for the entire
+ *        buffer at once and when the buffer grows and is split
+ *        incrementally as it is in the producer's input path.
+ */
+static int unittest_delim_scan (void) {
+        static const char *delims[] = {
+                "\n", ";", "ab", "aba", ";KeyDel;", ":MyDilemma:",
+                "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", NULL
+        };
+        char buf[2048];
+        int i;
+        int fails = 0;
+
+        for (i = 0 ; delims[i] ; i++) {
+                const char *delim = delims[i];
+                size_t dsize = strlen(delim);
+                struct delim_scan ds, ids;
+                size_t of, exp_of = 0, base = 0, len = 0;
+                size_t j, seg, size;
+                int cnt = 0;
+
+                /* Fill buffer with partial, overlapping and full
+                 * delimiters so that matches and near-matches
+                 * straddle block boundaries. */
+                for (j = 0, seg = 0 ;
+                     j + (2 * dsize) + 1 < sizeof(buf) ; seg++) {
+                        size_t plen = (seg * 5) % dsize;
+
+                        memcpy(buf+j, delim, plen);
+                        j += plen;
+                        if (seg % 4 != 1)
+                                buf[j++] = (char)('x' + (seg % 3));
+                        if (seg % 3 == 0) {
+                                memcpy(buf+j, delim, dsize);
+                                j += dsize;
+                        }
+                }
+                size = j;
+
+                delim_scan_init(&ds, delim, dsize);
+                delim_scan_init(&ids, delim, dsize);
+
+                while (1) {
+                        const char *t;
+                        size_t iof;
+
+                        /* Naive reference search. */
+                        for (t = NULL ; exp_of + dsize <= size ;
+                             exp_of++) {
+                                if (!memcmp(buf+exp_of, delim, dsize)) {
+                                        t = buf+exp_of;
+                                        break;
+                                }
+                        }
+
+                        if (!delim_scan(&ds, buf, size, &of)) {
+                                if (t) {
+                                        fprintf(stderr,
+                                                "%s: FAILED: delim \"%s\": "
+                                                "expected match at %d\n",
+                                                __FUNCTION__, delim,
+                                                (int)exp_of);
+                                        fails++;
+                                }
+                                break;
+                        }
+
+                        if (!t || of != exp_of) {
+                                fprintf(stderr,
+                                        "%s: FAILED: delim \"%s\": "
+                                        "match at %d, expected %d\n",
+                                        __FUNCTION__, delim, (int)of,
+                                        t ? (int)exp_of : -1);
+                                fails++;
+                                break;
+                        }
+
+                        /* Incremental scan: feed the buffer in odd-sized
+                         * chunks and rebase at each match, like inbuf. */
+                        while (!delim_scan(&ids, buf+base, len, &iof)) {
+                                if (base + len == size)
+                                        break;
+                                len = MIN(len + 37, size - base);
+                        }
+
+                        if (base + iof != exp_of) {
+                                fprintf(stderr,
+                                        "%s: FAILED: delim \"%s\": "
+                                        "incremental match at %d, "
+                                        "expected %d\n",
+                                        __FUNCTION__, delim,
+                                        (int)(base + iof), (int)exp_of);
+                                fails++;
+                                break;
+                        }
+
+                        delim_scan_rebase(&ids, iof + dsize);
+                        len -= iof + dsize;
+                        base += iof + dsize;
+
+                        exp_of += dsize;
+                        cnt++;
+                }
+
+                if (cnt == 0) {
+                        fprintf(stderr, "%s: FAILED: delim \"%s\": "
+                                "no matches in test buffer\n",
+                                __FUNCTION__, delim);
+                        fails++;
+                }
+        }
+
+        return fails;
+}
+
 static int unittest_parse_delim (void) {
         struct {
                 const char *in;
@@ -1939,7 +4718,41 @@ static int unittest (void) {
         int r = 0;
 
         r += unittest_strnstr();
+        r += unittest_delim_scan();
         r += unittest_parse_delim();
+        r += unittest_msg_headers();
+        r += json_envelope_unittest();
+        r += fmt_unittest();
+        r += filter_unittest();
+        r += dump_unittest();
+        r += bench_unittest();
+        r += ratelimit_unittest();
+        r += mdcache_unittest();
+
+        return r;
+}
+
+
+/**
+ * @brief Run microbenchmarks (-U bench), printing a
+ *        "<name> <ns/op> <MB/s>" line per benchmark to stdout,
+ *        see ubench_result() and tests/bench.sh.
+ *
+ * @returns the number of failed benchmarks.
+ */
+static int bench (void) {
+        int r = 0;
+
+        printf("# kafkacat %s microbenchmarks (librdkafka %s)\n"
+               "# name ns/op MB/s\n",
+               KAFKACAT_VERSION, rd_kafka_version_str());
+
+        r += bench_strnstr() == -1;
+        r += inbuf_bench() == -1;
+        r += fmt_bench() == -1;
+#if ENABLE_AVRO
+        r += kc_avro_bench() == -1;
+#endif
 
         return r;
 }
@@ -1959,7 +4772,7 @@ static void add_header (const char *inp) {
 
         if (!conf.headers)
                 conf.headers = rd_kafka_headers_new(8);
-
+        conf.header_cnt++;
 
         err = rd_kafka_header_add(conf.headers,
                                   inp,
@@ -1984,11 +4797,12 @@ static void argparse (int argc, char **argv,
         char tmp_fmt[64];
         int do_conf_dump = 0;
         int conf_files_read = 0;
+        int threads_set = 0;
         int i;
 
         while ((opt = getopt(argc, argv,
-                             ":PCG:LQt:p:b:z:o:eED:K:k:H:Od:qvF:X:c:Tuf:ZlVh"
-                             "s:r:Jm:U")) != -1) {
+                             ":PCG:LQAt:p:b:z:o:eED:K:k:H:Od:qvF:X:c:Tuf:ZlVhj:"
+                             "s:r:Jm:UB")) != -1) {
                 switch (opt) {
                 case 'P':
                 case 'C':
@@ -1996,9 +4810,14 @@ static void argparse (int argc, char **argv,
                 case 'Q':
                         conf.mode = opt;
                         break;
+                case 'A':
+                        /* -G <group> only sets the lag mode's group */
+                        conf.mode = opt;
+                        break;
 #if ENABLE_KAFKACONSUMER
                 case 'G':
-                        conf.mode = opt;
+                        if (conf.mode != 'A')
+                                conf.mode = opt;
                         conf.group = optarg;
                         if (rd_kafka_conf_set(conf.rk_conf, "group.id", optarg,
                                               errstr, sizeof(errstr)) !=
@@ -2012,8 +4831,13 @@ static void argparse (int argc, char **argv,
                                         *rktparlistp = rd_kafka_topic_partition_list_new(1);
                                 add_topparoff("-t", *rktparlistp, optarg);
                                 conf.flags |= CONF_F_APIVERREQ;
-                        } else
+                        } else {
                                 conf.topic = optarg;
+                                conf.topics = realloc(conf.topics,
+                                                      sizeof(*conf.topics) *
+                                                      (conf.topic_cnt + 1));
+                                conf.topics[conf.topic_cnt++] = optarg;
+                        }
 
                         break;
                 case 'p':
@@ -2129,6 +4953,12 @@ static void argparse (int argc, char **argv,
                 case 'c':
                         conf.msg_cnt = strtoll(optarg, NULL, 10);
                         break;
+                case 'j':
+                        conf.threads = atoi(optarg);
+                        if (conf.threads < 1)
+                                KC_FATAL("-j <threads> must be at least 1");
+                        threads_set = 1;
+                        break;
                 case 'm':
                         conf.metadata_timeout = strtoll(optarg, NULL, 10);
                         break;
@@ -2154,6 +4984,7 @@ static void argparse (int argc, char **argv,
                         break;
                 case 'u':
                         setbuf(stdout, NULL);
+                        conf.output_flush_ms = 0;
                         break;
                 case 'F':
                         conf.flags |= CONF_F_NO_CONF_SEARCH;
@@ -2196,7 +5027,19 @@ static void argparse (int argc, char **argv,
                 }
                 break;
 
+                case 'B':
+                        conf.flags |= CONF_F_BENCH;
+                        break;
+
                 case 'U':
+                        if (optind < argc &&
+                            !strcmp(argv[optind], "bench")) {
+                                if (bench())
+                                        exit(1);
+                                else
+                                        exit(0);
+                        }
+
                         if (unittest())
                                 exit(1);
                         else
@@ -2249,8 +5092,14 @@ static void argparse (int argc, char **argv,
         }
 
 
-        if (!strchr("GLQ", conf.mode) && !conf.topic)
+        /* Offset queries are spread over the partition leaders */
+        if (strchr("ALQ", conf.mode) && !threads_set)
+                conf.threads = 16;
+
+        if (!strchr("AGLQ", conf.mode) && !conf.topic)
                 usage(argv[0], 1, "-t <topic> missing", 0);
+        else if (conf.topic_cnt > 1 && conf.mode != 'C')
+                usage(argv[0], 1, "multiple -t <topic>s require -C", 0);
         else if (conf.mode == 'Q' && !*rktparlistp)
                 usage(argv[0], 1,
                       "-t <topic>:<partition>:<offset_or_timestamp> missing",
@@ -2306,6 +5155,60 @@ static void argparse (int argc, char **argv,
         }
 
 
+        if (conf.flags & CONF_F_BENCH) {
+                if (!strchr("PCG", conf.mode))
+                        KC_FATAL("-B requires -P, -C or -G");
+
+                if (conf.flags & (CONF_F_FMT_DUMP|CONF_F_LINE|CONF_F_TEE))
+                        KC_FATAL("-B can't be combined with -l, -T "
+                                 "or -X kafkacat.dump=true");
+        }
+
+
+        if (conf.filter_cnt && !strchr("CG", conf.mode))
+                KC_FATAL("-X kafkacat.filter requires -C or -G");
+
+        if (conf.stats_interval_ms) {
+                if (!strchr("PCG", conf.mode))
+                        KC_FATAL("-X kafkacat.stats.interval.ms requires "
+                                 "-P, -C or -G");
+
+                stats_init();
+#if RD_KAFKA_VERSION >= 0x00090000
+                /* Count throttle time */
+                rd_kafka_conf_set_throttle_cb(conf.rk_conf, throttle_cb);
+#endif
+        }
+
+        if (conf.rate_msgs > 0 || conf.rate_bytes > 0 || conf.rate_adaptive) {
+                if (!strchr("PCG", conf.mode))
+                        KC_FATAL("-X kafkacat.rate.* requires "
+                                 "-P, -C or -G");
+
+                ratelimit_init();
+#if RD_KAFKA_VERSION >= 0x00090000
+                /* Adapt to broker throttling */
+                rd_kafka_conf_set_throttle_cb(conf.rk_conf, throttle_cb);
+#endif
+        }
+
+
+        if (conf.flags & CONF_F_FMT_DUMP) {
+                if ((conf.flags & CONF_F_FMT_JSON) ||
+                    (strchr("GC", conf.mode) &&
+                     (conf.pack[KC_MSG_FIELD_KEY] ||
+                      conf.pack[KC_MSG_FIELD_VALUE])))
+                        KC_FATAL("-X kafkacat.dump=true can't be combined "
+                                 "with -J or -s");
+
+                if (conf.mode == 'P' && conf.offset < 0 &&
+                    conf.offset != RD_KAFKA_OFFSET_INVALID &&
+                    conf.offset != RD_KAFKA_OFFSET_BEGINNING)
+                        KC_FATAL("Dump restore only supports absolute "
+                                 "-o <offset>s and -o s@/e@<timestamp>");
+        }
+
+
         /*
          * Verify and initialize Avro/SR
          */
@@ -2337,6 +5240,15 @@ static void argparse (int argc, char **argv,
 
                 /* Initialize Avro/Schema-Registry client */
                 kc_avro_init(NULL, NULL, NULL, NULL);
+
+                if (conf.schema_prefetch) {
+                        if (conf.topic_cnt > 0)
+                                kc_avro_prefetch(conf.topics,
+                                                 conf.topic_cnt);
+                        else if (conf.mode == 'G')
+                                kc_avro_prefetch(&argv[optind],
+                                                 argc - optind);
+                }
         }
 #endif
 
@@ -2441,17 +5353,30 @@ int main (int argc, char **argv) {
         argparse(argc, argv, &rktparlist);
 
         if (optind < argc) {
-                if (!strchr("PG", conf.mode))
+                if (!strchr("PGA", conf.mode))
                         usage(argv[0], 1,
                               "file/topic list only allowed in "
-                              "producer(-P)/kafkaconsumer(-G) mode", 0);
+                              "producer(-P)/kafkaconsumer(-G)/lag(-A) mode",
+                              0);
+                else if (conf.mode == 'P' && (conf.flags & CONF_F_BENCH))
+                        KC_FATAL("-B produces synthetic messages, "
+                                 "not files");
                 else if ((conf.flags & CONF_F_LINE) && argc - optind > 1)
                         KC_FATAL("Only one file allowed for line mode (-l)");
+                else if (conf.mode == 'P' &&
+                         (conf.flags & CONF_F_FMT_DUMP) &&
+                         !(conf.flags & CONF_F_LINE))
+                        KC_FATAL("Dump files must be restored with "
+                                 "-l <file>");
                 else if (conf.flags & CONF_F_LINE) {
                         in = fopen(argv[optind], "r");
                         if (in == NULL)
                                 KC_FATAL("Cannot open %s: %s", argv[optind],
                                       strerror(errno));
+
+                        if (conf.input_compression == KC_COMPRESSION_AUTO)
+                                conf.input_compression =
+                                        compression_by_path(argv[optind]);
                 }
         }
 
@@ -2461,11 +5386,21 @@ int main (int argc, char **argv) {
         signal(SIGPIPE, term);
 #endif
 
+        if (conf.flags & CONF_F_BENCH)
+                bench_start();
+
+#if ENABLE_INSTR
+        if (conf.verbosity >= 4 || conf.trace_path)
+                instr_init();
+#endif
+
         /* Run according to mode */
         switch (conf.mode)
         {
         case 'C':
-                consumer_run(stdout);
+                consumer_output_init();
+                consumer_run(&consumer_out);
+                consumer_output_term();
                 break;
 
 #if ENABLE_KAFKACONSUMER
@@ -2473,7 +5408,12 @@ int main (int argc, char **argv) {
                 if (conf.stopts || conf.startts)
                         KC_FATAL("-o ..@ timestamps can't be used "
                                  "with -G mode\n");
-                kafkaconsumer_run(stdout, &argv[optind], argc-optind);
+                if (conf.threads > 1)
+                        KC_FATAL("-j <threads> can't be used "
+                                 "with -G mode\n");
+                consumer_output_init();
+                kafkaconsumer_run(&consumer_out, &argv[optind], argc-optind);
+                consumer_output_term();
                 break;
 #endif
 
@@ -2496,18 +5436,69 @@ int main (int argc, char **argv) {
                 rd_kafka_topic_partition_list_destroy(rktparlist);
                 break;
 
+        case 'A':
+                if (conf.topic) {
+                        /* -t <topic> in addition to the arguments */
+                        char **topics = malloc(sizeof(*topics) *
+                                               (argc - optind + 1));
+                        topics[0] = conf.topic;
+                        memcpy(&topics[1], &argv[optind],
+                               sizeof(*topics) * (argc - optind));
+                        lag_run(topics, argc - optind + 1);
+                        free(topics);
+                } else
+                        lag_run(&argv[optind], argc - optind);
+                break;
+
         default:
                 usage(argv[0], 0, NULL, 0);
                 break;
         }
 
+        if (conf.stats_interval_ms)
+                stats_term();
+
+        ratelimit_term();
+        filter_term();
+
+#if ENABLE_INSTR
+        if (instr_enabled)
+                instr_term();
+#endif
+
+        if (conf.flags & CONF_F_BENCH) {
+                /* Produced messages referenced the message pool until
+                 * the producer was destroyed. */
+                bench_stats_report(1);
+                bench_term();
+        }
+
         if (conf.headers)
                 rd_kafka_headers_destroy(conf.headers);
 
+        if (conf.topics)
+                free(conf.topics);
+
         if (conf.key_delim)
                 free(conf.key_delim);
+        if (conf.input_hdr_delim)
+                free(conf.input_hdr_delim);
         if (conf.delim)
                 free(conf.delim);
+        if (conf.consume_output_path)
+                free(conf.consume_output_path);
+        if (conf.output_path)
+                free(conf.output_path);
+        if (conf.stats_output)
+                free(conf.stats_output);
+        if (conf.trace_path)
+                free(conf.trace_path);
+        if (conf.metadata_cache)
+                free(conf.metadata_cache);
+#if ENABLE_AVRO
+        if (conf.schema_cache)
+                free(conf.schema_cache);
+#endif
 
         if (in != stdin)
                 fclose(in);
@@ -82,6 +82,36 @@ typedef enum {
         KC_MSG_FIELD_CNT
 } kc_msg_field_t;
 
+/**
+ * @brief Output of the partition-parallel consumer (-C -j <threads>)
+ */
+typedef enum {
+        KC_CONSUME_OUTPUT_PARTITION,   /**< Workers write to stdout in
+                                        *   message-aligned chunks. */
+        KC_CONSUME_OUTPUT_INTERLEAVED, /**< Workers write each message to
+                                        *   stdout as it is consumed. */
+        KC_CONSUME_OUTPUT_WORKER,      /**< Workers write to a file each */
+} kc_consume_output_t;
+
+/**
+ * @brief Consumer offset store (see offsets.h)
+ */
+typedef enum {
+        KC_OFFSET_STORE_MESSAGE,  /**< Store each message's offset */
+        KC_OFFSET_STORE_BATCH,    /**< Store per consumed batch */
+        KC_OFFSET_STORE_FLUSH,    /**< Store once the output is written */
+} kc_offset_store_t;
+
+/**
+ * @brief Input and output stream compression
+ */
+typedef enum {
+        KC_COMPRESSION_NONE,
+        KC_COMPRESSION_ZSTD,
+        KC_COMPRESSION_LZ4,
+        KC_COMPRESSION_AUTO,   /**< Input: by file name extension */
+} kc_compression_t;
+
 struct conf {
         int     run;
         int     verbosity;
@@ -102,10 +132,15 @@ struct conf {
 #define CONF_F_FMT_AVRO_KEY   0x400 /* Convert key from Avro to JSON */
 #define CONF_F_FMT_AVRO_VALUE 0x800 /* Convert value from Avro to JSON  */
 #define CONF_F_SR_URL_SEEN    0x1000 /* schema.registry.url/-r seen */
+#define CONF_F_FMT_DUMP       0x2000 /* Binary dump format */
+#define CONF_F_BENCH          0x4000 /* -B: Benchmark mode */
         char   *delim;
         size_t  delim_size;
         char   *key_delim;
         size_t  key_delim_size;
+        char   *input_hdr_delim;  /**< Producer: input header column
+                                   *   delimiter, NULL = disabled. */
+        size_t  input_hdr_delim_size;
 
         struct {
                 fmt_type_t type;
@@ -119,10 +154,84 @@ struct conf {
         const char *pack[KC_MSG_FIELD_CNT];
 
         int     msg_size;
+        size_t  input_chunk_size; /**< Producer: chunked input mode
+                                   *   chunk size, 0 = disabled. */
+        size_t  input_read_size;  /**< Producer: input read size */
+        int     input_mmap;       /**< Producer: mmap regular input files */
+        kc_compression_t input_compression; /**< Producer: decompress
+                                             *   input. */
+        int     produce_batch_size;   /**< Producer: max messages per
+                                       *   produce_batch(), 0 = disabled */
+        size_t  produce_batch_bytes;  /**< Producer: max bytes per batch */
+        int     produce_batch_ms;     /**< Producer: max batch linger (ms) */
+        int     produce_pipeline_depth; /**< Producer: pipeline ring depth,
+                                         *   0 = disabled */
+        int     produce_files_ordered; /**< Producer: produce files in
+                                        *   order with -j,
+                                        *   -1 = if fixed key is set */
+        int     threads;          /**< -j <threads> */
+        size_t  output_buffer_size; /**< Consumer: output buffer size */
+        int     output_flush_ms;  /**< Consumer: output flush interval,
+                                   *   -1 = auto, 0 = every message. */
+        int     consume_batch_size; /**< Consumer: -G max messages per
+                                     *   consume_batch_queue(),
+                                     *   1 = poll per message. */
+        kc_offset_store_t offset_store; /**< Consumer: when to store
+                                         *   offsets. */
+        int     output_fsync;     /**< Consumer: fsync() output before
+                                   *   storing offsets. */
+        int64_t rate_msgs;        /**< Messages per second, 0 = unlimited */
+        int64_t rate_bytes;       /**< Bytes per second, 0 = unlimited */
+        int     rate_burst_ms;    /**< Rate limiter burst */
+        int     rate_adaptive;    /**< Adapt the rate to throttling and
+                                   *   delivery latency. */
+        int     rate_latency_ms;  /**< Adaptive target delivery latency,
+                                   *   0 = automatic. */
+        kc_consume_output_t consume_output; /**< Consumer: -j output */
+        char   *consume_output_path; /**< Consumer: -j worker output file
+                                      *   prefix. */
+        char   *output_path;      /**< Consumer: per-partition output
+                                   *   file path template. */
+        int64_t output_rotate_bytes;   /**< Consumer: rotate output files
+                                        *   at this size, 0 = disabled */
+        int64_t output_rotate_offsets; /**< Consumer: rotate output files
+                                        *   every this many offsets,
+                                        *   0 = disabled */
+        int64_t output_preallocate;    /**< Consumer: preallocate output
+                                        *   files, 0 = disabled */
+        kc_compression_t output_compression; /**< Consumer: compress
+                                              *   output. */
+        int     output_compression_level;   /**< 0 = codec's default */
+        int     output_compression_threads; /**< zstd worker threads */
+        int     dump_index_interval; /**< Consumer: binary dump index
+                                      *   entry every this many
+                                      *   messages, 0 = no index. */
+        int     bench_msg_size;   /**< -B producer: message size */
+        int     bench_key_cnt;    /**< -B producer: number of distinct
+                                   *   keys, 0 = no keys. */
+        int     bench_compressibility; /**< -B producer: percentage of
+                                        *   each message that is
+                                        *   repeated text. */
+        int     bench_rate;       /**< -B producer: messages per second,
+                                   *   0 = unlimited. */
+        int     bench_report_ms;  /**< -B: report interval, 0 = only
+                                   *   the final report. */
+        int     stats_interval_ms; /**< Statistics interval, 0 = disabled */
+        char   *stats_output;     /**< Statistics destination: path,
+                                   *   udp:// or statsd://, NULL = stderr */
+        char   *trace_path;       /**< Instrumentation trace file */
+        int     metadata_watermarks; /**< -L: query partition watermarks */
+        char   *metadata_cache;   /**< -C: metadata cache file */
+        int64_t metadata_cache_ttl_ms; /**< Metadata cache TTL */
+        int     lag_watch_ms;     /**< -A: refresh interval, 0 = once */
+        int     filter_cnt;       /**< Consumer filters, see filter.h */
         char   *brokers;
         char   *topic;
+        char  **topics;           /**< All -t topics (-C) */
+        int     topic_cnt;
         int32_t partition;
         rd_kafka_headers_t *headers;
+        size_t  header_cnt;       /**< Number of -H headers */
         char   *group;
         char   *fixed_key;
         int32_t fixed_key_len;
@@ -154,12 +263,41 @@ struct conf {
 #if ENABLE_AVRO
         serdes_conf_t *srconf;
         char   *schema_registry_url;
+        char   *schema_cache;     /**< Avro schema cache directory */
+        int     schema_prefetch;  /**< Prefetch the topics' schemas */
 #endif
 };
 
 extern struct conf conf;
 
 
+/**
+ * Counters, reported by -B and -X kafkacat.stats.interval.ms.
+ */
+struct stats {
+        uint64_t tx;
+        uint64_t tx_err_q;      /**< Produce retries on QUEUE_FULL */
+        uint64_t tx_err_dr;
+        uint64_t tx_delivered;
+        uint64_t tx_bytes;      /**< Delivered bytes */
+
+        uint64_t rx;
+        uint64_t rx_bytes;      /**< Consumed bytes (-B, stats) */
+        uint64_t fmt_ns;        /**< Time spent formatting consumed
+                                 *   messages (stats) */
+
+        uint64_t throttle_ms;   /**< Broker throttle time */
+
+        int64_t *part_next;     /**< -C: next offset per topic partition,
+                                 *   -1 if unknown (stats), see
+                                 *   stats_partitions_add() */
+        char   **part_topic;    /**< -C: topic of each part_next element */
+        int      part_cnt;      /**< Number of part_next elements */
+};
+
+extern struct stats stats;
+
+
 void RD_NORETURN fatal0 (const char *func, int line,
                          const char *fmt, ...);
 
@@ -178,17 +316,36 @@ void error0 (int erroronexit, const char *func, int line,
 
 
 
+/*
+ * stats.c
+ */
+void stats_init (void);
+void stats_term (void);
+int stats_partitions_add (const char *topic, int cnt);
+
+
+/*
+ * lag.c
+ */
+void lag_run (char **topics, int topic_cnt);
+
+
 /*
  * format.c
  */
 void pack_check (const char *what, const char *fmt);
 
-void fmt_msg_output (FILE *fp, const rd_kafka_message_t *rkmessage);
+struct outbuf;
+void fmt_msg_output (struct outbuf *ob, const rd_kafka_message_t *rkmessage);
 
 void fmt_parse (const char *fmt);
 
 void fmt_init (void);
 void fmt_term (void);
+void fmt_thread_term (void);
+
+int fmt_unittest (void);
+int fmt_bench (void);
 
 
 
@@ -196,11 +353,20 @@ void fmt_term (void);
 /*
  * json.c
  */
-void fmt_msg_output_json (FILE *fp, const rd_kafka_message_t *rkmessage);
+void fmt_msg_output_json (struct outbuf *ob,
+                          const rd_kafka_message_t *rkmessage);
 void metadata_print_json (const struct rd_kafka_metadata *metadata,
-                          int32_t controllerid);
+                          int32_t controllerid,
+                          const rd_kafka_topic_partition_list_t *lows,
+                          const rd_kafka_topic_partition_list_t *highs);
 void partition_list_print_json (const rd_kafka_topic_partition_list_t *parts,
                                 void *json_gen);
+void lag_print_json (const char *group,
+                     const rd_kafka_topic_partition_list_t *highs,
+                     const rd_kafka_topic_partition_list_t *lows,
+                     const rd_kafka_topic_partition_list_t *committed,
+                     const int64_t *lag, const rd_kafka_resp_err_t *errs,
+                     int64_t total);
 void fmt_init_json (void);
 void fmt_term_json (void);
 int  json_can_emit_verbatim (void);
@@ -210,14 +376,18 @@ int  json_can_emit_verbatim (void);
 /*
  * avro.c
  */
-char *kc_avro_to_json (const void *data, size_t data_len, int *schema_idp,
-                       char *errstr, size_t errstr_size);
+const char *kc_avro_to_json (const void *data, size_t data_len,
+                             int *schema_idp, size_t *json_lenp,
+                             char *errstr, size_t errstr_size);
 
 void kc_avro_init (const char *key_schema_name,
                    const char *key_schema_path,
                    const char *value_schema_name,
                    const char *value_schema_path);
+void kc_avro_prefetch (char * const *topics, int topic_cnt);
 void kc_avro_term (void);
+void kc_avro_thread_term (void);
+int kc_avro_bench (void);
 #endif
 
 
@@ -225,3 +395,10 @@ void kc_avro_term (void);
  * tools.c
  */
 int query_offsets_by_time (rd_kafka_topic_partition_list_t *offsets);
+#if RD_KAFKA_VERSION >= 0x00090300
+rd_kafka_resp_err_t
+offsets_for_times_by_leader (rd_kafka_topic_partition_list_t **lists,
+                             int list_cnt,
+                             const rd_kafka_metadata_topic_t *topics,
+                             int topic_cnt, int timeout_ms);
+#endif
@@ -0,0 +1,399 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Consumer lag summary mode (-A)
+ *
+ * Queries the high watermarks of all partitions of a set of topics and,
+ * with -G <group>, the group's committed offsets, and prints the lag of
+ * each partition and in total: the high watermark minus the committed
+ * offset, or minus the low watermark for partitions without a committed
+ * offset (and without -G).
+ *
+ * The watermarks are queried with one request per partition leader
+ * (see offsets_for_times_by_leader()), low watermarks only where they
+ * are needed, and the committed offsets with a single request to the
+ * group coordinator. With -X kafkacat.lag.watch.ms=<ms> the offsets are
+ * re-queried every interval, without new metadata requests unless a
+ * leader has moved, and only the partitions whose lag changed are
+ * printed again.
+ */
+
+#include <stdio.h>
+
+#include "kafkacat.h"
+
+
+static struct {
+        char  **topics;
+        int     topic_cnt;
+        const rd_kafka_metadata_t *metadata;
+        int     refresh_metadata;  /**< Re-fetch metadata next round */
+        rd_kafka_topic_partition_list_t *highs;     /**< High watermarks */
+        rd_kafka_topic_partition_list_t *lows;      /**< Low watermarks */
+        rd_kafka_topic_partition_list_t *committed; /**< Group's committed
+                                                     *   offsets, NULL
+                                                     *   without -G. */
+        int64_t *lag;              /**< Per partition, -1 on error */
+        rd_kafka_resp_err_t *errs; /**< Per partition error */
+        int64_t *printed;          /**< Lag last printed (-A watch) */
+} lag;
+
+
+/**
+ * @returns true if partition \p i has a committed offset.
+ */
+static int lag_committed_valid (int i) {
+        return lag.committed && !lag.committed->elems[i].err &&
+                lag.committed->elems[i].offset >= 0;
+}
+
+
+/**
+ * @returns the lag of partition \p i, or -1 if it is unknown in which
+ *          case \p errp is set to the error.
+ */
+static int64_t lag_of (int i, rd_kafka_resp_err_t *errp) {
+        const rd_kafka_topic_partition_t *hi = &lag.highs->elems[i];
+        const rd_kafka_topic_partition_t *lo = &lag.lows->elems[i];
+        int64_t base;
+
+        if (lag.committed && lag.committed->elems[i].err)
+                *errp = lag.committed->elems[i].err;
+        else if (hi->err)
+                *errp = hi->err;
+        else if (!lag_committed_valid(i) && lo->err)
+                *errp = lo->err;
+        else
+                *errp = RD_KAFKA_RESP_ERR_NO_ERROR;
+
+        if (*errp)
+                return -1;
+
+        base = lag_committed_valid(i) ?
+                lag.committed->elems[i].offset : lo->offset;
+
+        return MAX(hi->offset - base, 0);
+}
+
+
+/**
+ * @brief Fetch the metadata of the topics and (re)create the partition
+ *        lists, keeping the printed lags if the partitions did not change.
+ */
+static void lag_metadata (void) {
+        rd_kafka_topic_t *rkt = NULL;
+        rd_kafka_resp_err_t err;
+        int cnt = 0, i, j;
+
+        if (lag.metadata)
+                rd_kafka_metadata_destroy(lag.metadata);
+
+        if (lag.topic_cnt == 1)
+                rkt = rd_kafka_topic_new(conf.rk, lag.topics[0], NULL);
+
+        err = rd_kafka_metadata(conf.rk, rkt ? 0 : 1, rkt, &lag.metadata,
+                                conf.metadata_timeout * 1000);
+        if (rkt)
+                rd_kafka_topic_destroy(rkt);
+        if (err)
+                KC_FATAL("Failed to acquire metadata: %s",
+                         rd_kafka_err2str(err));
+
+        if (lag.highs) {
+                cnt = lag.highs->cnt;
+                rd_kafka_topic_partition_list_destroy(lag.highs);
+                rd_kafka_topic_partition_list_destroy(lag.lows);
+                if (lag.committed)
+                        rd_kafka_topic_partition_list_destroy(lag.committed);
+        }
+
+        lag.highs = rd_kafka_topic_partition_list_new(lag.topic_cnt);
+        lag.lows  = rd_kafka_topic_partition_list_new(lag.topic_cnt);
+        lag.committed = conf.group ?
+                rd_kafka_topic_partition_list_new(lag.topic_cnt) : NULL;
+
+        /* Partitions in the order of the given topics */
+        for (i = 0 ; i < lag.topic_cnt ; i++) {
+                const rd_kafka_metadata_topic_t *t = NULL;
+
+                for (j = 0 ; j < lag.metadata->topic_cnt && !t ; j++)
+                        if (!strcmp(lag.metadata->topics[j].topic,
+                                    lag.topics[i]))
+                                t = &lag.metadata->topics[j];
+
+                if (!t || t->err || t->partition_cnt == 0) {
+                        KC_ERROR("Topic %s: %s", lag.topics[i],
+                                 rd_kafka_err2str(
+                                         t && t->err ? t->err :
+                                         RD_KAFKA_RESP_ERR__UNKNOWN_TOPIC));
+                        continue;
+                }
+
+                for (j = 0 ; j < t->partition_cnt ; j++) {
+                        int32_t partition = t->partitions[j].id;
+
+                        rd_kafka_topic_partition_list_add(
+                                lag.highs, t->topic, partition);
+                        rd_kafka_topic_partition_list_add(
+                                lag.lows, t->topic, partition)->offset =
+                                RD_KAFKA_OFFSET_INVALID;
+                        if (lag.committed)
+                                rd_kafka_topic_partition_list_add(
+                                        lag.committed, t->topic, partition);
+                }
+        }
+
+        if (lag.highs->cnt == 0)
+                KC_FATAL("No partitions to query");
+
+        if (cnt != lag.highs->cnt) {
+                lag.lag     = realloc(lag.lag, sizeof(*lag.lag) *
+                                      lag.highs->cnt);
+                lag.errs    = realloc(lag.errs, sizeof(*lag.errs) *
+                                      lag.highs->cnt);
+                lag.printed = realloc(lag.printed, sizeof(*lag.printed) *
+                                      lag.highs->cnt);
+                if (!lag.lag || !lag.errs || !lag.printed)
+                        KC_FATAL("Failed to allocate lag state");
+                for (i = 0 ; i < lag.highs->cnt ; i++)
+                        lag.printed[i] = INT64_MIN;
+        }
+
+        lag.refresh_metadata = 0;
+}
+
+
+/**
+ * @brief Query the committed offsets and the watermarks.
+ */
+static void lag_query (void) {
+        rd_kafka_topic_partition_list_t *lists[2];
+        rd_kafka_resp_err_t err;
+        int i;
+
+#if ENABLE_KAFKACONSUMER
+        if (lag.committed) {
+                for (i = 0 ; i < lag.committed->cnt ; i++) {
+                        lag.committed->elems[i].offset =
+                                RD_KAFKA_OFFSET_INVALID;
+                        lag.committed->elems[i].err =
+                                RD_KAFKA_RESP_ERR_NO_ERROR;
+                }
+
+                if ((err = rd_kafka_committed(conf.rk, lag.committed,
+                                              conf.metadata_timeout * 1000))) {
+                        KC_ERROR("Failed to query committed offsets "
+                                 "of group %s: %s",
+                                 conf.group, rd_kafka_err2str(err));
+                        for (i = 0 ; i < lag.committed->cnt ; i++)
+                                lag.committed->elems[i].err = err;
+                }
+        }
+#endif
+
+        /* The high watermarks of all partitions, and the low watermarks
+         * of those without a committed offset. */
+        lists[0] = lag.highs;
+        lists[1] = rd_kafka_topic_partition_list_new(lag.lows->cnt);
+
+        for (i = 0 ; i < lag.highs->cnt ; i++) {
+                rd_kafka_topic_partition_t *p = &lag.highs->elems[i];
+
+                p->offset = RD_KAFKA_OFFSET_END;
+                p->err    = RD_KAFKA_RESP_ERR_NO_ERROR;
+
+                if (!lag_committed_valid(i) &&
+                    (!lag.committed || !lag.committed->elems[i].err)) {
+                        rd_kafka_topic_partition_t *lo =
+                                rd_kafka_topic_partition_list_add(
+                                        lists[1], p->topic, p->partition);
+                        lo->offset = RD_KAFKA_OFFSET_BEGINNING;
+                        lo->opaque = (void *)(intptr_t)i;
+                }
+        }
+
+        if ((err = offsets_for_times_by_leader(lists,
+                                               lists[1]->cnt > 0 ? 2 : 1,
+                                               lag.metadata->topics,
+                                               lag.metadata->topic_cnt,
+                                               conf.metadata_timeout * 1000)))
+                KC_ERROR("Failed to query watermarks: %s",
+                         rd_kafka_err2str(err));
+
+        for (i = 0 ; i < lists[1]->cnt ; i++) {
+                const rd_kafka_topic_partition_t *r = &lists[1]->elems[i];
+                rd_kafka_topic_partition_t *p =
+                        &lag.lows->elems[(intptr_t)r->opaque];
+
+                p->offset = r->offset;
+                p->err    = r->err;
+        }
+
+        rd_kafka_topic_partition_list_destroy(lists[1]);
+
+        /* Re-fetch the leaders if they moved */
+        for (i = 0 ; i < lag.highs->cnt ; i++) {
+                switch (lag.highs->elems[i].err)
+                {
+                case RD_KAFKA_RESP_ERR_LEADER_NOT_AVAILABLE:
+                case RD_KAFKA_RESP_ERR_NOT_LEADER_FOR_PARTITION:
+                case RD_KAFKA_RESP_ERR_UNKNOWN_TOPIC_OR_PART:
+                        lag.refresh_metadata = 1;
+                        break;
+                default:
+                        break;
+                }
+        }
+}
+
+
+/**
+ * @brief Format \p offset to \p dst, "-" if not a valid offset.
+ */
+static const char *lag_offset_str (char *dst, size_t size, int64_t offset) {
+        if (offset < 0)
+                return "-";
+        snprintf(dst, size, "%"PRId64, offset);
+        return dst;
+}
+
+
+/**
+ * @brief Print the lag table, after the first round only the partitions
+ *        whose lag changed.
+ */
+static void lag_print (int round) {
+        int64_t total = 0;
+        int failed = 0;
+        int i;
+
+        for (i = 0 ; i < lag.highs->cnt ; i++) {
+                if ((lag.lag[i] = lag_of(i, &lag.errs[i])) == -1)
+                        failed++;
+                else
+                        total += lag.lag[i];
+        }
+
+#if ENABLE_JSON
+        if (conf.flags & CONF_F_FMT_JSON) {
+                lag_print_json(conf.group, lag.highs, lag.lows,
+                               lag.committed, lag.lag, lag.errs, total);
+                return;
+        }
+#endif
+
+        if (round == 0)
+                printf("%-32s %9s %12s %12s %12s %12s\n",
+                       "topic", "partition", "low", "high",
+                       "committed", "lag");
+
+        for (i = 0 ; i < lag.highs->cnt ; i++) {
+                const rd_kafka_topic_partition_t *hi = &lag.highs->elems[i];
+                char lo[24], h[24], c[24];
+
+                if (lag.lag[i] == lag.printed[i])
+                        continue;
+                lag.printed[i] = lag.lag[i];
+
+                printf("%-32s %9"PRId32" %12s %12s %12s ",
+                       hi->topic, hi->partition,
+                       lag_offset_str(lo, sizeof(lo),
+                                      lag.lows->elems[i].offset),
+                       lag_offset_str(h, sizeof(h),
+                                      hi->err ? -1 : hi->offset),
+                       lag_offset_str(c, sizeof(c),
+                                      lag_committed_valid(i) ?
+                                      lag.committed->elems[i].offset : -1));
+
+                if (lag.errs[i])
+                        printf("%12s %s\n", "-",
+                               rd_kafka_err2str(lag.errs[i]));
+                else
+                        printf("%12"PRId64"\n", lag.lag[i]);
+        }
+
+        printf("%-32s %9d %12s %12s %12s %12"PRId64"%s\n",
+               "total", lag.highs->cnt - failed, "", "", "", total,
+               failed ? " (partitions failed)" : "");
+}
+
+
+/**
+ * @brief Run the lag mode (-A) for \p topics.
+ */
+void lag_run (char **topics, int topic_cnt) {
+        char errstr[512];
+        int round;
+
+        if (topic_cnt == 0)
+                KC_FATAL("-A requires one or more topics");
+
+        lag.topics    = topics;
+        lag.topic_cnt = topic_cnt;
+
+        /* A consumer handle for the group's committed offsets */
+        if (!(conf.rk = rd_kafka_new(conf.group ?
+                                     RD_KAFKA_CONSUMER : RD_KAFKA_PRODUCER,
+                                     conf.rk_conf, errstr, sizeof(errstr))))
+                KC_FATAL("Failed to create handle: %s", errstr);
+        conf.rk_conf = NULL;
+
+        lag_metadata();
+
+        for (round = 0 ; conf.run ; round++) {
+                int64_t next = rd_clock() +
+                        (int64_t)conf.lag_watch_ms * 1000;
+
+                if (lag.refresh_metadata)
+                        lag_metadata();
+
+                lag_query();
+                lag_print(round);
+
+                if (!conf.lag_watch_ms)
+                        break;
+
+                fflush(stdout);
+                while (conf.run && rd_clock() < next)
+                        rd_kafka_poll(conf.rk,
+                                      (int)MIN(100, (next - rd_clock() +
+                                                     999) / 1000));
+        }
+
+        rd_kafka_topic_partition_list_destroy(lag.highs);
+        rd_kafka_topic_partition_list_destroy(lag.lows);
+        if (lag.committed)
+                rd_kafka_topic_partition_list_destroy(lag.committed);
+        rd_kafka_metadata_destroy(lag.metadata);
+        free(lag.lag);
+        free(lag.errs);
+        free(lag.printed);
+
+        rd_kafka_destroy(conf.rk);
+}
@@ -0,0 +1,656 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Cluster metadata cache, see mdcache.h
+ *
+ * The cache file is text, one record per line:
+ *   kafkacat-mdcache 1
+ *   cluster <bootstrap.servers>
+ *   all <time>          (the topics are all the cluster's topics)
+ *   broker <id> <port> <host>
+ *   topic <time> <name> <partition_cnt> <partition>:<leader>...
+ * where <time> is the time (ms since the epoch) the metadata was
+ * fetched.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _MSC_VER
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#include <sys/time.h>
+#endif
+
+#include "kafkacat.h"
+#include "mdcache.h"
+
+#define MDCACHE_MAGIC "kafkacat-mdcache 1"
+
+
+/**
+ * @brief Metadata loaded from the cache file, the strings point
+ *        into \c buf.
+ */
+struct mdcache_md {
+        rd_kafka_metadata_t md;        /**< Must be first */
+        int64_t  *ts;                  /**< Fetch time of each topic */
+        int64_t   all_ts;              /**< Fetch time of the complete
+                                        *   topic list, 0 = none */
+        char     *buf;                 /**< File contents */
+        struct mdcache_md *next;       /**< Next handed out metadata */
+};
+
+static struct {
+        char     *cluster;             /**< bootstrap.servers */
+        struct mdcache_md *hits;       /**< Metadata handed out by
+                                        *   mdcache_metadata() */
+        int       hit_cnt;
+        int       miss_cnt;
+} mdcache;
+
+
+/**
+ * @returns the wall clock time in milliseconds.
+ */
+static int64_t mdcache_now (void) {
+        struct timeval tv;
+
+        rd_gettimeofday(&tv, NULL);
+
+        return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+static void mdcache_md_destroy (struct mdcache_md *mc) {
+        int i;
+
+        for (i = 0 ; i < mc->md.topic_cnt ; i++)
+                free(mc->md.topics[i].partitions);
+        free(mc->md.topics);
+        free(mc->md.brokers);
+        free(mc->ts);
+        free(mc->buf);
+        free(mc);
+}
+
+
+/**
+ * @returns the next space-separated token of \p *sp, or NULL if none.
+ */
+static char *mdcache_token (char **sp) {
+        char *s = *sp, *t;
+
+        while (*s == ' ')
+                s++;
+        if (!*s)
+                return NULL;
+
+        if ((t = strchr(s, ' '))) {
+                *t = '\0';
+                *sp = t + 1;
+        } else
+                *sp = s + strlen(s);
+
+        return s;
+}
+
+
+/**
+ * @brief Load the cache file \p path of cluster \p cluster.
+ *
+ * @returns the cached metadata, or NULL if there is no cache file,
+ *          it is invalid or it is another cluster's.
+ */
+static struct mdcache_md *mdcache_load (const char *path,
+                                        const char *cluster) {
+        FILE *fp;
+        struct mdcache_md *mc;
+        char *line, *next;
+        long size;
+        int topic_size = 0, broker_size = 0;
+        int has_cluster = 0;
+
+        if (!(fp = fopen(path, "rb")))
+                return NULL;
+
+        if (fseek(fp, 0, SEEK_END) == -1 || (size = ftell(fp)) < 0 ||
+            fseek(fp, 0, SEEK_SET) == -1) {
+                fclose(fp);
+                return NULL;
+        }
+
+        mc = calloc(1, sizeof(*mc));
+        mc->buf = malloc(size + 1);
+        if (fread(mc->buf, 1, size, fp) != (size_t)size) {
+                fclose(fp);
+                mdcache_md_destroy(mc);
+                return NULL;
+        }
+        fclose(fp);
+        mc->buf[size] = '\0';
+
+        mc->md.orig_broker_id   = -1;
+        mc->md.orig_broker_name = (char *)"metadata cache";
+
+        for (line = mc->buf ; line ; line = next) {
+                char *s = line, *type;
+
+                if ((next = strchr(line, '\n')))
+                        *(next++) = '\0';
+
+                if (line == mc->buf) {
+                        if (strcmp(line, MDCACHE_MAGIC))
+                                goto invalid;
+                        continue;
+                }
+
+                if (!(type = mdcache_token(&s)))
+                        continue;
+
+                if (!strcmp(type, "cluster")) {
+                        if (strcmp(s, cluster)) {
+                                KC_INFO(2, "Metadata cache %s is of "
+                                        "another cluster (%s)\n", path, s);
+                                mdcache_md_destroy(mc);
+                                return NULL;
+                        }
+                        has_cluster = 1;
+
+                } else if (!strcmp(type, "all")) {
+                        mc->all_ts = strtoll(s, NULL, 10);
+
+                } else if (!strcmp(type, "broker")) {
+                        rd_kafka_metadata_broker_t *b;
+                        char *id   = mdcache_token(&s);
+                        char *port = id ? mdcache_token(&s) : NULL;
+                        char *host = port ? mdcache_token(&s) : NULL;
+
+                        if (!host)
+                                goto invalid;
+
+                        if (mc->md.broker_cnt == broker_size) {
+                                broker_size = broker_size ?
+                                        broker_size * 2 : 8;
+                                mc->md.brokers = realloc(
+                                        mc->md.brokers,
+                                        sizeof(*mc->md.brokers) *
+                                        broker_size);
+                        }
+
+                        b = &mc->md.brokers[mc->md.broker_cnt++];
+                        b->id   = atoi(id);
+                        b->port = atoi(port);
+                        b->host = host;
+
+                } else if (!strcmp(type, "topic")) {
+                        rd_kafka_metadata_topic_t *t;
+                        char *ts   = mdcache_token(&s);
+                        char *name = ts ? mdcache_token(&s) : NULL;
+                        char *cnt  = name ? mdcache_token(&s) : NULL;
+                        int i;
+
+                        if (!cnt || atoi(cnt) <= 0)
+                                goto invalid;
+
+                        if (mc->md.topic_cnt == topic_size) {
+                                topic_size = topic_size ?
+                                        topic_size * 2 : 16;
+                                mc->md.topics = realloc(
+                                        mc->md.topics,
+                                        sizeof(*mc->md.topics) * topic_size);
+                                mc->ts = realloc(mc->ts, sizeof(*mc->ts) *
+                                                 topic_size);
+                        }
+
+                        mc->ts[mc->md.topic_cnt] = strtoll(ts, NULL, 10);
+                        t = &mc->md.topics[mc->md.topic_cnt++];
+                        memset(t, 0, sizeof(*t));
+                        t->topic         = name;
+                        t->partition_cnt = atoi(cnt);
+                        t->partitions    = calloc(t->partition_cnt,
+                                                  sizeof(*t->partitions));
+
+                        for (i = 0 ; i < t->partition_cnt ; i++) {
+                                char *p = mdcache_token(&s), *l;
+
+                                if (!p || !(l = strchr(p, ':')))
+                                        goto invalid;
+
+                                t->partitions[i].id     = atoi(p);
+                                t->partitions[i].leader = atoi(l+1);
+                        }
+                }
+        }
+
+        if (has_cluster)
+                return mc;
+
+ invalid:
+        KC_INFO(1, "Ignoring invalid metadata cache %s\n", path);
+        mdcache_md_destroy(mc);
+        return NULL;
+}
+
+
+/**
+ * @brief Remove the topics fetched more than \p ttl_ms before \p now
+ *        from \p mc.
+ */
+static void mdcache_expire (struct mdcache_md *mc, int64_t now,
+                            int64_t ttl_ms) {
+        int i, cnt = 0;
+
+        for (i = 0 ; i < mc->md.topic_cnt ; i++) {
+                if (now - mc->ts[i] > ttl_ms || mc->ts[i] > now) {
+                        free(mc->md.topics[i].partitions);
+                        continue;
+                }
+                mc->md.topics[cnt] = mc->md.topics[i];
+                mc->ts[cnt++] = mc->ts[i];
+        }
+        mc->md.topic_cnt = cnt;
+
+        if (now - mc->all_ts > ttl_ms || mc->all_ts > now)
+                mc->all_ts = 0;
+}
+
+
+/**
+ * @returns topic \p name of \p md, or NULL if not found.
+ */
+static const rd_kafka_metadata_topic_t *
+mdcache_topic (const rd_kafka_metadata_t *md, const char *name) {
+        int i;
+
+        for (i = 0 ; i < md->topic_cnt ; i++)
+                if (!strcmp(md->topics[i].topic, name))
+                        return &md->topics[i];
+
+        return NULL;
+}
+
+
+/**
+ * @returns true if \p mc has the metadata of the \p name_cnt topics
+ *          \p names, and of all topics if \p all_topics is true.
+ */
+static int mdcache_covers (const struct mdcache_md *mc, int all_topics,
+                           const char **names, int name_cnt) {
+        int i;
+
+        if (all_topics && !mc->all_ts)
+                return 0;
+
+        for (i = 0 ; i < name_cnt ; i++)
+                if (!mdcache_topic(&mc->md, names[i]))
+                        return 0;
+
+        return 1;
+}
+
+
+/**
+ * @brief Write the metadata \p md fetched at \p now, and the topics of
+ *        the previously cached \p old (if not NULL) that \p md doesn't
+ *        have (unless \p all_topics, in which case \p md has all
+ *        topics), to the cache file \p path, replacing it atomically.
+ *
+ * @returns 0 on success or -1 on failure (with errno set).
+ */
+static int mdcache_write (const char *path, const char *cluster,
+                          const rd_kafka_metadata_t *md, int all_topics,
+                          const struct mdcache_md *old, int64_t now) {
+        char tmppath[1024];
+        FILE *fp;
+        int i, j;
+        int r;
+
+        snprintf(tmppath, sizeof(tmppath), "%s.%d.tmp",
+                 path, (int)getpid());
+
+        if (!(fp = fopen(tmppath, "w")))
+                return -1;
+
+        fprintf(fp, MDCACHE_MAGIC "\ncluster %s\n", cluster);
+
+        if (all_topics)
+                fprintf(fp, "all %"PRId64"\n", now);
+        else if (old && old->all_ts)
+                fprintf(fp, "all %"PRId64"\n", old->all_ts);
+
+        for (i = 0 ; i < md->broker_cnt ; i++)
+                fprintf(fp, "broker %"PRId32" %d %s\n",
+                        md->brokers[i].id, md->brokers[i].port,
+                        md->brokers[i].host);
+
+        for (i = 0 ; i < md->topic_cnt ; i++) {
+                const rd_kafka_metadata_topic_t *t = &md->topics[i];
+
+                /* Errors are not cached */
+                if (t->err || t->partition_cnt == 0)
+                        continue;
+
+                fprintf(fp, "topic %"PRId64" %s %d", now, t->topic,
+                        t->partition_cnt);
+                for (j = 0 ; j < t->partition_cnt ; j++)
+                        fprintf(fp, " %"PRId32":%"PRId32,
+                                t->partitions[j].id,
+                                t->partitions[j].leader);
+                fprintf(fp, "\n");
+        }
+
+        for (i = 0 ; old && !all_topics && i < old->md.topic_cnt ; i++) {
+                const rd_kafka_metadata_topic_t *t = &old->md.topics[i];
+
+                if (mdcache_topic(md, t->topic))
+                        continue;
+
+                fprintf(fp, "topic %"PRId64" %s %d", old->ts[i], t->topic,
+                        t->partition_cnt);
+                for (j = 0 ; j < t->partition_cnt ; j++)
+                        fprintf(fp, " %"PRId32":%"PRId32,
+                                t->partitions[j].id,
+                                t->partitions[j].leader);
+                fprintf(fp, "\n");
+        }
+
+        r = ferror(fp);
+        if (fclose(fp) == EOF || r) {
+                remove(tmppath);
+                return -1;
+        }
+
+#ifdef _MSC_VER
+        /* rename() does not replace existing files on Windows */
+        remove(path);
+#endif
+        if (rename(tmppath, path) == -1) {
+                int errno_save = errno;
+                remove(tmppath);
+                errno = errno_save;
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * @brief Set up the cache for the cluster of \p rk_conf, which must
+ *        be called before the client is created from it.
+ */
+void mdcache_init (rd_kafka_conf_t *rk_conf) {
+        char servers[1024];
+        size_t size = sizeof(servers);
+
+        if (!conf.metadata_cache)
+                return;
+
+        if (rd_kafka_conf_get(rk_conf, "bootstrap.servers",
+                              servers, &size) != RD_KAFKA_CONF_OK ||
+            !*servers) {
+                KC_INFO(1, "Not using the metadata cache: "
+                        "no bootstrap servers configured\n");
+                return;
+        }
+
+        mdcache.cluster = strdup(servers);
+}
+
+
+/**
+ * @brief Get the metadata of the topics \p rkts, and of all the
+ *        cluster's topics if \p all_topics is true, as
+ *        rd_kafka_metadata() does for the client's topics, but from
+ *        the cache if it has them all.
+ *
+ * The returned \p *mdp must be destroyed with mdcache_metadata_destroy().
+ */
+rd_kafka_resp_err_t mdcache_metadata (rd_kafka_t *rk, int all_topics,
+                                      rd_kafka_topic_t * const *rkts,
+                                      int rkt_cnt,
+                                      const rd_kafka_metadata_t **mdp,
+                                      int timeout_ms) {
+        struct mdcache_md *mc;
+        const char **names;
+        rd_kafka_resp_err_t err;
+        int64_t now;
+        int i;
+
+        if (!mdcache.cluster)
+                return rd_kafka_metadata(rk, all_topics, NULL, mdp,
+                                         timeout_ms);
+
+        now = mdcache_now();
+
+        if ((mc = mdcache_load(conf.metadata_cache, mdcache.cluster))) {
+                mdcache_expire(mc, now, conf.metadata_cache_ttl_ms);
+
+                names = malloc(sizeof(*names) * (rkt_cnt + 1));
+                for (i = 0 ; i < rkt_cnt ; i++)
+                        names[i] = rd_kafka_topic_name(rkts[i]);
+
+                if (mdcache_covers(mc, all_topics, names, rkt_cnt)) {
+                        free(names);
+                        KC_INFO(2, "Using cached metadata of %d topic(s) "
+                                "from %s\n",
+                                mc->md.topic_cnt, conf.metadata_cache);
+                        mc->next = mdcache.hits;
+                        mdcache.hits = mc;
+                        mdcache.hit_cnt++;
+                        *mdp = &mc->md;
+                        return RD_KAFKA_RESP_ERR_NO_ERROR;
+                }
+
+                free(names);
+        }
+
+        mdcache.miss_cnt++;
+
+        err = rd_kafka_metadata(rk, all_topics, NULL, mdp, timeout_ms);
+
+        if (!err && mdcache_write(conf.metadata_cache, mdcache.cluster,
+                                  *mdp, all_topics, mc, now) == -1)
+                KC_INFO(1, "Failed to write metadata cache %s: %s\n",
+                        conf.metadata_cache, strerror(errno));
+
+        if (mc)
+                mdcache_md_destroy(mc);
+
+        return err;
+}
+
+
+/**
+ * @brief Destroy metadata returned by mdcache_metadata().
+ */
+void mdcache_metadata_destroy (const rd_kafka_metadata_t *md) {
+        struct mdcache_md **mcp;
+
+        for (mcp = &mdcache.hits ; *mcp ; mcp = &(*mcp)->next) {
+                if (&(*mcp)->md == md) {
+                        struct mdcache_md *mc = *mcp;
+                        *mcp = mc->next;
+                        mdcache_md_destroy(mc);
+                        return;
+                }
+        }
+
+        rd_kafka_metadata_destroy(md);
+}
+
+
+void mdcache_term (void) {
+        if (!mdcache.cluster)
+                return;
+
+        KC_INFO(2, "Metadata cache: %d hit(s), %d miss(es)\n",
+                mdcache.hit_cnt, mdcache.miss_cnt);
+
+        while (mdcache.hits) {
+                struct mdcache_md *mc = mdcache.hits;
+                mdcache.hits = mc->next;
+                mdcache_md_destroy(mc);
+        }
+
+        free(mdcache.cluster);
+        mdcache.cluster = NULL;
+}
+
+
+
+int mdcache_unittest (void) {
+        struct conf save = conf;
+        rd_kafka_metadata_partition_t pa[2] = {
+                { .id = 0, .leader = 1 }, { .id = 1, .leader = 2 } };
+        rd_kafka_metadata_partition_t pb[3] = {
+                { .id = 0, .leader = 2 }, { .id = 1, .leader = 1 },
+                { .id = 2, .leader = 2 } };
+        rd_kafka_metadata_topic_t t1[] = {
+                { .topic = "a", .partition_cnt = 2, .partitions = pa },
+                { .topic = "b", .partition_cnt = 1, .partitions = pb },
+                { .topic = "bad",
+                  .err = RD_KAFKA_RESP_ERR_UNKNOWN_TOPIC_OR_PART } };
+        rd_kafka_metadata_topic_t t2[] = {
+                { .topic = "b", .partition_cnt = 3, .partitions = pb } };
+        rd_kafka_metadata_topic_t t3[] = {
+                { .topic = "x", .partition_cnt = 1, .partitions = pa } };
+        rd_kafka_metadata_broker_t brokers[] = {
+                { .id = 1, .host = "k1", .port = 9092 },
+                { .id = 2, .host = "k2", .port = 9093 } };
+        rd_kafka_metadata_t md1 = { .broker_cnt = 2, .brokers = brokers,
+                                    .topic_cnt = 3, .topics = t1 };
+        rd_kafka_metadata_t md2 = { .broker_cnt = 2, .brokers = brokers,
+                                    .topic_cnt = 1, .topics = t2 };
+        rd_kafka_metadata_t md3 = { .broker_cnt = 2, .brokers = brokers,
+                                    .topic_cnt = 1, .topics = t3 };
+        const char *ab[] = { "a", "b" }, *ax[] = { "a", "x" };
+        const rd_kafka_metadata_topic_t *t;
+        struct mdcache_md *mc;
+        const char *cluster = "k1:9092,k2:9093";
+        const char *dir;
+        char path[512];
+        int64_t now = 1600000000000;
+        int fails = 0;
+
+#define MC_CHECK(COND, ...) do {                                        \
+                if (!(COND)) {                                          \
+                        fprintf(stderr, "%s: FAILED: ", __FUNCTION__); \
+                        fprintf(stderr, __VA_ARGS__);                   \
+                        fails++;                                        \
+                }                                                       \
+        } while (0)
+
+        conf.verbosity = 0;
+
+        if (!(dir = getenv("TMPDIR")) && !(dir = getenv("TEMP")))
+                dir = "/tmp";
+        snprintf(path, sizeof(path), "%s/kafkacat-mdcache-test.%d",
+                 dir, (int)getpid());
+
+        MC_CHECK(!mdcache_load(path, cluster), "loaded missing file\n");
+
+        if (mdcache_write(path, cluster, &md1, 0, NULL, now) == -1) {
+                fprintf(stderr, "%s: FAILED: write %s: %s\n",
+                        __FUNCTION__, path, strerror(errno));
+                conf = save;
+                return 1;
+        }
+
+        MC_CHECK(!mdcache_load(path, "k3:9092"),
+                 "loaded another cluster's cache\n");
+
+        /* Errored topics are not cached */
+        mc = mdcache_load(path, cluster);
+        MC_CHECK(mc && mc->md.topic_cnt == 2 && mc->md.broker_cnt == 2,
+                 "expected 2 topics and 2 brokers, not %d and %d\n",
+                 mc ? mc->md.topic_cnt : -1, mc ? mc->md.broker_cnt : -1);
+        if (!mc) {
+                remove(path);
+                conf = save;
+                return fails;
+        }
+
+        t = mdcache_topic(&mc->md, "a");
+        MC_CHECK(t && t->partition_cnt == 2 &&
+                 t->partitions[1].id == 1 && t->partitions[1].leader == 2,
+                 "topic a not restored\n");
+        MC_CHECK(!strcmp(mc->md.brokers[1].host, "k2") &&
+                 mc->md.brokers[1].port == 9093,
+                 "broker 2 not restored\n");
+
+        MC_CHECK(mdcache_covers(mc, 0, ab, 2), "a and b not covered\n");
+        MC_CHECK(!mdcache_covers(mc, 0, ax, 2), "x covered\n");
+        MC_CHECK(!mdcache_covers(mc, 1, NULL, 0), "all topics covered\n");
+
+        /* Refreshing b keeps a, with its own fetch time */
+        MC_CHECK(mdcache_write(path, cluster, &md2, 0, mc, now + 1000) == 0,
+                 "write: %s\n", strerror(errno));
+        mdcache_md_destroy(mc);
+        mc = mdcache_load(path, cluster);
+        MC_CHECK(mc && mc->md.topic_cnt == 2, "expected 2 topics\n");
+        if (mc) {
+                t = mdcache_topic(&mc->md, "b");
+                MC_CHECK(t && t->partition_cnt == 3,
+                         "topic b not refreshed\n");
+
+                /* a expires before b */
+                mdcache_expire(mc, now + 1500, 1000);
+                MC_CHECK(mc->md.topic_cnt == 1 &&
+                         !strcmp(mc->md.topics[0].topic, "b"),
+                         "expected only b to remain, not %d topic(s)\n",
+                         mc->md.topic_cnt);
+
+                /* A complete topic list replaces all topics */
+                MC_CHECK(mdcache_write(path, cluster, &md3, 1, mc,
+                                       now + 2000) == 0,
+                         "write: %s\n", strerror(errno));
+                mdcache_md_destroy(mc);
+        }
+
+        mc = mdcache_load(path, cluster);
+        MC_CHECK(mc && mc->md.topic_cnt == 1 &&
+                 mdcache_covers(mc, 1, NULL, 0) &&
+                 !mdcache_covers(mc, 1, ab, 1),
+                 "expected complete topic list of x\n");
+        if (mc) {
+                mdcache_expire(mc, now + 4000, 1000);
+                MC_CHECK(!mdcache_covers(mc, 1, NULL, 0),
+                         "expired topic list covered\n");
+                mdcache_md_destroy(mc);
+        }
+
+        remove(path);
+        conf = save;
+
+        return fails;
+}
@@ -0,0 +1,61 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _MDCACHE_H_
+#define _MDCACHE_H_
+
+/**
+ * On-disk cluster metadata cache (-X kafkacat.metadata.cache=<path>)
+ *
+ * The simple consumer's topic metadata (partitions and leaders, and
+ * the cluster's topic names for -t ^regex) is cached in a file, keyed
+ * by the bootstrap servers, so that later invocations within
+ * kafkacat.metadata.cache.ttl.ms can start consuming without waiting
+ * for a metadata round trip. Topics are cached, and expire, one by
+ * one; a lookup that is not fully answered by the cache queries the
+ * cluster and refreshes the file, which is replaced atomically so
+ * that concurrent invocations may share it.
+ *
+ * Leaders are only used to group offset queries; librdkafka itself
+ * routes the requests, so a stale leader costs no correctness.
+ * Partitions added within the TTL are not consumed until it expires.
+ */
+
+void mdcache_init (rd_kafka_conf_t *rk_conf);
+rd_kafka_resp_err_t mdcache_metadata (rd_kafka_t *rk, int all_topics,
+                                      rd_kafka_topic_t * const *rkts,
+                                      int rkt_cnt,
+                                      const rd_kafka_metadata_t **mdp,
+                                      int timeout_ms);
+void mdcache_metadata_destroy (const rd_kafka_metadata_t *md);
+void mdcache_term (void);
+
+int mdcache_unittest (void);
+
+#endif
@@ -0,0 +1,361 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * Consumer offset store, see offsets.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kafkacat.h"
+#include "output.h"
+#include "offsets.h"
+
+
+/**
+ * @brief Offset state of a partition.
+ *        Offsets are as passed to rd_kafka_offset_store(), i.e., of the
+ *        last processed message, -1 if none.
+ */
+struct offpart {
+        int64_t        marked;  /**< Last output message */
+        int64_t        written; /**< Last marked message whose output
+                                 *   has been flushed. */
+        int64_t        stored;  /**< Last passed to librdkafka */
+        struct outbuf *owner;   /**< Consuming thread's buffer */
+        struct outbuf *out;     /**< Buffer the partition is output to */
+};
+
+struct offtopic {
+        struct offtopic  *next;
+        rd_kafka_topic_t *rkt;   /**< Lookup key: message topic handle */
+        rd_kafka_topic_t *rkt_ref; /**< Reference keeping rkt alive */
+        struct offpart   *parts;
+        int               cnt;
+};
+
+static struct {
+        struct offtopic *topics;
+} offsets;
+
+static RD_TLS struct offtopic *offtopic_last;
+
+
+static void offpart_reset (struct offpart *op) {
+        op->marked  = -1;
+        op->written = -1;
+        op->stored  = -1;
+        op->owner   = NULL;
+        op->out     = NULL;
+}
+
+static void offtopic_grow (struct offtopic *ot, int cnt) {
+        int i;
+
+        ot->parts = realloc(ot->parts, sizeof(*ot->parts) * cnt);
+        for (i = ot->cnt ; i < cnt ; i++)
+                offpart_reset(&ot->parts[i]);
+        ot->cnt = cnt;
+}
+
+static struct offtopic *offtopic_new (rd_kafka_topic_t *rkt,
+                                      int partition_cnt) {
+        struct offtopic *ot = calloc(1, sizeof(*ot));
+
+        /* Keep the topic handle, and thus the lookup key, alive. */
+        ot->rkt     = rkt;
+        ot->rkt_ref = rd_kafka_topic_new(conf.rk, rd_kafka_topic_name(rkt),
+                                         NULL);
+
+        offtopic_grow(ot, partition_cnt);
+
+        ot->next = offsets.topics;
+        offsets.topics = ot;
+
+        return ot;
+}
+
+
+/**
+ * @brief Get the offset state of a partition.
+ *
+ * Topics and partitions not added with offsets_topic_add() are added
+ * here, which is only safe for the single-threaded consumer.
+ */
+static struct offpart *offpart_get (rd_kafka_topic_t *rkt,
+                                    int32_t partition) {
+        struct offtopic *ot = offtopic_last;
+
+        if (!ot || ot->rkt != rkt) {
+                for (ot = offsets.topics ; ot ; ot = ot->next)
+                        if (ot->rkt == rkt)
+                                break;
+                if (!ot)
+                        ot = offtopic_new(rkt, partition + 1);
+                offtopic_last = ot;
+        }
+
+        if (partition >= ot->cnt)
+                offtopic_grow(ot, partition + 1);
+
+        return &ot->parts[partition];
+}
+
+
+/**
+ * @brief Pass the offsets of the partitions selected by \p owner and
+ *        \p out (NULL = any) that advanced since they were last stored
+ *        to librdkafka: only their written offsets with
+ *        kafkacat.offset.store=flush.
+ */
+static void offsets_store0 (struct outbuf *owner, struct outbuf *out) {
+        struct offtopic *ot;
+        rd_kafka_topic_partition_list_t *rktparlist = NULL;
+        int flush = conf.offset_store == KC_OFFSET_STORE_FLUSH;
+
+        for (ot = offsets.topics ; ot ; ot = ot->next) {
+                int i;
+
+                for (i = 0 ; i < ot->cnt ; i++) {
+                        struct offpart *op = &ot->parts[i];
+                        int64_t offset = flush ? op->written : op->marked;
+
+                        if ((owner && op->owner != owner) ||
+                            (out && op->out != out) ||
+                            offset <= op->stored)
+                                continue;
+
+                        op->stored = offset;
+
+#if RD_KAFKA_VERSION >= 0x00090100
+                        /* The high-level consumer stores the offsets in
+                         * a single call, the simple consumer's
+                         * partitions are not assigned and must be stored
+                         * one by one. */
+                        if (conf.mode == 'G') {
+                                if (!rktparlist)
+                                        rktparlist =
+                                                rd_kafka_topic_partition_list_new(
+                                                        8);
+                                rd_kafka_topic_partition_list_add(
+                                        rktparlist,
+                                        rd_kafka_topic_name(ot->rkt),
+                                        i)->offset = offset + 1;
+                                continue;
+                        }
+#endif
+                        rd_kafka_offset_store(ot->rkt, i, offset);
+                }
+        }
+
+#if RD_KAFKA_VERSION >= 0x00090100
+        if (rktparlist) {
+                int i;
+
+                /* Partitions that were just revoked can't be stored. */
+                rd_kafka_offsets_store(conf.rk, rktparlist);
+                for (i = 0 ; i < rktparlist->cnt ; i++)
+                        if (rktparlist->elems[i].err)
+                                KC_INFO(2, "Failed to store offset "
+                                        "%"PRId64" of %s [%"PRId32"]: %s\n",
+                                        rktparlist->elems[i].offset,
+                                        rktparlist->elems[i].topic,
+                                        rktparlist->elems[i].partition,
+                                        rd_kafka_err2str(
+                                                rktparlist->elems[i].err));
+                rd_kafka_topic_partition_list_destroy(rktparlist);
+        }
+#endif
+}
+
+
+/**
+ * @brief Output buffer written callback (kafkacat.offset.store=flush):
+ *        the partitions output to \p ob have been written up to their
+ *        marked offsets.
+ */
+static void offsets_written_cb (struct outbuf *ob) {
+        struct offtopic *ot;
+
+        for (ot = offsets.topics ; ot ; ot = ot->next) {
+                int i;
+
+                for (i = 0 ; i < ot->cnt ; i++)
+                        if (ot->parts[i].out == ob)
+                                ot->parts[i].written = ot->parts[i].marked;
+        }
+
+        offsets_store0(NULL, ob);
+}
+
+
+/**
+ * @brief Set up the offset store as configured by kafkacat.offset.store
+ */
+void offsets_init (void) {
+        if (conf.offset_store == KC_OFFSET_STORE_FLUSH)
+                outbuf_set_written_cb(offsets_written_cb);
+}
+
+
+/**
+ * @brief Add \p partition_cnt partitions of \p rkt to the offset table
+ *        before they are consumed by multiple threads.
+ */
+void offsets_topic_add (rd_kafka_topic_t *rkt, int partition_cnt) {
+        if (conf.offset_store == KC_OFFSET_STORE_MESSAGE)
+                return;
+
+        offpart_get(rkt, partition_cnt - 1);
+}
+
+
+/**
+ * @brief Record \p offset as processed for the message's partition,
+ *        which is consumed by the thread of \p owner and is output to
+ *        \p out (NULL: unchanged, e.g., for messages that were not
+ *        output).
+ */
+void offsets_mark (const rd_kafka_message_t *rkmessage, int64_t offset,
+                   struct outbuf *owner, struct outbuf *out) {
+        struct offpart *op;
+
+        if (conf.offset_store == KC_OFFSET_STORE_MESSAGE) {
+                /* The high-level consumer's messages are stored by
+                 * librdkafka as they are consumed. */
+                if (conf.mode == 'C')
+                        rd_kafka_offset_store(rkmessage->rkt,
+                                              rkmessage->partition, offset);
+                return;
+        }
+
+        op = offpart_get(rkmessage->rkt, rkmessage->partition);
+        op->marked = offset;
+        op->owner  = owner;
+        if (out)
+                op->out = out;
+        else if (!op->out)
+                op->out = owner;
+}
+
+
+/**
+ * @brief Store the offsets of the partitions consumed by \p owner's
+ *        thread after a batch of messages (kafkacat.offset.store=batch).
+ */
+void offsets_store (struct outbuf *owner) {
+        if (conf.offset_store == KC_OFFSET_STORE_BATCH)
+                offsets_store0(owner, NULL);
+}
+
+
+/**
+ * @brief Store the offset of a partition before it is stopped, with
+ *        kafkacat.offset.store=flush first flushing its output.
+ */
+void offsets_partition_stop (rd_kafka_topic_t *rkt, int32_t partition) {
+        struct offpart *op;
+
+        if (conf.offset_store == KC_OFFSET_STORE_MESSAGE)
+                return;
+
+        op = offpart_get(rkt, partition);
+        if (!op->owner)
+                return;
+
+        if (conf.offset_store == KC_OFFSET_STORE_FLUSH)
+                outbuf_flush(op->out);
+        else
+                offsets_store0(op->owner, NULL);
+}
+
+
+/**
+ * @brief Store the offsets of all partitions, with
+ *        kafkacat.offset.store=flush first flushing their output.
+ *        Must only be called when no other thread is consuming.
+ */
+void offsets_flush (void) {
+        struct offtopic *ot;
+
+        if (conf.offset_store != KC_OFFSET_STORE_FLUSH) {
+                offsets_store0(NULL, NULL);
+                return;
+        }
+
+        for (ot = offsets.topics ; ot ; ot = ot->next) {
+                int i;
+
+                for (i = 0 ; i < ot->cnt ; i++)
+                        if (ot->parts[i].out &&
+                            ot->parts[i].written < ot->parts[i].marked)
+                                outbuf_flush(ot->parts[i].out);
+        }
+}
+
+
+/**
+ * @brief Store the offsets of all partitions before the high-level
+ *        consumer's partitions are revoked, and forget them.
+ */
+void offsets_revoke (void) {
+        struct offtopic *ot;
+
+        offsets_flush();
+
+        for (ot = offsets.topics ; ot ; ot = ot->next) {
+                int i;
+
+                for (i = 0 ; i < ot->cnt ; i++)
+                        offpart_reset(&ot->parts[i]);
+        }
+}
+
+
+/**
+ * @brief Store the offsets of all partitions and free the offset table.
+ *        Must be called before the consumer is closed.
+ */
+void offsets_term (void) {
+        struct offtopic *ot;
+
+        offsets_flush();
+
+        outbuf_set_written_cb(NULL);
+
+        while ((ot = offsets.topics)) {
+                offsets.topics = ot->next;
+                if (ot->rkt_ref)
+                        rd_kafka_topic_destroy(ot->rkt_ref);
+                free(ot->parts);
+                free(ot);
+        }
+        offtopic_last = NULL;
+}
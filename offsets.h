@@ -0,0 +1,63 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _OFFSETS_H_
+#define _OFFSETS_H_
+
+struct outbuf;
+
+/**
+ * Consumer offset store (-X kafkacat.offset.store=message|batch|flush)
+ *
+ * The offset of each output message is recorded in a per-partition
+ * table with offsets_mark() and passed to librdkafka:
+ *  - message: immediately, as before (-G: by librdkafka itself).
+ *  - batch:   for all the partitions that advanced, by offsets_store()
+ *             after each consumed batch.
+ *  - flush:   once the output buffer the messages were written to has
+ *             been flushed (and fsync()ed with kafkacat.output.fsync),
+ *             so that a consumer resuming from the committed offsets
+ *             does not miss messages that were lost in the buffer.
+ *
+ * Each partition is owned by the consuming thread (identified by the
+ * output buffer it passes to consume_cb()), which is the only thread
+ * to mark and store its offsets.
+ */
+
+void offsets_init (void);
+void offsets_topic_add (rd_kafka_topic_t *rkt, int partition_cnt);
+void offsets_mark (const rd_kafka_message_t *rkmessage, int64_t offset,
+                   struct outbuf *owner, struct outbuf *out);
+void offsets_store (struct outbuf *owner);
+void offsets_partition_stop (rd_kafka_topic_t *rkt, int32_t partition);
+void offsets_flush (void);
+void offsets_revoke (void);
+void offsets_term (void);
+
+#endif
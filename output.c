@@ -0,0 +1,964 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MSC_VER
+#define _GNU_SOURCE  /* fallocate() */
+#endif
+
+#include "kafkacat.h"
+#include "output.h"
+#include "dump.h"
+#include "instr.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#include <sys/uio.h>
+#else
+#include <io.h>
+#include <direct.h>
+#endif
+
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+#if HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+
+/**
+ * @brief Initialize output buffer \p ob of \p size bytes writing to
+ *        \p fd, flushing buffered messages \p flush_ms after the
+ *        last flush (0 = flush every message).
+ */
+void outbuf_init (struct outbuf *ob, int fd, size_t size, int flush_ms) {
+        memset(ob, 0, sizeof(*ob));
+        ob->fd         = fd;
+        ob->size       = MAX(size, 64);
+        ob->buf        = malloc(ob->size);
+        ob->flush_size = ob->size;
+        ob->flush_us   = (int64_t)flush_ms * 1000;
+        ob->ts_flush   = rd_clock();
+}
+
+
+static int outcodec_end (struct outcodec *oc, int fd);
+static void outcodec_destroy (struct outcodec *oc);
+
+/**
+ * @brief Flush and free the buffer, ending the binary dump and
+ *        the compressed stream if the buffer owns its codec.
+ */
+void outbuf_destroy (struct outbuf *ob) {
+        if (ob->dump)
+                dump_output_end(ob);
+        outbuf_flush(ob);
+        if (ob->codec && ob->codec_owner) {
+                if (outcodec_end(ob->codec, ob->fd) == -1)
+                        KC_FATAL("Output write error: %s", strerror(errno));
+                outcodec_destroy(ob->codec);
+        }
+        ob->codec = NULL;
+        free(ob->buf);
+        ob->buf = NULL;
+}
+
+
+#ifdef _MSC_VER
+struct iovec {
+        void   *iov_base;
+        size_t  iov_len;
+};
+#endif
+
+
+/**
+ * @brief Write all of \p iov to \p fd, retrying on partial writes.
+ *
+ * @returns 0 on success or -1 on write error (errno is set).
+ */
+static int outbuf_writev (int fd, struct iovec *iov, int iovcnt) {
+        while (iovcnt > 0) {
+                ssize_t r;
+
+                if (iov->iov_len == 0) {
+                        iov++;
+                        iovcnt--;
+                        continue;
+                }
+
+#ifndef _MSC_VER
+                r = writev(fd, iov, iovcnt);
+#else
+                r = _write(fd, iov->iov_base,
+                           (unsigned int)MIN(iov->iov_len, INT_MAX));
+#endif
+                if (r == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+
+                /* Skip what was written */
+                while (r > 0) {
+                        size_t n = MIN((size_t)r, iov->iov_len);
+
+                        iov->iov_base = (char *)iov->iov_base + n;
+                        iov->iov_len -= n;
+                        r -= n;
+                        if (iov->iov_len == 0) {
+                                iov++;
+                                iovcnt--;
+                        }
+                }
+        }
+
+        return 0;
+}
+
+
+/**
+ * @brief Fatal output write error: the buffered data is discarded.
+ */
+static void RD_NORETURN outbuf_fatal (struct outbuf *ob) {
+        ob->len = 0;
+        KC_FATAL("Output write error: %s", strerror(errno));
+}
+
+
+/**
+ * Compressed output (-X kafkacat.output.compression=zstd|lz4)
+ *
+ * The buffered output is compressed as a single stream per output file
+ * descriptor: buffers sharing a file descriptor share its codec, which
+ * is protected by the buffers' lock.
+ * The compressor holds on to its input until it has a block worth of
+ * compressed data, or the output is idle, see outbuf_flush_idle().
+ */
+
+#ifndef LZ4F_HEADER_SIZE_MAX
+#define LZ4F_HEADER_SIZE_MAX 19
+#endif
+
+/* Maximum input size per LZ4F_compressUpdate() */
+#define OUTCODEC_LZ4_INPUT_SIZE (64*1024)
+
+struct outcodec {
+        kc_compression_t type;
+#if HAVE_ZSTD
+        ZSTD_CCtx *zstd;
+#endif
+#if HAVE_LZ4
+        LZ4F_cctx *lz4;
+        LZ4F_preferences_t lz4_prefs;
+        int        lz4_begun;   /**< Frame header has been written */
+#endif
+        char      *buf;         /**< Compressed output */
+        size_t     size;
+        int        pending;     /**< Input written since the last flush */
+};
+
+typedef enum {
+        OUTCODEC_CONTINUE,      /**< Compress input */
+        OUTCODEC_FLUSH,         /**< Write all compressed data */
+        OUTCODEC_END,           /**< End the frame */
+} outcodec_op_t;
+
+
+/**
+ * @brief Create an output compressor as configured by
+ *        kafkacat.output.compression, .level and .threads.
+ */
+struct outcodec *outcodec_new (void) {
+        struct outcodec *oc = calloc(1, sizeof(*oc));
+
+        oc->type = conf.output_compression;
+
+        switch (oc->type)
+        {
+#if HAVE_ZSTD
+        case KC_COMPRESSION_ZSTD:
+        {
+                size_t r;
+
+                if (!(oc->zstd = ZSTD_createCCtx()))
+                        KC_FATAL("Failed to create zstd compressor");
+
+                r = ZSTD_CCtx_setParameter(oc->zstd,
+                                           ZSTD_c_compressionLevel,
+                                           conf.output_compression_level);
+                if (ZSTD_isError(r))
+                        KC_FATAL("Invalid zstd compression level %d: %s",
+                                 conf.output_compression_level,
+                                 ZSTD_getErrorName(r));
+
+                if (conf.output_compression_threads > 0) {
+                        r = ZSTD_CCtx_setParameter(
+                                oc->zstd, ZSTD_c_nbWorkers,
+                                conf.output_compression_threads);
+                        if (ZSTD_isError(r))
+                                KC_INFO(1, "zstd compression threads are "
+                                        "not supported by libzstd (%s): "
+                                        "compressing in the calling "
+                                        "thread\n", ZSTD_getErrorName(r));
+                }
+
+                oc->size = ZSTD_CStreamOutSize();
+                break;
+        }
+#endif
+#if HAVE_LZ4
+        case KC_COMPRESSION_LZ4:
+        {
+                LZ4F_errorCode_t r;
+
+                r = LZ4F_createCompressionContext(&oc->lz4, LZ4F_VERSION);
+                if (LZ4F_isError(r))
+                        KC_FATAL("Failed to create lz4 compressor: %s",
+                                 LZ4F_getErrorName(r));
+
+                oc->lz4_prefs.compressionLevel =
+                        conf.output_compression_level;
+                oc->lz4_prefs.frameInfo.contentChecksumFlag =
+                        LZ4F_contentChecksumEnabled;
+
+                oc->size = LZ4F_compressBound(OUTCODEC_LZ4_INPUT_SIZE,
+                                              &oc->lz4_prefs) +
+                        LZ4F_HEADER_SIZE_MAX;
+                break;
+        }
+#endif
+        default:
+                KC_FATAL("Unsupported output compression");
+        }
+
+        oc->buf = malloc(oc->size);
+
+        return oc;
+}
+
+
+static void outcodec_destroy (struct outcodec *oc) {
+#if HAVE_ZSTD
+        if (oc->zstd)
+                ZSTD_freeCCtx(oc->zstd);
+#endif
+#if HAVE_LZ4
+        if (oc->lz4)
+                LZ4F_freeCompressionContext(oc->lz4);
+#endif
+        free(oc->buf);
+        free(oc);
+}
+
+
+#if HAVE_ZSTD || HAVE_LZ4
+/**
+ * @brief Write \p len bytes of compressed output to \p fd.
+ */
+static int outcodec_out (int fd, const char *p, size_t len) {
+        struct iovec iov;
+
+        if (len == 0)
+                return 0;
+
+        iov.iov_base = (void *)p;
+        iov.iov_len  = len;
+        return outbuf_writev(fd, &iov, 1);
+}
+#endif
+
+
+/**
+ * @brief Perform \p op on \p len bytes of \p p (only for
+ *        OUTCODEC_CONTINUE) and write the resulting compressed
+ *        output to \p fd.
+ *
+ * @returns 0 on success or -1 on write error (errno is set).
+ */
+static int outcodec_write (struct outcodec *oc, int fd,
+                           const char *p, size_t len, outcodec_op_t op) {
+
+        oc->pending = op == OUTCODEC_CONTINUE;
+
+        switch (oc->type)
+        {
+#if HAVE_ZSTD
+        case KC_COMPRESSION_ZSTD:
+        {
+                ZSTD_EndDirective mode = op == OUTCODEC_END ? ZSTD_e_end :
+                        (op == OUTCODEC_FLUSH ? ZSTD_e_flush :
+                         ZSTD_e_continue);
+                ZSTD_inBuffer in = { p, len, 0 };
+                size_t remaining;
+
+                do {
+                        ZSTD_outBuffer out = { oc->buf, oc->size, 0 };
+
+                        remaining = ZSTD_compressStream2(oc->zstd, &out, &in,
+                                                         mode);
+                        if (ZSTD_isError(remaining))
+                                KC_FATAL("zstd compression failed: %s",
+                                         ZSTD_getErrorName(remaining));
+
+                        if (outcodec_out(fd, oc->buf, out.pos) == -1)
+                                return -1;
+                } while (mode == ZSTD_e_continue ?
+                         in.pos < in.size : remaining > 0);
+
+                return 0;
+        }
+#endif
+#if HAVE_LZ4
+        case KC_COMPRESSION_LZ4:
+        {
+                size_t r;
+
+                if (!oc->lz4_begun) {
+                        r = LZ4F_compressBegin(oc->lz4, oc->buf, oc->size,
+                                               &oc->lz4_prefs);
+                        if (LZ4F_isError(r))
+                                KC_FATAL("lz4 compression failed: %s",
+                                         LZ4F_getErrorName(r));
+                        if (outcodec_out(fd, oc->buf, r) == -1)
+                                return -1;
+                        oc->lz4_begun = 1;
+                }
+
+                while (len > 0) {
+                        size_t chunk = MIN(len, OUTCODEC_LZ4_INPUT_SIZE);
+
+                        r = LZ4F_compressUpdate(oc->lz4, oc->buf, oc->size,
+                                                p, chunk, NULL);
+                        if (LZ4F_isError(r))
+                                KC_FATAL("lz4 compression failed: %s",
+                                         LZ4F_getErrorName(r));
+                        if (outcodec_out(fd, oc->buf, r) == -1)
+                                return -1;
+
+                        p   += chunk;
+                        len -= chunk;
+                }
+
+                if (op == OUTCODEC_CONTINUE)
+                        return 0;
+
+                if (op == OUTCODEC_END) {
+                        r = LZ4F_compressEnd(oc->lz4, oc->buf, oc->size,
+                                             NULL);
+                        oc->lz4_begun = 0;
+                } else
+                        r = LZ4F_flush(oc->lz4, oc->buf, oc->size, NULL);
+
+                if (LZ4F_isError(r))
+                        KC_FATAL("lz4 compression failed: %s",
+                                 LZ4F_getErrorName(r));
+
+                return outcodec_out(fd, oc->buf, r);
+        }
+#endif
+        default:
+                return 0;
+        }
+}
+
+
+/**
+ * @brief End the compressed stream, e.g., the zstd or lz4 frame.
+ */
+static int outcodec_end (struct outcodec *oc, int fd) {
+        return outcodec_write(oc, fd, NULL, 0, OUTCODEC_END);
+}
+
+
+/**
+ * @brief Write \p iov through the codec to \p fd.
+ */
+static int outcodec_writev (struct outcodec *oc, int fd,
+                            struct iovec *iov, int iovcnt) {
+        int i;
+
+        for (i = 0 ; i < iovcnt ; i++)
+                if (outcodec_write(oc, fd, iov[i].iov_base, iov[i].iov_len,
+                                   OUTCODEC_CONTINUE) == -1)
+                        return -1;
+
+        return 0;
+}
+
+
+/**
+ * @brief Compress the output with \p codec, which is ended and
+ *        destroyed with the buffer if \p owner is true, else the codec
+ *        is shared with its owner buffer (using a shared lock).
+ */
+void outbuf_set_codec (struct outbuf *ob, struct outcodec *codec,
+                       int owner) {
+        ob->codec       = codec;
+        ob->codec_owner = owner;
+}
+
+
+/**
+ * Called when a buffer's output has been written (and fsync()ed with
+ * kafkacat.output.fsync), see outbuf_set_written_cb().
+ */
+static void (*outbuf_written_cb) (struct outbuf *ob);
+
+/**
+ * @brief Call \p cb whenever all complete messages of any buffer have
+ *        been written to its file descriptor (NULL to disable).
+ *        Compressed output is then flushed by every buffer write.
+ */
+void outbuf_set_written_cb (void (*cb) (struct outbuf *ob)) {
+        outbuf_written_cb = cb;
+}
+
+
+/**
+ * @brief Share the output file descriptor with other buffers using
+ *        \p lock.
+ */
+void outbuf_set_lock (struct outbuf *ob, rd_mutex_t *lock) {
+        ob->lock = lock;
+}
+
+
+/**
+ * @brief Write \p iov to the output, acquiring the lock (if any)
+ *        unless already held.
+ */
+static void outbuf_writev_locked (struct outbuf *ob,
+                                  struct iovec *iov, int iovcnt) {
+        int i;
+
+        for (i = 0 ; i < iovcnt ; i++)
+                ob->written += iov[i].iov_len;
+
+        if (ob->lock && !ob->locked) {
+                rd_mutex_lock(ob->lock);
+                ob->locked = 1;
+        }
+
+        KC_INSTR_BEGIN(KC_STAGE_WRITE);
+        if ((ob->codec ?
+             outcodec_writev(ob->codec, ob->fd, iov, iovcnt) :
+             outbuf_writev(ob->fd, iov, iovcnt)) == -1)
+                outbuf_fatal(ob);
+        KC_INSTR_END(KC_STAGE_WRITE);
+
+        ob->len      = 0;
+        ob->ts_flush = rd_clock();
+}
+
+
+/**
+ * @brief Write any data held by the compressor to the output.
+ */
+static void outbuf_codec_flush (struct outbuf *ob) {
+        if (ob->lock)
+                rd_mutex_lock(ob->lock);
+
+        if (ob->codec->pending &&
+            outcodec_write(ob->codec, ob->fd, NULL, 0, OUTCODEC_FLUSH) == -1)
+                outbuf_fatal(ob);
+
+        if (ob->lock)
+                rd_mutex_unlock(ob->lock);
+}
+
+
+/**
+ * @brief All complete messages of \p ob have been passed to
+ *        outbuf_writev_locked(): make sure they are written to the file
+ *        descriptor, and optionally the disk, and call the written
+ *        callback.
+ */
+static void outbuf_written (struct outbuf *ob) {
+        if (ob->codec)
+                outbuf_codec_flush(ob);
+
+        /* Pipes and terminals can't be synced. */
+        if (conf.output_fsync &&
+#ifndef _MSC_VER
+            fsync(ob->fd) == -1 && errno != EINVAL && errno != EROFS
+#else
+            _commit(ob->fd) == -1 && errno != EBADF
+#endif
+                )
+                KC_FATAL("Failed to sync output: %s", strerror(errno));
+
+        outbuf_written_cb(ob);
+}
+
+
+/**
+ * @brief Write the buffered data to the output.
+ *        Must only be called at message boundaries.
+ */
+void outbuf_flush (struct outbuf *ob) {
+        struct iovec iov;
+
+        if (ob->len > 0) {
+                iov.iov_base = ob->buf;
+                iov.iov_len  = ob->len;
+                outbuf_writev_locked(ob, &iov, 1);
+        } else
+                ob->ts_flush = rd_clock();
+
+        if (ob->locked) {
+                ob->locked = 0;
+                rd_mutex_unlock(ob->lock);
+        }
+
+        if (outbuf_written_cb)
+                outbuf_written(ob);
+}
+
+
+/**
+ * @brief Write the buffered data, and any data held by the compressor,
+ *        to the output. Called when the output is idle.
+ */
+void outbuf_flush_idle (struct outbuf *ob) {
+        outbuf_flush(ob);
+
+        if (ob->codec)
+                outbuf_codec_flush(ob);
+}
+
+
+/**
+ * @brief Write the buffered data to the output in the middle of a
+ *        message, keeping the lock (if any) until the end of the message.
+ */
+void outbuf_flush_partial (struct outbuf *ob) {
+        struct iovec iov;
+
+        iov.iov_base = ob->buf;
+        iov.iov_len  = ob->len;
+        outbuf_writev_locked(ob, &iov, 1);
+}
+
+
+/**
+ * @brief Write the buffered data to the output, ignoring write errors.
+ *        For use from exit handlers.
+ */
+void outbuf_flush_atexit (struct outbuf *ob) {
+        struct iovec iov;
+
+        if (!ob->buf)
+                return;
+
+        iov.iov_base = ob->buf;
+        iov.iov_len  = ob->len;
+        ob->len = 0;
+
+        if (!ob->codec)
+                outbuf_writev(ob->fd, &iov, 1);
+        else if (outcodec_writev(ob->codec, ob->fd, &iov, 1) != -1 &&
+                 ob->codec_owner)
+                outcodec_end(ob->codec, ob->fd);
+}
+
+
+/**
+ * @brief Slow path of outbuf_write(): \p len bytes do not fit in
+ *        the remaining buffer space.
+ */
+void outbuf_write0 (struct outbuf *ob, const void *p, size_t len) {
+        struct iovec iov[2];
+
+        if (len < ob->size / 2) {
+                /* Small enough to be worth copying */
+                outbuf_flush_partial(ob);
+                memcpy(ob->buf, p, len);
+                ob->len = len;
+                return;
+        }
+
+        iov[0].iov_base = ob->buf;
+        iov[0].iov_len  = ob->len;
+        iov[1].iov_base = (void *)p;
+        iov[1].iov_len  = len;
+        outbuf_writev_locked(ob, iov, 2);
+}
+
+
+/**
+ * @brief Append printf-formatted string.
+ */
+void outbuf_printf (struct outbuf *ob, const char *fmt, ...) {
+        va_list ap;
+        int r;
+
+        va_start(ap, fmt);
+        r = vsnprintf(ob->buf + ob->len, ob->size - ob->len, fmt, ap);
+        va_end(ap);
+
+        if (r < 0)
+                KC_FATAL("Output formatting error");
+
+        if ((size_t)r < ob->size - ob->len) {
+                ob->len += r;
+                return;
+        } else {
+                /* Did not fit in the buffer */
+                char *tmp = malloc(r + 1);
+
+                va_start(ap, fmt);
+                vsnprintf(tmp, r + 1, fmt, ap);
+                va_end(ap);
+
+                outbuf_write(ob, tmp, r);
+                free(tmp);
+        }
+}
+
+
+/**
+ * @brief Append the decimal representation of \p v.
+ */
+void outbuf_u64 (struct outbuf *ob, uint64_t v) {
+        char tmp[20];
+        char *p = tmp + sizeof(tmp);
+
+        do {
+                *(--p) = (char)('0' + (v % 10));
+                v /= 10;
+        } while (v > 0);
+
+        outbuf_write(ob, p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+
+/**
+ * @brief Append the decimal representation of \p v.
+ */
+void outbuf_i64 (struct outbuf *ob, int64_t v) {
+        if (v < 0) {
+                outbuf_putc(ob, '-');
+                /* Negate as unsigned to handle INT64_MIN */
+                outbuf_u64(ob, (uint64_t)0 - (uint64_t)v);
+        } else
+                outbuf_u64(ob, (uint64_t)v);
+}
+
+
+
+/**
+ * Per-partition output files (-X kafkacat.output.path=<template>)
+ *
+ * Each topic partition is written to its own file through its own
+ * output buffer, which is only used by the thread consuming the
+ * partition. The file table is shared by all consumer threads.
+ */
+#define OUTFILES_BUCKETS 256
+
+static struct {
+        rd_mutex_t      lock;       /**< Protects the buckets */
+        struct outfile *buckets[OUTFILES_BUCKETS];
+        int             cnt;
+} outfiles;
+
+/* Last looked up file of the thread, avoids the lock. */
+static RD_TLS struct outfile *outfile_last;
+
+
+/**
+ * @brief Validate the output path template and set up the file table.
+ */
+void outfiles_init (void) {
+        int has_topic = 0, has_partition = 0, has_offset = 0;
+        const char *t;
+
+        for (t = conf.output_path ; *t ; t++) {
+                if (*t != '%')
+                        continue;
+
+                switch (*(++t))
+                {
+                case 't':
+                        has_topic = 1;
+                        break;
+                case 'p':
+                        has_partition = 1;
+                        break;
+                case '%':
+                        break;
+                case 'o':
+                        has_offset = 1;
+                        break;
+                default:
+                        KC_FATAL("kafkacat.output.path: unsupported "
+                                 "token %%%c, expected %%t, %%p, %%o or %%%%",
+                                 *t ? *t : ' ');
+                }
+        }
+
+        /* Each partition must have a file of its own */
+        if (!has_partition || (conf.mode == 'G' && !has_topic))
+                KC_FATAL("kafkacat.output.path requires %%p%s",
+                         conf.mode == 'G' ? " and %t" : "");
+
+        if ((conf.output_rotate_bytes || conf.output_rotate_offsets) &&
+            !has_offset)
+                KC_FATAL("kafkacat.output.rotate.bytes and "
+                         "kafkacat.output.rotate.offsets require "
+                         "%%o in kafkacat.output.path");
+
+        memset(&outfiles, 0, sizeof(outfiles));
+        rd_mutex_init(&outfiles.lock);
+}
+
+
+/**
+ * @brief Render the output path of \p of for a file starting at
+ *        \p offset into \p path.
+ */
+static void outfile_path (const struct outfile *of, int64_t offset,
+                          char *path, size_t size) {
+        const char *t;
+        size_t len = 0;
+
+        for (t = conf.output_path ; *t && len < size - 1 ; t++) {
+                int r = 0;
+
+                if (*t != '%') {
+                        path[len++] = *t;
+                        continue;
+                }
+
+                switch (*(++t))
+                {
+                case 't':
+                        r = snprintf(path+len, size-len, "%s", of->topic);
+                        break;
+                case 'p':
+                        r = snprintf(path+len, size-len, "%"PRId32,
+                                     of->partition);
+                        break;
+                case 'o':
+                        r = snprintf(path+len, size-len, "%"PRId64, offset);
+                        break;
+                default: /* '%' */
+                        path[len++] = '%';
+                        break;
+                }
+
+                if (r < 0 || (size_t)r >= size - len)
+                        KC_FATAL("kafkacat.output.path: path too long");
+                len += r;
+        }
+
+        if (*t)
+                KC_FATAL("kafkacat.output.path: path too long");
+
+        path[len] = '\0';
+}
+
+
+/**
+ * @brief Create the missing parent directories of \p path.
+ */
+static void outfile_mkdirs (char *path) {
+        char *s;
+
+        for (s = path + 1 ; (s = strchr(s, '/')) ; s++) {
+                int r;
+
+                *s = '\0';
+#ifndef _MSC_VER
+                r = mkdir(path, 0755);
+#else
+                r = _mkdir(path);
+#endif
+                if (r == -1 && errno != EEXIST)
+                        KC_FATAL("Failed to create directory %s: %s",
+                                 path, strerror(errno));
+                *s = '/';
+        }
+}
+
+
+/**
+ * @brief Open output file of \p of for a file starting at \p offset.
+ */
+static void outfile_open (struct outfile *of, int64_t offset) {
+        char path[1024];
+        int fd;
+
+        outfile_path(of, offset, path, sizeof(path));
+        outfile_mkdirs(path);
+
+        if ((fd = _COMPAT(open)(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1)
+                KC_FATAL("Failed to open output file %s: %s",
+                         path, strerror(errno));
+
+#if HAVE_FALLOCATE
+        /* Reserve the space up front, without changing the file size,
+         * to avoid fragmentation and allocation on write. */
+        if (conf.output_preallocate > 0 &&
+            fallocate(fd, FALLOC_FL_KEEP_SIZE, 0,
+                      (off_t)conf.output_preallocate) == -1)
+                KC_INFO(2, "Failed to preallocate %"PRId64" bytes "
+                        "for %s: %s\n",
+                        conf.output_preallocate, path, strerror(errno));
+#endif
+
+        KC_INFO(3, "Writing %s [%"PRId32"] to %s\n",
+                of->topic, of->partition, path);
+
+        /* The buffer is only written when full, so the files are
+         * written with large sequential writes. */
+        outbuf_init(&of->ob, fd, conf.output_buffer_size, INT_MAX);
+        if (conf.output_compression != KC_COMPRESSION_NONE)
+                outbuf_set_codec(&of->ob, outcodec_new(), 1/*owner*/);
+        of->start_offset = offset;
+}
+
+
+/**
+ * @brief Close the current output file of \p of.
+ */
+static void outfile_close (struct outfile *of) {
+        outbuf_destroy(&of->ob);
+#if HAVE_FALLOCATE
+        /* Release the preallocated space beyond the end of file */
+        if (conf.output_preallocate > 0) {
+                off_t end = lseek(of->ob.fd, 0, SEEK_CUR);
+
+                if (end != -1 && end < (off_t)conf.output_preallocate)
+                        (void)ftruncate(of->ob.fd, end);
+        }
+#endif
+        _COMPAT(close)(of->ob.fd);
+}
+
+
+/**
+ * @returns the output file for \p rkmessage's partition,
+ *          opening, or rotating, the file as needed.
+ *
+ * Must be called before the message is written to the file.
+ */
+struct outfile *outfile_get (const rd_kafka_message_t *rkmessage) {
+        struct outfile *of = outfile_last;
+        unsigned int bkt;
+
+        if (!of || of->rkt != rkmessage->rkt ||
+            of->partition != rkmessage->partition) {
+                bkt = (unsigned int)(((uintptr_t)rkmessage->rkt >> 4) ^
+                                     (uintptr_t)rkmessage->partition) %
+                        OUTFILES_BUCKETS;
+
+                rd_mutex_lock(&outfiles.lock);
+
+                for (of = outfiles.buckets[bkt] ; of ; of = of->next)
+                        if (of->rkt == rkmessage->rkt &&
+                            of->partition == rkmessage->partition)
+                                break;
+
+                if (!of) {
+                        of = calloc(1, sizeof(*of));
+                        of->rkt       = rkmessage->rkt;
+                        of->topic     = strdup(rd_kafka_topic_name(
+                                                       rkmessage->rkt));
+                        of->partition = rkmessage->partition;
+                        outfile_open(of, rkmessage->offset);
+
+                        of->next = outfiles.buckets[bkt];
+                        outfiles.buckets[bkt] = of;
+                        outfiles.cnt++;
+                }
+
+                rd_mutex_unlock(&outfiles.lock);
+
+                outfile_last = of;
+        }
+
+        /* Rotate at message boundary, if the file is not empty. */
+        if ((conf.output_rotate_bytes &&
+             of->ob.written + of->ob.len >=
+             (uint64_t)conf.output_rotate_bytes) ||
+            (conf.output_rotate_offsets &&
+             rkmessage->offset - of->start_offset >=
+             conf.output_rotate_offsets)) {
+                outfile_close(of);
+                outfile_open(of, rkmessage->offset);
+        }
+
+        return of;
+}
+
+
+/**
+ * @brief Write all buffered output file data, ignoring errors.
+ *        For use from exit handlers.
+ */
+void outfiles_flush_atexit (void) {
+        int i;
+
+        for (i = 0 ; i < OUTFILES_BUCKETS ; i++) {
+                struct outfile *of;
+
+                for (of = outfiles.buckets[i] ; of ; of = of->next)
+                        outbuf_flush_atexit(&of->ob);
+        }
+}
+
+
+/**
+ * @brief Flush and close all output files.
+ */
+void outfiles_term (void) {
+        int i;
+
+        for (i = 0 ; i < OUTFILES_BUCKETS ; i++) {
+                struct outfile *of;
+
+                while ((of = outfiles.buckets[i])) {
+                        outfiles.buckets[i] = of->next;
+                        outfile_close(of);
+                        free(of->topic);
+                        free(of);
+                }
+        }
+
+        KC_INFO(3, "Closed %d output file(s)\n", outfiles.cnt);
+
+        rd_mutex_destroy(&outfiles.lock);
+        outfiles.cnt = 0;
+        outfile_last = NULL;
+}
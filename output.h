@@ -0,0 +1,194 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+
+struct outcodec;
+struct dump_output;
+
+/**
+ * @brief Buffered output writer.
+ *
+ * Messages are rendered into the buffer with the outbuf_..() functions
+ * and the buffer is written to the file descriptor with large write()s
+ * once it holds flush_size bytes, or flush_us after the last flush.
+ * Message boundaries are signalled with outbuf_msg_done().
+ *
+ * Buffers of multiple threads may share an output file descriptor by
+ * sharing a lock (see outbuf_set_lock()): the output of one buffer is
+ * then only interleaved with other buffers' at message boundaries.
+ */
+struct outbuf {
+        int     fd;          /**< Output file descriptor */
+        char   *buf;
+        size_t  size;        /**< Allocated size of buf */
+        size_t  len;         /**< How much of buf is used */
+
+        size_t  flush_size;  /**< Flush when this many bytes are buffered */
+        int64_t flush_us;    /**< Flush buffered messages this long
+                              *   after the last flush,
+                              *   0 = flush every message. */
+        int64_t ts_flush;    /**< rd_clock() of last flush */
+        uint64_t written;    /**< Bytes written to fd (uncompressed) */
+
+        struct outcodec *codec; /**< Optional output compressor */
+        int     codec_owner; /**< Codec is ended and destroyed with
+                              *   the buffer, else it is shared with
+                              *   the owning buffer. */
+
+        struct dump_output *dump; /**< Binary dump writer state,
+                                   *   see dump.c */
+
+        rd_mutex_t *lock;    /**< Optional lock of a shared fd */
+        int     locked;      /**< lock is held until the end of the
+                              *   current message, which did not fit
+                              *   in the buffer. */
+        int     batch;       /**< Between outbuf_batch_begin() and
+                              *   outbuf_batch_end(): only flush when
+                              *   the buffer is full. */
+};
+
+
+void outbuf_init (struct outbuf *ob, int fd, size_t size, int flush_ms);
+void outbuf_destroy (struct outbuf *ob);
+void outbuf_set_lock (struct outbuf *ob, rd_mutex_t *lock);
+void outbuf_set_codec (struct outbuf *ob, struct outcodec *codec, int owner);
+void outbuf_set_written_cb (void (*cb) (struct outbuf *ob));
+void outbuf_flush (struct outbuf *ob);
+void outbuf_flush_idle (struct outbuf *ob);
+void outbuf_flush_partial (struct outbuf *ob);
+void outbuf_flush_atexit (struct outbuf *ob);
+void outbuf_write0 (struct outbuf *ob, const void *p, size_t len);
+void outbuf_printf (struct outbuf *ob, const char *fmt, ...);
+void outbuf_i64 (struct outbuf *ob, int64_t v);
+void outbuf_u64 (struct outbuf *ob, uint64_t v);
+
+
+/**
+ * @brief Append a single character.
+ */
+static RD_UNUSED RD_INLINE
+void outbuf_putc (struct outbuf *ob, char c) {
+        if (ob->len == ob->size)
+                outbuf_flush_partial(ob);
+        ob->buf[ob->len++] = c;
+}
+
+/**
+ * @brief Append \p len bytes from \p p.
+ *
+ * Data that does not fit in the buffer is written directly along
+ * with the buffered data, without copying.
+ */
+static RD_UNUSED RD_INLINE
+void outbuf_write (struct outbuf *ob, const void *p, size_t len) {
+        if (len <= ob->size - ob->len) {
+                memcpy(ob->buf + ob->len, p, len);
+                ob->len += len;
+        } else
+                outbuf_write0(ob, p, len);
+}
+
+/**
+ * @brief Append a nul-terminated string.
+ */
+static RD_UNUSED RD_INLINE
+void outbuf_str (struct outbuf *ob, const char *s) {
+        outbuf_write(ob, s, strlen(s));
+}
+
+
+/**
+ * @brief Signal the end of a message: flushes the buffer if it is
+ *        full enough or the flush interval has elapsed.
+ */
+static RD_UNUSED RD_INLINE
+void outbuf_msg_done (struct outbuf *ob) {
+        if (ob->len >= ob->flush_size || ob->locked ||
+            (ob->len > 0 && !ob->batch &&
+             (ob->flush_us == 0 ||
+              rd_clock() - ob->ts_flush >= ob->flush_us)))
+                outbuf_flush(ob);
+}
+
+/**
+ * @brief Start a batch of messages: the buffer is not flushed at the end
+ *        of each message, unless full, until outbuf_batch_end().
+ */
+static RD_UNUSED RD_INLINE
+void outbuf_batch_begin (struct outbuf *ob) {
+        ob->batch = 1;
+}
+
+/**
+ * @brief End a batch of messages, flushing the buffer as
+ *        outbuf_msg_done() would have after its last message.
+ */
+static RD_UNUSED RD_INLINE
+void outbuf_batch_end (struct outbuf *ob) {
+        ob->batch = 0;
+        outbuf_msg_done(ob);
+}
+
+/**
+ * @brief Flush the buffer, and compressor, if the flush interval has
+ *        elapsed. Call periodically while waiting for messages.
+ */
+static RD_UNUSED RD_INLINE
+void outbuf_idle (struct outbuf *ob) {
+        if ((ob->len > 0 || ob->codec) &&
+            rd_clock() - ob->ts_flush >= ob->flush_us)
+                outbuf_flush_idle(ob);
+}
+
+
+
+/**
+ * @brief Per-partition output file (kafkacat.output.path),
+ *        see outfile_get().
+ */
+struct outfile {
+        struct outfile *next;       /**< Hash bucket chain */
+        const rd_kafka_topic_t *rkt; /**< Lookup key (with partition) */
+        char           *topic;
+        int32_t         partition;
+
+        struct outbuf   ob;         /**< Current file's buffered writer */
+        int64_t         start_offset; /**< First offset in current file */
+};
+
+struct outcodec *outcodec_new (void);
+
+void outfiles_init (void);
+struct outfile *outfile_get (const rd_kafka_message_t *rkmessage);
+void outfiles_flush_atexit (void);
+void outfiles_term (void);
+
+#endif
@@ -0,0 +1,393 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * Rate limiter, see ratelimit.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kafkacat.h"
+#include "ratelimit.h"
+
+
+/* Adaptive pacing parameters */
+#define RL_ADJUST_US      (200 * 1000) /**< Minimum time between
+                                        *   rate adjustments */
+#define RL_BACKOFF_THROTTLE 0.5        /**< Rate factor on throttling */
+#define RL_BACKOFF_LATENCY  0.8        /**< Rate factor on high latency */
+#define RL_INCREASE       0.05         /**< Increase per adjustment,
+                                        *   relative to the configured
+                                        *   (or current) rate. */
+
+/**
+ * @brief Token bucket, implemented as a virtual scheduler: \c tat is
+ *        the time at which all tokens taken so far will have been
+ *        replenished.
+ */
+struct rl_bucket {
+        double   rate;      /**< Configured units per second, 0 = none */
+        double   cur;       /**< Current units per second, 0 = none */
+        int64_t  tat;       /**< Theoretical arrival time (us) */
+        double   window;    /**< Units taken in the current window */
+        double   observed;  /**< Units per second of the last window */
+};
+
+enum {
+        RL_MSGS,
+        RL_BYTES,
+        RL_BUCKET_CNT
+};
+
+static struct {
+        rd_mutex_t lock;
+        int        enabled;
+        int        adaptive;
+        int64_t    burst_us;
+
+        struct rl_bucket b[RL_BUCKET_CNT];
+
+        int64_t    ts_window;       /**< Start of the current window */
+        int64_t    ts_adjust;       /**< Last rate adjustment */
+
+        int64_t    latency_min;     /**< Lowest delivery latency (us) */
+        double     latency_avg;     /**< Moving average latency (us) */
+
+        uint64_t   backoffs;        /**< Number of rate decreases */
+        uint64_t   waits;           /**< Number of delayed messages */
+        int64_t    waited_us;       /**< Total delay */
+} rl;
+
+
+/**
+ * @brief Set up the rate limiter from the kafkacat.rate.* properties.
+ */
+void ratelimit_init (void) {
+        memset(&rl, 0, sizeof(rl));
+
+        rl.adaptive = conf.rate_adaptive;
+        rl.enabled  = conf.rate_msgs > 0 || conf.rate_bytes > 0 ||
+                rl.adaptive;
+        if (!rl.enabled)
+                return;
+
+        rd_mutex_init(&rl.lock);
+        rl.burst_us = (int64_t)conf.rate_burst_ms * 1000;
+        rl.b[RL_MSGS].rate  = rl.b[RL_MSGS].cur  = (double)conf.rate_msgs;
+        rl.b[RL_BYTES].rate = rl.b[RL_BYTES].cur = (double)conf.rate_bytes;
+        rl.ts_window = rl.ts_adjust = rd_clock();
+}
+
+
+/**
+ * @brief Lower the current rates by \p factor, starting from the
+ *        observed rate where none is set.
+ *
+ * @locks rl.lock MUST be held
+ */
+static void ratelimit_backoff (int64_t now, double factor) {
+        int i;
+
+        if (now - rl.ts_adjust < RL_ADJUST_US)
+                return;
+
+        for (i = 0 ; i < RL_BUCKET_CNT ; i++) {
+                struct rl_bucket *b = &rl.b[i];
+                double base = b->cur > 0 ? b->cur : b->observed;
+
+                if (base <= 0)
+                        continue; /* Nothing observed yet */
+
+                /* Never go below one message (or byte) per second. */
+                b->cur = MAX(base * factor, 1.0);
+        }
+
+        rl.ts_adjust = now;
+        rl.backoffs++;
+        KC_INFO(2, "Rate limiter: backing off to %.0f msgs/s, "
+                "%.0f bytes/s\n", rl.b[RL_MSGS].cur, rl.b[RL_BYTES].cur);
+}
+
+
+/**
+ * @brief Raise the current rates towards the configured rates, and lift
+ *        an adaptive limit that is no longer restricting.
+ *
+ * @locks rl.lock MUST be held
+ */
+static void ratelimit_increase (int64_t now) {
+        int i;
+
+        for (i = 0 ; i < RL_BUCKET_CNT ; i++) {
+                struct rl_bucket *b = &rl.b[i];
+
+                if (b->cur <= 0 || (b->rate > 0 && b->cur >= b->rate))
+                        continue;
+
+                if (b->rate > 0) {
+                        b->cur = MIN(b->cur + b->rate * RL_INCREASE,
+                                     b->rate);
+                } else {
+                        b->cur *= 1.0 + RL_INCREASE;
+                        if (b->cur > 2 * b->observed)
+                                b->cur = 0;
+                }
+        }
+
+        rl.ts_adjust = now;
+}
+
+
+/**
+ * @brief Take the tokens of \p msgs messages of \p bytes bytes.
+ *
+ * Thread-safe.
+ *
+ * @returns the time in microseconds the caller must wait before
+ *          producing (or outputting) the messages, 0 if none.
+ */
+int64_t ratelimit_take (int msgs, size_t bytes) {
+        const double cost[RL_BUCKET_CNT] = { (double)msgs, (double)bytes };
+        int64_t now, wait_us = 0;
+        int i;
+
+        if (!rl.enabled)
+                return 0;
+
+        now = rd_clock();
+
+        rd_mutex_lock(&rl.lock);
+
+        /* Measure the rate per window, which the adaptive rates start
+         * from and are lifted at. */
+        if (now - rl.ts_window >= RL_ADJUST_US) {
+                for (i = 0 ; i < RL_BUCKET_CNT ; i++) {
+                        rl.b[i].observed = rl.b[i].window * 1000000.0 /
+                                (double)(now - rl.ts_window);
+                        rl.b[i].window = 0;
+                }
+                rl.ts_window = now;
+
+                if (rl.adaptive && now - rl.ts_adjust >= RL_ADJUST_US)
+                        ratelimit_increase(now);
+        }
+
+        for (i = 0 ; i < RL_BUCKET_CNT ; i++) {
+                struct rl_bucket *b = &rl.b[i];
+                int64_t w;
+
+                b->window += cost[i];
+
+                if (b->cur <= 0)
+                        continue;
+
+                /* A bucket that has been idle is full, not more.
+                 * The messages may go once the tokens taken before
+                 * them, less the burst, have been replenished, so that
+                 * a message larger than the burst is not held back on
+                 * an idle bucket. */
+                if (b->tat < now)
+                        b->tat = now;
+
+                w = b->tat - now - rl.burst_us;
+                if (w > wait_us)
+                        wait_us = w;
+
+                b->tat += (int64_t)(cost[i] * 1000000.0 / b->cur);
+        }
+
+        if (wait_us > 0) {
+                rl.waits++;
+                rl.waited_us += wait_us;
+        }
+
+        rd_mutex_unlock(&rl.lock);
+
+        return wait_us;
+}
+
+
+/**
+ * @brief A broker throttled a request by \p throttle_time_ms,
+ *        back off if adaptive.
+ */
+void ratelimit_throttled (int throttle_time_ms) {
+        if (!rl.adaptive || throttle_time_ms <= 0)
+                return;
+
+        rd_mutex_lock(&rl.lock);
+        ratelimit_backoff(rd_clock(), RL_BACKOFF_THROTTLE);
+        rd_mutex_unlock(&rl.lock);
+}
+
+
+/**
+ * @brief A message was delivered \p latency_us after it was produced,
+ *        back off if adaptive and the average latency exceeds the
+ *        target: kafkacat.rate.adaptive.latency.ms, or four times the
+ *        lowest latency seen (at least 10ms).
+ */
+void ratelimit_latency (int64_t latency_us) {
+        int64_t target;
+
+        if (!rl.adaptive || latency_us < 0)
+                return;
+
+        rd_mutex_lock(&rl.lock);
+
+        if (!rl.latency_min || latency_us < rl.latency_min)
+                rl.latency_min = MAX(latency_us, 1);
+
+        if (rl.latency_avg <= 0)
+                rl.latency_avg = (double)latency_us;
+        else
+                rl.latency_avg += ((double)latency_us - rl.latency_avg) / 16;
+
+        if (conf.rate_latency_ms > 0)
+                target = (int64_t)conf.rate_latency_ms * 1000;
+        else
+                target = MAX(rl.latency_min * 4, 10 * 1000);
+
+        if (rl.latency_avg > (double)target)
+                ratelimit_backoff(rd_clock(), RL_BACKOFF_LATENCY);
+
+        rd_mutex_unlock(&rl.lock);
+}
+
+
+/**
+ * @brief Print the rate limiter's statistics (-v) and free its
+ *        resources.
+ */
+void ratelimit_term (void) {
+        if (!rl.enabled)
+                return;
+
+        KC_INFO(2, "Rate limiter: %"PRIu64" message(s) delayed by "
+                "%.3fs in total, %"PRIu64" backoff(s)\n",
+                rl.waits, (double)rl.waited_us / 1000000.0, rl.backoffs);
+
+        rd_mutex_destroy(&rl.lock);
+        rl.enabled = 0;
+}
+
+
+/**
+ * @brief Unittests for the token buckets and adaptive backoff.
+ */
+int ratelimit_unittest (void) {
+        struct conf save = conf;
+        int64_t w, w2;
+        int fails = 0;
+        int i;
+
+#define RL_NEAR(A,B) ((A) > (B) - 0.001 && (A) < (B) + 0.001)
+#define RL_CHECK(COND, ...) do {                                        \
+                if (!(COND)) {                                          \
+                        fprintf(stderr, "%s: FAILED: ", __FUNCTION__); \
+                        fprintf(stderr, __VA_ARGS__);                   \
+                        fails++;                                        \
+                }                                                       \
+        } while (0)
+
+        conf.verbosity = 0;
+
+        /* Disabled: never waits */
+        conf.rate_msgs = conf.rate_bytes = 0;
+        conf.rate_adaptive = 0;
+        ratelimit_init();
+        RL_CHECK(ratelimit_take(1000000, 1000000000) == 0,
+                 "disabled limiter waited\n");
+        ratelimit_term();
+
+        /* 1000 msgs/s with a 10ms burst: 11 messages are admitted
+         * immediately, then one per millisecond. */
+        conf.rate_msgs = 1000;
+        conf.rate_burst_ms = 10;
+        ratelimit_init();
+        for (i = 0 ; i < 11 ; i++)
+                RL_CHECK((w = ratelimit_take(1, 100)) == 0,
+                         "burst message #%d waited %"PRId64"us\n", i, w);
+        w  = ratelimit_take(1, 100);
+        w2 = ratelimit_take(1, 100);
+        RL_CHECK(w > 0 && w <= 1000, "expected wait < 1ms, not %"PRId64"us\n",
+                 w);
+        RL_CHECK(w2 - w >= 900 && w2 - w <= 1100,
+                 "expected 1ms between messages, not %"PRId64"us\n", w2 - w);
+        ratelimit_term();
+
+        /* Bytes: 1 MB/s, a 1 MB message waits for about a second
+         * minus the burst. */
+        conf.rate_msgs = 0;
+        conf.rate_bytes = 1000000;
+        ratelimit_init();
+        RL_CHECK(ratelimit_take(1, 1000000) == 0,
+                 "first message waited\n");
+        w = ratelimit_take(1, 1000000);
+        RL_CHECK(w >= 980000 && w <= 990000,
+                 "expected wait of ~0.99s, not %"PRId64"us\n", w);
+        ratelimit_term();
+
+        /* Adaptive: throttling halves the rate, once per interval. */
+        conf.rate_msgs = 1000;
+        conf.rate_bytes = 0;
+        conf.rate_adaptive = 1;
+        ratelimit_init();
+        rl.ts_adjust -= RL_ADJUST_US;
+        ratelimit_throttled(100);
+        ratelimit_throttled(100);
+        RL_CHECK(RL_NEAR(rl.b[RL_MSGS].cur, 500),
+                 "expected 500 msgs/s after throttling, not %.0f\n",
+                 rl.b[RL_MSGS].cur);
+        ratelimit_increase(rd_clock());
+        RL_CHECK(RL_NEAR(rl.b[RL_MSGS].cur, 550),
+                 "expected 550 msgs/s after increase, not %.0f\n",
+                 rl.b[RL_MSGS].cur);
+
+        /* Adaptive: latency above target backs off. */
+        conf.rate_latency_ms = 50;
+        rl.ts_adjust -= RL_ADJUST_US;
+        ratelimit_latency(20 * 1000);
+        RL_CHECK(RL_NEAR(rl.b[RL_MSGS].cur, 550),
+                 "backed off below latency target\n");
+        rl.latency_avg = 0;
+        ratelimit_latency(100 * 1000);
+        RL_CHECK(RL_NEAR(rl.b[RL_MSGS].cur, 440),
+                 "expected 440 msgs/s after high latency, not %.0f\n",
+                 rl.b[RL_MSGS].cur);
+        ratelimit_term();
+
+#undef RL_CHECK
+#undef RL_NEAR
+
+        conf = save;
+
+        return fails;
+}
@@ -0,0 +1,58 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+/**
+ * Producer and consumer rate limiter (-X kafkacat.rate.*)
+ *
+ * Messages are admitted by a pair of token buckets, in messages and
+ * bytes per second, that allow bursts of kafkacat.rate.burst.ms worth
+ * of messages. Each admitted message reserves its tokens up front and
+ * the caller waits for the returned time, so concurrent producer or
+ * consumer threads are paced in the order they asked and the combined
+ * rate never exceeds the limit.
+ *
+ * With kafkacat.rate.adaptive=true the current rates are lowered
+ * (multiplicatively) when a broker throttles a request or the delivery
+ * latency exceeds kafkacat.rate.adaptive.latency.ms, and raised
+ * (additively) back towards the configured rates, or without a
+ * configured rate until the limit is lifted, while neither happens.
+ */
+
+void ratelimit_init (void);
+int64_t ratelimit_take (int msgs, size_t bytes);
+void ratelimit_throttled (int throttle_time_ms);
+void ratelimit_latency (int64_t latency_us);
+void ratelimit_term (void);
+
+int ratelimit_unittest (void);
+
+#endif
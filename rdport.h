@@ -40,6 +40,7 @@
 
 #define RD_NORETURN
 #define RD_UNUSED
+#define RD_INLINE __inline
 
 /* MSVC loves prefixing POSIX functions with underscore */
 #define _COMPAT(FUNC)  _ ## FUNC
@@ -72,15 +73,189 @@ int rd_gettimeofday (struct timeval *tv, struct timezone *tz) {
 }
 
 
+/**
+ * @returns a monotonic clock in microseconds.
+ */
+static RD_UNUSED
+int64_t rd_clock (void) {
+        static LARGE_INTEGER freq;
+        LARGE_INTEGER now;
+
+        if (!freq.QuadPart)
+                QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&now);
+
+        return (int64_t)((now.QuadPart / freq.QuadPart) * 1000000 +
+                         ((now.QuadPart % freq.QuadPart) * 1000000) /
+                         freq.QuadPart);
+}
+
+/**
+ * @returns a monotonic clock in nanoseconds.
+ */
+static RD_UNUSED
+int64_t rd_clock_ns (void) {
+        static LARGE_INTEGER freq;
+        LARGE_INTEGER now;
+
+        if (!freq.QuadPart)
+                QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&now);
+
+        return (int64_t)((now.QuadPart / freq.QuadPart) * 1000000000 +
+                         ((now.QuadPart % freq.QuadPart) * 1000000000) /
+                         freq.QuadPart);
+}
+
+#define rd_usleep(us) Sleep((DWORD)(((us) + 999) / 1000))
+
+
+/**
+ * Threads
+ */
+typedef HANDLE rd_thread_t;
+typedef DWORD rd_thread_ret_t;
+#define RD_THREAD_CC WINAPI
+
+static RD_UNUSED
+int rd_thread_create (rd_thread_t *thrp,
+                      rd_thread_ret_t (RD_THREAD_CC *start) (void *),
+                      void *arg) {
+        *thrp = CreateThread(NULL, 0, start, arg, 0, NULL);
+        return *thrp ? 0 : -1;
+}
+
+static RD_UNUSED
+void rd_thread_join (rd_thread_t thr) {
+        WaitForSingleObject(thr, INFINITE);
+        CloseHandle(thr);
+}
+
+/* Thread-local storage */
+#define RD_TLS __declspec(thread)
+
+/**
+ * Mutexes
+ */
+typedef CRITICAL_SECTION rd_mutex_t;
+#define rd_mutex_init(M)    InitializeCriticalSection(M)
+#define rd_mutex_destroy(M) DeleteCriticalSection(M)
+#define rd_mutex_lock(M)    EnterCriticalSection(M)
+#define rd_mutex_unlock(M)  LeaveCriticalSection(M)
+
+
+/**
+ * Atomics (int, and uint64_t for rd_atomic64_..())
+ */
+#define rd_atomic_load(P) \
+        ((int)InterlockedCompareExchange((volatile LONG *)(P), 0, 0))
+#define rd_atomic_store(P,V) \
+        ((void)InterlockedExchange((volatile LONG *)(P), (LONG)(V)))
+#define rd_atomic_add(P,V) \
+        ((int)InterlockedExchangeAdd((volatile LONG *)(P), (LONG)(V)) + (V))
+#define rd_atomic_sub(P,V) rd_atomic_add(P, -(V))
+#define rd_atomic64_add(P,V) \
+        ((uint64_t)InterlockedExchangeAdd64((volatile LONG64 *)(P), \
+                                            (LONG64)(V)) + (V))
+#define rd_atomic64_load(P) \
+        ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(P), 0, 0))
+#define rd_atomic64_store(P,V) \
+        ((void)InterlockedExchange64((volatile LONG64 *)(P), (LONG64)(V)))
+
+
 #else
 /* POSIX */
+#include <time.h>
+#include <errno.h>
 
 #define RD_NORETURN __attribute__((noreturn))
 #define RD_UNUSED __attribute__((unused))
+#define RD_INLINE inline
 
 #define _COMPAT(FUNC) FUNC
 
 #define rd_gettimeofday(tv,tz) gettimeofday(tv,tz)
+
+/**
+ * @returns a monotonic clock in microseconds.
+ */
+static RD_UNUSED RD_INLINE
+int64_t rd_clock (void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ((int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/**
+ * @returns a monotonic clock in nanoseconds.
+ */
+static RD_UNUSED RD_INLINE
+int64_t rd_clock_ns (void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static RD_UNUSED RD_INLINE
+void rd_usleep (int64_t us) {
+        struct timespec ts = { (time_t)(us / 1000000),
+                               (long)((us % 1000000) * 1000) };
+
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+                ;
+}
+
+
+/**
+ * Threads
+ */
+#include <pthread.h>
+
+typedef pthread_t rd_thread_t;
+typedef void *rd_thread_ret_t;
+#define RD_THREAD_CC
+
+static RD_UNUSED RD_INLINE
+int rd_thread_create (rd_thread_t *thrp,
+                      rd_thread_ret_t (RD_THREAD_CC *start) (void *),
+                      void *arg) {
+        return pthread_create(thrp, NULL, start, arg) ? -1 : 0;
+}
+
+static RD_UNUSED RD_INLINE
+void rd_thread_join (rd_thread_t thr) {
+        pthread_join(thr, NULL);
+}
+
+/* Thread-local storage */
+#define RD_TLS __thread
+
+/**
+ * Mutexes
+ */
+typedef pthread_mutex_t rd_mutex_t;
+#define rd_mutex_init(M)    pthread_mutex_init(M, NULL)
+#define rd_mutex_destroy(M) pthread_mutex_destroy(M)
+#define rd_mutex_lock(M)    pthread_mutex_lock(M)
+#define rd_mutex_unlock(M)  pthread_mutex_unlock(M)
+
+
+/**
+ * Atomics (int, and uint64_t for rd_atomic64_..()):
+ * loads are acquire, stores are release and add/sub are full barriers
+ * returning the new value.
+ */
+#define rd_atomic_load(P)     __atomic_load_n(P, __ATOMIC_ACQUIRE)
+#define rd_atomic_store(P,V)  __atomic_store_n(P, V, __ATOMIC_RELEASE)
+#define rd_atomic_add(P,V)    __atomic_add_fetch(P, V, __ATOMIC_SEQ_CST)
+#define rd_atomic_sub(P,V)    __atomic_sub_fetch(P, V, __ATOMIC_SEQ_CST)
+#define rd_atomic64_add(P,V)  __atomic_add_fetch(P, V, __ATOMIC_SEQ_CST)
+#define rd_atomic64_load(P)   __atomic_load_n(P, __ATOMIC_ACQUIRE)
+#define rd_atomic64_store(P,V) __atomic_store_n(P, V, __ATOMIC_RELEASE)
 #endif
 
 
@@ -91,3 +266,17 @@ int rd_gettimeofday (struct timeval *tv, struct timezone *tz) {
 #ifndef MIN
 #define MIN(A,B) ((A) < (B) ? (A) : (B))
 #endif
+
+
+/**
+ * @brief strndup() replacement, MSVC lacks it.
+ */
+static RD_UNUSED RD_INLINE
+char *rd_strndup (const char *s, size_t len) {
+        char *d = malloc(len + 1);
+
+        memcpy(d, s, len);
+        d[len] = '\0';
+
+        return d;
+}
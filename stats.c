@@ -0,0 +1,562 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2021, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Periodic statistics (-X kafkacat.stats.interval.ms=<ms>)
+ *
+ * librdkafka's statistics callback drives the reporting: every interval
+ * the rates of the kafkacat counters (struct stats), the producer queue
+ * depth and the consumer lag of each partition are written as a text
+ * line to stderr, as a JSON object (along with librdkafka's statistics)
+ * per line to a file, as a JSON datagram to udp://host:port, or as
+ * statsd metrics to statsd://host:port.
+ */
+
+#ifndef _MSC_VER
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "kafkacat.h"
+
+
+#ifdef _MSC_VER
+typedef SOCKET stats_sock_t;
+#define STATS_SOCK_INVALID INVALID_SOCKET
+#define stats_sock_close(S) closesocket(S)
+#else
+typedef int stats_sock_t;
+#define STATS_SOCK_INVALID -1
+#define stats_sock_close(S) close(S)
+#endif
+
+/* Maximum statsd datagram size */
+#define STATS_STATSD_MTU 1400
+
+typedef enum {
+        STATS_OUT_TEXT,   /**< Text lines to stderr */
+        STATS_OUT_FILE,   /**< JSON lines to a file */
+        STATS_OUT_UDP,    /**< JSON datagrams */
+        STATS_OUT_STATSD, /**< statsd datagrams */
+} stats_out_t;
+
+static struct {
+        stats_out_t  type;
+        FILE        *fp;            /**< STATS_OUT_FILE */
+        stats_sock_t sock;          /**< STATS_OUT_UDP, .._STATSD */
+        int64_t      ts_last;       /**< rd_clock() of the last interval */
+        struct stats last;          /**< Counters at the last interval */
+} stats_out = { .sock = STATS_SOCK_INVALID };
+
+
+/**
+ * @brief Growable string buffer for rendering a report.
+ */
+struct stats_str {
+        char  *buf;
+        size_t len;
+        size_t size;
+};
+
+static void stats_printf (struct stats_str *str, const char *fmt, ...) {
+        va_list ap;
+        int r;
+
+        while (1) {
+                va_start(ap, fmt);
+                r = vsnprintf(str->buf + str->len, str->size - str->len,
+                              fmt, ap);
+                va_end(ap);
+
+                if (r < 0)
+                        KC_FATAL("Failed to format statistics");
+
+                if ((size_t)r < str->size - str->len)
+                        break;
+
+                str->size = (str->size + r + 1) * 2;
+                if (!(str->buf = realloc(str->buf, str->size)))
+                        KC_FATAL("Failed to allocate %zu bytes of "
+                                 "statistics", str->size);
+        }
+
+        str->len += (size_t)r;
+}
+
+
+/**
+ * @brief Connect the UDP socket to \p hostport ("host:port").
+ */
+static void stats_connect (const char *hostport) {
+        struct addrinfo hints = { 0 }, *res;
+        const char *t = strrchr(hostport, ':');
+        char host[256];
+        int r;
+
+        if (!t || t == hostport || (size_t)(t - hostport) >= sizeof(host) ||
+            !*(t+1))
+                KC_FATAL("kafkacat.stats.output: expected host:port, "
+                         "not \"%s\"", hostport);
+
+        memcpy(host, hostport, (size_t)(t - hostport));
+        host[t - hostport] = '\0';
+
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+
+        if ((r = getaddrinfo(host, t+1, &hints, &res)))
+                KC_FATAL("kafkacat.stats.output: failed to resolve %s: %s",
+                         hostport, gai_strerror(r));
+
+        stats_out.sock = socket(res->ai_family, res->ai_socktype,
+                                res->ai_protocol);
+        if (stats_out.sock == STATS_SOCK_INVALID ||
+            connect(stats_out.sock, res->ai_addr,
+                    (int)res->ai_addrlen) == -1)
+                KC_FATAL("kafkacat.stats.output: failed to connect "
+                         "to %s: %s", hostport, strerror(errno));
+
+        freeaddrinfo(res);
+}
+
+
+/**
+ * @brief Send \p len bytes of \p buf as a datagram, errors are ignored
+ *        (e.g., no one is listening).
+ */
+static void stats_send (const char *buf, size_t len) {
+        if (send(stats_out.sock, buf, (int)len, 0) == -1)
+                KC_INFO(2, "Failed to send statistics: %s\n",
+                        strerror(errno));
+}
+
+
+/**
+ * @returns the next offset of each consumed partition, with
+ *          the offsets set to -1 for partitions where it isn't known,
+ *          or NULL if not a consumer.
+ */
+static rd_kafka_topic_partition_list_t *stats_positions (void) {
+        rd_kafka_topic_partition_list_t *parts = NULL;
+        int i;
+
+        if (stats.part_next) {
+                /* Simple consumer (-C) */
+                int base = 0;
+
+                parts = rd_kafka_topic_partition_list_new(stats.part_cnt);
+                for (i = 0 ; i < stats.part_cnt ; i++) {
+                        int64_t next = (int64_t)rd_atomic64_load(
+                                &stats.part_next[i]);
+
+                        /* Each topic's partitions are consecutive */
+                        if (i > 0 &&
+                            stats.part_topic[i] != stats.part_topic[i-1])
+                                base = i;
+
+                        if (next >= 0)
+                                rd_kafka_topic_partition_list_add(
+                                        parts, stats.part_topic[i],
+                                        i - base)->offset = next;
+                }
+
+#if ENABLE_KAFKACONSUMER
+        } else if (conf.mode == 'G' && conf.assignment) {
+                /* High-level consumer (-G) */
+                parts = rd_kafka_topic_partition_list_copy(conf.assignment);
+                if (rd_kafka_position(conf.rk, parts))
+                        for (i = 0 ; i < parts->cnt ; i++)
+                                parts->elems[i].offset = -1;
+#endif
+        }
+
+        return parts;
+}
+
+
+/**
+ * @returns the consumer lag of \p rktpar given its next offset,
+ *          using the cached high watermark, or -1 if not known.
+ */
+static int64_t stats_lag (const rd_kafka_topic_partition_t *rktpar) {
+        int64_t lo, hi;
+
+        if (rktpar->offset < 0 ||
+            rd_kafka_get_watermark_offsets(conf.rk, rktpar->topic,
+                                           rktpar->partition, &lo, &hi) ||
+            hi < 0)
+                return -1;
+
+        return hi > rktpar->offset ? hi - rktpar->offset : 0;
+}
+
+
+/**
+ * @brief Statistics of the last interval.
+ */
+struct stats_interval {
+        double   secs;
+        uint64_t tx_msgs;
+        uint64_t tx_bytes;
+        uint64_t tx_err_q;
+        uint64_t tx_err_dr;
+        uint64_t rx_msgs;
+        uint64_t rx_bytes;
+        double   fmt_us;     /**< Average formatting time per message */
+        uint64_t throttle_ms;
+        int      outq;
+};
+
+
+/**
+ * @brief Render the interval statistics \p si and partition lag as
+ *        a text line.
+ */
+static void stats_render_text (struct stats_str *str,
+                               const struct stats_interval *si,
+                               const rd_kafka_topic_partition_list_t *parts) {
+        int i, cnt = 0;
+
+        stats_printf(str, "%% Stats: %.2fs: ", si->secs);
+
+        if (conf.mode == 'P')
+                stats_printf(str,
+                             "delivered %.0f msgs/s (%.2f MB/s), "
+                             "outq %d, queue full %"PRIu64", "
+                             "failed %"PRIu64,
+                             (double)si->tx_msgs / si->secs,
+                             (double)si->tx_bytes / si->secs /
+                             (1024.0 * 1024.0),
+                             si->outq, si->tx_err_q, si->tx_err_dr);
+        else
+                stats_printf(str,
+                             "consumed %.0f msgs/s (%.2f MB/s), "
+                             "format %.2fus/msg",
+                             (double)si->rx_msgs / si->secs,
+                             (double)si->rx_bytes / si->secs /
+                             (1024.0 * 1024.0),
+                             si->fmt_us);
+
+        stats_printf(str, ", throttled %"PRIu64"ms", si->throttle_ms);
+
+        for (i = 0 ; parts && i < parts->cnt ; i++) {
+                int64_t lag = stats_lag(&parts->elems[i]);
+                if (lag == -1)
+                        continue;
+                stats_printf(str, "%s%s [%"PRId32"] %"PRId64,
+                             cnt++ == 0 ? ", lag " : ", ",
+                             parts->elems[i].topic,
+                             parts->elems[i].partition, lag);
+        }
+
+        stats_printf(str, "\n");
+}
+
+
+/**
+ * @brief Render the interval statistics \p si and partition lag as
+ *        a JSON object, without the trailing '}'.
+ */
+static void stats_render_json (struct stats_str *str,
+                               const struct stats_interval *si,
+                               const rd_kafka_topic_partition_list_t *parts) {
+        int i, cnt = 0;
+
+        stats_printf(str,
+                     "{\"kafkacat\":{\"mode\":\"%c\",\"interval\":%.3f,"
+                     "\"tx_msgs_per_sec\":%.1f,\"tx_bytes_per_sec\":%.1f,"
+                     "\"tx_err_q\":%"PRIu64",\"tx_err_dr\":%"PRIu64","
+                     "\"outq\":%d,"
+                     "\"rx_msgs_per_sec\":%.1f,\"rx_bytes_per_sec\":%.1f,"
+                     "\"fmt_us_per_msg\":%.3f,\"throttle_ms\":%"PRIu64","
+                     "\"partitions\":[",
+                     conf.mode, si->secs,
+                     (double)si->tx_msgs / si->secs,
+                     (double)si->tx_bytes / si->secs,
+                     si->tx_err_q, si->tx_err_dr, si->outq,
+                     (double)si->rx_msgs / si->secs,
+                     (double)si->rx_bytes / si->secs,
+                     si->fmt_us, si->throttle_ms);
+
+        /* Topic names are not escaped: legal topic names only
+         * consist of [a-zA-Z0-9._-] */
+        for (i = 0 ; parts && i < parts->cnt ; i++) {
+                int64_t lag = stats_lag(&parts->elems[i]);
+                if (lag == -1)
+                        continue;
+                stats_printf(str,
+                             "%s{\"topic\":\"%s\",\"partition\":%"PRId32","
+                             "\"offset\":%"PRId64",\"lag\":%"PRId64"}",
+                             cnt++ > 0 ? "," : "",
+                             parts->elems[i].topic,
+                             parts->elems[i].partition,
+                             parts->elems[i].offset, lag);
+        }
+
+        stats_printf(str, "]}");
+}
+
+
+/**
+ * @brief Send the interval statistics \p si and partition lag as
+ *        statsd gauges, in datagrams of at most STATS_STATSD_MTU bytes.
+ */
+static void stats_emit_statsd (const struct stats_interval *si,
+                               const rd_kafka_topic_partition_list_t *parts) {
+        struct stats_str str = { NULL };
+        size_t of = 0; /* Start of the current datagram */
+        int i;
+
+        if (conf.mode == 'P')
+                stats_printf(&str,
+                             "kafkacat.tx.msgs_per_sec:%.0f|g\n"
+                             "kafkacat.tx.bytes_per_sec:%.0f|g\n"
+                             "kafkacat.tx.queue_full:%"PRIu64"|c\n"
+                             "kafkacat.tx.failed:%"PRIu64"|c\n"
+                             "kafkacat.tx.outq:%d|g\n",
+                             (double)si->tx_msgs / si->secs,
+                             (double)si->tx_bytes / si->secs,
+                             si->tx_err_q, si->tx_err_dr, si->outq);
+        else
+                stats_printf(&str,
+                             "kafkacat.rx.msgs_per_sec:%.0f|g\n"
+                             "kafkacat.rx.bytes_per_sec:%.0f|g\n"
+                             "kafkacat.rx.fmt_us_per_msg:%.3f|g\n",
+                             (double)si->rx_msgs / si->secs,
+                             (double)si->rx_bytes / si->secs,
+                             si->fmt_us);
+
+        stats_printf(&str, "kafkacat.throttle_ms:%"PRIu64"|c\n",
+                     si->throttle_ms);
+
+        for (i = 0 ; parts && i < parts->cnt ; i++) {
+                int64_t lag = stats_lag(&parts->elems[i]);
+                size_t len = str.len;
+
+                if (lag == -1)
+                        continue;
+
+                stats_printf(&str, "kafkacat.rx.lag.%s.%"PRId32":%"PRId64
+                             "|g\n",
+                             parts->elems[i].topic,
+                             parts->elems[i].partition, lag);
+
+                /* Send what precedes this metric if it would make
+                 * the datagram too large. */
+                if (str.len - of > STATS_STATSD_MTU && len > of) {
+                        stats_send(str.buf + of, len - of);
+                        of = len;
+                }
+        }
+
+        if (str.len > of)
+                stats_send(str.buf + of, str.len - of);
+
+        free(str.buf);
+}
+
+
+/**
+ * @brief librdkafka statistics callback: emit the kafkacat statistics
+ *        of the last interval, and the librdkafka \p json statistics
+ *        to the JSON file.
+ */
+static int stats_cb (rd_kafka_t *rk, char *json, size_t json_len,
+                     void *opaque) {
+        struct stats cur = { 0 };
+        struct stats_interval si;
+        struct stats_str str = { NULL };
+        rd_kafka_topic_partition_list_t *parts;
+        int64_t now = rd_clock();
+
+        cur.tx_delivered = rd_atomic64_load(&stats.tx_delivered);
+        cur.tx_bytes     = rd_atomic64_load(&stats.tx_bytes);
+        cur.tx_err_q     = rd_atomic64_load(&stats.tx_err_q);
+        cur.tx_err_dr    = rd_atomic64_load(&stats.tx_err_dr);
+        cur.rx           = rd_atomic64_load(&stats.rx);
+        cur.rx_bytes     = rd_atomic64_load(&stats.rx_bytes);
+        cur.fmt_ns       = rd_atomic64_load(&stats.fmt_ns);
+        cur.throttle_ms  = rd_atomic64_load(&stats.throttle_ms);
+
+        si.secs        = (double)(now - stats_out.ts_last) / 1000000.0;
+        if (si.secs <= 0.0)
+                si.secs = 0.000001;
+        si.tx_msgs     = cur.tx_delivered - stats_out.last.tx_delivered;
+        si.tx_bytes    = cur.tx_bytes - stats_out.last.tx_bytes;
+        si.tx_err_q    = cur.tx_err_q - stats_out.last.tx_err_q;
+        si.tx_err_dr   = cur.tx_err_dr - stats_out.last.tx_err_dr;
+        si.rx_msgs     = cur.rx - stats_out.last.rx;
+        si.rx_bytes    = cur.rx_bytes - stats_out.last.rx_bytes;
+        si.fmt_us      = si.rx_msgs ?
+                (double)(cur.fmt_ns - stats_out.last.fmt_ns) / 1000.0 /
+                (double)si.rx_msgs : 0.0;
+        si.throttle_ms = cur.throttle_ms - stats_out.last.throttle_ms;
+        si.outq        = conf.mode == 'P' ? rd_kafka_outq_len(rk) : 0;
+
+        stats_out.last    = cur;
+        stats_out.ts_last = now;
+
+        parts = conf.mode != 'P' ? stats_positions() : NULL;
+
+        switch (stats_out.type)
+        {
+        case STATS_OUT_TEXT:
+                stats_render_text(&str, &si, parts);
+                fwrite(str.buf, str.len, 1, stderr);
+                break;
+
+        case STATS_OUT_FILE:
+                stats_render_json(&str, &si, parts);
+                stats_printf(&str, ",\"rdkafka\":%.*s}\n",
+                             (int)json_len, json);
+                if (fwrite(str.buf, str.len, 1, stats_out.fp) != 1 ||
+                    fflush(stats_out.fp))
+                        KC_ERROR("Failed to write statistics to %s: %s",
+                                 conf.stats_output, strerror(errno));
+                break;
+
+        case STATS_OUT_UDP:
+                stats_render_json(&str, &si, parts);
+                stats_printf(&str, "}");
+                stats_send(str.buf, str.len);
+                break;
+
+        case STATS_OUT_STATSD:
+                stats_emit_statsd(&si, parts);
+                break;
+        }
+
+        if (parts)
+                rd_kafka_topic_partition_list_destroy(parts);
+        free(str.buf);
+
+        return 0; /* Let librdkafka free the json */
+}
+
+
+/**
+ * @brief Set up periodic statistics for the configured interval and
+ *        destination, prior to creating the client instance.
+ */
+void stats_init (void) {
+        char tmp[32];
+        char errstr[256];
+        const char *out = conf.stats_output;
+
+        snprintf(tmp, sizeof(tmp), "%d", conf.stats_interval_ms);
+        if (rd_kafka_conf_set(conf.rk_conf, "statistics.interval.ms", tmp,
+                              errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK)
+                KC_FATAL("%s", errstr);
+
+        rd_kafka_conf_set_stats_cb(conf.rk_conf, stats_cb);
+
+        if (!out || !strcmp(out, "-")) {
+                stats_out.type = STATS_OUT_TEXT;
+
+        } else if (!strncmp(out, "udp://", 6)) {
+                stats_out.type = STATS_OUT_UDP;
+                stats_connect(out + 6);
+
+        } else if (!strncmp(out, "statsd://", 9)) {
+                stats_out.type = STATS_OUT_STATSD;
+                stats_connect(out + 9);
+
+        } else {
+                stats_out.type = STATS_OUT_FILE;
+                if (!(stats_out.fp = fopen(out, "a")))
+                        KC_FATAL("Failed to open statistics file %s: %s",
+                                 out, strerror(errno));
+        }
+
+        stats_out.ts_last = rd_clock();
+}
+
+
+/**
+ * @brief Track the consumed offsets of the \p cnt partitions of
+ *        \p topic of the simple consumer (-C) for the lag statistics.
+ *        Must be called before consuming.
+ *
+ * @returns the index of the topic's partition 0 in stats.part_next.
+ */
+int stats_partitions_add (const char *topic, int cnt) {
+        int base = stats.part_cnt;
+        char *name = strdup(topic);
+        int i;
+
+        stats.part_next  = realloc(stats.part_next,
+                                   sizeof(*stats.part_next) *
+                                   (base + cnt));
+        stats.part_topic = realloc(stats.part_topic,
+                                   sizeof(*stats.part_topic) *
+                                   (base + cnt));
+        for (i = base ; i < base + cnt ; i++) {
+                stats.part_next[i]  = -1;
+                stats.part_topic[i] = name;
+        }
+        stats.part_cnt = base + cnt;
+
+        return base;
+}
+
+
+/**
+ * @brief Close the statistics destination.
+ */
+void stats_term (void) {
+        if (stats_out.fp) {
+                fclose(stats_out.fp);
+                stats_out.fp = NULL;
+        }
+
+        if (stats_out.sock != STATS_SOCK_INVALID) {
+                stats_sock_close(stats_out.sock);
+                stats_out.sock = STATS_SOCK_INVALID;
+        }
+
+        if (stats.part_next) {
+                int i;
+
+                for (i = 0 ; i < stats.part_cnt ; i++)
+                        if (i == 0 ||
+                            stats.part_topic[i] != stats.part_topic[i-1])
+                                free(stats.part_topic[i]);
+                free(stats.part_topic);
+                free(stats.part_next);
+                stats.part_next = NULL;
+                stats.part_topic = NULL;
+                stats.part_cnt = 0;
+        }
+}
@@ -67,6 +67,26 @@ if [[ $output != $exp ]]; then
 fi
 
 
+info "Reading Avro messages through the schema cache"
+dir=$(mktemp -d)
+trap "rm -rf $dir" EXIT
+for run in fetch cached ; do
+    output=$($KAFKACAT -C -r $SR_URL -t $topic -o beginning -e -D\; \
+                       -s value=avro -s key=avro \
+                       -X kafkacat.schema.cache=$dir \
+                       -X kafkacat.schema.prefetch=true)
+    if [[ $output != $exp ]]; then
+        echo "FAIL: Expected '$exp' ($run), not '$output'"
+        exit 1
+    fi
+done
+
+if ! ls $dir/sr-*.avsc >/dev/null ; then
+    echo "FAIL: No schemas were cached in $dir"
+    exit 1
+fi
+
+
 info "Verifying first message's JSON with jq"
 output=$($KAFKACAT -C -r $SR_URL -t $topic -o beginning -c 1 -s value=avro | \
              jq -r '(.name + "=" + (.number | tostring))')
@@ -0,0 +1,62 @@
+#!/bin/bash
+#
+
+set -e
+
+source helpers.sh
+
+
+#
+# Verify that -X kafkacat.output.path writes each partition to its own
+# file, with and without -j and rotation.
+#
+
+
+topic=$(make_topic_name)
+
+dir=$(mktemp -d)
+trap "rm -rf $dir" EXIT
+
+# Produce some messages to three partitions
+info "Priming producer for $topic"
+for p in 0 1 2 ; do
+    seq 1 100 | sed -e "s/^/$p:/" | $KAFKACAT -t $topic -p $p
+done
+
+
+for threads in 1 3 ; do
+    info "Consuming to per-partition files with -j $threads"
+    rm -rf $dir/*
+
+    $KAFKACAT -C -t $topic -o beginning -e -j $threads \
+              -X kafkacat.output.path=$dir/%t/%p.log
+
+    for p in 0 1 2 ; do
+        output=$(cat $dir/$topic/$p.log)
+        exp=$(seq 1 100 | sed -e "s/^/$p:/")
+        if [[ $output != $exp ]]; then
+            FAIL "Partition $p file with -j $threads: expected '$exp', not '$output'"
+        fi
+    done
+done
+
+
+info "Consuming to per-partition files with rotation"
+rm -rf $dir/*
+
+$KAFKACAT -C -t $topic -p 1 -o beginning -e \
+          -X kafkacat.output.path=$dir/%p-%o.log \
+          -X kafkacat.output.rotate.offsets=30
+
+files=$(cd $dir && ls | sort -t- -k2 -n | xargs)
+if [[ $files != "1-0.log 1-30.log 1-60.log 1-90.log" ]]; then
+    FAIL "Unexpected rotated files: $files"
+fi
+
+output=$(cat $dir/1-0.log $dir/1-30.log $dir/1-60.log $dir/1-90.log)
+exp=$(seq 1 100 | sed -e "s/^/1:/")
+if [[ $output != $exp ]]; then
+    FAIL "Rotated files: expected '$exp', not '$output'"
+fi
+
+PASS
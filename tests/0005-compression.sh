@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+
+set -e
+
+source helpers.sh
+
+
+#
+# Verify that compressed consumer output can be produced back as
+# compressed producer input.
+#
+
+
+topic=$(make_topic_name)
+topic2=$(make_topic_name)
+
+dir=$(mktemp -d)
+trap "rm -rf $dir" EXIT
+
+info "Priming producer for $topic"
+seq 1 1000 | $KAFKACAT -t $topic -p 0
+
+
+for codec in zstd lz4 ; do
+    if ! $KAFKACAT -X kafkacat.output.compression=$codec -V >/dev/null 2>&1
+    then
+        info "Skipping $codec: not supported by this build"
+        continue
+    fi
+
+    info "Consuming $codec compressed output"
+    $KAFKACAT -C -t $topic -p 0 -o beginning -e \
+              -X kafkacat.output.compression=$codec > $dir/out.$codec
+
+    info "Producing $codec compressed input"
+    ext=$codec
+    [[ $codec == zstd ]] && ext=zst
+    mv $dir/out.$codec $dir/in.$ext
+    $KAFKACAT -P -t ${topic2}_$codec -p 0 -l $dir/in.$ext
+
+    output=$($KAFKACAT -C -t ${topic2}_$codec -p 0 -o beginning -e)
+    exp=$(seq 1 1000)
+    if [[ $output != $exp ]]; then
+        FAIL "$codec roundtrip: expected '$exp', not '$output'"
+    fi
+done
+
+PASS
@@ -0,0 +1,57 @@
+#!/bin/bash
+#
+
+set -e
+
+source helpers.sh
+
+
+#
+# Verify that a binary dump (-X kafkacat.dump=true) restores the
+# messages with their keys and partitions, in full and from an offset.
+#
+
+
+topic=$(make_topic_name)
+topic2=$(make_topic_name)
+topic3=$(make_topic_name)
+
+dir=$(mktemp -d)
+trap "rm -rf $dir" EXIT
+
+info "Priming producer for $topic"
+for p in 0 1 ; do
+    seq 1 200 | sed -e "s/^/key$p:/" | $KAFKACAT -t $topic -p $p -K:
+done
+
+fmt='%p %k %s\n'
+
+
+info "Dumping $topic"
+$KAFKACAT -C -t $topic -o beginning -e -X kafkacat.dump=true \
+          -X kafkacat.dump.index.interval=10 > $dir/dump.kcd
+
+info "Restoring the dump to $topic2"
+$KAFKACAT -P -t $topic2 -X kafkacat.dump=true -l $dir/dump.kcd
+
+for p in 0 1 ; do
+    output=$($KAFKACAT -C -t $topic2 -p $p -o beginning -e -f "$fmt")
+    exp=$($KAFKACAT -C -t $topic -p $p -o beginning -e -f "$fmt")
+    if [[ $output != $exp ]]; then
+        FAIL "Partition $p restore: expected '$exp', not '$output'"
+    fi
+done
+
+
+info "Restoring the dump from offset 150 to $topic3"
+$KAFKACAT -P -t $topic3 -X kafkacat.dump=true -o 150 -l $dir/dump.kcd
+
+for p in 0 1 ; do
+    output=$($KAFKACAT -C -t $topic3 -p $p -o beginning -e -f "$fmt")
+    exp=$(seq 151 200 | sed -e "s/^/$p key$p /")
+    if [[ $output != $exp ]]; then
+        FAIL "Partition $p restore from offset: expected '$exp', not '$output'"
+    fi
+done
+
+PASS
@@ -0,0 +1,37 @@
+#!/bin/bash
+#
+
+set -e
+
+source helpers.sh
+
+
+#
+# Verify that a -G consumer resumes, for each kafkacat.offset.store mode,
+# right after the last message output by the previous consumer of the
+# group, without gaps or duplicates.
+#
+
+
+topic=$(make_topic_name)
+
+info "Priming producer for $topic"
+seq 1 100 | $KAFKACAT -t $topic -p 0
+
+for mode in message batch flush; do
+    group=${topic}_$mode
+
+    info "Consuming 30 and then the remaining messages with $mode"
+    first=$($KAFKACAT -G $group -X auto.offset.reset=earliest -c 30 \
+                      -X kafkacat.offset.store=$mode $topic)
+    rest=$($KAFKACAT -G $group -X auto.offset.reset=earliest -e \
+                     -X kafkacat.offset.store=$mode $topic)
+
+    output=$(echo "$first"; echo "$rest")
+    exp=$(seq 1 100)
+    if [[ $output != $exp ]]; then
+        FAIL "$mode: expected 1..100 over two consumers, not '$output'"
+    fi
+done
+
+PASS
@@ -0,0 +1,59 @@
+#!/bin/bash
+#
+
+set -e
+
+source helpers.sh
+
+
+#
+# Verify that -o s@<ts> -o e@<ts> consumes exactly the messages within
+# the time range from each partition, and that partitions without
+# messages in the range are not consumed.
+#
+
+
+topic=$(make_topic_name)
+
+create_topic $topic 3
+
+base=1600000000000
+
+info "Producing messages with timestamps to $topic"
+for p in 0 1 ; do
+    for i in $(seq 0 99) ; do
+        echo "{\"partition\":$p,\"ts\":$(( base + i * 1000 )),\"key\":\"$i\",\"payload\":\"msg$p.$i\"}"
+    done
+done | $KAFKACAT -P -t $topic -J
+
+# Partition 2 has messages only after the range
+for i in $(seq 0 9) ; do
+    echo "{\"partition\":2,\"ts\":$(( base + 200000 + i )),\"payload\":\"late$i\"}"
+done | $KAFKACAT -P -t $topic -J
+
+
+info "Consuming the messages from 20s to 50s"
+output=$($KAFKACAT -C -t $topic -o s@$(( base + 20000 )) \
+                   -o e@$(( base + 50000 )) -f '%p %k %s\n' | sort -n -k1 -k2)
+
+exp=$(for p in 0 1 ; do
+          for i in $(seq 20 49) ; do
+              echo "$p $i msg$p.$i"
+          done
+      done)
+
+if [[ $output != $exp ]]; then
+    FAIL "Expected '$exp', not '$output'"
+fi
+
+
+info "Consuming up to 5.5s from the beginning"
+output=$($KAFKACAT -C -t $topic -p 1 -o beginning -o e@$(( base + 5500 )) \
+                   -f '%s\n')
+exp=$(seq 0 5 | sed -e 's/^/msg1./')
+
+if [[ $output != $exp ]]; then
+    FAIL "Expected '$exp', not '$output'"
+fi
+
+PASS
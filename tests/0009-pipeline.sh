@@ -0,0 +1,93 @@
+#!/bin/bash
+#
+
+set -e
+
+source helpers.sh
+
+
+#
+# Verify that the pipelined producer (-X kafkacat.produce.pipeline.depth)
+# produces all messages, also when stopped by -c <cnt> while messages
+# are still in the pipeline, and that it stops cleanly when terminated
+# with messages still in the pipeline.
+#
+
+
+topic=$(make_topic_name)
+
+
+info "Producing 20000 messages through the pipeline to $topic"
+seq 1 20000 | $KAFKACAT -P -t $topic -p 0 \
+                        -X kafkacat.produce.pipeline.depth=1000
+
+output=$($KAFKACAT -C -t $topic -p 0 -o beginning -e -f '%s\n')
+exp=$(seq 1 20000)
+
+if [[ $output != $exp ]]; then
+    FAIL "Pipelined produce: expected 20000 messages in order"
+fi
+
+
+info "Producing 10000 of 50000 messages through the pipeline with -c"
+seq 1 50000 | $KAFKACAT -P -t $topic -p 1 -c 10000 \
+                        -X kafkacat.produce.pipeline.depth=1000
+
+output=$($KAFKACAT -C -t $topic -p 1 -o beginning -e -f '%s\n')
+exp=$(seq 1 10000)
+
+if [[ $output != $exp ]]; then
+    FAIL "Pipelined produce with -c: expected the first 10000 messages"
+fi
+
+
+topic2=$(make_topic_name)
+
+# Terminate the pipelined producer with SIGINT while the ring is full
+# and librdkafka's small queue, which is only drained after linger.ms,
+# keeps the produce thread retrying on QUEUE_FULL.
+function sigint_test {
+    local partition=$1
+    local what=$2
+    shift 2
+
+    info "Terminating the $what pipelined producer to $topic2 with SIGINT"
+    local errfile=$(mktemp)
+    seq 1 10000000 | $KAFKACAT -P -t $topic2 -p $partition \
+                               -X kafkacat.produce.pipeline.depth=100000 \
+                               -X queue.buffering.max.messages=10 \
+                               -X batch.num.messages=10 \
+                               -X linger.ms=1000 \
+                               "$@" 2>$errfile &
+    local pid=$!
+    sleep 2
+    kill -INT $pid
+    set +e
+    wait $pid
+    local ret=$?
+    set -e
+    local err=$(cat $errfile)
+    rm -f $errfile
+
+    if [[ $ret != 0 ]]; then
+        FAIL "Pipelined $what produce: exited with $ret on SIGINT: $err"
+    fi
+
+    if [[ $err == *"Program terminated while producing"* ]]; then
+        FAIL "Pipelined $what produce: fatal error on SIGINT: $err"
+    fi
+
+    local output=$($KAFKACAT -C -t $topic2 -p $partition -o beginning -e \
+                             -f '%s\n')
+    local cnt=$(echo -n "$output" | grep -c '' || true)
+    local exp=$(seq 1 $cnt)
+
+    if [[ $output != $exp ]]; then
+        FAIL "Pipelined $what produce with SIGINT: expected the first $cnt messages"
+    fi
+}
+
+sigint_test 0 "single message"
+sigint_test 1 "batched" -X kafkacat.produce.batch.size=100
+
+PASS
@@ -0,0 +1,67 @@
+#!/bin/bash
+#
+
+set -e
+
+source helpers.sh
+
+
+#
+# Verify that batched producing (-X kafkacat.produce.batch.size=..)
+# produces all messages in order: bounded by message count, bytes and
+# time, with -c <cnt>, and when part of a batch fails on a full
+# producer queue and is resubmitted.
+#
+
+
+topic=$(make_topic_name)
+
+create_topic $topic 5
+
+fmt='%k %s\n'
+
+function check_partition {
+    local p=$1
+    local exp=$2
+    local what=$3
+    local output
+
+    output=$($KAFKACAT -C -t $topic -p $p -o beginning -e -f "$fmt")
+    if [[ $output != $exp ]]; then
+        FAIL "$what: expected '$(echo "$exp" | head -3)...', not '$(echo "$output" | head -3)...'"
+    fi
+}
+
+
+info "Producing batches of 100 messages"
+seq 1 10000 | sed -e 's/.*/k&:&/' | \
+    $KAFKACAT -P -t $topic -p 0 -K: -X kafkacat.produce.batch.size=100
+check_partition 0 "$(seq 1 10000 | sed -e 's/.*/k& &/')" "batch.size"
+
+info "Producing batches bounded by bytes and time"
+seq 1 10000 | $KAFKACAT -P -t $topic -p 1 \
+                        -X kafkacat.produce.batch.size=1000 \
+                        -X kafkacat.produce.batch.bytes=512 \
+                        -X kafkacat.produce.batch.ms=1
+check_partition 1 "$(seq 1 10000 | sed -e 's/^/ /')" "batch.bytes"
+
+info "Producing 2500 of 10000 messages in batches with -c"
+seq 1 10000 | $KAFKACAT -P -t $topic -p 2 -c 2500 \
+                        -X kafkacat.produce.batch.size=1000
+check_partition 2 "$(seq 1 2500 | sed -e 's/^/ /')" "batch.size with -c"
+
+info "Producing batches larger than the producer queue"
+seq 1 20000 | $KAFKACAT -P -t $topic -p 3 \
+                        -X kafkacat.produce.batch.size=1000 \
+                        -X queue.buffering.max.messages=300
+check_partition 3 "$(seq 1 20000 | sed -e 's/^/ /')" \
+                "batch resubmitted on full queue"
+
+info "Producing batches larger than the producer queue with -c"
+seq 1 20000 | $KAFKACAT -P -t $topic -p 4 -c 15000 \
+                        -X kafkacat.produce.batch.size=1000 \
+                        -X queue.buffering.max.messages=300
+check_partition 4 "$(seq 1 15000 | sed -e 's/^/ /')" \
+                "batch resubmitted on full queue with -c"
+
+PASS
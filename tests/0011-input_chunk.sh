@@ -0,0 +1,50 @@
+#!/bin/bash
+#
+
+set -e
+
+source helpers.sh
+
+
+#
+# Verify that chunked input (-X kafkacat.input.chunk.size=..) produces
+# the same messages as regular input, with single and multi-byte
+# delimiters and messages that span and exceed the chunk size.
+#
+
+
+topic=$(make_topic_name)
+
+dir=$(mktemp -d)
+trap "rm -rf $dir" EXIT
+
+fmt='%k=%s\n'
+
+# Messages of 0..2999 bytes, larger than the 1024 byte chunks
+gen_msgs ';KeyDel;' ':MyDelim:' > $dir/multi.txt
+gen_msgs ';' '\n' > $dir/single.txt
+
+exp=$(gen_msgs '=' '\n')
+
+
+info "Producing multi-byte delimited input in chunks"
+cat $dir/multi.txt | $KAFKACAT -P -t $topic -p 0 -K ';KeyDel;' \
+                               -D ':MyDelim:' \
+                               -X kafkacat.input.chunk.size=1024
+
+output=$($KAFKACAT -C -t $topic -p 0 -o beginning -e -f "$fmt")
+if [[ $output != $exp ]]; then
+    FAIL "Chunked multi-byte delimited input differs"
+fi
+
+
+info "Producing single-byte delimited input in chunks"
+cat $dir/single.txt | $KAFKACAT -P -t $topic -p 1 -K ';' \
+                                -X kafkacat.input.chunk.size=1024
+
+output=$($KAFKACAT -C -t $topic -p 1 -o beginning -e -f "$fmt")
+if [[ $output != $exp ]]; then
+    FAIL "Chunked single-byte delimited input differs"
+fi
+
+PASS
@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+
+set -e
+
+source helpers.sh
+
+
+#
+# Verify that producing files with a pool of worker threads (-P -j)
+# produces one message per file, in the order given with a fixed key
+# (-k, ordered mode) and all of them without.
+#
+
+
+topic=$(make_topic_name)
+
+dir=$(mktemp -d)
+trap "rm -rf $dir" EXIT
+
+files=""
+for i in $(seq 1 100) ; do
+    # Sizes from a few bytes to 64 KiB
+    head -c $(( (i * 7919) % 65536 )) /dev/zero | tr '\0' 'x' > $dir/f$i
+    echo "file$i" >> $dir/f$i
+    files="$files $dir/f$i"
+done
+
+exp=$(for i in $(seq 1 100) ; do echo "$(( (i * 7919) % 65536 + 5 + ${#i} )) file$i" ; done)
+
+
+info "Producing files in order with -j 8 -k"
+$KAFKACAT -P -t $topic -p 0 -j 8 -k fixed $files
+
+output=$($KAFKACAT -C -t $topic -p 0 -o beginning -e -f '%k %S %s' |
+             sed -e 's/x*file/file/' | awk '{ print $2, $3 }')
+if [[ $output != $exp ]]; then
+    FAIL "Ordered files: expected '$exp', not '$output'"
+fi
+
+keys=$($KAFKACAT -C -t $topic -p 0 -o beginning -e -f '%k\n' | sort -u)
+if [[ $keys != "fixed" ]]; then
+    FAIL "Ordered files: expected key 'fixed', not '$keys'"
+fi
+
+
+info "Producing files unordered with -j 8"
+$KAFKACAT -P -t $topic -p 1 -j 8 -X kafkacat.produce.files.ordered=false \
+          $files
+
+output=$($KAFKACAT -C -t $topic -p 1 -o beginning -e -f '%S %s' |
+             sed -e 's/x*file/file/' | sort -n -k2.5)
+exp=$(echo "$exp" | sort -n -k2.5)
+if [[ $output != $exp ]]; then
+    FAIL "Unordered files: expected '$exp', not '$output'"
+fi
+
+PASS
@@ -0,0 +1,46 @@
+#!/bin/bash
+#
+
+set -e
+
+source helpers.sh
+
+
+#
+# Verify that producing from a regular file, which is memory mapped
+# by default, produces the same messages as with
+# -X kafkacat.input.mmap=false, with multi-byte delimiters.
+#
+
+
+topic=$(make_topic_name)
+
+dir=$(mktemp -d)
+trap "rm -rf $dir" EXIT
+
+fmt='%k=%s\n'
+
+# Messages of 0..2999 bytes, the last one without a trailing delimiter
+gen_msgs ';KeyDel;' ':MyDelim:' 1 > $dir/input.txt
+
+exp=$(gen_msgs '=' '\n')
+
+
+info "Producing from redirected stdin (mmap)"
+$KAFKACAT -P -t $topic -p 0 -K ';KeyDel;' -D ':MyDelim:' < $dir/input.txt
+
+info "Producing from -l <file> (mmap)"
+$KAFKACAT -P -t $topic -p 1 -K ';KeyDel;' -D ':MyDelim:' -l $dir/input.txt
+
+info "Producing from redirected stdin with input.mmap=false"
+$KAFKACAT -P -t $topic -p 2 -K ';KeyDel;' -D ':MyDelim:' \
+          -X kafkacat.input.mmap=false < $dir/input.txt
+
+for p in 0 1 2 ; do
+    output=$($KAFKACAT -C -t $topic -p $p -o beginning -e -f "$fmt")
+    if [[ $output != $exp ]]; then
+        FAIL "Partition $p: produced messages differ from the input"
+    fi
+done
+
+PASS
@@ -0,0 +1,110 @@
+#!/bin/bash
+#
+# Run the microbenchmarks (kafkacat -U bench) and, if $BROKERS is set,
+# a produce and consume throughput run (-B), and compare the results
+# against a stored baseline.
+#
+# Results are written as "<name> <ns/op> <MB/s>" lines to
+# $BENCH_OUTPUT (bench/last.txt).
+# A benchmark whose ns/op exceeds the baseline's by more than
+# $BENCH_TOLERANCE percent (default 20) fails the run.
+#
+# Usage:
+#   ./bench.sh               Run and compare against $BENCH_BASELINE
+#                            (bench/baseline.txt)
+#   ./bench.sh --baseline    Run and store the results as the baseline
+#
+
+set -e
+
+CLR_BGRED="\033[37;41m"
+CLR_BGGREEN="\033[37;42m"
+CLR_INFO="\033[34m"
+CLR="\033[0m"
+
+KAFKACAT=${KAFKACAT:-../kafkacat}
+BENCH_BASELINE=${BENCH_BASELINE:-bench/baseline.txt}
+BENCH_OUTPUT=${BENCH_OUTPUT:-bench/last.txt}
+BENCH_TOLERANCE=${BENCH_TOLERANCE:-20}
+BENCH_MSGCNT=${BENCH_MSGCNT:-1000000}
+BENCH_MSGSIZE=${BENCH_MSGSIZE:-100}
+
+function info {
+    echo -e "${CLR_INFO}bench | $1${CLR}"
+}
+
+function FAIL {
+    echo -e "${CLR_BGRED}bench | FAILED: $1${CLR}"
+    exit 1
+}
+
+
+#
+# Convert a -B "Total: <what> <n> messages (<b> bytes) in <s>s: ..." report
+# line to a "<name> <ns/op> <MB/s>" result line.
+#
+function broker_result {
+    local name=$1
+    awk -v name=$name '/^Total: / {
+        msgs = $3; secs = $8; sub(/s:$/, "", secs);
+        bytes = $5; sub(/^\(/, "", bytes);
+        if (msgs > 0 && secs > 0)
+            printf("%-40s %12.2f %10.2f\n", name, secs * 1e9 / msgs,
+                   bytes / secs / (1024 * 1024));
+    }'
+}
+
+
+mkdir -p $(dirname $BENCH_OUTPUT)
+tmp=$(mktemp)
+trap "rm -f $tmp" EXIT
+
+info "Running microbenchmarks"
+$KAFKACAT -U bench | tee $tmp
+
+if [[ -n $BROKERS ]]; then
+    topic="kafkacat_bench_$$_${RANDOM}"
+
+    info "Producing $BENCH_MSGCNT messages to $topic on $BROKERS"
+    $KAFKACAT -b $BROKERS -P -B -t $topic -c $BENCH_MSGCNT \
+              -X kafkacat.bench.msg.size=$BENCH_MSGSIZE | \
+        broker_result broker/produce | tee -a $tmp
+
+    info "Consuming $BENCH_MSGCNT messages from $topic"
+    $KAFKACAT -b $BROKERS -C -B -t $topic -o beginning -e \
+              -c $BENCH_MSGCNT | \
+        broker_result broker/consume | tee -a $tmp
+else
+    info "\$BROKERS not set: skipping produce/consume throughput run"
+fi
+
+grep -v '^#' $tmp > $BENCH_OUTPUT
+
+if [[ $1 == "--baseline" ]]; then
+    mkdir -p $(dirname $BENCH_BASELINE)
+    cp $BENCH_OUTPUT $BENCH_BASELINE
+    info "Stored results as baseline $BENCH_BASELINE"
+    exit 0
+fi
+
+if [[ ! -f $BENCH_BASELINE ]]; then
+    info "No baseline $BENCH_BASELINE: store one with 'make bench-baseline'"
+    exit 0
+fi
+
+info "Comparing against $BENCH_BASELINE (tolerance $BENCH_TOLERANCE%)"
+if ! awk -v tol=$BENCH_TOLERANCE '
+    NR == FNR { if ($1 !~ /^#/) base[$1] = $2; next }
+    $1 in base {
+        change = base[$1] > 0 ? ($2 - base[$1]) * 100 / base[$1] : 0;
+        status = change > tol ? "REGRESSION" : "ok";
+        if (change > tol)
+            fails++;
+        printf("%-40s %12.2f %12.2f %+8.1f%% %s\n",
+               $1, base[$1], $2, change, status);
+    }
+    END { exit fails > 0 }' $BENCH_BASELINE $BENCH_OUTPUT; then
+    FAIL "ns/op regressed by more than $BENCH_TOLERANCE% from the baseline"
+fi
+
+echo -e "${CLR_BGGREEN}bench | PASSED${CLR}"
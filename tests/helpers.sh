@@ -32,6 +32,25 @@ function create_topic {
 }
 
 
+# Print 2000 messages "key<i><key-delim><value>" of 0..2999 byte values,
+# each followed by <delim>, or with <leading-delim> set to 1 preceded by
+# <delim> except for the first message (no trailing delimiter).
+# Delimiters are interpreted as awk strings, e.g. '\n'.
+function gen_msgs {
+    local key_delim=$1
+    local delim=$2
+    local leading=${3:-0}
+    awk -v kd="$key_delim" -v d="$delim" -v lead="$leading" \
+        'BEGIN { for (i = 1 ; i <= 2000 ; i++) {
+                     len = (i * 7919) % 3000; v = "";
+                     while (length(v) < len) v = v "v" i;
+                     printf("%skey%d%s%s%s",
+                            lead == 1 && i > 1 ? d : "",
+                            i, kd, substr(v, 1, len),
+                            lead == 1 ? "" : d) } }'
+}
+
+
 function info {
     local str=$1
     echo -e "${CLR_INFO}${TEST_NAME} | $str${CLR}"
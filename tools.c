@@ -52,17 +52,264 @@ void partition_list_print (rd_kafka_topic_partition_list_t *parts,
         }
 }
 
+#if RD_KAFKA_VERSION >= 0x00090300
+/**
+ * @brief One leader's share of an offsets_for_times_by_leader() query.
+ */
+struct offsets_job {
+        int32_t leader;
+        int     list;                           /**< Caller's list */
+        rd_kafka_topic_partition_list_t *parts; /**< The leader's partitions,
+                                                 *   the opaque is the index
+                                                 *   in the caller's list. */
+        rd_kafka_resp_err_t err;
+};
+
+static struct {
+        struct offsets_job *jobs;
+        int     cnt;
+        int     next;           /**< Next job to pick. Atomic. */
+        int     timeout_ms;
+} offsets_jobs;
+
+
+static rd_thread_ret_t RD_THREAD_CC offsets_worker_main (void *arg) {
+        int i;
+
+        while ((i = rd_atomic_add(&offsets_jobs.next, 1) - 1) <
+               offsets_jobs.cnt) {
+                struct offsets_job *job = &offsets_jobs.jobs[i];
+
+                job->err = rd_kafka_offsets_for_times(conf.rk, job->parts,
+                                                      offsets_jobs.timeout_ms);
+        }
+
+        return (rd_thread_ret_t)0;
+}
+
+
+/**
+ * @returns the leader of \p topic [\p partition] in \p topics,
+ *          or -1 if unknown.
+ *
+ * @param cachep caches the last topic looked up, since lists are
+ *               mostly grouped by topic.
+ */
+static int32_t partition_leader (const rd_kafka_metadata_topic_t *topics,
+                                 int topic_cnt,
+                                 const rd_kafka_metadata_topic_t **cachep,
+                                 const char *topic, int32_t partition) {
+        const rd_kafka_metadata_topic_t *t = *cachep;
+        int i;
+
+        if (!t || strcmp(t->topic, topic)) {
+                for (i = 0, t = NULL ; i < topic_cnt && !t ; i++)
+                        if (!strcmp(topics[i].topic, topic))
+                                t = &topics[i];
+                if (!(*cachep = t))
+                        return -1;
+        }
+
+        /* Partitions are usually listed in partition order */
+        if (partition >= 0 && partition < t->partition_cnt &&
+            t->partitions[partition].id == partition)
+                return t->partitions[partition].leader;
+
+        for (i = 0 ; i < t->partition_cnt ; i++)
+                if (t->partitions[i].id == partition)
+                        return t->partitions[i].leader;
+
+        return -1;
+}
+
+
+/**
+ * @returns the job of \p leader and \p list in \p *jobsp, appending
+ *          a new job if there is none.
+ */
+static struct offsets_job *offsets_job_get (struct offsets_job **jobsp,
+                                            int *cntp, int *sizep,
+                                            int32_t leader, int list) {
+        struct offsets_job *job;
+        int i;
+
+        for (i = *cntp - 1 ; i >= 0 ; i--)
+                if ((*jobsp)[i].leader == leader && (*jobsp)[i].list == list)
+                        return &(*jobsp)[i];
+
+        if (*cntp == *sizep) {
+                *sizep = *sizep ? *sizep * 2 : 16;
+                if (!(*jobsp = realloc(*jobsp, sizeof(**jobsp) * *sizep)))
+                        KC_FATAL("Failed to allocate offset queries");
+        }
+
+        job = &(*jobsp)[(*cntp)++];
+        job->leader = leader;
+        job->list   = list;
+        job->parts  = rd_kafka_topic_partition_list_new(64);
+        job->err    = RD_KAFKA_RESP_ERR_NO_ERROR;
+
+        return job;
+}
+
+
+/**
+ * @brief Look up the offsets for the timestamps (or the logical
+ *        offsets END and BEGINNING for the watermarks) in each of the
+ *        \p list_cnt \p lists as rd_kafka_offsets_for_times() does,
+ *        but split into one request per partition leader and list, with
+ *        the requests issued in parallel by up to conf.threads threads.
+ *
+ * A request that fails or times out fails only its own partitions,
+ * and partitions without a known leader (in the \p topics metadata)
+ * fail with LEADER_NOT_AVAILABLE.
+ *
+ * @returns an error if all requests failed, else NO_ERROR with the
+ *          partitions' errors set.
+ */
+rd_kafka_resp_err_t
+offsets_for_times_by_leader (rd_kafka_topic_partition_list_t **lists,
+                             int list_cnt,
+                             const rd_kafka_metadata_topic_t *topics,
+                             int topic_cnt, int timeout_ms) {
+        const rd_kafka_metadata_topic_t *cache = NULL;
+        struct offsets_job *jobs = NULL;
+        rd_thread_t *thrs;
+        int job_cnt = 0, job_size = 0, thr_cnt, failed = 0;
+        int part_cnt = 0;
+        rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
+        int l, i, j;
+
+        /* Group the partitions by leader */
+        for (l = 0 ; l < list_cnt ; l++) {
+                for (i = 0 ; i < lists[l]->cnt ; i++) {
+                        rd_kafka_topic_partition_t *p = &lists[l]->elems[i];
+                        int32_t leader = partition_leader(topics, topic_cnt,
+                                                          &cache, p->topic,
+                                                          p->partition);
+                        struct offsets_job *job;
+
+                        part_cnt++;
+
+                        if (leader == -1) {
+                                p->err =
+                                        RD_KAFKA_RESP_ERR_LEADER_NOT_AVAILABLE;
+                                continue;
+                        }
+
+                        job = offsets_job_get(&jobs, &job_cnt, &job_size,
+                                              leader, l);
+
+                        rd_kafka_topic_partition_list_add(
+                                job->parts, p->topic, p->partition)->offset =
+                                p->offset;
+                        job->parts->elems[job->parts->cnt-1].opaque =
+                                (void *)(intptr_t)i;
+                }
+        }
+
+        if (job_cnt == 0) {
+                free(jobs);
+                return part_cnt > 0 ?
+                        RD_KAFKA_RESP_ERR_LEADER_NOT_AVAILABLE :
+                        RD_KAFKA_RESP_ERR_NO_ERROR;
+        }
+
+        offsets_jobs.jobs       = jobs;
+        offsets_jobs.cnt        = job_cnt;
+        offsets_jobs.next       = 0;
+        offsets_jobs.timeout_ms = timeout_ms;
+
+        thr_cnt = MIN(conf.threads, job_cnt);
+        KC_INFO(2, "Querying %d partition offset(s) with %d request(s) "
+                "using %d thread(s)\n", part_cnt, job_cnt, thr_cnt);
+
+        if (thr_cnt <= 1) {
+                offsets_worker_main(NULL);
+        } else {
+                thrs = calloc(thr_cnt, sizeof(*thrs));
+                for (i = 0 ; i < thr_cnt ; i++)
+                        if (rd_thread_create(&thrs[i], offsets_worker_main,
+                                             NULL) == -1)
+                                KC_FATAL("Failed to create offset query "
+                                         "thread: %s", strerror(errno));
+                for (i = 0 ; i < thr_cnt ; i++)
+                        rd_thread_join(thrs[i]);
+                free(thrs);
+        }
+
+        /* Scatter the results back to the caller's list */
+        for (j = 0 ; j < job_cnt ; j++) {
+                if (jobs[j].err) {
+                        KC_INFO(1, "Offset query to broker %"PRId32
+                                " failed: %s\n",
+                                jobs[j].leader,
+                                rd_kafka_err2str(jobs[j].err));
+                        err = jobs[j].err;
+                        failed++;
+                }
+
+                for (i = 0 ; i < jobs[j].parts->cnt ; i++) {
+                        const rd_kafka_topic_partition_t *r =
+                                &jobs[j].parts->elems[i];
+                        rd_kafka_topic_partition_t *p =
+                                &lists[jobs[j].list]->elems[
+                                        (intptr_t)r->opaque];
+
+                        if (jobs[j].err) {
+                                p->err = jobs[j].err;
+                        } else {
+                                p->offset = r->offset;
+                                p->err    = r->err;
+                        }
+                }
+
+                rd_kafka_topic_partition_list_destroy(jobs[j].parts);
+        }
+
+        free(jobs);
+
+        return failed == job_cnt ? err : RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+#endif
+
+
 int query_offsets_by_time (rd_kafka_topic_partition_list_t *offsets) {
         rd_kafka_resp_err_t err;
 #if RD_KAFKA_VERSION >= 0x00090300
         char errstr[512];
+        const rd_kafka_metadata_t *metadata;
+        rd_kafka_topic_t *rkt = NULL;
+        int i;
 
         if (!(conf.rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf.rk_conf,
                                      errstr, sizeof(errstr))))
                 KC_FATAL("Failed to create producer: %s", errstr);
 
-        err = rd_kafka_offsets_for_times(conf.rk, offsets,
-                                         conf.metadata_timeout * 1000);
+        /* Group the list by topic for the leader lookups */
+        rd_kafka_topic_partition_list_sort(offsets, NULL, NULL);
+
+        /* The partition leaders: of the topic, if there is only one */
+        for (i = 1 ; i < offsets->cnt ; i++)
+                if (strcmp(offsets->elems[i].topic, offsets->elems[0].topic))
+                        break;
+        if (offsets->cnt > 0 && i == offsets->cnt)
+                rkt = rd_kafka_topic_new(conf.rk, offsets->elems[0].topic,
+                                         NULL);
+
+        err = rd_kafka_metadata(conf.rk, rkt ? 0 : 1, rkt, &metadata,
+                                conf.metadata_timeout * 1000);
+        if (rkt)
+                rd_kafka_topic_destroy(rkt);
+        if (err)
+                KC_FATAL("Failed to acquire metadata: %s",
+                         rd_kafka_err2str(err));
+
+        err = offsets_for_times_by_leader(&offsets, 1, metadata->topics,
+                                          metadata->topic_cnt,
+                                          conf.metadata_timeout * 1000);
+
+        rd_kafka_metadata_destroy(metadata);
 #else
         err = RD_KAFKA_RESP_ERR__NOT_IMPLEMENTED;
 #endif